@@ -29,6 +29,8 @@
 extern "C" {
 #endif
 
+#include <time.h>
+
 #include "rscommon/commonbase.h"
 #include "rscommon/msq.h"
 
@@ -64,6 +66,7 @@ typedef struct MPAMessage {
 #define MPA_ERR_RECV_2BIG (MPA_ERR_BASE * 3 + 1)  // 需接收的消息大于给定缓冲区大小
 #define MPA_ERR_RECV_NOQ (MPA_ERR_BASE * 3 + 2)   // 消息队列不存在
 #define MPA_ERR_RECV_NOMSG (MPA_ERR_BASE * 3 + 3) // 消息队列无消息（IPC_NOWAIT时）
+#define MPA_ERR_RECV_TIMEOUT (MPA_ERR_BASE * 3 + 4) // 超时时间内无消息
 #define MPA_ERR_SEND MPA_ERR_BASE * 4
 #define MPA_ERR_SEND_NOMEM (MPA_ERR_BASE * 4 + 1) // 发送的消息大于系统缓冲区大小
 #define MPA_ERR_SEND_NOQ (MPA_ERR_BASE * 4 + 2)   // 消息队列不存在
@@ -72,6 +75,12 @@ typedef struct MPAMessage {
 #define MPA_ERR_NOINIT -205
 #define MPA_ERR_END -206
 
+#define MPA_GROUP_ROUND_ROBIN 0 // 服务组成员轮流接收
+#define MPA_GROUP_LEAST_DEPTH 1 // 消息队列积压最少的服务组成员接收
+
+/** 客户端上下文，见MPA_CtxOpen() */
+typedef struct MPA_Ctx MPA_Ctx;
+
 /****************************函数原型*********************************/
 /*********************************************************************
  *                            环境初始化                              *
@@ -86,6 +95,18 @@ typedef struct MPAMessage {
 =====================================================================*/
 DLL_PUBLIC int MPA_Init(const char *pszSHMFileName, DWORD sid);
 
+/*=====================================================================
+* func name: MPA_InitEx
+* func desc: 初始化MPA运行环境，并指定共享内存映射选项
+* param :    pszSHMFileName [in] MPA使用的共享内存路径
+*            sid            [in] 系统唯一标识(>0)
+*            nFlags         [in] MPA_SIS_MAP_*选项组合，见MPA_SIS_InitEx()，
+*                                重新映射共享内存时沿用
+* return:    0     成功
+*            !=0   失败
+=====================================================================*/
+DLL_PUBLIC int MPA_InitEx(const char *pszSHMFileName, DWORD sid, int nFlags);
+
 DLL_PUBLIC int MPA_End(Boolean bRelease);
 
 /*=====================================================================
@@ -282,10 +303,71 @@ DLL_PUBLIC int MPA_Sub(DWORD type);
 * param :    sid      [in] 目的系统标识符
 *            pMessage [in] 欲发送的消息
 * return:    = 0    成功
-*            !=0    失败
+*            !=0    失败，消息长度超过MPA_MESSAGESIZE时为MPA_ERR_PARAM
 =====================================================================*/
 DLL_PUBLIC int MPA_Send(DWORD sid, const MPAMessage *pMessage);
 
+/*=====================================================================
+* func name: MPA_SendBatch
+* func desc: 批量消息发送，将多条消息依次发送至同一系统，只查找一次路由
+* param :    sid         [in] 目的系统标识符
+*            ppMessages  [in] 欲发送的消息
+*            nCount      [in] 消息条数
+*            pnStatus    [out] 每条消息的发送结果，同MPA_Send()的返回值；
+*                              消息队列不存在或被信号中断后，其余消息不再
+*                              发送，结果与之相同；消息长度超过
+*                              MPA_MESSAGESIZE时该条为MPA_ERR_PARAM
+* return:    >=0    发送成功的消息条数
+*            <0    参数错误
+=====================================================================*/
+DLL_PUBLIC int MPA_SendBatch(DWORD sid, MPAMessage *const *ppMessages, size_t nCount,
+                             int *pnStatus);
+
+/*=====================================================================
+* func name: MPA_SendMulti
+* func desc: 消息发送，将同一条消息发送至多个系统，消息只复制一次
+* param :    pdwSids     [in] 目的系统标识符
+*            nCount      [in] 目的系统个数
+*            pMessage    [in] 欲发送的消息
+*            pnStatus    [out] 发送至每个系统的结果，同MPA_Send()的返回值；
+*                              被信号中断后，其余系统不再发送，结果与之相同
+* return:    >=0    发送成功的系统个数
+*            <0    参数错误，消息长度超过MPA_MESSAGESIZE时为MPA_ERR_PARAM，
+*                  不发送至任何系统
+=====================================================================*/
+DLL_PUBLIC int MPA_SendMulti(const DWORD *pdwSids, size_t nCount, const MPAMessage *pMessage,
+                             int *pnStatus);
+
+/*=====================================================================
+* func name: MPA_SendGroup
+* func desc: 消息发送，发送至服务组中的某个系统，消息队列不存在时依次尝试
+*            其他成员。每个服务组的轮流位置单独保存。
+*            MPA_GROUP_LEAST_DEPTH比较的是整个消息队列的积压消息数
+*            (msg_qnum)，与其他系统共享消息队列的成员，其积压包含其他
+*            系统的消息，此类服务组应使用独立的消息队列；积压数每1ms
+*            最多读取一次，其间按本进程发送给各成员的消息数累加
+* param :    gid      [in] 目的服务组标识符
+*            nPolicy  [in] 选择成员的方式，MPA_GROUP_ROUND_ROBIN或
+*                          MPA_GROUP_LEAST_DEPTH
+*            pMessage [in] 欲发送的消息
+* return:    = 0    成功
+*            !=0    失败，MPA_ERR_SVRINFO表示服务组没有成员
+=====================================================================*/
+DLL_PUBLIC int MPA_SendGroup(DWORD gid, int nPolicy, const MPAMessage *pMessage);
+
+/*=====================================================================
+* func name: MPA_SendGroupByProp
+* func desc: 消息发送，按消息属性值的一致性哈希发送至服务组中的某个系统，
+*            属性值相同的消息发送至同一系统，增减成员时只有少量属性值
+*            改变目的系统
+* param :    gid      [in] 目的服务组标识符
+*            pszName  [in] 属性名，如"acct"
+*            pMessage [in] 欲发送的消息
+* return:    = 0    成功
+*            !=0    失败，MPA_ERR_PARAM表示消息没有该属性
+=====================================================================*/
+DLL_PUBLIC int MPA_SendGroupByProp(DWORD gid, const char *pszName, const MPAMessage *pMessage);
+
 /*=====================================================================
 * func name: MPA_SendSelf
 * func desc: 消息发送，发送至本进程
@@ -315,6 +397,43 @@ DLL_PUBLIC int MPA_SendSelfEx(const MPAMessage *pMessage);
 =====================================================================*/
 DLL_PUBLIC int MPA_Pub(DWORD type, const MPAMessage *pMessage);
 
+/*=====================================================================
+* func name: MPA_SendReserve
+* func desc: 申请发送缓冲区，返回的消息包已初始化，位于发送缓冲区中，
+*            用MPA_SendCommit()或MPA_PubCommit()发送时不再复制消息；
+*            MPA_Send()等函数只复制消息包中已使用的部分
+* return:    !=NULL 消息包，可重复填写、发送，不再使用时调用MPA_SendRelease()
+*            NULL   内存不足
+=====================================================================*/
+DLL_PUBLIC MPAMessage *MPA_SendReserve(void);
+
+/*=====================================================================
+* func name: MPA_SendRelease
+* func desc: 释放MPA_SendReserve()申请的发送缓冲区
+* param :    pMessage  [in] MPA_SendReserve()返回的消息包
+=====================================================================*/
+DLL_PUBLIC void MPA_SendRelease(MPAMessage *pMessage);
+
+/*=====================================================================
+* func name: MPA_SendCommit
+* func desc: 消息发送，同MPA_Send()，直接发送发送缓冲区
+* param :    sid      [in] 目的系统标识符
+*            pMessage [in] MPA_SendReserve()返回的消息包，不可用其他消息包
+* return:    = 0    成功
+*            !=0    失败
+=====================================================================*/
+DLL_PUBLIC int MPA_SendCommit(DWORD sid, MPAMessage *pMessage);
+
+/*=====================================================================
+* func name: MPA_PubCommit
+* func desc: 消息发布，同MPA_Pub()，直接向每个订阅者发送发送缓冲区
+* param :    type     [in] 欲发布的消息类型
+*            pMessage [in] MPA_SendReserve()返回的消息包，不可用其他消息包
+* return:    = 0    成功
+*            !=0    失败
+=====================================================================*/
+DLL_PUBLIC int MPA_PubCommit(DWORD type, MPAMessage *pMessage);
+
 /*=====================================================================
 * func name: MPA_Recv
 * func desc: 消息接收
@@ -343,9 +462,77 @@ DLL_PUBLIC ssize_t MPA_RecvTypeNonBlock(DWORD mtype, MPAMessage *pMessage);
 =====================================================================*/
 DLL_PUBLIC ssize_t MPA_RecvNonBlock(MPAMessage *pMessage);
 
+/*=====================================================================
+* func name: MPA_RecvTimeout
+* func desc: 消息接收，最多等待指定时间；等待时休眠在发送方敲响的门铃上，
+*            本库发送的消息到达即被唤醒，不使用信号(SIGALRM)，不影响进程中的
+*            其他代码。每20毫秒仍会醒来查看一次消息队列，以收到不敲门铃的
+*            消息(如MPA_SIS_SplitQueue()或旧版本库发送的)，这类消息最多晚
+*            20毫秒收到；共享内存没有流量统计(即没有门铃)时，改为轮询消息
+*            队列，间隔从50微秒逐次加倍至20毫秒
+* param :    pMessage  [out] 接收到的消息
+*            nTimeout  [in] 超时时间(微秒)，0时不等待，<0时一直等待
+* return:    >=0    接收到消息的长度
+*            MPA_ERR_RECV_TIMEOUT 超时
+*            MPA_ERR_INTR 等待时被信号中断
+*            <0    失败
+=====================================================================*/
+DLL_PUBLIC ssize_t MPA_RecvTimeout(MPAMessage *pMessage, long nTimeout);
+
+/*=====================================================================
+* func name: MPA_RecvDeadline
+* func desc: 消息接收，同MPA_RecvTimeout()，等待至指定时刻，便于在循环中
+*            多次接收时共用同一截止时刻
+* param :    pMessage  [out] 接收到的消息
+*            pDeadline [in] 截止时刻，CLOCK_MONOTONIC时钟，NULL时一直等待
+* return:    >=0    接收到消息的长度
+*            MPA_ERR_RECV_TIMEOUT 超时
+*            MPA_ERR_INTR 等待时被信号中断
+*            <0    失败
+=====================================================================*/
+DLL_PUBLIC ssize_t MPA_RecvDeadline(MPAMessage *pMessage, const struct timespec *pDeadline);
+
+/*=====================================================================
+* func name: MPA_RecvMany
+* func desc: 批量消息接收，等待第一条消息，再以非阻塞方式接收队列中已有的
+*            其余消息，只查找一次路由；等待方式同MPA_RecvTimeout()，休眠在
+*            发送方敲响的门铃上，每20毫秒查看一次消息队列，没有门铃时轮询
+* param :    pMessages [out] 接收到的消息，每条消息的长度见MPA_GetMsgLength()
+*            nMax      [in] 最多接收的消息条数
+*            nTimeout  [in] 等待第一条消息的超时时间(微秒)，0时不等待，
+*                           <0时一直等待
+* return:    >0    接收到的消息条数
+*            0     超时
+*            MPA_ERR_INTR 等待第一条消息时被信号中断
+*            <0    失败
+=====================================================================*/
+DLL_PUBLIC ssize_t MPA_RecvMany(MPAMessage *pMessages, size_t nMax, long nTimeout);
+
+/*=====================================================================
+* func name: MPA_RecvReserved
+* func desc: 消息接收，同MPA_Recv()，消息直接接收到发送缓冲区中，不再复制；
+*            MPA_Recv()等函数只复制接收到的部分
+* param :    pMessage  [out] MPA_SendReserve()返回的消息包，不可用其他消息包，
+*                            接收后可直接用MPA_SendCommit()转发或回复
+* return:    >=0    接收到消息的长度
+*            <0    失败
+=====================================================================*/
+DLL_PUBLIC ssize_t MPA_RecvReserved(MPAMessage *pMessage);
+
+/*=====================================================================
+* func name: MPA_RecvTypeNonBlockReserved
+* func desc: 消息接收(非阻塞)，同MPA_RecvTypeNonBlock()，消息直接接收到
+*            发送缓冲区中
+* param :    mtype     [in] 需要接收的消息类型
+*            pMessage  [out] MPA_SendReserve()返回的消息包
+* return:    >=0    接收到消息的长度
+*            <0    失败
+=====================================================================*/
+DLL_PUBLIC ssize_t MPA_RecvTypeNonBlockReserved(DWORD mtype, MPAMessage *pMessage);
+
 /*=====================================================================
 * func name: MPA_Validate
-* func desc: 检查本进程(g_sid)绑定的消息队列是否存在
+* func desc: 检查本进程(MPA_GetSID())绑定的消息队列是否存在
 * return:    0     存在
 *            -1    不存在
 *            -2    判断失败
@@ -353,6 +540,100 @@ DLL_PUBLIC ssize_t MPA_RecvNonBlock(MPAMessage *pMessage);
 =====================================================================*/
 DLL_PUBLIC int MPA_Validate(void);
 
+/*=====================================================================
+* func name: MPA_WaitChange
+* func desc: 等待路由配置信息变更(不轮询共享内存)，共享内存被重新装载时
+*            自动映射新的共享内存
+* param :    pdwGeneration [in,out] 上次得到的配置版本号，变更后返回新的版本号
+*            nTimeout      [in] 超时时间(毫秒)，<0时一直等待
+* return:    0     配置信息已变更
+*            1     超时
+*            <0    失败
+=====================================================================*/
+DLL_PUBLIC int MPA_WaitChange(DWORD *pdwGeneration, int nTimeout);
+
+/*********************************************************************
+ *                            客户端上下文                            *
+ **********************************************************************/
+/* 每个上下文持有自己的系统标识、共享内存映射和路由缓存，由一把互斥锁
+ * 保护，可由多个线程同时使用；消息的发送和接收在锁外进行，一个线程阻塞
+ * 在MPA_CtxRecv()时不影响其他线程发送。不带上下文的函数使用默认上下文
+ * (MPA_CtxDefault())，由MPA_Init()初始化。以下函数与同名的不带上下文
+ * 的函数含义相同，pCtx为NULL时返回MPA_ERR_PARAM。 */
+
+/*=====================================================================
+* func name: MPA_CtxOpen
+* func desc: 创建客户端上下文并映射共享内存
+* param :    pszSHMFileName [in] MPA使用的共享内存路径
+*            sid            [in] 系统唯一标识(>0)
+*            nFlags         [in] MPA_SIS_MAP_*选项组合，同MPA_InitEx()
+* return:    !=NULL 客户端上下文
+*            NULL   失败
+=====================================================================*/
+DLL_PUBLIC MPA_Ctx *MPA_CtxOpen(const char *pszSHMFileName, DWORD sid, int nFlags);
+
+/*=====================================================================
+* func name: MPA_CtxClose
+* func desc: 解除共享内存映射并释放客户端上下文，不删除共享内存；
+*            调用时不能有其他线程正在使用该上下文
+* param :    pCtx  [in] MPA_CtxOpen()返回的客户端上下文，默认上下文被忽略
+=====================================================================*/
+DLL_PUBLIC void MPA_CtxClose(MPA_Ctx *pCtx);
+
+/*=====================================================================
+* func name: MPA_CtxDefault
+* func desc: 得到不带上下文的函数使用的默认上下文
+* return:    默认上下文，MPA_Init()之前不可用于收发消息
+=====================================================================*/
+DLL_PUBLIC MPA_Ctx *MPA_CtxDefault(void);
+
+DLL_PUBLIC DWORD MPA_CtxGetSID(const MPA_Ctx *pCtx);
+
+DLL_PUBLIC int MPA_CtxSend(MPA_Ctx *pCtx, DWORD sid, const MPAMessage *pMessage);
+
+DLL_PUBLIC int MPA_CtxSendBatch(MPA_Ctx *pCtx, DWORD sid, MPAMessage *const *ppMessages,
+                                size_t nCount, int *pnStatus);
+
+DLL_PUBLIC int MPA_CtxSendMulti(MPA_Ctx *pCtx, const DWORD *pdwSids, size_t nCount,
+                                const MPAMessage *pMessage, int *pnStatus);
+
+DLL_PUBLIC int MPA_CtxSendGroup(MPA_Ctx *pCtx, DWORD gid, int nPolicy,
+                                const MPAMessage *pMessage);
+
+DLL_PUBLIC int MPA_CtxSendGroupByProp(MPA_Ctx *pCtx, DWORD gid, const char *pszName,
+                                      const MPAMessage *pMessage);
+
+DLL_PUBLIC int MPA_CtxSendSelf(MPA_Ctx *pCtx, DWORD mtype, const MPAMessage *pMessage);
+
+DLL_PUBLIC int MPA_CtxPub(MPA_Ctx *pCtx, DWORD type, const MPAMessage *pMessage);
+
+DLL_PUBLIC int MPA_CtxSendCommit(MPA_Ctx *pCtx, DWORD sid, MPAMessage *pMessage);
+
+DLL_PUBLIC int MPA_CtxPubCommit(MPA_Ctx *pCtx, DWORD type, MPAMessage *pMessage);
+
+DLL_PUBLIC ssize_t MPA_CtxRecv(MPA_Ctx *pCtx, MPAMessage *pMessage);
+
+DLL_PUBLIC ssize_t MPA_CtxRecvTypeNonBlock(MPA_Ctx *pCtx, DWORD mtype, MPAMessage *pMessage);
+
+DLL_PUBLIC ssize_t MPA_CtxRecvNonBlock(MPA_Ctx *pCtx, MPAMessage *pMessage);
+
+DLL_PUBLIC ssize_t MPA_CtxRecvTimeout(MPA_Ctx *pCtx, MPAMessage *pMessage, long nTimeout);
+
+DLL_PUBLIC ssize_t MPA_CtxRecvDeadline(MPA_Ctx *pCtx, MPAMessage *pMessage,
+                                       const struct timespec *pDeadline);
+
+DLL_PUBLIC ssize_t MPA_CtxRecvMany(MPA_Ctx *pCtx, MPAMessage *pMessages, size_t nMax,
+                                   long nTimeout);
+
+DLL_PUBLIC ssize_t MPA_CtxRecvReserved(MPA_Ctx *pCtx, MPAMessage *pMessage);
+
+DLL_PUBLIC ssize_t MPA_CtxRecvTypeNonBlockReserved(MPA_Ctx *pCtx, DWORD mtype,
+                                                   MPAMessage *pMessage);
+
+DLL_PUBLIC int MPA_CtxValidate(MPA_Ctx *pCtx);
+
+DLL_PUBLIC int MPA_CtxWaitChange(MPA_Ctx *pCtx, DWORD *pdwGeneration, int nTimeout);
+
 DLL_PUBLIC void DumpMPAMessage(const MPAMessage *pMessage);
 
 DLL_PUBLIC void mpa_getVersion(int *major, int *minor, int *patch, char *meta);
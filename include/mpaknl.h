@@ -34,6 +34,8 @@
 extern "C" {
 #endif
 
+#include <time.h>
+
 #include "mpatype.h"
 #include "rscommon/commonbase.h"
 #include "rscommon/msq.h"
@@ -50,10 +52,31 @@ extern "C" {
 
 #define MPA_PF_MSGTYPE_SEC "msgtype"
 #define MPA_PF_TYPE_NUM "type_nums"
+
+#define MPA_SIS_MAP_POPULATE 0x01 /**< Prefault the whole segment when it is mapped */
+#define MPA_SIS_MAP_MLOCK 0x02    /**< Lock the segment in memory */
+#define MPA_SIS_MAP_HUGEPAGE 0x04 /**< Back the segment with transparent huge pages */
+
+#define MPA_STAT_SENT 0  /**< A message is sent, see MPA_SIS_StatServer() */
+#define MPA_STAT_RECV 1  /**< A message is received */
+#define MPA_STAT_ERROR 2 /**< Sending or receiving failed, but for EINTR */
+#define MPA_STAT_INTR 3  /**< Sending or receiving was interrupted by a signal */
 // Constant declarations }}}
 
 // Type definitions {{{
-typedef unsigned short int mpa_index_t;
+typedef unsigned int mpa_index_t;
+
+#define MPA_INDEX_NONE ((mpa_index_t)~(mpa_index_t)0) /**< Empty slot in index tables */
+
+#define MPA_SIS_MAGIC 0x3241504DU /**< "MPA2" in a little-endian segment */
+#define MPA_SIS_VERSION 2         /**< Version of segment layout created by this library */
+#define MPA_SIS_FEATURE_MASK 0xFFFF0000U   /**< Feature flags in the version word */
+#define MPA_SIS_FEATURE_GROUPS 0x00010000U /**< Segment has group ids */
+#define MPA_SIS_FEATURE_STATS 0x00020000U  /**< Segment has traffic counters */
+#define MPA_SIS_MAX_INFO 0x00FFFFFFU /**< Upper limit of server or type info numbers */
+#define MPA_SID_NONE ((DWORD)~0U)      /**< Server id of deleted server infos */
+#define MPA_SIS_ERR_RETIRED -3 /**< Segment retired by a reload or grow, map the file again */
+#define MPA_SIS_IMAGE_MAGIC 0x4941504DU /**< "MPAI" in the footer of compiled images */
 
 typedef struct MPA_SIS_SrvInfo {
   DWORD dwSid;
@@ -64,22 +87,83 @@ typedef struct MPA_SIS_SrvInfo {
 
 typedef struct MPA_SIS_TypeInfo {
   DWORD dwType;
-  WORD wSidIndex;
+  DWORD dwSidIndex;
 } MPA_SIS_TypeInfo;
 
+typedef struct MPA_SIS_TypeBucket {
+  DWORD dwType;
+  DWORD dwStart; /**< Offset of the first subscriber in subscriber list */
+  DWORD dwCount; /**< Number of subscribers, 0 for empty bucket */
+} MPA_SIS_TypeBucket;
+
+/** Traffic counters of a server info or a type, which fill one cache line.
+ *  Messages sent are counted on the destination server, or on the type when
+ *  published, messages received on the receiving server and on the type of
+ *  published ones. */
+typedef struct MPA_SIS_Stat {
+  unsigned long long qwSent;        /**< Messages sent to the server or of the type */
+  unsigned long long qwSentBytes;   /**< Bytes sent */
+  unsigned long long qwRecv;        /**< Messages received by the server or of the type */
+  unsigned long long qwRecvBytes;   /**< Bytes received */
+  unsigned long long qwErrors;      /**< Failed sends and receives */
+  unsigned long long qwIntr;        /**< Sends and receives interrupted by signals */
+  unsigned long long qwReserved[2]; /**< Padding to 64 bytes */
+} MPA_SIS_Stat;
+
+/** Depth of the message queue of a server info, see MPA_SIS_QueueStats() */
+typedef struct MPA_SIS_QueueStat {
+  DWORD dwSid;      /**< Server id */
+  key_t dwQkey;     /**< Message queue key */
+  int dwQid;        /**< Message queue id, as stored in the segment */
+  DWORD dwQtype;    /**< Message type of the server in the queue */
+  int nErrno;       /**< 0, or errno if the queue could not be read */
+  size_t nMsgs;     /**< Messages in the queue, msg_qnum */
+  size_t nBytes;    /**< Bytes in the queue, msg_cbytes */
+  size_t nMaxBytes; /**< Max bytes of the queue, msg_qbytes */
+  time_t tSend;     /**< Time of the last send, msg_stime */
+  time_t tRecv;     /**< Time of the last receive, msg_rtime */
+} MPA_SIS_QueueStat;
+
 typedef struct MPA_SISInfo {
   DWORD dwTotalSize;             /**< Total size in bytes of MPA information segment */
-  WORD wMaxSvrInfo;              /**< Max server (process) numbers */
-  WORD wMaxTypeInfo;             /**< Max type numbers */
-  WORD wSAddrOffset;             /**< Server info section head offset */
-  WORD wTAddrOffset;             /**< Type info section head offset */
-  WORD *pwSrvInfoSize;           /**< Pointer to the memory which stores size of server
+  DWORD dwVersion;               /**< Version of segment layout, only dwTotalSize is set
+                                    besides it when it is not MPA_SIS_VERSION */
+  DWORD dwFeatures;              /**< MPA_SIS_FEATURE_* flags of the optional sections */
+  DWORD dwMaxSvrInfo;            /**< Max server (process) numbers */
+  DWORD dwMaxTypeInfo;           /**< Max type numbers */
+  DWORD dwSAddrOffset;           /**< Server info section head offset */
+  DWORD dwTAddrOffset;           /**< Type info section head offset */
+  DWORD *pdwSrvInfoSize;         /**< Pointer to the memory which stores size of server
                                     infos */
   MPA_SIS_SrvInfo *pServerInfos; /**< Pointer to the head of server info list */
-  WORD wTListHeadOffset;         /**< Offset of type info list in type info section */
-  WORD *pwTListSize;             /**< Pointer to the memory which stores size of type list
+  DWORD dwTListHeadOffset;       /**< Offset of type info list in type info section */
+  DWORD *pdwTListSize;           /**< Pointer to the memory which stores size of type list
                                     size */
   MPA_SIS_TypeInfo *pTypeInfos;  /**< Pointer to the head of type info list */
+  DWORD dwSidBuckets;            /**< Bucket numbers of sid hash index */
+  mpa_index_t *pSidHash;         /**< Pointer to the buckets of sid hash index */
+  DWORD dwTypeBuckets;           /**< Bucket numbers of type hash index */
+  MPA_SIS_TypeBucket *pTypeHash; /**< Pointer to the buckets of type hash index */
+  mpa_index_t *pSubscribers;     /**< Pointer to the head of subscriber list */
+  DWORD *pdwGeneration;          /**< Pointer to the generation counter */
+  DWORD *pdwSeq;                 /**< Pointer to the sequence of segment writers */
+  DWORD *pdwWriter;              /**< Pointer to the token of the writer holding the sequence,
+                                    pid, start time and pid namespace */
+  DWORD *pdwSrvFree;             /**< Pointer to the head of deleted server info list */
+  DWORD *pdwTypeFree;            /**< Pointer to the head of deleted type info list */
+  DWORD *pdwRetired;             /**< Pointer to the flag set when the segment is replaced */
+  DWORD *pdwSidKeys;             /**< Pointer to the server ids of server info list */
+  DWORD *pdwTypeKeys;            /**< Pointer to the types of type info list */
+  DWORD *pdwGroupKeys;           /**< Pointer to the group ids of server info list, NULL
+                                    without them */
+  DWORD dwStatStripes;           /**< Stripes of traffic counters, 0 without them */
+  DWORD dwStatTypeSlots;         /**< Slots of type traffic counters */
+  DWORD *pdwStatFull;            /**< Pointer to the flag set when a type finds no free
+                                    counter slot */
+  DWORD *pdwStatTypes;           /**< Pointer to the types of type traffic counters */
+  DWORD *pdwDoorbells;           /**< Pointer to the doorbells of server infos, one per
+                                    64-byte line */
+  MPA_SIS_Stat *pStats;          /**< Pointer to the first stripe of traffic counters */
 } MPA_SISInfo;
 // Type definitions }}}
 
@@ -94,36 +178,184 @@ typedef struct MPA_SISInfo {
  * memory, it can be accessed by GetSISInfo(), it will fill a MPA_SISInfo struct
  * object with all the informations you need.
  *
- *  The MPA information structure in memory:
- *  +-----+----+----+----+----+----+---------------+----+----+-------------+
- *  |DWORD|WORD|WORD|WORD|WORD|WORD|Server Infos...|WORD|WORD|Type Infos...|
- *  | (1) |(2) |(3) |(4) |(5) |(6) |     (7)       |(8) |(9) |    (10)     |
- *  +-----+----+----+----+----+----+---------------+----+----+-------------+
+ *  The MPA information structure in memory (version 2):
+ *  +-----+-----+-----+-----+-----+-----+-----+-----+---------------+
+ *  |DWORD|DWORD|DWORD|DWORD|DWORD|DWORD|DWORD|DWORD|Server Infos...|
+ *  | (1) | (2) | (3) | (4) | (5) | (6) | (7) | (8) |      (9)      |
+ *  +-----+-----+-----+-----+-----+-----+-----+-----+---------------+
+ *  +-----+-----+-------------+-----+-------------+-----+--------------+
+ *  |DWORD|DWORD|Type Infos...|DWORD|Sid Index... |DWORD|Type Index... |
+ *  |(10) |(11) |    (12)     |(13) |    (14)     |(15) |    (16)      |
+ *  +-----+-----+-------------+-----+-------------+-----+--------------+
+ *  +-------------------+-----+-----+-------+-----+-----+-----+
+ *  |Subscriber List... |DWORD|DWORD|DWORDx3|DWORD|DWORD|DWORD|
+ *  |       (17)        |(18) |(19) | (20)  |(21) |(22) |(23) |
+ *  +-------------------+-----+-----+-------+-----+-----+-----+
+ *  +--------------+---------------+---------------+
+ *  |Sid Keys...   |Type Keys...   |Group Keys...  |
+ *  |    (24)      |     (25)      |     (26)      |
+ *  +--------------+---------------+---------------+
+ *  +-----+-----+--------------+------------+----------+
+ *  |DWORD|DWORD|Stat Types... |Doorbells...|Stats...  |
+ *  |(27) |(28) |     (29)     |    (30)    |  (31)    |
+ *  +-----+-----+--------------+------------+----------+
  *
  *  (1). Total size of the whole memory segment, stored in dwTotalSize in
  * MPA_SISInfo when returned by GetSISInfo;
  *
- *  (2). Max server info size, stored in wMaxSvrInfo;
+ *  (2). Magic number MPA_SIS_MAGIC;
  *
- *  (3). Max type info size, stored in wMaxTypeInfo;
+ *  (3). Version of the layout in the low 16 bits, stored in dwVersion, and
+ *       MPA_SIS_FEATURE_* flags of the optional sections (26) and (27) -
+ *       (31) in the high 16 bits, stored in dwFeatures. MPA_SIS_Create()
+ *       sets the flag of every optional section it writes, and GetSISInfo()
+ *       only looks for the sections whose flags are set. This layout of
+ *       version 2 is final, a change to it takes another MPA_SIS_VERSION;
  *
- *  (4). Offset of the server info list, stored in wSAddrOffset;
+ *  (4). Max server info size, stored in dwMaxSvrInfo;
  *
- *  (5). Offset of the type info section head, stored in wTAddrOffset;
+ *  (5). Max type info size, stored in dwMaxTypeInfo;
  *
- *  (6). Server list size, pointed by the pointer pwSrvInfoSize;
+ *  (6). Offset of the server info list, stored in dwSAddrOffset;
  *
- *  (7). Server info list which contains a list of all the server settings,
+ *  (7). Offset of the type info section head, stored in dwTAddrOffset;
+ *
+ *  (8). Server list size, pointed by the pointer pdwSrvInfoSize;
+ *
+ *  (9). Server info list which contains a list of all the server settings,
  *       the starting address is pointed by the pointer pServerInfos;
  *
- *  (8). Type list head offset, stored in wTListHeadOffset, which helps to
- *       calculate the starting address of Type info list(10);
+ *  (10). Type list head offset, stored in dwTListHeadOffset, which helps to
+ *        calculate the starting address of Type info list(12);
  *
- *  (9). Type list size, pointed by the pointer pwTListSize;
+ *  (11). Type list size, pointed by the pointer pdwTListSize;
  *
- *  (10). Type info list which contains a list of all the type settings,
+ *  (12). Type info list which contains a list of all the type settings,
  *        the starting address is pointed by the pointer pTypeInfos.
  *
+ *  (13). Bucket numbers of sid hash index, stored in dwSidBuckets. This
+ *        section starts at the first 4-byte aligned offset after (12);
+ *
+ *  (14). Sid hash index, an open-addressing (linear probing) table which maps
+ *        a server id to its index in server info list(9), empty buckets hold
+ *        MPA_INDEX_NONE. It is pointed by the pointer pSidHash.
+ *
+ *  (15). Bucket numbers of type hash index, stored in dwTypeBuckets. This
+ *        section starts at the first 4-byte aligned offset after (14);
+ *
+ *  (16). Type hash index, an open-addressing table of MPA_SIS_TypeBucket
+ *        which maps a message type to a range of subscriber list(17). It is
+ *        pointed by the pointer pTypeHash;
+ *
+ *  (17). Subscriber list, a compressed (CSR-style) adjacency list holding the
+ *        server info indexes of all the type settings grouped by type, so the
+ *        subscribers of one type are contiguous. It has room for max type
+ *        numbers of entries and is pointed by the pointer pSubscribers.
+ *
+ *  (16) and (17) are rebuilt from type info list(12) whenever it changes.
+ *
+ *  (18). Generation counter, pointed by the pointer pdwGeneration. Every
+ *        MPA_SIS_* function which changes the segment increases it after the
+ *        change is done, so processes can keep private copies of routing
+ *        informations and refresh them only when the counter changes. It is
+ *        seeded with the creation time. It is also the futex word processes
+ *        blocked in MPA_SIS_WaitChange() sleep on, writers wake them after
+ *        increasing it;
+ *
+ *  (19). Sequence of segment writers (seqlock), pointed by the pointer
+ *        pdwSeq. A writer makes it odd before changing the segment and even
+ *        again when it is done, only one writer can hold an odd sequence.
+ *        Readers copy what they need and retry if the sequence was odd or
+ *        has moved meanwhile, so they never see half-written entries and
+ *        never block writers;
+ *
+ *  (20). Token of the writer holding the sequence, pointed by the pointer
+ *        pdwWriter: its pid, its start time in clock ticks after boot and
+ *        the inode of its pid namespace. It lets waiting processes of the
+ *        same pid namespace release the sequence if that writer died in the
+ *        middle of a change. A pid alone could name a later process which
+ *        reused it;
+ *
+ *  (21). Index of the first deleted server info, pointed by the pointer
+ *        pdwSrvFree, or MPA_INDEX_NONE. A deleted server info keeps its
+ *        slot with MPA_SID_NONE as server id, so the indexes held by type
+ *        infos stay valid, and holds the index of the next deleted one in
+ *        dwQtype. Slots in this list are reused by new server infos;
+ *
+ *  (22). Index of the first deleted type info, pointed by the pointer
+ *        pdwTypeFree, or MPA_INDEX_NONE. A deleted type info has
+ *        MPA_INDEX_NONE as server index and holds the index of the next
+ *        deleted one in dwType;
+ *
+ *  (23). Retired flag, pointed by the pointer pdwRetired. It is set when
+ *        MPA_SIS_LoadConfig() has published a new segment under the same
+ *        file name, processes which still map this one should map the file
+ *        again for new calls;
+ *
+ *  (24). Server ids of server info list(9) stored contiguously, one DWORD
+ *        per server info slot, pointed by the pointer pdwSidKeys. Deleted
+ *        slots hold MPA_SID_NONE;
+ *
+ *  (25). Types of type info list(12) stored contiguously, one DWORD per
+ *        type info slot, pointed by the pointer pdwTypeKeys. Entries of
+ *        deleted slots are stale.
+ *
+ *  (24) and (25) copy the keys out of the records, so that lookups compare
+ *  a dense array of keys, several at a time with SIMD instructions, instead
+ *  of striding through whole records.
+ *
+ *  (26). Group ids of server info list(9), one DWORD per server info slot,
+ *        pointed by the pointer pdwGroupKeys. 0 is for server infos out of
+ *        any group. Segments without MPA_SIS_FEATURE_GROUPS end at (25) and
+ *        have pdwGroupKeys set to NULL;
+ *
+ *  (27). Stripes of traffic counters, stored in dwStatStripes. This section
+ *        starts at the first 64-byte aligned offset after (26), so that every
+ *        counter record fills a cache line of its own;
+ *
+ *  (28). Slots of type traffic counters, stored in dwStatTypeSlots, twice
+ *        the max type numbers or more, followed by the full flag pointed by
+ *        the pointer pdwStatFull. A type probes at most 32 slots; if none
+ *        is free, the flag is set and the type is not counted until
+ *        MPA_SIS_Compact() gives back the slots of types no longer routed,
+ *        or MPA_SIS_LoadConfig() builds a new segment. The rest of the
+ *        64-byte line is reserved;
+ *
+ *  (29). Types of type traffic counters, an open-addressing table claimed by
+ *        the first sender of a type with compare-and-swap, free slots hold
+ *        MPA_SID_NONE. It is pointed by the pointer pdwStatTypes and padded
+ *        to 64 bytes;
+ *
+ *  (30). Doorbells of server infos, one DWORD at the start of a 64-byte
+ *        line for every server info slot, pointed by the pointer
+ *        pdwDoorbells. Senders ring them on every message, so they share no
+ *        line with each other or with the counters;
+ *
+ *  (31). Traffic counters, MPA_SIS_Stat records of every server info slot
+ *        followed by those of every type slot, repeated for every stripe and
+ *        pointed by the pointer pStats. A process updates the stripe of the
+ *        CPU it runs on, so that processes on other CPUs never write the
+ *        same cache line, and readers add the stripes up.
+ *
+ *  (27) - (31) take 16 stripes whatever the CPUs of the host, fewer if they
+ *  would exceed 64 MB, and they are left out if even one stripe would be
+ *  larger. Processes on CPUs beyond the 16th share stripes. Segments created
+ *  without them work as before, without traffic counters.
+ *
+ *  Deleted entries at the tail of server info list(9) or type info list(12)
+ *  are dropped from the list at once, MPA_SIS_Compact() moves the others
+ *  out of the middle of the lists.
+ *
+ *  Version 1 segments stored (3) - (8), (10) and (11) as WORDs without magic
+ *  number and version, which limited the segment to 64 KB. MPA_SIS_Init()
+ *  refuses them, they must be converted by MPA_SIS_Upgrade() first.
+ *
+ *  Version 2 breaks the ABI as well as the file format: mpa_index_t, the
+ *  sizes and offsets of MPA_SISInfo and the server index of
+ *  MPA_SIS_TypeInfo grew from WORD to DWORD, and MPA_SISInfo gained the
+ *  pointers above. Programs built against version 1 headers must be rebuilt,
+ *  and a version 1 library cannot read a version 2 file.
+ *
  *  @see struct MPA_SISInfo
  *  @see GetSISInfo()
  *
@@ -138,7 +370,8 @@ DLL_PUBLIC int MPA_SIS_Create(const char *pszFileName, size_t nNumOfProcess, siz
 /** @brief Map memory-map file to memory.
  *
  *  This function maps MPA memory-map file to memory and returns the
- *  head address.
+ *  head address. Files of other layout versions than MPA_SIS_VERSION are
+ *  refused.
  *
  *  @see manpage mmap(2)
  *
@@ -148,6 +381,47 @@ DLL_PUBLIC int MPA_SIS_Create(const char *pszFileName, size_t nNumOfProcess, siz
  */
 DLL_PUBLIC char *MPA_SIS_Init(const char *pszFileName);
 
+/** @brief Map memory-map file to memory with options.
+ *
+ *  Same as MPA_SIS_Init(), nFlags is a combination of:
+ *  - MPA_SIS_MAP_POPULATE: prefault the whole segment (MAP_POPULATE), so the
+ *    first lookups after a restart take no page faults;
+ *  - MPA_SIS_MAP_MLOCK: lock the segment in memory (mlock), so it is never
+ *    paged out. It fails without enough RLIMIT_MEMLOCK, which is traced and
+ *    ignored;
+ *  - MPA_SIS_MAP_HUGEPAGE: advise transparent huge pages (MADV_HUGEPAGE),
+ *    which takes effect when the file is on a tmpfs mounted with huge pages
+ *    enabled. Failures are traced and ignored.
+ *
+ *  @param[in] pszFileName MPA memory-map file name
+ *  @param[in] nFlags Options of MPA_SIS_MAP_*, 0 for none
+ *  @return >0 Sucess; pointer to the head of memeory segment
+ *  @return 0 Failed
+ */
+DLL_PUBLIC char *MPA_SIS_InitEx(const char *pszFileName, int nFlags);
+
+/** @brief Upgrade memory-map file to current layout version.
+ *
+ *  This function converts a version 1 MPA memory-map file to the layout of
+ *  MPA_SIS_VERSION. Server infos, including their message queue ids, and
+ *  type infos are copied to a new file beside it, which then replaces the
+ *  old one by rename(2).
+ *
+ *  The upgrade is not done in place. A version 1 segment has no retired flag,
+ *  so processes still mapping the old file are not told: they keep reading
+ *  the stale version 1 segment, and changes made to the new file are not
+ *  seen by them until they are restarted. Stop all MPA processes before
+ *  upgrading, or restart them right after it.
+ *
+ *  Sizes and offsets of the old file are checked against its size before any
+ *  entry is read, a damaged file is refused and left untouched.
+ *
+ *  @param[in] pszFileName MPA memory-map file name
+ *  @return 0 Success, or the file is already of current version
+ *  @return -1 Failed
+ */
+DLL_PUBLIC int MPA_SIS_Upgrade(const char *pszFileName);
+
 /** @brief Add server info.
  *
  *  This function adds a server info into MPA configuration memory segment.
@@ -158,9 +432,25 @@ DLL_PUBLIC char *MPA_SIS_Init(const char *pszFileName);
  *  @param[in] qtype Message type
  *  @return 0 Success
  *  @return -1 Failed
+ *  @return MPA_SIS_ERR_RETIRED The segment has been retired, nothing is changed
  */
 DLL_PUBLIC int MPA_SIS_SInfoAdd(const char *pMPAStart, DWORD sid, key_t qkey, DWORD qtype);
 
+/** @brief Put a server info into a server group.
+ *
+ *  Server infos of the same group serve the same messages, MPA_SendGroup()
+ *  sends a message to one of them. A group is configured in [server] by a
+ *  fourth field of its members, `s#=sid:qkey:qtype:gid`.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @param[in] sid Server id
+ *  @param[in] gid Group id, 0 to take the server info out of its group
+ *  @return 0 Success
+ *  @return -1 Failed, or the segment was created without groups
+ *  @return MPA_SIS_ERR_RETIRED The segment has been retired, nothing is changed
+ */
+DLL_PUBLIC int MPA_SIS_SInfoSetGroup(const char *pMPAStart, DWORD sid, DWORD gid);
+
 /** @brief Modify server info.
  *
  *  This function updates a server info in MPA configuration memory segment
@@ -172,23 +462,435 @@ DLL_PUBLIC int MPA_SIS_SInfoAdd(const char *pMPAStart, DWORD sid, key_t qkey, DW
  *  @param[in] qtype New message type
  *  @return 0 Success
  *  @return -1 Failed
+ *  @return MPA_SIS_ERR_RETIRED The segment has been retired, nothing is changed
  */
 DLL_PUBLIC int MPA_SIS_SInfoModify(const char *pMPAStart, DWORD sid, key_t qkey, DWORD qtype);
+
+/** @brief Delete the last server info.
+ *
+ *  This function deletes the last server info of server info list, refusing
+ *  it as MPA_SIS_SInfoDelete() does if type infos still use it.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @return 0 Success, or the list is empty
+ *  @return -1 Failed, type infos still use the server
+ *  @return MPA_SIS_ERR_RETIRED The segment has been retired, nothing is changed
+ */
 DLL_PUBLIC int MPA_SIS_SInfoDelLast(const char *pMPAStart);
+
+/** @brief Delete server info.
+ *
+ *  This function deletes a server info from MPA configuration memory
+ *  segment. Its slot is reused by servers added later. The message queue of
+ *  the server is left as it is, since other servers may share it.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @param[in] sid Server id
+ *  @return 0 Success
+ *  @return -1 Failed, the server does not exist or type infos still use it
+ *  @return MPA_SIS_ERR_RETIRED The segment has been retired, nothing is changed
+ */
+DLL_PUBLIC int MPA_SIS_SInfoDelete(const char *pMPAStart, DWORD sid);
 DLL_PUBLIC int MPA_SIS_TInfoAdd(const char *pMPAStart, DWORD type, DWORD sid);
 DLL_PUBLIC int MPA_SIS_TInfoModify(const char *pMPAStart, DWORD type, DWORD sid, DWORD new_type,
                                    DWORD new_sid);
 DLL_PUBLIC int MPA_SIS_TInfoDelLast(const char *pMPAStart);
+
+/** @brief Delete type info.
+ *
+ *  This function deletes the type info which routes type to server sid
+ *  from MPA configuration memory segment.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @param[in] type Message type
+ *  @param[in] sid Server id
+ *  @return 0 Success
+ *  @return -1 Failed
+ *  @return MPA_SIS_ERR_RETIRED The segment has been retired, nothing is changed
+ */
+DLL_PUBLIC int MPA_SIS_TInfoDelete(const char *pMPAStart, DWORD type, DWORD sid);
+
+/** @brief Compact server info list and type info list.
+ *
+ *  This function moves entries from the tail of the lists into the slots of
+ *  deleted entries, until no deleted entry is left, and points type infos
+ *  to the new indexes of moved server infos. At most nBatch entries are
+ *  moved under one write of the segment, so readers are never held for
+ *  long and can run while it works.
+ *
+ *  If the table of type traffic counters has been marked full, it is then
+ *  rebuilt without the types no type info routes any more, under one more
+ *  write. Counts added while it is rebuilt may be lost.
+ *
+ *  It runs synchronously in the calling process, no background thread
+ *  compacts the lists. Call it, or 'mpaadm <file> compact', after deleting
+ *  many entries.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @param[in] nBatch Max entries moved in one write, 0 for default
+ *  @return >=0 Number of entries moved
+ *  @return MPA_SIS_ERR_RETIRED The segment has been retired, entries moved
+ *          in it are lost with it
+ */
+DLL_PUBLIC int MPA_SIS_Compact(const char *pMPAStart, size_t nBatch);
 DLL_PUBLIC int MPA_SIS_End(const char *pMPAStart, Boolean bRelease);
+
+/** @brief Wait for a change of the segment.
+ *
+ *  Blocks until the generation counter differs from *pdwGeneration, without
+ *  polling: the caller sleeps on the counter as a futex and is woken by the
+ *  writer which increases it. The counter of a segment retired by
+ *  MPA_SIS_LoadConfig() is increased too, so check pdwRetired of
+ *  GetSISInfo() and map the file again when it is set.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @param[in,out] pdwGeneration Generation last seen, set to the current one
+ *                 when it has changed
+ *  @param[in] nTimeout Timeout in milliseconds, negative to wait forever
+ *  @return 0 The segment has changed
+ *  @return 1 Timeout
+ *  @return -1 Error, the segment has no generation counter
+ */
+DLL_PUBLIC int MPA_SIS_WaitChange(const char *pMPAStart, DWORD *pdwGeneration, int nTimeout);
 DLL_PUBLIC void MPA_SIS_Display(const char *pMPAStart);
+
+/** @brief Count a message sent to or received by a server info.
+ *
+ *  Adds to the counters of the server info slot in the stripe of the
+ *  running CPU, with atomic adds which never block. Nothing is counted if
+ *  the segment has no traffic counters.
+ *
+ *  @param[in] pSISInfo MPA segment informations got by GetSISInfo()
+ *  @param[in] index Index of the server info
+ *  @param[in] nEvent MPA_STAT_SENT, MPA_STAT_RECV, MPA_STAT_ERROR or
+ *             MPA_STAT_INTR
+ *  @param[in] nBytes Message length of MPA_STAT_SENT and MPA_STAT_RECV
+ */
+DLL_PUBLIC void MPA_SIS_StatServer(const MPA_SISInfo *pSISInfo, mpa_index_t index, int nEvent,
+                                   size_t nBytes);
+
+/** @brief Count a message of a type, like MPA_SIS_StatServer().
+ *
+ *  The counter slot of the type is claimed by the first message of it.
+ *  Nothing is counted if all the slots are taken by other types.
+ *
+ *  @param[in] pSISInfo MPA segment informations got by GetSISInfo()
+ *  @param[in] type Message type
+ *  @param[in] nEvent MPA_STAT_SENT, MPA_STAT_RECV, MPA_STAT_ERROR or
+ *             MPA_STAT_INTR
+ *  @param[in] nBytes Message length of MPA_STAT_SENT and MPA_STAT_RECV
+ */
+DLL_PUBLIC void MPA_SIS_StatType(const MPA_SISInfo *pSISInfo, DWORD type, int nEvent,
+                                 size_t nBytes);
+
+/** @brief Get the doorbell of a server info.
+ *
+ *  The doorbell is a futex word rung by MPA clients after sending a message
+ *  to the server, so that a receiver waiting with a timeout sleeps on it
+ *  instead of polling the message queue. Bit 0 is set by waiters, every
+ *  ring adds 2 and wakes the waiters only if the bit is set, so senders
+ *  make no system call while nobody waits.
+ *
+ *  @param[in] pSISInfo MPA segment informations got by GetSISInfo()
+ *  @param[in] index Index of the server info
+ *  @return Pointer to the doorbell, NULL if the segment has no traffic
+ *          counters
+ */
+DLL_PUBLIC DWORD *MPA_SIS_Doorbell(const MPA_SISInfo *pSISInfo, mpa_index_t index);
+
+/** @brief Ring a doorbell got by MPA_SIS_Doorbell(), after a message is sent. */
+DLL_PUBLIC void MPA_SIS_RingDoorbell(DWORD *pdwDoorbell);
+
+/** @brief Announce a waiter on a doorbell got by MPA_SIS_Doorbell().
+ *
+ *  The message queue must be checked again after this call and before
+ *  MPA_SIS_WaitDoorbell(), a message sent in between is then either found
+ *  or rings the doorbell.
+ *
+ *  @param[in] pdwDoorbell Doorbell of the server
+ *  @return Value of the doorbell to pass to MPA_SIS_WaitDoorbell()
+ */
+DLL_PUBLIC DWORD MPA_SIS_ArmDoorbell(DWORD *pdwDoorbell);
+
+/** @brief Wait until a doorbell is rung.
+ *
+ *  @param[in] pdwDoorbell Doorbell of the server
+ *  @param[in] dwSeen Value returned by MPA_SIS_ArmDoorbell()
+ *  @param[in] pTimeout Relative timeout, NULL to wait forever
+ *  @return 0 The doorbell has been rung, or was rung before the wait
+ *  @return 1 Timeout
+ *  @return 2 The wait was interrupted by a signal
+ *  @return -1 Error
+ */
+DLL_PUBLIC int MPA_SIS_WaitDoorbell(DWORD *pdwDoorbell, DWORD dwSeen,
+                                    const struct timespec *pTimeout);
+
+/** @brief Get traffic counters of a server, added up over all stripes.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @param[in] sid Server id
+ *  @param[out] pStat Counters of the server
+ *  @return 0 Success
+ *  @return -1 The server does not exist or the segment has no counters
+ */
+DLL_PUBLIC int MPA_SIS_GetServerStat(const char *pMPAStart, DWORD sid, MPA_SIS_Stat *pStat);
+
+/** @brief Get traffic counters of a type, added up over all stripes.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @param[in] type Message type
+ *  @param[out] pStat Counters of the type
+ *  @return 0 Success
+ *  @return -1 No message of the type has been counted
+ */
+DLL_PUBLIC int MPA_SIS_GetTypeStat(const char *pMPAStart, DWORD type, MPA_SIS_Stat *pStat);
+
+/** @brief Get depth of the message queues of all server infos in one pass.
+ *
+ *  Server ids, queue keys and queue ids are copied out of the segment under
+ *  one read, then every queue is read with IPC_STAT by the queue id stored
+ *  in the segment, without resolving queue keys again. Servers sharing a
+ *  queue share one IPC_STAT wherever they are listed.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @param[out] pStats Buffer to store queue depths
+ *  @param[in] nSize Max number of entries pStats can hold
+ *  @return >=0 Total number of server infos, entries after nSize are left out
+ *  @return -1 The segment is not of the current version
+ */
+DLL_PUBLIC int MPA_SIS_QueueStats(const char *pMPAStart, MPA_SIS_QueueStat *pStats,
+                                  size_t nSize);
+
+/** @brief Count messages waiting in a queue by message type.
+ *
+ *  Queues shared by many server infos are told apart by message type, and
+ *  msgrcv(2) of one type walks past the messages of the others. This
+ *  function copies messages with MSG_COPY, which leaves them in the queue,
+ *  and counts those of each of pdwTypes. At most MPA_QSCAN_MAX messages
+ *  are copied, each of them found by walking the queue from its head, so
+ *  it is meant for diagnosis rather than for every send.
+ *
+ *  @param[in] qid Message queue id
+ *  @param[in] pdwTypes Message types to count
+ *  @param[out] pnMsgs Number of messages of each type
+ *  @param[in] nTypes Number of types
+ *  @return >=0 Number of messages copied
+ *  @return -1 The queue cannot be read, or MSG_COPY is not supported
+ */
+DLL_PUBLIC int MPA_SIS_QueueTypeDepth(int qid, const DWORD *pdwTypes, size_t *pnMsgs,
+                                      size_t nTypes);
+
+/** @brief Move a server info off a shared queue onto a queue of its own.
+ *
+ *  The queue of qkey is created and the messages of the server waiting in
+ *  the old queue are moved to it, then the server info is switched to it
+ *  and the generation increased. Messages sent by clients which still use
+ *  the route of before are moved again, and an empty message of the queue
+ *  type of the server is sent to the old queue: MPA clients blocked on the
+ *  old queue take it as a sign to look up their route again, and each of
+ *  them sends it back to the old queue before moving, so every receiver
+ *  of the server is woken. After a grace period the messages sent with the
+ *  route of before are moved once more and the empty message is dropped.
+ *  Traffic of the server goes on during the move.
+ *  The new queue is given the max bytes of the old one first, and the move
+ *  is refused if the messages waiting in the old queue may not fit in it.
+ *  A message is only taken from the old queue once there is room for it,
+ *  so messages keep their order. Messages sent to the old queue after the
+ *  first move, and messages sent long after the switch with a stale route,
+ *  are received behind messages sent to the new queue after the switch.
+ *  The server should keep receiving, otherwise the move may wait for room
+ *  in the new queue.
+ *
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @param[in] sid Server id
+ *  @param[in] qkey Message queue key used by no server info
+ *  @return >=0 Number of messages moved
+ *  @return -1 Error, or the messages waiting do not fit in the new queue
+ *  @return MPA_SIS_ERR_RETIRED The segment has been retired, the server is not
+ *          moved; messages already moved wait in the new queue
+ */
+DLL_PUBLIC int MPA_SIS_SplitQueue(const char *pMPAStart, DWORD sid, key_t qkey);
+
+/** @brief Print traffic counters of all server infos and types. */
+DLL_PUBLIC void MPA_SIS_DisplayStat(const char *pMPAStart);
+/** @brief Load MPA configuration from file without stopping traffic.
+ *
+ *  The new segment is built in a sibling file named `<pszSHMFileName>.reload`
+ *  and renamed over pszSHMFileName when it is complete, so the live segment
+ *  is never truncated or half-written. Then the old segment, if any, is
+ *  marked retired and its generation is increased: calls already running
+ *  finish against the old segment, which stays valid while it is mapped,
+ *  and new calls of MPA clients map the new one. A client unmaps the old
+ *  segment once no call of it uses the segment any more.
+ *
+ *  Message queues are keyed by the qkey of each server info in the
+ *  configuration and opened with MsqCreate() while loading, so the queue of
+ *  a qkey which already exists is reused with the messages it holds. A
+ *  server info whose qkey changed gets another queue, messages left in the
+ *  old one are not moved.
+ *
+ *  MPA_SIS_Create() still creates the file in place and must not be used on
+ *  a segment in use.
+ *
+ *  MPA_SIS_LoadConfig(), MPA_SIS_ApplyConfigDiff(), MPA_SIS_Grow(),
+ *  MPA_SIS_LoadImage() and MPA_SIS_Upgrade() hold an exclusive flock() on
+ *  the sibling file `<pszSHMFileName>.lock` while they run, so they wait for
+ *  each other instead of working on a segment retired by another one.
+ *
+ *  The functions changing entries of a mapped segment, MPA_SIS_SInfoAdd() and
+ *  the like, refuse a retired segment with MPA_SIS_ERR_RETIRED, since the
+ *  change would be lost with it: map the file again and retry.
+ *
+ *  @param[in] pszSHMFileName MPA memory map file name
+ *  @param[in] pszFileName MPA configuration file name
+ *  @return 0 Success
+ *  @return -1 Error, the live segment is left untouched
+ */
 DLL_PUBLIC int MPA_SIS_LoadConfig(const char *pszSHMFileName, const char *pszFileName);
+
+/** @brief Take the admin lock of the memory map file, which
+ *  MPA_SIS_LoadConfig() and the others above hold while they run.
+ *
+ *  Entries changed through a segment mapped under the lock cannot be lost to
+ *  a reload or grow retiring it. The functions taking the lock must not be
+ *  called while holding it, they would wait for it forever.
+ *
+ *  @param[in] pszSHMFileName MPA memory map file name
+ *  @return >=0 Descriptor to pass to MPA_SIS_AdminUnlock()
+ *  @return -1 Error
+ */
+DLL_PUBLIC int MPA_SIS_AdminLock(const char *pszSHMFileName);
+
+/** @brief Release the admin lock taken by MPA_SIS_AdminLock(), -1 is ignored. */
+DLL_PUBLIC void MPA_SIS_AdminUnlock(int fd);
+
+/** @brief Apply the difference between MPA configuration file and the live
+ *  segment in place.
+ *
+ *  The file is loaded into a scratch segment and compared with the live one
+ *  by server id and by type and server id. Server infos and type infos
+ *  missing in the file are removed, new ones are added in free slots, and
+ *  server infos with another queue key or queue type are updated. Entries
+ *  left unchanged are not written, and their message queues and queue ids
+ *  are kept. Queues of new queue keys are created before the change, which
+ *  is then made under one write of the sequence lock.
+ *
+ *  The live segment must be of the current version, use MPA_SIS_LoadConfig()
+ *  otherwise. If it is too small for the file, it is grown by MPA_SIS_Grow()
+ *  first, to twice the max numbers or as many as the file needs.
+ *
+ *  @param[in] pszSHMFileName MPA memory map file name
+ *  @param[in] pszFileName MPA configuration file name
+ *  If an entry cannot be added, the others are still added and -1 is
+ *  returned after the write: the change is not rolled back, the segment is
+ *  consistent and holds every entry applied, and the same file can be
+ *  applied again once the cause is fixed.
+ *
+ *  @return >=0 Number of entries added, changed and removed
+ *  @return -1 Error, the live segment is left untouched unless an entry
+ *             could not be added as described above
+ */
+DLL_PUBLIC int MPA_SIS_ApplyConfigDiff(const char *pszSHMFileName, const char *pszFileName);
+
+/** @brief Grow max numbers of server infos and type infos of the live
+ *  segment.
+ *
+ *  Entries, free slots, group ids and traffic counters are copied at the
+ *  same indexes into a larger segment beside the file, which is published
+ *  like MPA_SIS_LoadConfig() does. Message queues and queue ids are kept.
+ *  The old segment is copied and the copy synced to disk without its
+ *  sequence lock, which is then held only to rename the copy over the file
+ *  and retire the old segment. A copy made while a writer changed the old
+ *  segment is made again, after a few of them in the write, so no change is
+ *  lost in between. MPA clients map the grown segment on their next call;
+ *  other writers keeping the old segment mapped must check pdwRetired and
+ *  map the file again, as after a reload. Traffic counted on the old
+ *  segment after the copy is lost.
+ *
+ *  @param[in] pszSHMFileName MPA memory map file name
+ *  @param[in] nNumOfProcess New max number of server infos, 0 to keep it
+ *  @param[in] nNumOfType New max number of type infos, 0 to keep it
+ *  @return 0 Success, or both numbers are the current ones
+ *  @return -1 Error, or a number is smaller than the current one; the live
+ *             segment is left untouched
+ */
+DLL_PUBLIC int MPA_SIS_Grow(const char *pszSHMFileName, size_t nNumOfProcess, size_t nNumOfType);
 DLL_PUBLIC int MPA_SIS_ExportConfig(const char *pMPAStart, const char *pszFileName);
+
+/** @brief Compile MPA configuration file into an image.
+ *
+ *  The image is a segment loaded from pszFileName, without message queues
+ *  (dwQid is -1) and with zero generation, so that the same configuration
+ *  always compiles to the same image. It keeps the routing sections only,
+ *  (1) - (26) of MPA_SIS_Create(), with the size of them in (1) and no
+ *  MPA_SIS_FEATURE_STATS flag. It is followed by a footer of two DWORDs,
+ *  MPA_SIS_IMAGE_MAGIC and the CRC-32 of the sections:
+ *  +--------------------------------+-----+-----+
+ *  |Segment (1) - (26)              |DWORD|DWORD|
+ *  |                                |magic| CRC |
+ *  +--------------------------------+-----+-----+
+ *
+ *  @see MPA_SIS_LoadImage()
+ *
+ *  @param[in] pszImageFileName Image file name
+ *  @param[in] pszFileName MPA configuration file name
+ *  @return 0 Success
+ *  @return -1 Error
+ */
+DLL_PUBLIC int MPA_SIS_CompileConfig(const char *pszImageFileName, const char *pszFileName);
+
+/** @brief Load an image compiled by MPA_SIS_CompileConfig().
+ *
+ *  The image is checked against its footer, checksum and layout, then
+ *  copied as the new segment with the message queues of this host created,
+ *  followed by traffic counters and doorbells laid out afresh and zeroed,
+ *  and published like MPA_SIS_LoadConfig() does, without parsing anything.
+ *
+ *  @param[in] pszSHMFileName MPA memory map file name
+ *  @param[in] pszImageFileName Image file name
+ *  @return 0 Success
+ *  @return -1 Error, the live segment is left untouched
+ */
+DLL_PUBLIC int MPA_SIS_LoadImage(const char *pszSHMFileName, const char *pszImageFileName);
 DLL_PUBLIC void GetSISInfo(const char *pMPAStart, MPA_SISInfo *pSISInfo);
 DLL_PUBLIC int MPA_GetServerInfoByIndex(mpa_index_t index, MPA_SIS_SrvInfo *pSrvInfo,
                                         const char *pMPAStart);
 DLL_PUBLIC int MPA_GetServerInfo(DWORD sid, MPA_SIS_SrvInfo *pSrvInfo, const char *pMPAStart);
 DLL_PUBLIC int MPA_GetTypeInfo(mpa_index_t index_, DWORD type, MPA_SIS_TypeInfo *pTypeInfo,
                                const char *pMPAStart);
+
+/** @brief Get server infos of the subscribers of a type.
+ *
+ *  This function looks up the type in type hash index and copies the server
+ *  infos of its subscribers, starting from the index_-th one, to pSrvInfos.
+ *  At most nSize server infos are copied.
+ *
+ *  @param[in] type Message type
+ *  @param[in] index_ Index of the first subscriber to copy
+ *  @param[out] pSrvInfos Buffer to store server infos
+ *  @param[in] nSize Max number of server infos pSrvInfos can hold
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @return >=0 Total number of subscribers of the type
+ *  @return -1 The segment has no type hash index, use MPA_GetTypeInfo()
+ */
+DLL_PUBLIC int MPA_GetSubscribers(DWORD type, mpa_index_t index_, MPA_SIS_SrvInfo *pSrvInfos,
+                                  size_t nSize, const char *pMPAStart);
+
+/** @brief Get server infos of the members of a server group.
+ *
+ *  This function scans group ids of server info list and copies the server
+ *  infos of the group, in the order of the list, to pSrvInfos. At most nSize
+ *  server infos are copied.
+ *
+ *  @param[in] gid Group id, not 0
+ *  @param[out] pSrvInfos Buffer to store server infos
+ *  @param[in] nSize Max number of server infos pSrvInfos can hold
+ *  @param[in] pMPAStart Beginning address of MPA configuration memory segment
+ *  @return >=0 Total number of members of the group
+ *  @return -1 The segment was created without groups
+ */
+DLL_PUBLIC int MPA_GetGroupMembers(DWORD gid, MPA_SIS_SrvInfo *pSrvInfos, size_t nSize,
+                                   const char *pMPAStart);
 DLL_PUBLIC size_t MPA_CheckQKey(key_t qkey, const char *pMPAStart);
 DLL_PUBLIC int MPA_CheckMsgQ(key_t qkey);
 // Functions }}}
@@ -34,42 +34,215 @@
 // Includes {{{
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/msg.h>
+#include <time.h>
 
 #include "mpacli.h"
 #include "mpaknl.h"
 #include "rscommon/debug.h"
 // }}}
 
-static DWORD g_sid = 0; /**< Server id of the running process */
-/** Pointer to the beginning of memory map
- *  section which contains MPA configurations */
-static char *g_pMPAStart = NULL;
+#define MPA_ROUTE_CACHE_BITS 8 /**< Route cache holds 2^8 server infos */
+#define MPA_PLAN_CACHE_BITS 6  /**< Plan cache holds 2^6 types */
+#define MPA_GROUP_CACHE_BITS 4 /**< Group cache holds 2^4 groups */
+#define MPA_RING_REPLICAS 64   /**< Points of a group member on hash ring */
+#define MPA_RING_KEY_SIZE 256  /**< Property values longer are hashed by prefix */
+#define MPA_PUB_BATCH 16       /**< Subscribers copied out of plan cache at a time */
+/** Age after which least depth reads the queue depths of a group again,
+ *  in between it counts the messages it sends to each member itself */
+#define MPA_GROUP_DEPTH_NS 1000000LL
+/** Longest sleep of a receiver waiting with a timeout, after which it looks
+ *  up its route again and checks for messages sent by ones which do not
+ *  ring the doorbell, such as MPA_SIS_SplitQueue() or processes linked with
+ *  a library before doorbells. Such messages wait up to this long. */
+#define MPA_RECV_WAIT_NS 20000000L
+#define MPA_RECV_POLL_NS 50000L /**< First poll interval of a segment without doorbells */
+
+/** Point of a group member on hash ring */
+typedef struct MPA_RingPoint {
+  DWORD dwHash;
+  DWORD dwMember; /**< Index of the member in the plan */
+} MPA_RingPoint;
+
+/** Server info resolved from MPA segment, valid while the generation of
+ *  the segment stays the same */
+typedef struct MPA_RouteEntry {
+  Boolean bValid;
+  DWORD dwGeneration;
+  int nIndex; /**< Index of the server info, where its traffic is counted */
+  MPA_SIS_SrvInfo SrvInfo;
+} MPA_RouteEntry;
+
+/** Server infos of all the subscribers of a type, or of all the members of
+ *  a group, valid while the generation of the segment stays the same */
+typedef struct MPA_TypePlan {
+  Boolean bValid;
+  DWORD dwGeneration;
+  DWORD dwType;               /**< Type, or group id in group cache */
+  size_t nCount;
+  size_t nCapacity;
+  MPA_SIS_SrvInfo *pSrvInfos;
+  int *pIndexes;              /**< Indexes of the server infos of subscribers, where
+                                   their traffic is counted */
+  size_t nRingSize;           /**< Points on hash ring of members, 0 until built */
+  MPA_RingPoint *pRing;
+  msgqnum_t *pDepths;         /**< Queue depths of members, for least depth */
+  long long nDepthTime;       /**< Time the depths were read in ns, 0 until read */
+} MPA_TypePlan;
+
+/** Round-robin position of a group. Positions are kept apart from group
+ *  cache, so groups sharing a slot of it do not reset each other. */
+typedef struct MPA_GroupCursor {
+  DWORD gid;
+  size_t nNext; /**< Member to take next */
+} MPA_GroupCursor;
+
+/** A mapping of MPA memory map file. The context holds a reference to the
+ *  segment it maps, and a call which reads the segment without the lock,
+ *  such as a waiter sleeping on one of its futex words, holds one more. A
+ *  segment replaced by a remap is unmapped when its last reference is
+ *  dropped, never under a call still using it. */
+typedef struct MPA_Segment {
+  char *pMPAStart;
+  MPA_SISInfo SISInfo;
+  int nRefs; /**< References, changed atomically */
+} MPA_Segment;
+
+/** Client context, see MPA_CtxOpen(). The lock guards everything after
+ *  it: MPA segment is only read or written while holding the lock, and
+ *  messages are sent and received without it. */
+struct MPA_Ctx {
+  pthread_mutex_t Lock;
+  DWORD dwSid; /**< Server id the context acts as */
+  /** Pointer to the beginning of memory map
+   *  section which contains MPA configurations */
+  char *pMPAStart;
+  /** Pointer to the generation counter of MPA segment, NULL if the segment
+   *  has no counter and nothing can be cached */
+  const DWORD *pdwGeneration;
+  /** Pointer to the retired flag of MPA segment, set when a reload has
+   *  published a new segment under the same file name */
+  const DWORD *pdwRetired;
+  MPA_SISInfo SISInfo; /**< Informations of the mapped segment, kept for traffic counters */
+  MPA_Segment *pSegment; /**< Mapped segment, pMPAStart and SISInfo are its */
+  char szSHMFileName[PATH_MAX]; /**< MPA memory map file name */
+  int nMapFlags;                /**< Options to map MPA memory map file */
+
+  MPA_RouteEntry SelfRoute;
+  MPA_RouteEntry RouteCache[1 << MPA_ROUTE_CACHE_BITS];
+  MPA_TypePlan PlanCache[1 << MPA_PLAN_CACHE_BITS];
+  MPA_TypePlan GroupCache[1 << MPA_GROUP_CACHE_BITS];
+  MPA_GroupCursor *pCursors; /**< Round-robin positions of the groups sent to */
+  size_t nCursors;
+  size_t nCursorCapacity;
+};
+
+/** Context of MPA_Init() and of the functions taking no context */
+static MPA_Ctx g_Ctx = {.Lock = PTHREAD_MUTEX_INITIALIZER};
 
 static size_t CalculateMsgLength(const MPAMessage *pMessage);
 static void GetMsgPart(const MPAMessage *pMessage, MPA_MSG_Head **head, MPA_MSG_Prop **prop,
                        MPA_MSG_Body **body);
+static int CtxInit(MPA_Ctx *pCtx, const char *pszSHMFileName, DWORD sid, int nFlags);
+static void FreePlans(MPA_Ctx *pCtx);
+static int MPA_Send_Stub(MPA_Ctx *pCtx, DWORD sid, DWORD type, const MPAMessage *pMessage,
+                         MsgBufDef *pMsgBuf);
+static int MPA_Pub_Stub(MPA_Ctx *pCtx, DWORD type, const MPAMessage *pMessage,
+                        MsgBufDef *pMsgBuf);
+static ssize_t MPA_Recv_Stub(MPA_Ctx *pCtx, MPAMessage *pMessage, MsgBufDef *pMsgBuf);
+static ssize_t MPA_RecvTypeNonBlock_Stub(MPA_Ctx *pCtx, DWORD mtype, MPAMessage *pMessage,
+                                         MsgBufDef *pMsgBuf);
+static ssize_t MPA_RecvNonBlock_Stub(MPA_Ctx *pCtx, MPAMessage *pMessage, MsgBufDef *pMsgBuf);
+static ssize_t MPA_RecvWait_Stub(MPA_Ctx *pCtx, MPAMessage *pMessage, MsgBufDef *pMsgBuf,
+                                 const struct timespec *pDeadline);
+static void DeadlineAfter(struct timespec *pDeadline, long long nNs);
+static Boolean TimeLeft(const struct timespec *pDeadline, long nMaxNs, struct timespec *pWait);
+static MsgBufDef *GetMsgBuf(const MPAMessage *pMessage);
+static size_t SetP2PHead(MPA_Ctx *pCtx, DWORD sid, const MPAMessage *pMessage);
+static int SendMsgBuf(int qid, MsgBufDef *pMsgBuf, size_t nMsgLen);
+static void ClearRouteCache(MPA_Ctx *pCtx);
+static MPA_Segment *MapSegment(const char *pszSHMFileName, int nFlags);
+static MPA_Segment *SegmentGet(MPA_Ctx *pCtx);
+static void SegmentPut(MPA_Segment *pSegment);
+static void SetSegment(MPA_Ctx *pCtx, MPA_Segment *pSegment);
+static void RefreshSegment(MPA_Ctx *pCtx);
+static int ResolveRoute(MPA_Ctx *pCtx, DWORD sid, MPA_SIS_SrvInfo *pSrvInfo);
+static int ResolveSubscribers(MPA_Ctx *pCtx, DWORD type, const MPA_SIS_SrvInfo **ppSrvInfos,
+                              const int **ppIndexes);
+static int ResolveMembers(MPA_Ctx *pCtx, DWORD gid, MPA_TypePlan **ppPlan);
+static size_t *GroupCursor(MPA_Ctx *pCtx, DWORD gid);
+static size_t PickMember(MPA_TypePlan *pPlan, size_t *pnNext, int nPolicy);
+static DWORD RingHash(const char *p, size_t n);
+static int RingPointCompare(const void *p1, const void *p2);
+static int BuildRing(MPA_TypePlan *pPlan);
+static size_t RingLookup(const MPA_TypePlan *pPlan, DWORD dwHash);
+static void CountServer(MPA_Ctx *pCtx, DWORD sid, int nEvent, size_t nBytes);
+static void CountRecv(MPA_Ctx *pCtx, const MPAMessage *pMessage, size_t nMsgLen);
+static void CountRecvLocked(MPA_Ctx *pCtx, const MPAMessage *pMessage, size_t nMsgLen);
+static void PassWake(MPA_Ctx *pCtx, const MPA_SIS_SrvInfo *pServerInfo);
+static void CountSend(const MPA_Segment *pSegment, int nIndex, int nRetCode, size_t nBytes);
+static void CountPub(const MPA_Segment *pSegment, int nIndex, DWORD type, int nRetCode,
+                     size_t nBytes);
 
 DLL_PUBLIC int MPA_Init(const char *pszSHMFileName, DWORD sid) { // {{{
-  if (sid <= 0) {
-    return MPA_ERR_PARAM;
+  return MPA_InitEx(pszSHMFileName, sid, 0);
+} // }}}
+
+DLL_PUBLIC int MPA_InitEx(const char *pszSHMFileName, DWORD sid, int nFlags) { // {{{
+  int nRetCode;
+
+  pthread_mutex_lock(&g_Ctx.Lock);
+  nRetCode = CtxInit(&g_Ctx, pszSHMFileName, sid, nFlags);
+  pthread_mutex_unlock(&g_Ctx.Lock);
+  return nRetCode;
+} // }}}
+
+DLL_PUBLIC MPA_Ctx *MPA_CtxOpen(const char *pszSHMFileName, DWORD sid, int nFlags) { // {{{
+  MPA_Ctx *pCtx;
+
+  if ((pCtx = calloc(1, sizeof(MPA_Ctx))) == NULL) {
+    return NULL;
   }
-  g_sid = sid;
-  if ((g_pMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
-    return MPA_ERR_INIT;
+  pthread_mutex_init(&pCtx->Lock, NULL);
+  if (CtxInit(pCtx, pszSHMFileName, sid, nFlags) != 0) {
+    pthread_mutex_destroy(&pCtx->Lock);
+    free(pCtx);
+    return NULL;
   }
-  return 0;
+  return pCtx;
 } // }}}
 
-DLL_PUBLIC int MPA_End(Boolean bRelease) { // {{{
-  if (g_pMPAStart == NULL) {
-    return MPA_ERR_NOINIT;
-  }
-  if (0 != MPA_SIS_End(g_pMPAStart, bRelease)) {
-    return MPA_ERR_END;
+DLL_PUBLIC void MPA_CtxClose(MPA_Ctx *pCtx) { // {{{
+  if (pCtx == NULL || pCtx == &g_Ctx) {
+    return;
   }
+  SegmentPut(pCtx->pSegment);
+  FreePlans(pCtx);
+  pthread_mutex_destroy(&pCtx->Lock);
+  free(pCtx);
+} // }}}
 
-  return 0;
+DLL_PUBLIC MPA_Ctx *MPA_CtxDefault(void) { return &g_Ctx; }
+
+DLL_PUBLIC int MPA_End(Boolean bRelease) { // {{{
+  int nRetCode = 0;
+
+  pthread_mutex_lock(&g_Ctx.Lock);
+  if (g_Ctx.pMPAStart == NULL) {
+    nRetCode = MPA_ERR_NOINIT;
+  } else {
+    RefreshSegment(&g_Ctx);
+    if (0 != MPA_SIS_End(g_Ctx.pMPAStart, bRelease)) {
+      nRetCode = MPA_ERR_END;
+    }
+  }
+  pthread_mutex_unlock(&g_Ctx.Lock);
+  return nRetCode;
 } // }}}
 
 DLL_PUBLIC void MPA_MsgInit(MPAMessage *pMessage) { // {{{
@@ -101,7 +274,9 @@ DLL_PUBLIC void MPA_MsgInit(MPAMessage *pMessage) { // {{{
 } // }}}
 
 /* MPA Message Getters & Setters {{{ */
-DLL_PUBLIC DWORD MPA_GetSID() { return g_sid; }
+DLL_PUBLIC DWORD MPA_GetSID() { return g_Ctx.dwSid; }
+
+DLL_PUBLIC DWORD MPA_CtxGetSID(const MPA_Ctx *pCtx) { return (pCtx) ? pCtx->dwSid : 0; }
 
 DLL_PUBLIC ssize_t MPA_GetMsgLength(const MPAMessage *pMessage) {
   MPA_MSG_Head *head;
@@ -425,37 +600,63 @@ static size_t CalculateMsgLength(const MPAMessage *pMessage) {
          body->wBodyLen;
 }
 
-static int MPA_Send_Stub(DWORD sid, DWORD type,
-                         const MPAMessage *pMessage) { // {{{
+/** Send a message to a server. pMsgBuf is the send buffer holding the
+ *  message if it was got by MPA_SendReserve(), otherwise NULL and only the
+ *  used bytes of the message are copied into a buffer on stack. */
+static int MPA_Send_Stub(MPA_Ctx *pCtx, DWORD sid, DWORD type, // {{{
+                         const MPAMessage *pMessage, MsgBufDef *pMsgBuf) {
   MPA_MSG_Head *head;
   MPA_MSG_Prop *prop;
   MPA_MSG_Body *body;
   MPA_SIS_SrvInfo ServerInfo;
+  MPA_Segment *pSegment = NULL;
   MsgBufDef MsgBuf;
-  int nRetCode = -1;
+  size_t nMsgLen;
+  int nRetCode = -1, nIndex = -1;
 
-  if (pMessage == NULL) {
+  if (pCtx == NULL || pMessage == NULL) {
     return MPA_ERR_PARAM;
   }
 
   GetMsgPart(pMessage, &head, &prop, &body);
-  head->wMsgLen = CalculateMsgLength(pMessage);
-  head->bMsgMode = MPA_SM_P2P;
-  head->dwSourceID = g_sid;
-  head->dwDestID = sid;
+  if ((nMsgLen = SetP2PHead(pCtx, sid, pMessage)) > MPA_MESSAGESIZE) {
+    trace("MPA_Send>Message length[%zu] is over %d", nMsgLen, MPA_MESSAGESIZE);
+    return MPA_ERR_PARAM;
+  }
 
-  if (MPA_GetServerInfo(sid, &ServerInfo, g_pMPAStart) < 0) {
+  /** The route is resolved once under the lock, and the segment it comes
+   *  from is referenced so that the message is counted in it without the
+   *  lock */
+  pthread_mutex_lock(&pCtx->Lock);
+  if ((nIndex = ResolveRoute(pCtx, sid, &ServerInfo)) >= 0) {
+    pSegment = SegmentGet(pCtx);
+  }
+  pthread_mutex_unlock(&pCtx->Lock);
+  if (nIndex < 0) {
     return MPA_ERR_SVRINFO;
   }
 
+  if (pMsgBuf == NULL) {
+    pMsgBuf = &MsgBuf;
+    memcpy(MsgBuf.mtext, pMessage, nMsgLen);
+  }
   if (type == 0) {
-    MsgBuf.mtype = ServerInfo.dwQtype;
+    pMsgBuf->mtype = ServerInfo.dwQtype;
   } else {
-    MsgBuf.mtype = type;
+    pMsgBuf->mtype = type;
   }
 
-  memcpy(MsgBuf.mtext, pMessage, sizeof(MPAMessage));
-  if ((nRetCode = MsqSend(ServerInfo.dwQid, (T_Msgbuf *)&MsgBuf, head->wMsgLen)) == -1) {
+  nRetCode = SendMsgBuf(ServerInfo.dwQid, pMsgBuf, nMsgLen);
+  CountSend(pSegment, nIndex, nRetCode, nMsgLen);
+  SegmentPut(pSegment);
+  return nRetCode;
+} // }}}
+
+/** Send a framed message to a queue, see MPA_Send_Stub() for the errors */
+static int SendMsgBuf(int qid, MsgBufDef *pMsgBuf, size_t nMsgLen) { // {{{
+  int nRetCode;
+
+  if ((nRetCode = MsqSend(qid, (T_Msgbuf *)pMsgBuf, nMsgLen)) == -1) {
     int err = errno;
     trace("MPA_Send>MsqSend error:%d, errno=%d", nRetCode, err);
     if (err == EINTR) {
@@ -464,7 +665,7 @@ static int MPA_Send_Stub(DWORD sid, DWORD type,
     }
 
     if (err == EINVAL || err == EIDRM) {
-      trace("MPA_Send>Invalid msqid[%d] or the queue is removed", ServerInfo.dwQid);
+      trace("MPA_Send>Invalid msqid[%d] or the queue is removed", qid);
       return MPA_ERR_SEND_NOQ;
     }
 
@@ -479,66 +680,421 @@ static int MPA_Send_Stub(DWORD sid, DWORD type,
 } // }}}
 
 DLL_PUBLIC int MPA_Send(DWORD sid, const MPAMessage *pMessage) { // {{{
-  return MPA_Send_Stub(sid, 0, pMessage);
+  return MPA_Send_Stub(&g_Ctx, sid, 0, pMessage, NULL);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxSend(MPA_Ctx *pCtx, DWORD sid, const MPAMessage *pMessage) { // {{{
+  return MPA_Send_Stub(pCtx, sid, 0, pMessage, NULL);
+} // }}}
+
+DLL_PUBLIC int MPA_SendBatch(DWORD sid, MPAMessage *const *ppMessages, size_t nCount, // {{{
+                             int *pnStatus) {
+  return MPA_CtxSendBatch(&g_Ctx, sid, ppMessages, nCount, pnStatus);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxSendBatch(MPA_Ctx *pCtx, DWORD sid, MPAMessage *const *ppMessages, // {{{
+                                size_t nCount, int *pnStatus) {
+  MPA_SIS_SrvInfo ServerInfo;
+  MPA_Segment *pSegment = NULL;
+  MsgBufDef MsgBuf;
+  size_t i, nMsgLen;
+  int nSent = 0, nFatal = 0, nIndex;
+
+  if (pCtx == NULL || (nCount > 0 && (ppMessages == NULL || pnStatus == NULL))) {
+    return MPA_ERR_PARAM;
+  }
+
+  pthread_mutex_lock(&pCtx->Lock);
+  if ((nIndex = ResolveRoute(pCtx, sid, &ServerInfo)) < 0) {
+    nFatal = MPA_ERR_SVRINFO;
+  } else {
+    pSegment = SegmentGet(pCtx);
+  }
+  pthread_mutex_unlock(&pCtx->Lock);
+
+  /** Once the queue is gone or a signal comes, the rest of the messages are
+   *  not tried and get the same status */
+  for (i = 0; i < nCount; i++) {
+    if (nFatal != 0) {
+      pnStatus[i] = nFatal;
+      continue;
+    }
+    if (ppMessages[i] == NULL) {
+      pnStatus[i] = MPA_ERR_PARAM;
+      continue;
+    }
+    if ((nMsgLen = SetP2PHead(pCtx, sid, ppMessages[i])) > MPA_MESSAGESIZE) {
+      pnStatus[i] = MPA_ERR_PARAM;
+      continue;
+    }
+    memcpy(MsgBuf.mtext, ppMessages[i], nMsgLen);
+    MsgBuf.mtype = ServerInfo.dwQtype;
+    if ((pnStatus[i] = SendMsgBuf(ServerInfo.dwQid, &MsgBuf, nMsgLen)) == 0) {
+      nSent++;
+    } else if (pnStatus[i] == MPA_ERR_SEND_NOQ || pnStatus[i] == MPA_ERR_INTR) {
+      nFatal = pnStatus[i];
+    }
+    CountSend(pSegment, nIndex, pnStatus[i], nMsgLen);
+  }
+  SegmentPut(pSegment);
+  return nSent;
+} // }}}
+
+DLL_PUBLIC int MPA_SendMulti(const DWORD *pdwSids, size_t nCount, // {{{
+                             const MPAMessage *pMessage, int *pnStatus) {
+  return MPA_CtxSendMulti(&g_Ctx, pdwSids, nCount, pMessage, pnStatus);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxSendMulti(MPA_Ctx *pCtx, const DWORD *pdwSids, size_t nCount, // {{{
+                                const MPAMessage *pMessage, int *pnStatus) {
+  MPA_MSG_Head *head;
+  MPA_MSG_Prop *prop;
+  MPA_MSG_Body *body;
+  MPA_SIS_SrvInfo ServerInfos[MPA_PUB_BATCH];
+  int nIndexes[MPA_PUB_BATCH];
+  MPA_Segment *pSegment;
+  MsgBufDef MsgBuf;
+  size_t i, j, nBatch, nMsgLen;
+  int nSent = 0, nFatal = 0;
+
+  if (pCtx == NULL || pMessage == NULL || (nCount > 0 && (pdwSids == NULL || pnStatus == NULL))) {
+    return MPA_ERR_PARAM;
+  }
+
+  /** The message is copied once, only its destination is changed for each
+   *  server. Routes are resolved a batch at a time under the lock, and
+   *  counted without it in the segment they come from. */
+  if ((nMsgLen = SetP2PHead(pCtx, MPA_SID_NONE, pMessage)) > MPA_MESSAGESIZE) {
+    trace("MPA_SendMulti>Message length[%zu] is over %d", nMsgLen, MPA_MESSAGESIZE);
+    return MPA_ERR_PARAM;
+  }
+  memcpy(MsgBuf.mtext, pMessage, nMsgLen);
+  GetMsgPart((const MPAMessage *)MsgBuf.mtext, &head, &prop, &body);
+  for (i = 0; i < nCount; i += nBatch) {
+    nBatch = (nCount - i < MPA_PUB_BATCH) ? nCount - i : MPA_PUB_BATCH;
+    pthread_mutex_lock(&pCtx->Lock);
+    for (j = 0; j < nBatch; j++) {
+      nIndexes[j] = ResolveRoute(pCtx, pdwSids[i + j], ServerInfos + j);
+      pnStatus[i + j] = (nIndexes[j] < 0) ? MPA_ERR_SVRINFO : 0;
+    }
+    pSegment = SegmentGet(pCtx);
+    pthread_mutex_unlock(&pCtx->Lock);
+
+    for (j = 0; j < nBatch; j++) {
+      if (nFatal != 0) {
+        pnStatus[i + j] = nFatal;
+        continue;
+      }
+      if (pnStatus[i + j] != 0) {
+        continue;
+      }
+      head->dwDestID = pdwSids[i + j];
+      MsgBuf.mtype = ServerInfos[j].dwQtype;
+      if ((pnStatus[i + j] = SendMsgBuf(ServerInfos[j].dwQid, &MsgBuf, nMsgLen)) == 0) {
+        nSent++;
+      } else if (pnStatus[i + j] == MPA_ERR_INTR) {
+        nFatal = MPA_ERR_INTR;
+      }
+      CountSend(pSegment, nIndexes[j], pnStatus[i + j], nMsgLen);
+    }
+    SegmentPut(pSegment);
+  }
+  return nSent;
+} // }}}
+
+DLL_PUBLIC int MPA_SendGroup(DWORD gid, int nPolicy, const MPAMessage *pMessage) { // {{{
+  return MPA_CtxSendGroup(&g_Ctx, gid, nPolicy, pMessage);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxSendGroup(MPA_Ctx *pCtx, DWORD gid, int nPolicy, // {{{
+                                const MPAMessage *pMessage) {
+  MPA_TypePlan *pPlan = NULL;
+  size_t i, nFirst = 0, nNext = 0, *pnNext;
+  int nCount = 1, nRetCode = MPA_ERR_SVRINFO;
+  DWORD sid;
+
+  if (pCtx == NULL || pMessage == NULL || gid == 0 ||
+      (nPolicy != MPA_GROUP_ROUND_ROBIN && nPolicy != MPA_GROUP_LEAST_DEPTH)) {
+    return MPA_ERR_PARAM;
+  }
+
+  /** Members whose queue is gone are skipped in list order. The member is
+   *  taken under the lock and the message is sent without it. */
+  for (i = 0; i < (size_t)nCount; i++) {
+    sid = MPA_SID_NONE;
+    pthread_mutex_lock(&pCtx->Lock);
+    if ((nCount = ResolveMembers(pCtx, gid, &pPlan)) > 0) {
+      if (i == 0) {
+        pnNext = GroupCursor(pCtx, gid);
+        nFirst = PickMember(pPlan, pnNext ? pnNext : &nNext, nPolicy);
+      }
+      sid = pPlan->pSrvInfos[(nFirst + i) % (size_t)nCount].dwSid;
+    }
+    pthread_mutex_unlock(&pCtx->Lock);
+    if (sid == MPA_SID_NONE) {
+      break;
+    }
+    nRetCode = MPA_Send_Stub(pCtx, sid, 0, pMessage, NULL);
+    if (nRetCode != MPA_ERR_SEND_NOQ && nRetCode != MPA_ERR_SVRINFO) {
+      break;
+    }
+  }
+  return nRetCode;
+} // }}}
+
+DLL_PUBLIC int MPA_SendGroupByProp(DWORD gid, const char *pszName, // {{{
+                                   const MPAMessage *pMessage) {
+  return MPA_CtxSendGroupByProp(&g_Ctx, gid, pszName, pMessage);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxSendGroupByProp(MPA_Ctx *pCtx, DWORD gid, const char *pszName, // {{{
+                                      const MPAMessage *pMessage) {
+  MPA_TypePlan *pPlan = NULL;
+  char szKey[MPA_RING_KEY_SIZE];
+  ssize_t nLen;
+  size_t i, nPoint = 0, nMembers = 0;
+  DWORD sid, dwMember, dwHash;
+  int nCount = 1, nTried = 0, nRetCode = MPA_ERR_SVRINFO;
+  unsigned char *pbTried = NULL; /**< Bitmap of members tried, by index in the plan */
+  Boolean bTried;
+
+  if (pCtx == NULL || pMessage == NULL || pszName == NULL || gid == 0) {
+    return MPA_ERR_PARAM;
+  }
+  if ((nLen = MPA_GetMsgProp(pszName, szKey, sizeof(szKey), pMessage)) < 0) {
+    trace("MPA_SendGroupByProp>Message has no property[%s]", pszName);
+    return MPA_ERR_PARAM;
+  }
+  dwHash = RingHash(szKey, (size_t)nLen);
+
+  /** If the queue of the owner is gone, the key goes to the next member
+   *  clockwise, as it would if the owner were removed. Points of members
+   *  already tried are skipped wherever they lie on the ring; if the
+   *  members change meanwhile, the bitmap starts over. */
+  for (i = 0; nTried < nCount; i++) {
+    sid = MPA_SID_NONE;
+    bTried = False;
+    pthread_mutex_lock(&pCtx->Lock);
+    if ((nCount = ResolveMembers(pCtx, gid, &pPlan)) > 0 &&
+        (pPlan->nRingSize > 0 || BuildRing(pPlan) == 0) && i < pPlan->nRingSize) {
+      if (i == 0) {
+        nPoint = RingLookup(pPlan, dwHash);
+      }
+      if (nMembers != (size_t)nCount) {
+        free(pbTried);
+        nMembers = ((pbTried = calloc(((size_t)nCount + 7) / 8, 1)) != NULL) ? (size_t)nCount : 0;
+        nTried = 0;
+      }
+      dwMember = pPlan->pRing[(nPoint + i) % pPlan->nRingSize].dwMember;
+      if (pbTried) {
+        bTried = (pbTried[dwMember / 8] & (1U << (dwMember % 8))) ? True : False;
+        pbTried[dwMember / 8] |= (unsigned char)(1U << (dwMember % 8));
+        sid = pPlan->pSrvInfos[dwMember].dwSid;
+      }
+    }
+    pthread_mutex_unlock(&pCtx->Lock);
+    if (sid == MPA_SID_NONE) {
+      break;
+    }
+    if (bTried == True) {
+      continue;
+    }
+    nTried++;
+    nRetCode = MPA_Send_Stub(pCtx, sid, 0, pMessage, NULL);
+    if (nRetCode != MPA_ERR_SEND_NOQ && nRetCode != MPA_ERR_SVRINFO) {
+      break;
+    }
+  }
+  free(pbTried);
+  return nRetCode;
 } // }}}
 
 DLL_PUBLIC int MPA_SendSelf(DWORD mtype, const MPAMessage *pMessage) { // {{{
-  return MPA_Send_Stub(g_sid, mtype, pMessage);
+  return MPA_Send_Stub(&g_Ctx, g_Ctx.dwSid, mtype, pMessage, NULL);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxSendSelf(MPA_Ctx *pCtx, DWORD mtype, const MPAMessage *pMessage) { // {{{
+  if (pCtx == NULL) {
+    return MPA_ERR_PARAM;
+  }
+  return MPA_Send_Stub(pCtx, pCtx->dwSid, mtype, pMessage, NULL);
 } // }}}
 
 DLL_PUBLIC int MPA_SendSelfEx(const MPAMessage *pMessage) { // {{{
-  return MPA_Send(g_sid, pMessage);
+  return MPA_Send(g_Ctx.dwSid, pMessage);
+} // }}}
+
+DLL_PUBLIC MPAMessage *MPA_SendReserve(void) { // {{{
+  MsgBufDef *pMsgBuf = malloc(sizeof(MsgBufDef));
+
+  if (pMsgBuf == NULL) {
+    trace("MPA_SendReserve>Out of memory");
+    return NULL;
+  }
+  MPA_MsgInit((MPAMessage *)pMsgBuf->mtext);
+  return (MPAMessage *)pMsgBuf->mtext;
+} // }}}
+
+DLL_PUBLIC void MPA_SendRelease(MPAMessage *pMessage) { // {{{
+  if (pMessage != NULL) {
+    free(GetMsgBuf(pMessage));
+  }
+} // }}}
+
+DLL_PUBLIC int MPA_SendCommit(DWORD sid, MPAMessage *pMessage) { // {{{
+  return MPA_CtxSendCommit(&g_Ctx, sid, pMessage);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxSendCommit(MPA_Ctx *pCtx, DWORD sid, MPAMessage *pMessage) { // {{{
+  if (pMessage == NULL) {
+    return MPA_ERR_PARAM;
+  }
+  return MPA_Send_Stub(pCtx, sid, 0, pMessage, GetMsgBuf(pMessage));
+} // }}}
+
+DLL_PUBLIC int MPA_PubCommit(DWORD type, MPAMessage *pMessage) { // {{{
+  return MPA_CtxPubCommit(&g_Ctx, type, pMessage);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxPubCommit(MPA_Ctx *pCtx, DWORD type, MPAMessage *pMessage) { // {{{
+  if (pMessage == NULL) {
+    return MPA_ERR_PARAM;
+  }
+  return MPA_Pub_Stub(pCtx, type, pMessage, GetMsgBuf(pMessage));
+} // }}}
+
+/** Send a message published to a subscriber, and count it in the segment
+ *  the subscriber was resolved from, where it has index nSrvIndex */
+static int MPA_Pub_Send(const MPA_Segment *pSegment, const MPA_SIS_SrvInfo *pServerInfo, // {{{
+                        int nSrvIndex, DWORD type, MsgBufDef *pMsgBuf, size_t nMsgLen,
+                        int nIndex) {
+  int nRetCode;
+
+  pMsgBuf->mtype = pServerInfo->dwQtype;
+  if ((nRetCode = MsqSend(pServerInfo->dwQid, (T_Msgbuf *)pMsgBuf, nMsgLen)) == -1) {
+    int err = errno;
+    trace("MPA_Pub>MsqSend error:%d, errno=%d", nRetCode, err);
+    CountPub(pSegment, nSrvIndex, type, (err == EINTR) ? MPA_ERR_INTR : MPA_ERR_SEND, 0);
+    if (err == EINTR) {
+      trace("MPA_Pub>MsqSend was interrupted");
+      return MPA_ERR_INTR;
+    }
+
+    if (err == EINVAL || err == EIDRM) {
+      trace("MPA_Send>Invalid msqid[%d] or the queue is removed", pServerInfo->dwQid);
+      return MPA_ERR_SEND_NOQ;
+    }
+
+    if (err == ENOMEM) {
+      trace("MPA_Send>Sent message is too big");
+      return MPA_ERR_SEND_NOMEM;
+    }
+
+    return (MPA_ERR_SEND - nIndex);
+  }
+  CountPub(pSegment, nSrvIndex, type, 0, nMsgLen);
+  return 0;
 } // }}}
 
 DLL_PUBLIC int MPA_Pub(DWORD type, const MPAMessage *pMessage) { // {{{
+  return MPA_CtxPub(&g_Ctx, type, pMessage);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxPub(MPA_Ctx *pCtx, DWORD type, const MPAMessage *pMessage) { // {{{
+  return MPA_Pub_Stub(pCtx, type, pMessage, NULL);
+} // }}}
+
+/** Publish a message to the subscribers of a type. The message is copied
+ *  into a buffer on stack at most once, as MPA_Send_Stub() does, and the
+ *  same buffer is sent to every subscriber. */
+static int MPA_Pub_Stub(MPA_Ctx *pCtx, DWORD type, const MPAMessage *pMessage, // {{{
+                        MsgBufDef *pMsgBuf) {
   MPA_MSG_Head *head;
   MPA_MSG_Prop *prop;
   MPA_MSG_Body *body;
   MPA_SIS_SrvInfo ServerInfo;
+  MPA_SIS_SrvInfo ServerInfos[MPA_PUB_BATCH];
+  int nSrvIndexes[MPA_PUB_BATCH];
+  const MPA_SIS_SrvInfo *pServerInfos = NULL;
+  const int *pIndexes = NULL;
   MPA_SIS_TypeInfo TypeInfo;
+  MPA_Segment *pSegment = NULL;
   MsgBufDef MsgBuf;
-  int nRetCode, nCount = 0, nIndex = 0;
+  size_t nMsgLen;
+  int nRetCode = 0, nCount = 0, nIndex = 0, nBatch = 0, i;
 
-  if (pMessage == NULL) {
+  if (pCtx == NULL || pMessage == NULL) {
+    return MPA_ERR_PARAM;
+  }
+  if ((nMsgLen = CalculateMsgLength(pMessage)) > MPA_MESSAGESIZE) {
+    trace("MPA_Pub>Message length[%zu] is over %d", nMsgLen, MPA_MESSAGESIZE);
     return MPA_ERR_PARAM;
   }
 
   GetMsgPart(pMessage, &head, &prop, &body);
-  head->wMsgLen = CalculateMsgLength(pMessage);
+  head->wMsgLen = (WORD)nMsgLen;
   head->bMsgMode = MPA_SM_PUB;
-  head->dwSourceID = g_sid;
+  head->dwSourceID = pCtx->dwSid;
   head->dwMsgType = type;
+  if (pMsgBuf == NULL) {
+    pMsgBuf = &MsgBuf;
+    memcpy(MsgBuf.mtext, pMessage, head->wMsgLen);
+  }
 
+  /** Subscribers are copied out of the plan a batch at a time under the
+   *  lock, with a reference to the segment they come from, and the message
+   *  is sent to them and counted without it */
   for (;;) {
-    nIndex = MPA_GetTypeInfo((mpa_index_t)nIndex, type, &TypeInfo, g_pMPAStart);
-    if (nIndex < 0 || nIndex > USHRT_MAX) {
-      break; /**< If type is not found, quit */
+    pthread_mutex_lock(&pCtx->Lock);
+    if ((nCount = ResolveSubscribers(pCtx, type, &pServerInfos, &pIndexes)) > nIndex) {
+      nBatch = (nCount - nIndex < MPA_PUB_BATCH) ? nCount - nIndex : MPA_PUB_BATCH;
+      memcpy(ServerInfos, pServerInfos + nIndex, (size_t)nBatch * sizeof(MPA_SIS_SrvInfo));
+      memcpy(nSrvIndexes, pIndexes + nIndex, (size_t)nBatch * sizeof(int));
+      pSegment = SegmentGet(pCtx);
     }
-    nCount++;
-    if (MPA_GetServerInfoByIndex((mpa_index_t)TypeInfo.wSidIndex, &ServerInfo, g_pMPAStart) < 0) {
-      return (MPA_ERR_TYPEINFO - nIndex);
+    pthread_mutex_unlock(&pCtx->Lock);
+    if (nCount <= nIndex) {
+      break;
     }
-    MsgBuf.mtype = ServerInfo.dwQtype;
-    memcpy(MsgBuf.mtext, pMessage, sizeof(MPAMessage));
-    if ((nRetCode = MsqSend(ServerInfo.dwQid, (T_Msgbuf *)&MsgBuf, head->wMsgLen)) == -1) {
-      int err = errno;
-      trace("MPA_Pub>MsqSend error:%d, errno=%d", nRetCode, err);
-      if (err == EINTR) {
-        trace("MPA_Pub>MsqSend was interrupted");
-        return MPA_ERR_INTR;
-      }
-
-      if (err == EINVAL || err == EIDRM) {
-        trace("MPA_Send>Invalid msqid[%d] or the queue is removed", ServerInfo.dwQid);
-        return MPA_ERR_SEND_NOQ;
-      }
+    for (i = 0; i < nBatch && nRetCode == 0; i++, nIndex++) {
+      nRetCode = MPA_Pub_Send(pSegment, ServerInfos + i, nSrvIndexes[i], type, pMsgBuf,
+                              head->wMsgLen, nIndex);
+    }
+    SegmentPut(pSegment);
+    if (nRetCode != 0) {
+      return nRetCode;
+    }
+  }
+  if (nCount >= 0) {
+    return (nIndex == 0) ? MPA_ERR_TYPEINFO : 0;
+  }
 
-      if (err == ENOMEM) {
-        trace("MPA_Send>Sent message is too big");
-        return MPA_ERR_SEND_NOMEM;
-      }
+  /** The segment has no type index, search type info list */
+  nCount = 0;
+  nIndex = 0;
 
-      return (MPA_ERR_SEND - nIndex);
+  for (;;) {
+    pthread_mutex_lock(&pCtx->Lock);
+    nIndex = MPA_GetTypeInfo((mpa_index_t)nIndex, type, &TypeInfo, pCtx->pMPAStart);
+    if (nIndex >= 0) {
+      nRetCode = MPA_GetServerInfoByIndex((mpa_index_t)TypeInfo.dwSidIndex, &ServerInfo,
+                                          pCtx->pMPAStart);
+      pSegment = SegmentGet(pCtx);
+    }
+    pthread_mutex_unlock(&pCtx->Lock);
+    if (nIndex < 0) {
+      break; /**< If type is not found, quit */
+    }
+    nCount++;
+    if (nRetCode >= 0) {
+      nRetCode = MPA_Pub_Send(pSegment, &ServerInfo, (int)TypeInfo.dwSidIndex, type, pMsgBuf,
+                              head->wMsgLen, nIndex);
+    } else {
+      nRetCode = MPA_ERR_TYPEINFO - nIndex;
+    }
+    SegmentPut(pSegment);
+    if (nRetCode != 0) {
+      return nRetCode;
     }
     nIndex++; /**< Search from next index in the next cycle */
   }
@@ -551,108 +1107,355 @@ DLL_PUBLIC int MPA_Pub(DWORD type, const MPAMessage *pMessage) { // {{{
 } // }}}
 
 DLL_PUBLIC ssize_t MPA_Recv(MPAMessage *pMessage) { // {{{
+  return MPA_CtxRecv(&g_Ctx, pMessage);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_CtxRecv(MPA_Ctx *pCtx, MPAMessage *pMessage) { // {{{
+  return MPA_Recv_Stub(pCtx, pMessage, NULL);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_RecvReserved(MPAMessage *pMessage) { // {{{
+  return MPA_CtxRecvReserved(&g_Ctx, pMessage);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_CtxRecvReserved(MPA_Ctx *pCtx, MPAMessage *pMessage) { // {{{
+  if (pMessage == NULL) {
+    return MPA_ERR_PARAM;
+  }
+  return MPA_Recv_Stub(pCtx, pMessage, GetMsgBuf(pMessage));
+} // }}}
+
+/** Receive a message for the server of the context. pMsgBuf is the buffer
+ *  holding pMessage if it was got by MPA_SendReserve(), and the message is
+ *  received in place; otherwise it is NULL and the received bytes are
+ *  copied out of a buffer on stack. */
+static ssize_t MPA_Recv_Stub(MPA_Ctx *pCtx, MPAMessage *pMessage, // {{{
+                             MsgBufDef *pMsgBuf) {
   MPA_SIS_SrvInfo ServerInfo;
   MsgBufDef MsgBuf;
   ssize_t nMsgLen = 0;
   int nRetCode = 0;
 
-  if (pMessage == NULL) {
+  if (pCtx == NULL || pMessage == NULL) {
     return MPA_ERR_PARAM;
   }
-
-  if ((nRetCode = MPA_GetServerInfo(g_sid, &ServerInfo, g_pMPAStart)) < 0) {
-    trace("MPA_Recv>GetServerInfo error:%d", nRetCode);
-    return MPA_ERR_SVRINFO;
+  if (pMsgBuf == NULL) {
+    pMsgBuf = &MsgBuf;
   }
 
-  memset(&MsgBuf, 0, sizeof(MsgBufDef));
-  if ((nMsgLen = MsqRecvType(ServerInfo.dwQid, (T_Msgbuf *)&MsgBuf, MsgBufSize,
-                             ServerInfo.dwQtype)) < 0) {
-    int err = errno;
-    trace("MPA_Recv>MsqRecvType error:%d, errno=%d", nMsgLen, err);
-    if (err == EINTR) {
-      trace("MPA_Recv>MsqRecvType was interrupted");
-      return MPA_ERR_INTR;
+  /** An empty message is left by MPA_SIS_SplitQueue() in the queue the
+   *  server has been moved off, it is passed on to the next receiver and
+   *  the route is looked up again then */
+  do {
+    pthread_mutex_lock(&pCtx->Lock);
+    nRetCode = ResolveRoute(pCtx, pCtx->dwSid, &ServerInfo);
+    pthread_mutex_unlock(&pCtx->Lock);
+    if (nRetCode < 0) {
+      trace("MPA_Recv>GetServerInfo error:%d", nRetCode);
+      return MPA_ERR_SVRINFO;
     }
 
-    if (err == E2BIG) {
-      trace("MPA_Recv>Received message is too big for MPAMessage");
-      return MPA_ERR_RECV_2BIG;
-    }
+    if ((nMsgLen = MsqRecvType(ServerInfo.dwQid, (T_Msgbuf *)pMsgBuf, MsgBufSize,
+                               ServerInfo.dwQtype)) < 0) {
+      int err = errno;
+      trace("MPA_Recv>MsqRecvType error:%d, errno=%d", nMsgLen, err);
+      CountServer(pCtx, pCtx->dwSid, (err == EINTR) ? MPA_STAT_INTR : MPA_STAT_ERROR, 0);
+      if (err == EINTR) {
+        trace("MPA_Recv>MsqRecvType was interrupted");
+        return MPA_ERR_INTR;
+      }
 
-    if (err == EINVAL || err == EIDRM) {
-      trace("MPA_Recv>Invalid msqid[%d] or the queue is removed", ServerInfo.dwQid);
-      return MPA_ERR_RECV_NOQ;
-    }
+      if (err == E2BIG) {
+        trace("MPA_Recv>Received message is too big for MPAMessage");
+        return MPA_ERR_RECV_2BIG;
+      }
 
-    return MPA_ERR_RECV;
+      if (err == EINVAL || err == EIDRM) {
+        trace("MPA_Recv>Invalid msqid[%d] or the queue is removed", ServerInfo.dwQid);
+        return MPA_ERR_RECV_NOQ;
+      }
+
+      return MPA_ERR_RECV;
+    }
+    if (nMsgLen == 0) {
+      PassWake(pCtx, &ServerInfo);
+    }
+  } while (nMsgLen == 0);
+  if (pMsgBuf == &MsgBuf) {
+    memcpy(pMessage, MsgBuf.mtext, (size_t)nMsgLen);
   }
-  memcpy(pMessage, MsgBuf.mtext, (size_t)nMsgLen);
+  CountRecv(pCtx, pMessage, (size_t)nMsgLen);
   return nMsgLen;
 } // }}}
 
 DLL_PUBLIC ssize_t MPA_RecvTypeNonBlock(DWORD mtype, MPAMessage *pMessage) { // {{{
+  return MPA_CtxRecvTypeNonBlock(&g_Ctx, mtype, pMessage);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_CtxRecvTypeNonBlock(MPA_Ctx *pCtx, DWORD mtype, // {{{
+                                           MPAMessage *pMessage) {
+  return MPA_RecvTypeNonBlock_Stub(pCtx, mtype, pMessage, NULL);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_RecvTypeNonBlockReserved(DWORD mtype, MPAMessage *pMessage) { // {{{
+  return MPA_CtxRecvTypeNonBlockReserved(&g_Ctx, mtype, pMessage);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_CtxRecvTypeNonBlockReserved(MPA_Ctx *pCtx, DWORD mtype, // {{{
+                                                   MPAMessage *pMessage) {
+  if (pMessage == NULL) {
+    return MPA_ERR_PARAM;
+  }
+  return MPA_RecvTypeNonBlock_Stub(pCtx, mtype, pMessage, GetMsgBuf(pMessage));
+} // }}}
+
+/** Receive a message of mtype without blocking, pMsgBuf is as in
+ *  MPA_Recv_Stub() */
+static ssize_t MPA_RecvTypeNonBlock_Stub(MPA_Ctx *pCtx, DWORD mtype, // {{{
+                                         MPAMessage *pMessage, MsgBufDef *pMsgBuf) {
   MPA_SIS_SrvInfo ServerInfo;
   MsgBufDef MsgBuf;
   ssize_t nMsgLen = 0;
   int nRetCode = 0;
 
-  if (pMessage == NULL) {
+  if (pCtx == NULL || pMessage == NULL) {
     return MPA_ERR_PARAM;
   }
-
-  if ((nRetCode = MPA_GetServerInfo(g_sid, &ServerInfo, g_pMPAStart)) < 0) {
-    trace("MPA_RecvTypeNonBlock>GetServerInfo error:%d", nRetCode);
-    return MPA_ERR_SVRINFO;
+  if (pMsgBuf == NULL) {
+    pMsgBuf = &MsgBuf;
   }
 
-  memset(&MsgBuf, 0, sizeof(MsgBufDef));
-  if ((nMsgLen = MsqRecvTypeNonBlock(ServerInfo.dwQid, (T_Msgbuf *)&MsgBuf, MsgBufSize, mtype)) <
-      0) {
-    int err = errno;
-    trace("MPA_RecvTypeNonBlock>MsqRecvTypeNonBlock error:%d, errno=%d", nMsgLen, err);
-    if (err == E2BIG) {
-      trace("MPA_RecvTypeNonBlock>Received message is too big for MPAMessage");
-      return MPA_ERR_RECV_2BIG;
+  /** Empty messages are skipped like in MPA_CtxRecv() */
+  do {
+    pthread_mutex_lock(&pCtx->Lock);
+    nRetCode = ResolveRoute(pCtx, pCtx->dwSid, &ServerInfo);
+    pthread_mutex_unlock(&pCtx->Lock);
+    if (nRetCode < 0) {
+      trace("MPA_RecvTypeNonBlock>GetServerInfo error:%d", nRetCode);
+      return MPA_ERR_SVRINFO;
     }
 
-    if (err == EINVAL) {
-      trace("MPA_RecvTypeNonBlock>Invalid msqid[%d]", ServerInfo.dwQid);
-      return MPA_ERR_RECV_NOQ;
-    }
+    if ((nMsgLen = MsqRecvTypeNonBlock(ServerInfo.dwQid, (T_Msgbuf *)pMsgBuf, MsgBufSize,
+                                       mtype)) < 0) {
+      int err = errno;
+      trace("MPA_RecvTypeNonBlock>MsqRecvTypeNonBlock error:%d, errno=%d", nMsgLen, err);
+      if (err != ENOMSG) {
+        CountServer(pCtx, pCtx->dwSid, MPA_STAT_ERROR, 0);
+      }
+      if (err == E2BIG) {
+        trace("MPA_RecvTypeNonBlock>Received message is too big for MPAMessage");
+        return MPA_ERR_RECV_2BIG;
+      }
 
-    if (err == ENOMSG) {
-      trace("MPA_RecvTypeNonBlock>No message on the queue when IPC_NOWAIT");
-      return MPA_ERR_RECV_NOMSG;
-    }
+      if (err == EINVAL) {
+        trace("MPA_RecvTypeNonBlock>Invalid msqid[%d]", ServerInfo.dwQid);
+        return MPA_ERR_RECV_NOQ;
+      }
+
+      if (err == ENOMSG) {
+        trace("MPA_RecvTypeNonBlock>No message on the queue when IPC_NOWAIT");
+        return MPA_ERR_RECV_NOMSG;
+      }
 
-    return MPA_ERR_RECV;
+      return MPA_ERR_RECV;
+    }
+    if (nMsgLen == 0) {
+      PassWake(pCtx, &ServerInfo);
+    }
+  } while (nMsgLen == 0);
+  if (pMsgBuf == &MsgBuf) {
+    memcpy(pMessage, MsgBuf.mtext, (size_t)nMsgLen);
   }
-  memcpy(pMessage, MsgBuf.mtext, (size_t)nMsgLen);
+  CountRecv(pCtx, pMessage, (size_t)nMsgLen);
   return nMsgLen;
 } // }}}
 
 DLL_PUBLIC ssize_t MPA_RecvNonBlock(MPAMessage *pMessage) { // {{{
+  return MPA_CtxRecvNonBlock(&g_Ctx, pMessage);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_CtxRecvNonBlock(MPA_Ctx *pCtx, MPAMessage *pMessage) { // {{{
+  return MPA_RecvNonBlock_Stub(pCtx, pMessage, NULL);
+} // }}}
+
+/** Receive a message of the queue type of the server without blocking,
+ *  pMsgBuf is as in MPA_Recv_Stub() */
+static ssize_t MPA_RecvNonBlock_Stub(MPA_Ctx *pCtx, MPAMessage *pMessage, // {{{
+                                     MsgBufDef *pMsgBuf) {
   MPA_SIS_SrvInfo ServerInfo;
   int nRetCode = 0;
 
-  if (pMessage == NULL) {
+  if (pCtx == NULL || pMessage == NULL) {
     return MPA_ERR_PARAM;
   }
 
-  if ((nRetCode = MPA_GetServerInfo(g_sid, &ServerInfo, g_pMPAStart)) < 0) {
+  pthread_mutex_lock(&pCtx->Lock);
+  nRetCode = ResolveRoute(pCtx, pCtx->dwSid, &ServerInfo);
+  pthread_mutex_unlock(&pCtx->Lock);
+  if (nRetCode < 0) {
     trace("MPA_RecvNonBlock>GetServerInfo error:%d", nRetCode);
     return MPA_ERR_SVRINFO;
   }
 
-  return MPA_RecvTypeNonBlock(ServerInfo.dwQtype, pMessage);
+  return MPA_RecvTypeNonBlock_Stub(pCtx, ServerInfo.dwQtype, pMessage, pMsgBuf);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_RecvTimeout(MPAMessage *pMessage, long nTimeout) { // {{{
+  return MPA_CtxRecvTimeout(&g_Ctx, pMessage, nTimeout);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_CtxRecvTimeout(MPA_Ctx *pCtx, MPAMessage *pMessage, // {{{
+                                      long nTimeout) {
+  struct timespec deadline;
+
+  if (nTimeout < 0) {
+    return MPA_Recv_Stub(pCtx, pMessage, NULL);
+  }
+  DeadlineAfter(&deadline, (long long)nTimeout * 1000LL);
+  return MPA_CtxRecvDeadline(pCtx, pMessage, &deadline);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_RecvDeadline(MPAMessage *pMessage, // {{{
+                                    const struct timespec *pDeadline) {
+  return MPA_CtxRecvDeadline(&g_Ctx, pMessage, pDeadline);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_CtxRecvDeadline(MPA_Ctx *pCtx, MPAMessage *pMessage, // {{{
+                                       const struct timespec *pDeadline) {
+  ssize_t nMsgLen;
+
+  if (pDeadline == NULL) {
+    return MPA_Recv_Stub(pCtx, pMessage, NULL);
+  }
+  if ((nMsgLen = MPA_RecvWait_Stub(pCtx, pMessage, NULL, pDeadline)) == MPA_ERR_RECV_NOMSG) {
+    return MPA_ERR_RECV_TIMEOUT;
+  }
+  return nMsgLen;
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_RecvMany(MPAMessage *pMessages, size_t nMax, long nTimeout) { // {{{
+  return MPA_CtxRecvMany(&g_Ctx, pMessages, nMax, nTimeout);
+} // }}}
+
+DLL_PUBLIC ssize_t MPA_CtxRecvMany(MPA_Ctx *pCtx, MPAMessage *pMessages, size_t nMax, // {{{
+                                   long nTimeout) {
+  MPA_SIS_SrvInfo ServerInfo;
+  MsgBufDef MsgBuf;
+  struct timespec deadline;
+  ssize_t nMsgLen;
+  size_t i, n;
+
+  if (pCtx == NULL || pMessages == NULL || nMax == 0) {
+    return MPA_ERR_PARAM;
+  }
+
+  if (nTimeout < 0) {
+    nMsgLen = MPA_Recv_Stub(pCtx, pMessages, NULL);
+  } else {
+    DeadlineAfter(&deadline, (long long)nTimeout * 1000LL);
+    nMsgLen = MPA_RecvWait_Stub(pCtx, pMessages, NULL, &deadline);
+  }
+  if (nMsgLen < 0) {
+    return (nMsgLen == MPA_ERR_RECV_NOMSG) ? 0 : nMsgLen;
+  }
+
+  /** The rest are drained without blocking and counted under one lock.
+   *  Errors, and an empty message left by MPA_SIS_SplitQueue(), end the
+   *  batch, the next call reports them or looks the route up again. */
+  pthread_mutex_lock(&pCtx->Lock);
+  nMsgLen = ResolveRoute(pCtx, pCtx->dwSid, &ServerInfo);
+  pthread_mutex_unlock(&pCtx->Lock);
+  for (n = 1; nMsgLen >= 0 && n < nMax; n++) {
+    if ((nMsgLen = MsqRecvTypeNonBlock(ServerInfo.dwQid, (T_Msgbuf *)&MsgBuf, MsgBufSize,
+                                       ServerInfo.dwQtype)) <= 0) {
+      if (nMsgLen == 0) {
+        PassWake(pCtx, &ServerInfo);
+      }
+      break;
+    }
+    memcpy(pMessages + n, MsgBuf.mtext, (size_t)nMsgLen);
+  }
+
+  pthread_mutex_lock(&pCtx->Lock);
+  for (i = 1; i < n; i++) {
+    CountRecvLocked(pCtx, pMessages + i, (size_t)MPA_GetMsgLength(pMessages + i));
+  }
+  pthread_mutex_unlock(&pCtx->Lock);
+  return (ssize_t)n;
+} // }}}
+
+/** Receive a message like MPA_Recv_Stub(), but give up at the deadline on
+ *  CLOCK_MONOTONIC and return MPA_ERR_RECV_NOMSG. A signal ends the wait
+ *  with MPA_ERR_INTR, as it ends MPA_Recv_Stub(). */
+static ssize_t MPA_RecvWait_Stub(MPA_Ctx *pCtx, MPAMessage *pMessage, // {{{
+                                 MsgBufDef *pMsgBuf, const struct timespec *pDeadline) {
+  MPA_SIS_SrvInfo ServerInfo;
+  MPA_Segment *pSegment = NULL;
+  struct timespec wait;
+  long nPollNs = MPA_RECV_POLL_NS;
+  DWORD *pdwDoorbell = NULL, dwSeen = 0;
+  ssize_t nMsgLen;
+  int nIndex, nRetCode = 0;
+
+  /** The doorbell is armed after the queue is found empty, then the queue
+   *  is checked again: a message sent in between is either received now or
+   *  rings the doorbell, which ends the wait at once. The queue is checked
+   *  again every MPA_RECV_WAIT_NS for messages which ring no doorbell.
+   *  Without doorbells the queue is polled at growing intervals. The
+   *  segment holding the doorbell is referenced while sleeping on it, a
+   *  remap cannot unmap it. */
+  for (;;) {
+    if ((nMsgLen = MPA_RecvNonBlock_Stub(pCtx, pMessage, pMsgBuf)) != MPA_ERR_RECV_NOMSG) {
+      return nMsgLen;
+    }
+    pthread_mutex_lock(&pCtx->Lock);
+    nIndex = ResolveRoute(pCtx, pCtx->dwSid, &ServerInfo);
+    pdwDoorbell = (nIndex >= 0) ? MPA_SIS_Doorbell(&pCtx->SISInfo, (mpa_index_t)nIndex) : NULL;
+    if (pdwDoorbell) {
+      dwSeen = MPA_SIS_ArmDoorbell(pdwDoorbell);
+      pSegment = SegmentGet(pCtx);
+    }
+    pthread_mutex_unlock(&pCtx->Lock);
+    if (pdwDoorbell &&
+        (nMsgLen = MPA_RecvNonBlock_Stub(pCtx, pMessage, pMsgBuf)) != MPA_ERR_RECV_NOMSG) {
+      SegmentPut(pSegment);
+      return nMsgLen;
+    }
+
+    if (TimeLeft(pDeadline, pdwDoorbell ? MPA_RECV_WAIT_NS : nPollNs, &wait) == False) {
+      SegmentPut(pSegment);
+      return MPA_ERR_RECV_NOMSG;
+    }
+    if (pdwDoorbell) {
+      nRetCode = MPA_SIS_WaitDoorbell(pdwDoorbell, dwSeen, &wait);
+      SegmentPut(pSegment);
+      pSegment = NULL;
+    } else {
+      nRetCode = (nanosleep(&wait, NULL) != 0 && errno == EINTR) ? 2 : 0;
+      nPollNs = (nPollNs * 2 < MPA_RECV_WAIT_NS) ? nPollNs * 2 : MPA_RECV_WAIT_NS;
+    }
+    if (nRetCode == 2) {
+      trace("MPA_RecvWait>Wait was interrupted");
+      CountServer(pCtx, pCtx->dwSid, MPA_STAT_INTR, 0);
+      return MPA_ERR_INTR;
+    }
+  }
 } // }}}
 
-DLL_PUBLIC int MPA_Validate() {
+DLL_PUBLIC int MPA_Validate() { return MPA_CtxValidate(&g_Ctx); }
+
+DLL_PUBLIC int MPA_CtxValidate(MPA_Ctx *pCtx) {
   MPA_SIS_SrvInfo ServerInfo;
   int nRetCode = 0;
 
-  if ((nRetCode = MPA_GetServerInfo(g_sid, &ServerInfo, g_pMPAStart)) < 0) {
+  if (pCtx == NULL) {
+    return MPA_ERR_PARAM;
+  }
+
+  pthread_mutex_lock(&pCtx->Lock);
+  nRetCode = ResolveRoute(pCtx, pCtx->dwSid, &ServerInfo);
+  pthread_mutex_unlock(&pCtx->Lock);
+  if (nRetCode < 0) {
     trace("MPA_Validate>GetServerInfo error:%d", nRetCode);
     return MPA_ERR_SVRINFO;
   }
@@ -660,6 +1463,42 @@ DLL_PUBLIC int MPA_Validate() {
   return MPA_CheckMsgQ(ServerInfo.dwQkey);
 }
 
+DLL_PUBLIC int MPA_WaitChange(DWORD *pdwGeneration, int nTimeout) { // {{{
+  return MPA_CtxWaitChange(&g_Ctx, pdwGeneration, nTimeout);
+} // }}}
+
+DLL_PUBLIC int MPA_CtxWaitChange(MPA_Ctx *pCtx, DWORD *pdwGeneration, int nTimeout) { // {{{
+  MPA_Segment *pSegment = NULL;
+  int nRetCode = 0;
+
+  if (pCtx == NULL) {
+    return MPA_ERR_PARAM;
+  }
+  pthread_mutex_lock(&pCtx->Lock);
+  if (pCtx->pMPAStart != NULL) {
+    RefreshSegment(pCtx);
+    pSegment = SegmentGet(pCtx);
+  }
+  pthread_mutex_unlock(&pCtx->Lock);
+  if (pSegment == NULL) {
+    return MPA_ERR_NOINIT;
+  }
+  /** The segment waited on is referenced, it stays mapped however often
+   *  other threads remap while this one sleeps */
+  nRetCode = MPA_SIS_WaitChange(pSegment->pMPAStart, pdwGeneration, nTimeout);
+  SegmentPut(pSegment);
+  if (nRetCode != 0) {
+    return nRetCode;
+  }
+  /** A retired segment is woken when the new one is published, whose
+   *  generation is the one to wait on next time */
+  pthread_mutex_lock(&pCtx->Lock);
+  RefreshSegment(pCtx);
+  (*pdwGeneration) = __atomic_load_n(pCtx->pdwGeneration, __ATOMIC_ACQUIRE);
+  pthread_mutex_unlock(&pCtx->Lock);
+  return 0;
+} // }}}
+
 DLL_PUBLIC void DumpMPAMessage(const MPAMessage *pMessage) { // {{{
 #ifndef _NDUMP
   if (pMessage == NULL) {
@@ -680,6 +1519,566 @@ DLL_PUBLIC void DumpMPAMessage(const MPAMessage *pMessage) { // {{{
 #endif
 } // }}}
 
+/** Map MPA memory map file for the context. Called with the lock held. */
+static int CtxInit(MPA_Ctx *pCtx, const char *pszSHMFileName, DWORD sid, int nFlags) { // {{{
+  MPA_Segment *pSegment, *pOldSegment = pCtx->pSegment;
+
+  if (sid <= 0) {
+    return MPA_ERR_PARAM;
+  }
+  if (pszSHMFileName == NULL || strlen(pszSHMFileName) >= sizeof(pCtx->szSHMFileName)) {
+    return MPA_ERR_PARAM;
+  }
+  pCtx->dwSid = sid;
+
+  if ((pSegment = MapSegment(pszSHMFileName, nFlags)) == NULL) {
+    return MPA_ERR_INIT;
+  }
+  strcpy(pCtx->szSHMFileName, pszSHMFileName);
+  pCtx->nMapFlags = nFlags;
+  SetSegment(pCtx, pSegment);
+  SegmentPut(pOldSegment); /**< Segment of an earlier MPA_Init() */
+  return 0;
+} // }}}
+
+static void FreePlans(MPA_Ctx *pCtx) { // {{{
+  size_t i;
+
+  for (i = 0; i < (1 << MPA_PLAN_CACHE_BITS); i++) {
+    free(pCtx->PlanCache[i].pSrvInfos);
+    free(pCtx->PlanCache[i].pIndexes);
+    free(pCtx->PlanCache[i].pRing);
+  }
+  for (i = 0; i < (1 << MPA_GROUP_CACHE_BITS); i++) {
+    free(pCtx->GroupCache[i].pSrvInfos);
+    free(pCtx->GroupCache[i].pRing);
+    free(pCtx->GroupCache[i].pDepths);
+  }
+  free(pCtx->pCursors);
+} // }}}
+
+static void ClearRouteCache(MPA_Ctx *pCtx) { // {{{
+  size_t i;
+
+  pCtx->SelfRoute.bValid = False;
+  for (i = 0; i < (1 << MPA_ROUTE_CACHE_BITS); i++) {
+    pCtx->RouteCache[i].bValid = False;
+  }
+  for (i = 0; i < (1 << MPA_PLAN_CACHE_BITS); i++) {
+    pCtx->PlanCache[i].bValid = False;
+  }
+  for (i = 0; i < (1 << MPA_GROUP_CACHE_BITS); i++) {
+    pCtx->GroupCache[i].bValid = False;
+  }
+} // }}}
+
+/** Map MPA memory map file, the segment returned holds the reference of
+ *  the context which will use it */
+static MPA_Segment *MapSegment(const char *pszSHMFileName, int nFlags) { // {{{
+  MPA_Segment *pSegment;
+
+  if ((pSegment = calloc(1, sizeof(MPA_Segment))) == NULL) {
+    return NULL;
+  }
+  if ((pSegment->pMPAStart = MPA_SIS_InitEx(pszSHMFileName, nFlags)) == NULL) {
+    free(pSegment);
+    return NULL;
+  }
+  GetSISInfo(pSegment->pMPAStart, &pSegment->SISInfo);
+  pSegment->nRefs = 1;
+  return pSegment;
+} // }}}
+
+/** Take a reference to the mapped segment, called with the lock held.
+ *  Returns NULL if nothing is mapped. */
+static MPA_Segment *SegmentGet(MPA_Ctx *pCtx) { // {{{
+  if (pCtx->pSegment == NULL) {
+    return NULL;
+  }
+  __atomic_add_fetch(&pCtx->pSegment->nRefs, 1, __ATOMIC_RELAXED);
+  return pCtx->pSegment;
+} // }}}
+
+/** Drop a reference to a segment, without the lock. The last one is
+ *  dropped only after the context has moved to another segment, so nobody
+ *  can take a new reference to it any more. */
+static void SegmentPut(MPA_Segment *pSegment) { // {{{
+  if (pSegment == NULL || __atomic_sub_fetch(&pSegment->nRefs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  munmap(pSegment->pMPAStart, pSegment->SISInfo.dwTotalSize);
+  free(pSegment);
+} // }}}
+
+static void SetSegment(MPA_Ctx *pCtx, MPA_Segment *pSegment) { // {{{
+  pCtx->pSegment = pSegment;
+  pCtx->pMPAStart = pSegment->pMPAStart;
+  memcpy(&pCtx->SISInfo, &pSegment->SISInfo, sizeof(MPA_SISInfo));
+  pCtx->pdwGeneration = pCtx->SISInfo.pdwGeneration;
+  pCtx->pdwRetired = pCtx->SISInfo.pdwRetired;
+  ClearRouteCache(pCtx);
+} // }}}
+
+/** Map MPA memory map file again if the mapped segment has been retired by
+ *  MPA_SIS_LoadConfig(). The retired segment stays readable, so the process
+ *  keeps using it if the new one cannot be mapped. The context drops its
+ *  reference to the retired segment, which is unmapped at once unless calls
+ *  still hold references to it. */
+static void RefreshSegment(MPA_Ctx *pCtx) { // {{{
+  MPA_Segment *pSegment, *pOldSegment = pCtx->pSegment;
+
+  if (pCtx->pdwRetired == NULL || __atomic_load_n(pCtx->pdwRetired, __ATOMIC_ACQUIRE) == 0) {
+    return;
+  }
+  if ((pSegment = MapSegment(pCtx->szSHMFileName, pCtx->nMapFlags)) == NULL) {
+    trace("RefreshSegment>Cannot map memory map file[%s]", pCtx->szSHMFileName);
+    return;
+  }
+  SetSegment(pCtx, pSegment);
+  SegmentPut(pOldSegment);
+} // }}}
+
+static DWORD CacheSlot(DWORD key, int bits) { // {{{
+  return (key * 2654435761U) >> (32 - bits);
+} // }}}
+
+/** Resolve server info of sid through the route cache, fall back to MPA
+ *  segment when the cached one is missing or stale. Returns index of the
+ *  server info, or <0 if sid cannot be found, like MPA_GetServerInfo().
+ *  This and the other Resolve functions are called with the lock held. */
+static int ResolveRoute(MPA_Ctx *pCtx, DWORD sid, MPA_SIS_SrvInfo *pSrvInfo) { // {{{
+  MPA_RouteEntry *pEntry;
+  DWORD dwGeneration;
+  int nRetCode;
+
+  if (pCtx->pMPAStart == NULL) {
+    return -1;
+  }
+  RefreshSegment(pCtx);
+  if (pCtx->pdwGeneration == NULL) {
+    return MPA_GetServerInfo(sid, pSrvInfo, pCtx->pMPAStart);
+  }
+
+  pEntry = (sid == pCtx->dwSid) ? &pCtx->SelfRoute
+                                : pCtx->RouteCache + CacheSlot(sid, MPA_ROUTE_CACHE_BITS);
+  dwGeneration = __atomic_load_n(pCtx->pdwGeneration, __ATOMIC_ACQUIRE);
+  if (pEntry->bValid == True && pEntry->dwGeneration == dwGeneration &&
+      pEntry->SrvInfo.dwSid == sid) {
+    memcpy(pSrvInfo, &pEntry->SrvInfo, sizeof(MPA_SIS_SrvInfo));
+    return pEntry->nIndex;
+  }
+
+  if ((nRetCode = MPA_GetServerInfo(sid, pSrvInfo, pCtx->pMPAStart)) < 0) {
+    return nRetCode;
+  }
+  memcpy(&pEntry->SrvInfo, pSrvInfo, sizeof(MPA_SIS_SrvInfo));
+  pEntry->nIndex = nRetCode;
+  pEntry->dwGeneration = dwGeneration;
+  pEntry->bValid = True;
+  return nRetCode;
+} // }}}
+
+/** Resolve server infos of the subscribers of type through the plan cache,
+ *  fall back to MPA segment when the cached one is missing or stale. The
+ *  indexes of their server infos are looked up once per plan, so senders
+ *  count traffic without looking each subscriber up again. Returns number
+ *  of subscribers, or -1 if the segment has no type index. */
+static int ResolveSubscribers(MPA_Ctx *pCtx, DWORD type, // {{{
+                              const MPA_SIS_SrvInfo **ppSrvInfos, const int **ppIndexes) {
+  MPA_TypePlan *pPlan = pCtx->PlanCache + CacheSlot(type, MPA_PLAN_CACHE_BITS);
+  MPA_SIS_SrvInfo ServerInfo;
+  DWORD dwGeneration = 0;
+  int nTotal, i;
+
+  if (pCtx->pMPAStart == NULL) {
+    return -1;
+  }
+  RefreshSegment(pCtx);
+  if (pCtx->pdwGeneration) {
+    dwGeneration = __atomic_load_n(pCtx->pdwGeneration, __ATOMIC_ACQUIRE);
+    if (pPlan->bValid == True && pPlan->dwGeneration == dwGeneration && pPlan->dwType == type) {
+      (*ppSrvInfos) = pPlan->pSrvInfos;
+      (*ppIndexes) = pPlan->pIndexes;
+      return (int)pPlan->nCount;
+    }
+  }
+
+  pPlan->bValid = False;
+  for (;;) {
+    nTotal = MPA_GetSubscribers(type, 0, pPlan->pSrvInfos, pPlan->nCapacity, pCtx->pMPAStart);
+    if (nTotal < 0 || (size_t)nTotal <= pPlan->nCapacity) {
+      break;
+    }
+    /** Grow the plan and fetch again, the list may change in the meantime */
+    MPA_SIS_SrvInfo *p = realloc(pPlan->pSrvInfos, (size_t)nTotal * sizeof(MPA_SIS_SrvInfo));
+    if (p == NULL) {
+      return -1;
+    }
+    pPlan->pSrvInfos = p;
+    int *pIndexes = realloc(pPlan->pIndexes, (size_t)nTotal * sizeof(int));
+    if (pIndexes == NULL) {
+      return -1;
+    }
+    pPlan->pIndexes = pIndexes;
+    pPlan->nCapacity = (size_t)nTotal;
+  }
+  if (nTotal < 0) {
+    return -1;
+  }
+  for (i = 0; i < nTotal; i++) {
+    pPlan->pIndexes[i] = MPA_GetServerInfo(pPlan->pSrvInfos[i].dwSid, &ServerInfo,
+                                           pCtx->pMPAStart);
+  }
+
+  pPlan->dwType = type;
+  pPlan->nCount = (size_t)nTotal;
+  pPlan->dwGeneration = dwGeneration;
+  pPlan->bValid = (pCtx->pdwGeneration) ? True : False;
+  (*ppSrvInfos) = pPlan->pSrvInfos;
+  (*ppIndexes) = pPlan->pIndexes;
+  return nTotal;
+} // }}}
+
+/** Resolve server infos of the members of group gid through the group
+ *  cache like ResolveSubscribers(). Returns number of members, or -1 if
+ *  the segment has no groups. */
+static int ResolveMembers(MPA_Ctx *pCtx, DWORD gid, MPA_TypePlan **ppPlan) { // {{{
+  MPA_TypePlan *pPlan = pCtx->GroupCache + CacheSlot(gid, MPA_GROUP_CACHE_BITS);
+  DWORD dwGeneration = 0;
+  int nTotal;
+
+  if (pCtx->pMPAStart == NULL) {
+    return -1;
+  }
+  RefreshSegment(pCtx);
+  (*ppPlan) = pPlan;
+  if (pCtx->pdwGeneration) {
+    dwGeneration = __atomic_load_n(pCtx->pdwGeneration, __ATOMIC_ACQUIRE);
+    if (pPlan->bValid == True && pPlan->dwGeneration == dwGeneration && pPlan->dwType == gid) {
+      return (int)pPlan->nCount;
+    }
+  }
+
+  pPlan->bValid = False;
+  pPlan->nRingSize = 0;
+  pPlan->nDepthTime = 0;
+  for (;;) {
+    nTotal = MPA_GetGroupMembers(gid, pPlan->pSrvInfos, pPlan->nCapacity, pCtx->pMPAStart);
+    if (nTotal < 0 || (size_t)nTotal <= pPlan->nCapacity) {
+      break;
+    }
+    MPA_SIS_SrvInfo *p = realloc(pPlan->pSrvInfos, (size_t)nTotal * sizeof(MPA_SIS_SrvInfo));
+    if (p == NULL) {
+      return -1;
+    }
+    pPlan->pSrvInfos = p;
+    msgqnum_t *pDepths = realloc(pPlan->pDepths, (size_t)nTotal * sizeof(msgqnum_t));
+    if (pDepths == NULL) {
+      return -1;
+    }
+    pPlan->pDepths = pDepths;
+    pPlan->nCapacity = (size_t)nTotal;
+  }
+  if (nTotal < 0) {
+    return -1;
+  }
+
+  pPlan->dwType = gid;
+  pPlan->nCount = (size_t)nTotal;
+  pPlan->dwGeneration = dwGeneration;
+  pPlan->bValid = (pCtx->pdwGeneration) ? True : False;
+  return nTotal;
+} // }}}
+
+/** Find the round-robin position of a group, or add one at the first
+ *  member. Processes send to few groups, so positions are searched in
+ *  order. Returns NULL if out of memory. */
+static size_t *GroupCursor(MPA_Ctx *pCtx, DWORD gid) { // {{{
+  size_t i;
+
+  for (i = 0; i < pCtx->nCursors; i++) {
+    if (pCtx->pCursors[i].gid == gid) {
+      return &pCtx->pCursors[i].nNext;
+    }
+  }
+  if (pCtx->nCursors == pCtx->nCursorCapacity) {
+    i = (pCtx->nCursorCapacity > 0) ? 2 * pCtx->nCursorCapacity : 8;
+    MPA_GroupCursor *p = realloc(pCtx->pCursors, i * sizeof(MPA_GroupCursor));
+    if (p == NULL) {
+      return NULL;
+    }
+    pCtx->pCursors = p;
+    pCtx->nCursorCapacity = i;
+  }
+  pCtx->pCursors[pCtx->nCursors].gid = gid;
+  pCtx->pCursors[pCtx->nCursors].nNext = 0;
+  return &pCtx->pCursors[pCtx->nCursors++].nNext;
+} // }}}
+
+/** Pick the member of a group to send to, starting from the round-robin
+ *  position *pnNext so that members with equal depth take turns under
+ *  least depth. Least depth reads the number of messages in the queue of
+ *  every member with IPC_STAT at most once per MPA_GROUP_DEPTH_NS, and adds
+ *  the messages it sends meanwhile to the depths read. The depth is the one
+ *  of the whole queue, which counts messages of every server sharing it. */
+static size_t PickMember(MPA_TypePlan *pPlan, size_t *pnNext, int nPolicy) { // {{{
+  struct msqid_ds qds;
+  struct timespec now;
+  size_t i, j, nPick, nStart = (*pnNext) % pPlan->nCount;
+  long long nNow;
+
+  (*pnNext) = nStart + 1;
+  if (nPolicy != MPA_GROUP_LEAST_DEPTH || pPlan->nCount == 1) {
+    return nStart;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  nNow = (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+  if (pPlan->nDepthTime == 0 || nNow - pPlan->nDepthTime >= MPA_GROUP_DEPTH_NS) {
+    for (j = 0; j < pPlan->nCount; j++) {
+      /** A queue which cannot be read is taken last, the send reports it */
+      pPlan->pDepths[j] = (MsqInfo(pPlan->pSrvInfos[j].dwQid, &qds) == 0) ? qds.msg_qnum
+                                                                           : (msgqnum_t)-1;
+    }
+    pPlan->nDepthTime = nNow;
+  }
+  for (i = 1, nPick = nStart; i < pPlan->nCount && pPlan->pDepths[nPick] > 0; i++) {
+    j = (nStart + i) % pPlan->nCount;
+    if (pPlan->pDepths[j] < pPlan->pDepths[nPick]) {
+      nPick = j;
+    }
+  }
+  if (pPlan->pDepths[nPick] != (msgqnum_t)-1) {
+    pPlan->pDepths[nPick]++;
+  }
+  return nPick;
+} // }}}
+
+/** FNV-1a hash with a final avalanche, so that keys differing in the last
+ *  bytes spread over the whole ring */
+static DWORD RingHash(const char *p, size_t n) { // {{{
+  DWORD h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    h = (h ^ (unsigned char)p[i]) * 16777619U;
+  }
+  h ^= h >> 16;
+  h *= 0x85EBCA6BU;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35U;
+  h ^= h >> 16;
+  return h;
+} // }}}
+
+static int RingPointCompare(const void *p1, const void *p2) { // {{{
+  const MPA_RingPoint *pPoint1 = (const MPA_RingPoint *)p1;
+  const MPA_RingPoint *pPoint2 = (const MPA_RingPoint *)p2;
+
+  if (pPoint1->dwHash != pPoint2->dwHash) {
+    return (pPoint1->dwHash < pPoint2->dwHash) ? -1 : 1;
+  }
+  return (pPoint1->dwMember < pPoint2->dwMember) ? -1 : (pPoint1->dwMember > pPoint2->dwMember);
+} // }}}
+
+/** Place MPA_RING_REPLICAS points of every member on hash ring. Points are
+ *  hashed from the server id, not from the order of members, so adding or
+ *  removing a member moves only the keys of its own points. */
+static int BuildRing(MPA_TypePlan *pPlan) { // {{{
+  MPA_RingPoint *pRing;
+  size_t i, nSize = pPlan->nCount * MPA_RING_REPLICAS;
+  DWORD adwPoint[2]; /**< Server id and replica number */
+
+  if ((pRing = realloc(pPlan->pRing, nSize * sizeof(MPA_RingPoint))) == NULL) {
+    return -1;
+  }
+  pPlan->pRing = pRing;
+  for (i = 0; i < pPlan->nCount; i++) {
+    adwPoint[0] = pPlan->pSrvInfos[i].dwSid;
+    for (adwPoint[1] = 0; adwPoint[1] < MPA_RING_REPLICAS; adwPoint[1]++, pRing++) {
+      pRing->dwHash = RingHash((const char *)adwPoint, sizeof(adwPoint));
+      pRing->dwMember = (DWORD)i;
+    }
+  }
+  qsort(pPlan->pRing, nSize, sizeof(MPA_RingPoint), RingPointCompare);
+  pPlan->nRingSize = nSize;
+  return 0;
+} // }}}
+
+/** Find the first point at or after dwHash, wrapping around the ring */
+static size_t RingLookup(const MPA_TypePlan *pPlan, DWORD dwHash) { // {{{
+  size_t nLow = 0, nHigh = pPlan->nRingSize, nMid;
+
+  while (nLow < nHigh) {
+    nMid = nLow + (nHigh - nLow) / 2;
+    if (pPlan->pRing[nMid].dwHash < dwHash) {
+      nLow = nMid + 1;
+    } else {
+      nHigh = nMid;
+    }
+  }
+  return (nLow == pPlan->nRingSize) ? 0 : nLow;
+} // }}}
+
+/** Count traffic of server sid in the segment currently mapped, and ring
+ *  its doorbell when a message has been sent to it */
+static void CountServer(MPA_Ctx *pCtx, DWORD sid, int nEvent, size_t nBytes) { // {{{
+  MPA_SIS_SrvInfo ServerInfo;
+  DWORD *pdwDoorbell;
+  int nIndex;
+
+  pthread_mutex_lock(&pCtx->Lock);
+  if ((nIndex = ResolveRoute(pCtx, sid, &ServerInfo)) >= 0) {
+    MPA_SIS_StatServer(&pCtx->SISInfo, (mpa_index_t)nIndex, nEvent, nBytes);
+    if (nEvent == MPA_STAT_SENT && (pdwDoorbell = MPA_SIS_Doorbell(
+                                        &pCtx->SISInfo, (mpa_index_t)nIndex)) != NULL) {
+      MPA_SIS_RingDoorbell(pdwDoorbell);
+    }
+  }
+  pthread_mutex_unlock(&pCtx->Lock);
+} // }}}
+
+/** Count a message sent to the server info of index nIndex by its return
+ *  code, in a segment referenced by the sender, and ring its doorbell when
+ *  the message has been sent. Neither needs the lock. */
+static void CountSend(const MPA_Segment *pSegment, int nIndex, int nRetCode, // {{{
+                      size_t nBytes) {
+  DWORD *pdwDoorbell;
+
+  if (pSegment == NULL || nIndex < 0) {
+    return;
+  }
+  MPA_SIS_StatServer(&pSegment->SISInfo, (mpa_index_t)nIndex,
+                     (nRetCode == 0)              ? MPA_STAT_SENT
+                     : (nRetCode == MPA_ERR_INTR) ? MPA_STAT_INTR
+                                                  : MPA_STAT_ERROR,
+                     (nRetCode == 0) ? nBytes : 0);
+  if (nRetCode == 0 &&
+      (pdwDoorbell = MPA_SIS_Doorbell(&pSegment->SISInfo, (mpa_index_t)nIndex)) != NULL) {
+    MPA_SIS_RingDoorbell(pdwDoorbell);
+  }
+} // }}}
+
+/** Count a message published to a subscriber by its type, and ring the
+ *  doorbell of the subscriber as CountSend() does */
+static void CountPub(const MPA_Segment *pSegment, int nIndex, DWORD type, // {{{
+                     int nRetCode, size_t nBytes) {
+  DWORD *pdwDoorbell;
+
+  if (pSegment == NULL) {
+    return;
+  }
+  MPA_SIS_StatType(&pSegment->SISInfo, type,
+                   (nRetCode == 0)              ? MPA_STAT_SENT
+                   : (nRetCode == MPA_ERR_INTR) ? MPA_STAT_INTR
+                                                : MPA_STAT_ERROR,
+                   (nRetCode == 0) ? nBytes : 0);
+  if (nRetCode == 0 && nIndex >= 0 &&
+      (pdwDoorbell = MPA_SIS_Doorbell(&pSegment->SISInfo, (mpa_index_t)nIndex)) != NULL) {
+    MPA_SIS_RingDoorbell(pdwDoorbell);
+  }
+} // }}}
+
+
+/** Count a message received by the server of the context, and by its type
+ *  if it is published */
+static void CountRecv(MPA_Ctx *pCtx, const MPAMessage *pMessage, size_t nMsgLen) { // {{{
+  pthread_mutex_lock(&pCtx->Lock);
+  CountRecvLocked(pCtx, pMessage, nMsgLen);
+  pthread_mutex_unlock(&pCtx->Lock);
+} // }}}
+
+static void CountRecvLocked(MPA_Ctx *pCtx, const MPAMessage *pMessage, size_t nMsgLen) { // {{{
+  MPA_MSG_Head *head = NULL;
+  MPA_MSG_Prop *prop = NULL;
+  MPA_MSG_Body *body = NULL;
+  MPA_SIS_SrvInfo ServerInfo;
+  int nIndex;
+
+  if ((nIndex = ResolveRoute(pCtx, pCtx->dwSid, &ServerInfo)) >= 0) {
+    MPA_SIS_StatServer(&pCtx->SISInfo, (mpa_index_t)nIndex, MPA_STAT_RECV, nMsgLen);
+  }
+  GetMsgPart(pMessage, &head, &prop, &body);
+  if (head->bMsgMode == MPA_SM_PUB) {
+    MPA_SIS_StatType(&pCtx->SISInfo, head->dwMsgType, MPA_STAT_RECV, nMsgLen);
+  }
+} // }}}
+
+/** Pass an empty message taken from the queue of pServerInfo on to the
+ *  next receiver blocked there, if the server has been moved off it.
+ *  MPA_SIS_SplitQueue() sends a single one, and each receiver of the
+ *  server passes it on as it moves to the new queue, so all of them are
+ *  woken however many there are. MPA_SIS_SplitQueue() drops it after a
+ *  grace period, a stray one is dropped here. */
+static void PassWake(MPA_Ctx *pCtx, const MPA_SIS_SrvInfo *pServerInfo) { // {{{
+  MPA_SIS_SrvInfo ServerInfo;
+  MsgBufDef MsgBuf;
+  int nIndex;
+
+  pthread_mutex_lock(&pCtx->Lock);
+  nIndex = ResolveRoute(pCtx, pCtx->dwSid, &ServerInfo);
+  pthread_mutex_unlock(&pCtx->Lock);
+  if (nIndex >= 0 && ServerInfo.dwQid == pServerInfo->dwQid) {
+    return;
+  }
+  MsgBuf.mtype = (long)pServerInfo->dwQtype;
+  MsqSend(pServerInfo->dwQid, (T_Msgbuf *)&MsgBuf, 0);
+} // }}}
+
+/** Deadline nNs nanoseconds from now on CLOCK_MONOTONIC */
+static void DeadlineAfter(struct timespec *pDeadline, long long nNs) { // {{{
+  clock_gettime(CLOCK_MONOTONIC, pDeadline);
+  pDeadline->tv_sec += (time_t)(nNs / 1000000000LL);
+  pDeadline->tv_nsec += (long)(nNs % 1000000000LL);
+  if (pDeadline->tv_nsec >= 1000000000L) {
+    pDeadline->tv_sec++;
+    pDeadline->tv_nsec -= 1000000000L;
+  }
+} // }}}
+
+/** Time left until the deadline, at most nMaxNs. Returns False when the
+ *  deadline has passed. */
+static Boolean TimeLeft(const struct timespec *pDeadline, long nMaxNs, // {{{
+                        struct timespec *pWait) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  pWait->tv_sec = pDeadline->tv_sec - now.tv_sec;
+  pWait->tv_nsec = pDeadline->tv_nsec - now.tv_nsec;
+  if (pWait->tv_nsec < 0) {
+    pWait->tv_sec--;
+    pWait->tv_nsec += 1000000000L;
+  }
+  if (pWait->tv_sec < 0 || (pWait->tv_sec == 0 && pWait->tv_nsec == 0)) {
+    return False;
+  }
+  if (pWait->tv_sec > 0 || pWait->tv_nsec > nMaxNs) {
+    pWait->tv_sec = 0;
+    pWait->tv_nsec = nMaxNs;
+  }
+  return True;
+} // }}}
+
+/** Fill in the head of a message sent to a server, return its length.
+ *  Callers reject a length over MPA_MESSAGESIZE before copying the message. */
+static size_t SetP2PHead(MPA_Ctx *pCtx, DWORD sid, const MPAMessage *pMessage) { // {{{
+  MPA_MSG_Head *head;
+  MPA_MSG_Prop *prop;
+  MPA_MSG_Body *body;
+  size_t nMsgLen = CalculateMsgLength(pMessage);
+
+  GetMsgPart(pMessage, &head, &prop, &body);
+  head->wMsgLen = (WORD)nMsgLen;
+  head->bMsgMode = MPA_SM_P2P;
+  head->dwSourceID = pCtx->dwSid;
+  head->dwDestID = sid;
+  return nMsgLen;
+} // }}}
+
+/** Send buffer of a message got by MPA_SendReserve(), the message is its text */
+static MsgBufDef *GetMsgBuf(const MPAMessage *pMessage) { // {{{
+  return (MsgBufDef *)((char *)pMessage - offsetof(MsgBufDef, mtext)); // NOLINT
+} // }}}
+
 static void GetMsgPart(const MPAMessage *pMessage, MPA_MSG_Head **head, // {{{
                        MPA_MSG_Prop **prop, MPA_MSG_Body **body) {
   if (pMessage == NULL) {
@@ -42,30 +42,217 @@
  *  - Fix type conversion problems
  */
 // Includes {{{
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /**< For sched_getcpu() */
+#endif
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/msg.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "mpaknl.h"
 #include "rscommon/debug.h"
-#include "rscommon/profile.h"
 #include "rscommon/strfunc.h"
-#include "rscommon/strlist.h"
 // Includes }}}
 
+#define MPA_SEQ_SPINS 1024 /**< Spins on an odd sequence before yielding the CPU */
+#define MPA_COMPACT_BATCH 64 /**< Default entries moved in one write of MPA_SIS_Compact() */
+
+#define MPA_SCAN_MAX 64 /**< Server infos looked up by scanning keys instead of hashing */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MPA_SCAN_SIMD /**< SSE2 is always there, AVX2 is detected at run time */
+#endif
+
+#define MPA_CACHE_LINE 64 /**< Alignment of traffic counters */
+#define MPA_DOORBELL_STRIDE (MPA_CACHE_LINE / sizeof(DWORD)) /**< DWORDs between doorbells */
+#define MPA_STAT_STRIPES_MAX 16 /**< Max stripes of traffic counters */
+#define MPA_STAT_PROBE_MAX 32   /**< Max slots probed for the counters of a type */
+#define MPA_STAT_MAX_SIZE (64U << 20) /**< Max bytes of traffic counters of all stripes */
+
+#define MPA_WAIT_POLL_NS 1000000 /**< Poll interval of MPA_SIS_WaitChange() without futex */
+
+#define MPA_QSCAN_MAX 4096 /**< Messages copied by MPA_SIS_QueueTypeDepth() at most */
+#define MPA_SPLIT_GRACE_NS 50000000 /**< Time for senders to see the queue of a split server */
+#define MPA_GROW_TRIES 3 /**< Copies made by MPA_SIS_Grow() before copying in a write */
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0 /**< Segments are faulted in on demand without it */
+#endif
+
+#if defined(__linux__) && !defined(MSG_COPY)
+#define MSG_COPY 040000 /**< Copy a message without removing it, since Linux 3.8 */
+#endif
+
+// Local type definitions {{{
+typedef struct MPA_SIS_TypeInfoV1 {
+  DWORD dwType;
+  WORD wSidIndex;
+} MPA_SIS_TypeInfoV1;
+
+typedef struct MPA_SISInfoV1 {
+  DWORD dwTotalSize;
+  WORD wMaxSvrInfo;
+  WORD wMaxTypeInfo;
+  WORD *pwSrvInfoSize;
+  MPA_SIS_SrvInfo *pServerInfos;
+  WORD *pwTListSize;
+  MPA_SIS_TypeInfoV1 *pTypeInfos;
+} MPA_SISInfoV1;
+
+/** Called by StreamProfile() for each key of a profile */
+typedef int (*ProfileHandler)(const char *pszSection, const char *pszKey, const char *pszValue,
+                              void *pCtx);
+
+/** State of loading a profile into a segment */
+typedef struct MPA_ProfileLoad {
+  const MPA_SISInfo *pSISInfo; /**< Segment being loaded */
+  int nVersion;           /**< Version of the profile */
+  size_t nMaxSvrInfo;     /**< Max server infos of the segment */
+  size_t nMaxTypeInfo;    /**< Max type infos of the segment */
+  long long nSvrNum;      /**< Server number of version 1 profiles */
+  long long nTypeNum;     /**< Type number of version 1 profiles */
+  size_t nServers;        /**< Server infos loaded */
+  size_t nTypes;          /**< Type infos loaded */
+  int nQueues;            /**< Message queues created */
+  Boolean bMainSeen;      /**< Keys of [main] have been read */
+  Boolean bServerSeen;    /**< Keys of [server] have been read */
+  Boolean bTypesDeferred; /**< Type infos are listed before [server] */
+  Boolean bTypesOnly;     /**< Second pass which loads type infos only */
+  Boolean bCapped;        /**< Entries are left out by the cap of the segment */
+  Boolean bCompile;       /**< Compile an image, no message queue is created */
+} MPA_ProfileLoad;
+
+/** Entries touched by MPA_SIS_ApplyConfigDiff() */
+typedef struct MPA_ConfigDiff {
+  size_t nSvrAdded;    /**< Server infos added */
+  size_t nSvrChanged;  /**< Server infos with new queue key or type */
+  size_t nSvrRemoved;  /**< Server infos removed */
+  size_t nTypeAdded;   /**< Type infos added */
+  size_t nTypeRemoved; /**< Type infos removed */
+} MPA_ConfigDiff;
+/** Queue id of an entry of MPA_SIS_QueueStats(), sorted to find the
+ *  entries sharing a queue */
+typedef struct MPA_QueueRef {
+  int qid;
+  size_t nIndex; /**< Index of the entry */
+} MPA_QueueRef;
+// Local type definitions }}}
+
 // Local function declarations {{{
+static char *MapFile(const char *pszFileName, int nFlags);
+static char *CreateMapFile(const char *pszFileName, size_t nSize);
+static void PrefaultSegment(const char *pMPAStart, size_t nSize);
+static int GetSISInfoV1(const char *pMPAStart, size_t nFileSize, MPA_SISInfoV1 *pSISInfo);
+static int PublishSegment(const char *pszTmpName, const char *pszFileName);
+static int AdminLock(const char *pszFileName);
+static void AdminUnlock(int fd);
+static int UpgradeFile(const char *pszFileName);
+static int LoadConfigFile(const char *pszSHMFileName, const char *pszFileName);
+static int ApplyDiffFile(const char *pszSHMFileName, const char *pszFileName);
+static int GrowFile(const char *pszSHMFileName, size_t nNumOfProcess, size_t nNumOfType);
+static int LoadImageFile(const char *pszSHMFileName, const char *pszImageFileName);
+static size_t GrowCapacity(DWORD dwMax, size_t nNeed);
+static void GrowCopy(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo);
+static ssize_t MoveMessages(int qidFrom, int qidTo, DWORD qtype, T_MsgbufM *pBuf,
+                            size_t nMax, Boolean bDropWake);
+static DWORD Crc32(const char *p, size_t n);
+static Boolean ImageValid(const char *pImage, size_t nSize);
 static int DumpSISInfoToFile(const MPA_SISInfo *pSISInfo, const char *pszFileName);
 static void DisplaySISInfo(const MPA_SISInfo *pSISInfo);
 static int FindServerInfo(const MPA_SISInfo *pSISInfo, DWORD sid);
+static size_t ScanKeys(const DWORD *pKeys, size_t nFrom, size_t nTo, DWORD key);
+static size_t ScanKeysScalar(const DWORD *pKeys, size_t nFrom, size_t nTo, DWORD key);
+#ifdef MPA_SCAN_SIMD
+static size_t ScanKeysSSE2(const DWORD *pKeys, size_t nFrom, size_t nTo, DWORD key);
+static size_t ScanKeysAVX2(const DWORD *pKeys, size_t nFrom, size_t nTo, DWORD key);
+#endif
+static DWORD HashKey(DWORD key);
+static size_t SidIndexOffset(size_t nTListHeadOffset, size_t nNumOfType);
+static DWORD SidIndexBuckets(size_t nNumOfProcess);
+static void SidIndexInsert(const MPA_SISInfo *pSISInfo, DWORD sid, mpa_index_t index);
+static void SidIndexRemove(const MPA_SISInfo *pSISInfo, DWORD sid);
+static void SidIndexClear(const MPA_SISInfo *pSISInfo);
+static size_t TypeIndexOffset(size_t nSidIdxOffset, DWORD dwSidBuckets);
+static MPA_SIS_TypeBucket *TypeIndexBucket(const MPA_SISInfo *pSISInfo, DWORD type);
+static void TypeIndexRebuild(const MPA_SISInfo *pSISInfo);
+static void TypeIndexInsert(const MPA_SISInfo *pSISInfo, DWORD type, mpa_index_t index);
+static int AddServerInfo(const MPA_SISInfo *pSISInfo, DWORD sid, key_t qkey, DWORD qtype,
+                         DWORD gid, Boolean bCreateQueue);
+static DWORD ServerGroup(const MPA_SISInfo *pSISInfo, mpa_index_t index);
+static int AddTypeInfo(const MPA_SISInfo *pSISInfo, DWORD type, DWORD sid);
+static mpa_index_t ServerSlotAlloc(const MPA_SISInfo *pSISInfo);
+static void ServerSlotFree(const MPA_SISInfo *pSISInfo, mpa_index_t index);
+static void ServerSlotTrim(const MPA_SISInfo *pSISInfo);
+static mpa_index_t TypeSlotAlloc(const MPA_SISInfo *pSISInfo);
+static void TypeSlotFree(const MPA_SISInfo *pSISInfo, mpa_index_t index);
+static void TypeSlotTrim(const MPA_SISInfo *pSISInfo);
+static Boolean CompactServer(const MPA_SISInfo *pSISInfo);
+static Boolean CompactType(const MPA_SISInfo *pSISInfo);
+static size_t GenerationOffset(size_t nTypeIdxOffset, DWORD dwTypeBuckets, size_t nNumOfType);
+static size_t StatOffset(size_t nKeysEnd);
+static size_t StatSize(size_t nNumOfProcess, DWORD dwStripes, DWORD dwTypeSlots);
+static DWORD StatStripes(size_t nSlots);
+static size_t StatLayout(size_t nKeysEnd, size_t nNumOfProcess, size_t nNumOfType,
+                         DWORD *pdwStripes, DWORD *pdwTypeSlots);
+static void StatInit(char *pMPAStart, size_t nStatOffset, DWORD dwStripes, DWORD dwTypeSlots);
+static MPA_SIS_Stat *StatStripe(const MPA_SISInfo *pSISInfo);
+static mpa_index_t StatTypeSlot(const MPA_SISInfo *pSISInfo, DWORD type, Boolean bClaim);
+static size_t StatCompact(const MPA_SISInfo *pSISInfo);
+static void StatAdd(MPA_SIS_Stat *pStat, int nEvent, size_t nBytes);
+static void StatSum(const MPA_SISInfo *pSISInfo, size_t nSlot, MPA_SIS_Stat *pStat);
+static void StatReset(const MPA_SISInfo *pSISInfo, size_t nSlot);
+static void StatMove(const MPA_SISInfo *pSISInfo, size_t nFrom, size_t nTo);
+static int QueueRefCompare(const void *p1, const void *p2);
+static void QueueStatRead(MPA_SIS_QueueStat *pStat);
+static void BumpGeneration(const MPA_SISInfo *pSISInfo);
+static void WakeWatchers(DWORD *pdwGeneration);
+static int WaitGeneration(DWORD *pdwGeneration, DWORD dwGeneration, const struct timespec *pTimeout);
+static int ProcessStart(pid_t pid, DWORD *pdwStart);
+static DWORD PidNamespace(void);
+static void SeqWriteBegin(const MPA_SISInfo *pSISInfo);
+static void SeqWriteEnd(const MPA_SISInfo *pSISInfo);
+static int SeqWriteLive(const MPA_SISInfo *pSISInfo);
+static DWORD SeqReadBegin(const MPA_SISInfo *pSISInfo);
+static Boolean SeqReadRetry(const MPA_SISInfo *pSISInfo, DWORD dwSeq);
 static int FindTypeInfo(mpa_index_t index, const MPA_SISInfo *pSISInfo, DWORD type);
 static int FindTypeInfoBySid(const MPA_SISInfo *pSISInfo, DWORD type, DWORD sid);
-static int LoadFromFile(const char *pszSHMFileName, const char *pszINIFileName);
-static int LoadFromList(const char *pMPAStart, const char *pszINIFileName,
-                        size_t nMaxServerInfoNums, size_t nMaxTypeInfoNums);
+static Boolean TypeSubscribed(const MPA_SISInfo *pSISInfo, DWORD type, mpa_index_t index);
+static int DiffQueues(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo);
+static void DiffMarkTypes(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo,
+                          unsigned char *pbAdd);
+static void DiffRemove(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo,
+                       MPA_ConfigDiff *pDiff);
+static int DiffAdd(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo,
+                   const unsigned char *pbAdd, MPA_ConfigDiff *pDiff);
+static int LoadFromFile(const char *pszSHMFileName, const char *pszINIFileName,
+                        Boolean bCompile);
+static char *TrimSpace(char *psz);
+static int ParseNumber(const char **ppsz, char sep, long long *pValue);
+static int StreamProfile(const char *pszFileName, ProfileHandler pfnHandler, void *pCtx);
+static int HandleMainKey(const char *pszSection, const char *pszKey, const char *pszValue,
+                         void *pCtx);
+static Boolean EntryKeyAccepted(const MPA_ProfileLoad *pLoad, const char *pszKey, char prefix,
+                                long long nNum);
+static int HandleEntryKey(const char *pszSection, const char *pszKey, const char *pszValue,
+                          void *pCtx);
 // Local function declarations }}}
 
 #if defined(__clang__) ||                                                                          \
@@ -77,208 +264,365 @@ static int LoadFromList(const char *pMPAStart, const char *pszINIFileName,
 
 DLL_PUBLIC int MPA_SIS_Create(const char *pszFileName, size_t nNumOfProcess,
                               size_t nNumOfType) { //{{{
-  FILE *fp = NULL;
-  BYTE b = 0;
-  DWORD dw = 0;
-  WORD w = 0;
-  size_t nSizeOfArea = 0, n = 0, i = 0;
+  size_t nSizeOfArea = 0, nIdxOffset = 0, nTypeIdxOffset = 0, nGenOffset = 0, nStatOffset = 0;
+  DWORD dwSidBuckets = 0, dwTypeBuckets = 0, dwStatStripes = 0, dwStatTypeSlots = 0;
   char *pMPAStart = NULL; /**< Pointer to head address of memory
                                storing MPA informations */
-  WORD *pMPAWork = NULL;
+  DWORD *pMPAWork = NULL;
   MPA_SISInfo SISInfo;
 
-  check((nNumOfProcess <= USHRT_MAX), "Number of process is too large");
-  check((nNumOfType <= USHRT_MAX), "Number of types is too large");
+  check((nNumOfProcess <= MPA_SIS_MAX_INFO), "Number of process is too large");
+  check((nNumOfType <= MPA_SIS_MAX_INFO), "Number of types is too large");
 
   /** Create MPA information memory map file. {{{
    *  Create an empty memory map file with the size calculated.
    */
   /** 1. Calculate size of memory map file, see comment of MPA_SIS_Create()
    *     in mpaknl.h for details*/
-  nSizeOfArea = sizeof(DWORD) + 7 * sizeof(WORD) +
+  nSizeOfArea = 10 * sizeof(DWORD) +
                 (nNumOfProcess * sizeof(MPA_SIS_SrvInfo) + nNumOfType * sizeof(MPA_SIS_TypeInfo));
-
-  fp = fopen(pszFileName, "wbe"); /**< 2. Open file with binary write */
-  check(fp, "Create memory map file error");
-
-  dw = (DWORD)nSizeOfArea;
-  n = fwrite((void *)&dw, sizeof(DWORD), 1, fp); /**< 3. Write its size to it */
-  check(n == 1, "Write to memory map file error");
-
-  w = 0;
-  for (i = 0; i < 5; i++) { /**< 4. Make spaces for 5 WORDs */
-    n = fwrite((void *)&w, sizeof(WORD), 1, fp);
-    check(n == 1, "Write to memory map file error");
-  }
-  b = 0;
-  for (i = 0; i < (nNumOfProcess * sizeof(MPA_SIS_SrvInfo) + nNumOfType * sizeof(MPA_SIS_TypeInfo));
-       i++) { /**< 5. Make spaces for detail informations */
-    n = fwrite((void *)&b, sizeof(BYTE), 1, fp);
-    check(n == 1, "Write to memory map file error");
-  }
-  fclose(fp);
-  fp = NULL; //}}}
-
-  /** Map file to memory, and make it shared among processes */
-  pMPAStart = MPA_SIS_Init(pszFileName);
-  check(pMPAStart, "Initialize memory map error");
+  /** Append sid hash index, type hash index and subscriber list after type
+   *  info list */
+  nIdxOffset = SidIndexOffset(nSizeOfArea - nNumOfType * sizeof(MPA_SIS_TypeInfo), nNumOfType);
+  dwSidBuckets = SidIndexBuckets(nNumOfProcess);
+  nTypeIdxOffset = TypeIndexOffset(nIdxOffset, dwSidBuckets);
+  dwTypeBuckets = SidIndexBuckets(nNumOfType);
+  nGenOffset = GenerationOffset(nTypeIdxOffset, dwTypeBuckets, nNumOfType);
+  nSizeOfArea = nGenOffset + 8 * sizeof(DWORD); /**< Generation, sequence, writer token,
+                                                     heads of free lists and retired flag */
+  nSizeOfArea += (nNumOfProcess + nNumOfType) * sizeof(DWORD); /**< Key columns */
+  nSizeOfArea += nNumOfProcess * sizeof(DWORD);                /**< Group ids, all 0 */
+  /** Append traffic counters striped over CPUs if they are not too large */
+  nStatOffset = StatOffset(nSizeOfArea);
+  nSizeOfArea =
+      StatLayout(nSizeOfArea, nNumOfProcess, nNumOfType, &dwStatStripes, &dwStatTypeSlots);
+  check(nSizeOfArea <= UINT_MAX, "Memory map file size[%zu] is too large", nSizeOfArea);
+
+  /** 2. Create the file zero-filled and map it to memory */
+  pMPAStart = CreateMapFile(pszFileName, nSizeOfArea);
+  check(pMPAStart, "Initialize memory map error"); //}}}
+
+  pMPAWork = (DWORD *)pMPAStart;
+  *pMPAWork++ = (DWORD)nSizeOfArea; /**< 3. Write its size to it */
+  *pMPAWork++ = MPA_SIS_MAGIC;      /**< 4. Write magic number */
+  /** 5. Write layout version and the group ids it always has, the flag of
+   *     traffic counters is set with them */
+  *pMPAWork++ = MPA_SIS_VERSION | MPA_SIS_FEATURE_GROUPS;
 
   /** Setup MPA informations in this memory segment currently mapped. {{{
    *
    *  @see mpaknl.h For more details of MPA memory structure
    * */
-  /** 1. Jump over the size, it's been already set when map the file
-   *     to memory, see line 82-91 and MPA_SIS_Init() */
-  pMPAWork = (WORD *)(pMPAStart + sizeof(DWORD));
-  *pMPAWork++ = (WORD)nNumOfProcess; /**< 2. Set max process numbers */
-  *pMPAWork++ = (WORD)nNumOfType;    /**< 3. Set max type numbers */
-
-  /**< Jump over wSAddrOffset, wTAddrOffset, wSrvInfoSize to the start address
-   *   of server info section, and store this offset to SISInfo.wSAddrOffset */
-  SISInfo.wSAddrOffset = (WORD)(3 * sizeof(WORD) + (size_t)((char *)pMPAWork - pMPAStart));
-  (*pMPAWork++) = SISInfo.wSAddrOffset; /**< 4. Set server info section head
-                                           offset in the MPA memory segment  */
+  /** 1. Jump over the size, magic number and version, they've been already
+   *     set when the file was created */
+  *pMPAWork++ = (DWORD)nNumOfProcess; /**< 2. Set max process numbers */
+  *pMPAWork++ = (DWORD)nNumOfType;    /**< 3. Set max type numbers */
+
+  /**< Jump over dwSAddrOffset, dwTAddrOffset, dwSrvInfoSize to the start
+   *   address of server info section, and store this offset to
+   *   SISInfo.dwSAddrOffset */
+  SISInfo.dwSAddrOffset = (DWORD)(3 * sizeof(DWORD) + (size_t)((char *)pMPAWork - pMPAStart));
+  (*pMPAWork++) = SISInfo.dwSAddrOffset; /**< 4. Set server info section head
+                                            offset in the MPA memory segment  */
 
   /**< Jump over server info section, type list head offset, type list size to
    *   the start of type info section, and store this offset to
-   *   SISInfo.wTAddrOffset */
-  SISInfo.wTAddrOffset = (WORD)(nNumOfProcess * sizeof(MPA_SIS_SrvInfo) + 2 * sizeof(WORD) +
-                                (size_t)((char *)pMPAWork - pMPAStart));
-  (*pMPAWork++) = SISInfo.wTAddrOffset; /**< 5. Set type info section head
-                                           offset in the MPA memory segment */
-
-  (*pMPAWork) = (WORD)0; /**< 6. Set server info size to zero */
-
-  pMPAWork = (WORD *)(pMPAStart + SISInfo.wTAddrOffset);
-  /**< Jump over wTListHeadOffset and wTListSize */
-  SISInfo.wTListHeadOffset = SISInfo.wTAddrOffset + (WORD)(2 * sizeof(WORD));
-  (*pMPAWork++) = SISInfo.wTListHeadOffset; /**< 7. Set type list head offset
-                                                    in the MPA memory segment */
-
-  (*pMPAWork) = (WORD)0; /**< 8. Set type list size to zero */
+   *   SISInfo.dwTAddrOffset */
+  SISInfo.dwTAddrOffset = (DWORD)(nNumOfProcess * sizeof(MPA_SIS_SrvInfo) + 2 * sizeof(DWORD) +
+                                  (size_t)((char *)pMPAWork - pMPAStart));
+  (*pMPAWork++) = SISInfo.dwTAddrOffset; /**< 5. Set type info section head
+                                            offset in the MPA memory segment */
+
+  (*pMPAWork) = 0; /**< 6. Set server info size to zero */
+
+  pMPAWork = (DWORD *)(pMPAStart + SISInfo.dwTAddrOffset);
+  /**< Jump over dwTListHeadOffset and dwTListSize */
+  SISInfo.dwTListHeadOffset = SISInfo.dwTAddrOffset + (DWORD)(2 * sizeof(DWORD));
+  (*pMPAWork++) = SISInfo.dwTListHeadOffset; /**< 7. Set type list head offset
+                                                     in the MPA memory segment */
+
+  (*pMPAWork) = 0; /**< 8. Set type list size to zero */
+
+  *((DWORD *)(pMPAStart + nIdxOffset)) = dwSidBuckets; /**< 9. Set sid index bucket numbers */
+  *((DWORD *)(pMPAStart + nTypeIdxOffset)) = dwTypeBuckets; /**< 10. Set type index bucket
+                                                                  numbers, all buckets are
+                                                                  empty as they are zeroed */
+  if (dwStatStripes > 0) { /**< 11. Set up traffic counters and their flag */
+    StatInit(pMPAStart, nStatOffset, dwStatStripes, dwStatTypeSlots);
+  }
+  /** 12. Seed generation with current time, so that processes which have
+   *      mapped the file before it was recreated still see a change */
+  *((DWORD *)(pMPAStart + nGenOffset)) = (DWORD)time(NULL);
+  GetSISInfo(pMPAStart, &SISInfo);
+  SidIndexClear(&SISInfo); /**< 13. Mark all buckets of sid index empty */
+  (*SISInfo.pdwSrvFree) = MPA_INDEX_NONE; /**< 14. Free lists are empty */
+  (*SISInfo.pdwTypeFree) = MPA_INDEX_NONE;
   //}}}
 
+  munmap(pMPAStart, nSizeOfArea);
   return 0;
 
 error:
-  if (fp) {
-    fclose(fp);
-  }
   return -1;
 } //}}}
 
 DLL_PUBLIC char *MPA_SIS_Init(const char *pszFileName) { //{{{
-  int fd = -1;
-  DWORD dw = 0;
-  char *shmPtr = NULL;
-
-  /**< Open queue information memory map file */
-  fd = open(pszFileName, O_RDWR | O_CLOEXEC, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
-  check(fd != -1, "Open memory map file error");
+  return MPA_SIS_InitEx(pszFileName, 0);
+} //}}}
 
-  read(fd, &dw, sizeof(DWORD)); /**< Get its size stored in head */
-  check(dw > 0, "Invalid memory map file format");
+DLL_PUBLIC char *MPA_SIS_InitEx(const char *pszFileName, int nFlags) { //{{{
+  char *shmPtr = NULL;
+  MPA_SISInfo SISInfo;
 
-  lseek(fd, 0, SEEK_SET); /**< Reallocate offset to file head */
-  /**< Map file to memory */
-  shmPtr = mmap(NULL, (size_t)dw, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  check(shmPtr != MAP_FAILED, "Map file to memory failed");
+  shmPtr = MapFile(pszFileName, nFlags);
+  check(shmPtr, "Cannot map memory map file[%s]", pszFileName);
 
-  close(fd);
+  GetSISInfo(shmPtr, &SISInfo);
+  check(SISInfo.dwVersion == MPA_SIS_VERSION,
+        "Memory map file[%s] is of version %u, upgrade it by 'mpaadm %s upgrade'", pszFileName,
+        SISInfo.dwVersion, pszFileName);
   return shmPtr; /**< Return memory head address */
 
 error:
-  if (fd > 0) {
-    close(fd);
+  if (shmPtr) {
+    munmap(shmPtr, SISInfo.dwTotalSize);
   }
   return NULL;
 } //}}}
 
+static int UpgradeFile(const char *pszFileName) { //{{{
+  int n = 0;
+  DWORD i = 0;
+  char szTmpName[PATH_MAX];
+  char *pOldStart = NULL, *pMPAStart = NULL;
+  struct stat st;
+  MPA_SISInfo SISInfo;
+  MPA_SISInfoV1 OldInfo;
+  MPA_SIS_TypeInfo *pTypeInfo = NULL;
+
+  check(stat(pszFileName, &st) == 0, "Cannot stat memory map file[%s]", pszFileName);
+  pOldStart = MapFile(pszFileName, 0);
+  check(pOldStart, "Cannot map memory map file[%s]", pszFileName);
+
+  GetSISInfo(pOldStart, &SISInfo);
+  if (SISInfo.dwVersion == MPA_SIS_VERSION) {
+    trace("Memory map file[%s] is already of version %d", pszFileName, MPA_SIS_VERSION);
+    munmap(pOldStart, SISInfo.dwTotalSize);
+    return 0;
+  }
+  check(GetSISInfoV1(pOldStart, (size_t)st.st_size, &OldInfo) == 0,
+        "Invalid memory map file[%s]", pszFileName);
+
+  n = snprintf(szTmpName, sizeof(szTmpName), "%s.upgrade", pszFileName);
+  check(n > 0 && (size_t)n < sizeof(szTmpName), "File name[%s] is too long", pszFileName);
+  check(MPA_SIS_Create(szTmpName, OldInfo.wMaxSvrInfo, OldInfo.wMaxTypeInfo) == 0,
+        "Cannot create memory map file[%s]", szTmpName);
+  pMPAStart = MPA_SIS_Init(szTmpName);
+  check(pMPAStart, "Cannot map memory map file[%s]", szTmpName);
+
+  /** Nobody else maps the new file yet, so no sequence is needed. Server
+   *  infos are copied as they are, message queues are left untouched. */
+  GetSISInfo(pMPAStart, &SISInfo);
+  for (i = 0; i < (*OldInfo.pwSrvInfoSize); i++) {
+    memcpy(SISInfo.pServerInfos + i, OldInfo.pServerInfos + i, sizeof(MPA_SIS_SrvInfo));
+    SISInfo.pdwSidKeys[i] = (SISInfo.pServerInfos + i)->dwSid;
+    SidIndexInsert(&SISInfo, (SISInfo.pServerInfos + i)->dwSid, (mpa_index_t)i);
+    (*SISInfo.pdwSrvInfoSize)++;
+  }
+  for (i = 0; i < (*OldInfo.pwTListSize); i++) {
+    check((OldInfo.pTypeInfos + i)->wSidIndex < (*OldInfo.pwSrvInfoSize),
+          "Invalid server index of type info[%u]", i);
+    pTypeInfo = SISInfo.pTypeInfos + i;
+    pTypeInfo->dwType = (OldInfo.pTypeInfos + i)->dwType;
+    SISInfo.pdwTypeKeys[i] = pTypeInfo->dwType;
+    pTypeInfo->dwSidIndex = (OldInfo.pTypeInfos + i)->wSidIndex;
+    (*SISInfo.pdwTListSize)++;
+  }
+  TypeIndexRebuild(&SISInfo);
+  BumpGeneration(&SISInfo);
+
+  check(msync(pMPAStart, SISInfo.dwTotalSize, MS_SYNC) == 0, "Cannot sync memory map file[%s]",
+        szTmpName);
+  check(rename(szTmpName, pszFileName) == 0, "Cannot rename [%s] to [%s]", szTmpName,
+        pszFileName);
+  trace("Memory map file[%s] upgraded to version %d.\n"
+        ">  [%u] server info(s), [%u] type info(s).",
+        pszFileName, MPA_SIS_VERSION, (*SISInfo.pdwSrvInfoSize), (*SISInfo.pdwTListSize));
+  munmap(pMPAStart, SISInfo.dwTotalSize);
+  munmap(pOldStart, OldInfo.dwTotalSize);
+  return 0;
+
+error:
+  if (pMPAStart) {
+    munmap(pMPAStart, SISInfo.dwTotalSize);
+    unlink(szTmpName);
+  }
+  if (pOldStart) {
+    munmap(pOldStart, *((DWORD *)pOldStart));
+  }
+  return -1;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_Upgrade(const char *pszFileName) { //{{{
+  int fd = AdminLock(pszFileName), nRetCode = -1;
+
+  if (fd != -1) {
+    nRetCode = UpgradeFile(pszFileName);
+    AdminUnlock(fd);
+  }
+  return nRetCode;
+} //}}}
+
 DLL_PUBLIC int MPA_SIS_SInfoAdd(const char *pMPAStart, DWORD sid, key_t qkey,
                                 DWORD qtype) { //{{{
+  int nRetCode = -1;
+  MPA_SISInfo SISInfo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SeqWriteLive(&SISInfo) != 0) {
+    return MPA_SIS_ERR_RETIRED;
+  }
+  if ((nRetCode = AddServerInfo(&SISInfo, sid, qkey, qtype, 0, True)) == 0) {
+    BumpGeneration(&SISInfo);
+  }
+  SeqWriteEnd(&SISInfo);
+  return nRetCode;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_SInfoModify(const char *pMPAStart, DWORD sid, key_t qkey,
+                                   DWORD qtype) { //{{{
   int index = -1;
   int qid = -1;
   MPA_SISInfo SISInfo;
   MPA_SIS_SrvInfo *pSvrInfo = NULL;
 
   GetSISInfo(pMPAStart, &SISInfo);
-  check((*SISInfo.pwSrvInfoSize) < SISInfo.wMaxSvrInfo, "Maximum server info number[%d] reached",
-        SISInfo.wMaxSvrInfo);
-
+  if (SeqWriteLive(&SISInfo) != 0) {
+    return MPA_SIS_ERR_RETIRED;
+  }
   index = FindServerInfo(&SISInfo, sid);
-  check(index == -1, "Server info[%d] already exists", sid);
+  check(index >= 0, "Server info[%d] does not exist", sid);
 
   qid = MsqCreate(qkey, C_MsqRW);
   check(qid >= 0, "Cannot create message queue[qkey=%d]", qkey);
 
-  pSvrInfo = SISInfo.pServerInfos + (*SISInfo.pwSrvInfoSize);
-  pSvrInfo->dwSid = sid;
+  pSvrInfo = SISInfo.pServerInfos + index;
   pSvrInfo->dwQkey = qkey;
   pSvrInfo->dwQid = qid;
   pSvrInfo->dwQtype = qtype;
-  (*SISInfo.pwSrvInfoSize)++;
+  BumpGeneration(&SISInfo);
+  SeqWriteEnd(&SISInfo);
   return 0;
 
 error:
+  SeqWriteEnd(&SISInfo);
   return -1;
 } //}}}
 
-DLL_PUBLIC int MPA_SIS_SInfoModify(const char *pMPAStart, DWORD sid, key_t qkey,
-                                   DWORD qtype) { //{{{
+DLL_PUBLIC int MPA_SIS_SInfoSetGroup(const char *pMPAStart, DWORD sid, DWORD gid) { //{{{
   int index = -1;
-  int qid = -1;
   MPA_SISInfo SISInfo;
-  MPA_SIS_SrvInfo *pSvrInfo = NULL;
 
   GetSISInfo(pMPAStart, &SISInfo);
+  check(SISInfo.pdwGroupKeys, "Segment has no server groups");
+  if (SeqWriteLive(&SISInfo) != 0) {
+    return MPA_SIS_ERR_RETIRED;
+  }
   index = FindServerInfo(&SISInfo, sid);
   check(index >= 0, "Server info[%d] does not exist", sid);
 
-  qid = MsqCreate(qkey, C_MsqRW);
-  check(qid >= 0, "Cannot create message queue[qkey=%d]", qkey);
-
-  pSvrInfo = SISInfo.pServerInfos + index;
-  pSvrInfo->dwQkey = qkey;
-  pSvrInfo->dwQid = qid;
-  pSvrInfo->dwQtype = qtype;
+  if (SISInfo.pdwGroupKeys[index] != gid) {
+    SISInfo.pdwGroupKeys[index] = gid;
+    BumpGeneration(&SISInfo);
+  }
+  SeqWriteEnd(&SISInfo);
   return 0;
 
 error:
+  if (SISInfo.pdwGroupKeys) {
+    SeqWriteEnd(&SISInfo);
+  }
   return -1;
 } //}}}
 
 DLL_PUBLIC int MPA_SIS_SInfoDelLast(const char *pMPAStart) { //{{{
+  DWORD i;
   MPA_SISInfo SISInfo;
+  mpa_index_t index;
+  MPA_SIS_TypeInfo *pTypeInfo = NULL;
 
   GetSISInfo(pMPAStart, &SISInfo);
-  if ((*SISInfo.pwSrvInfoSize) > 0) {
-    (*SISInfo.pwSrvInfoSize)--;
+  if (SeqWriteLive(&SISInfo) != 0) {
+    return MPA_SIS_ERR_RETIRED;
   }
+  ServerSlotTrim(&SISInfo);
+  if ((*SISInfo.pdwSrvInfoSize) > 0) {
+    index = (*SISInfo.pdwSrvInfoSize) - 1;
+    /** Same as MPA_SIS_SInfoDelete(), type infos must not be left pointing
+     *  to a free slot */
+    for (i = 0, pTypeInfo = SISInfo.pTypeInfos; i < (*SISInfo.pdwTListSize); i++, pTypeInfo++) {
+      check(pTypeInfo->dwSidIndex != index, "Server info[%u] is used by type info[%u:%u]",
+            (SISInfo.pServerInfos + index)->dwSid, pTypeInfo->dwType,
+            (SISInfo.pServerInfos + index)->dwSid);
+    }
+    SidIndexRemove(&SISInfo, (SISInfo.pServerInfos + index)->dwSid);
+    ServerSlotFree(&SISInfo, index);
+    BumpGeneration(&SISInfo);
+  }
+  SeqWriteEnd(&SISInfo);
   return 0;
+
+error:
+  SeqWriteEnd(&SISInfo);
+  return -1;
 } //}}}
 
-DLL_PUBLIC int MPA_SIS_TInfoAdd(const char *pMPAStart, DWORD type, DWORD sid) { //{{{
-  int index = 0;
+DLL_PUBLIC int MPA_SIS_SInfoDelete(const char *pMPAStart, DWORD sid) { //{{{
+  int index = -1;
+  DWORD i;
   MPA_SISInfo SISInfo;
   MPA_SIS_TypeInfo *pTypeInfo = NULL;
 
   GetSISInfo(pMPAStart, &SISInfo);
-  check((*SISInfo.pwTListSize) < SISInfo.wMaxTypeInfo, "Maximum type info number[%d] reached",
-        SISInfo.wMaxTypeInfo);
-
+  if (SeqWriteLive(&SISInfo) != 0) {
+    return MPA_SIS_ERR_RETIRED;
+  }
   index = FindServerInfo(&SISInfo, sid);
-  check(index >= 0, "Cannot find server info[%d]", sid);
+  check(index >= 0, "Server info[%d] does not exist", sid);
 
-  pTypeInfo = SISInfo.pTypeInfos + (*SISInfo.pwTListSize);
-  pTypeInfo->dwType = type;
-  pTypeInfo->wSidIndex = (WORD)index;
-  (*SISInfo.pwTListSize)++;
+  for (i = 0, pTypeInfo = SISInfo.pTypeInfos; i < (*SISInfo.pdwTListSize); i++, pTypeInfo++) {
+    check(pTypeInfo->dwSidIndex != (DWORD)index, "Server info[%d] is used by type info[%d:%d]",
+          sid, pTypeInfo->dwType, sid);
+  }
+
+  SidIndexRemove(&SISInfo, sid);
+  ServerSlotFree(&SISInfo, (mpa_index_t)index);
+  BumpGeneration(&SISInfo);
+  SeqWriteEnd(&SISInfo);
   return 0;
 
 error:
+  SeqWriteEnd(&SISInfo);
   return -1;
 } //}}}
 
+DLL_PUBLIC int MPA_SIS_TInfoAdd(const char *pMPAStart, DWORD type, DWORD sid) { //{{{
+  MPA_SISInfo SISInfo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SeqWriteLive(&SISInfo) != 0) {
+    return MPA_SIS_ERR_RETIRED;
+  }
+  if (AddTypeInfo(&SISInfo, type, sid) != 0) {
+    SeqWriteEnd(&SISInfo);
+    return -1;
+  }
+  TypeIndexInsert(&SISInfo, type, (mpa_index_t)FindServerInfo(&SISInfo, sid));
+  BumpGeneration(&SISInfo);
+  SeqWriteEnd(&SISInfo);
+  return 0;
+} //}}}
+
 DLL_PUBLIC int MPA_SIS_TInfoModify(const char *pMPAStart, DWORD type, DWORD sid, DWORD new_type,
                                    DWORD new_sid) { //{{{
   int type_index = 0, new_sid_index = 0;
@@ -286,6 +630,9 @@ DLL_PUBLIC int MPA_SIS_TInfoModify(const char *pMPAStart, DWORD type, DWORD sid,
   MPA_SIS_TypeInfo *pTypeInfo = NULL;
 
   GetSISInfo(pMPAStart, &SISInfo);
+  if (SeqWriteLive(&SISInfo) != 0) {
+    return MPA_SIS_ERR_RETIRED;
+  }
   type_index = FindTypeInfoBySid(&SISInfo, new_type, new_sid);
   check(type_index < 0, "Type info[%d:%d] already exists", new_type, new_sid);
   type_index = FindTypeInfoBySid(&SISInfo, type, sid);
@@ -294,10 +641,15 @@ DLL_PUBLIC int MPA_SIS_TInfoModify(const char *pMPAStart, DWORD type, DWORD sid,
   check(new_sid_index >= 0, "Cannot find server info[%d]", new_sid);
   pTypeInfo = SISInfo.pTypeInfos + type_index;
   pTypeInfo->dwType = new_type;
-  pTypeInfo->wSidIndex = (WORD)new_sid_index;
+  SISInfo.pdwTypeKeys[type_index] = new_type;
+  pTypeInfo->dwSidIndex = (DWORD)new_sid_index;
+  TypeIndexRebuild(&SISInfo);
+  BumpGeneration(&SISInfo);
+  SeqWriteEnd(&SISInfo);
   return 0;
 
 error:
+  SeqWriteEnd(&SISInfo);
   return -1;
 } //}}}
 
@@ -305,136 +657,1104 @@ DLL_PUBLIC int MPA_SIS_TInfoDelLast(const char *pMPAStart) { //{{{
   MPA_SISInfo SISInfo;
 
   GetSISInfo(pMPAStart, &SISInfo);
-  if ((*SISInfo.pwTListSize) > 0) {
-    (*SISInfo.pwTListSize)--;
+  if (SeqWriteLive(&SISInfo) != 0) {
+    return MPA_SIS_ERR_RETIRED;
   }
+  TypeSlotTrim(&SISInfo);
+  if ((*SISInfo.pdwTListSize) > 0) {
+    TypeSlotFree(&SISInfo, (*SISInfo.pdwTListSize) - 1);
+    TypeIndexRebuild(&SISInfo);
+    BumpGeneration(&SISInfo);
+  }
+  SeqWriteEnd(&SISInfo);
   return 0;
 } //}}}
 
-DLL_PUBLIC void MPA_SIS_Display(const char *pMPAStart) { //{{{
+DLL_PUBLIC int MPA_SIS_TInfoDelete(const char *pMPAStart, DWORD type, DWORD sid) { //{{{
+  int type_index = 0;
+  MPA_SISInfo SISInfo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SeqWriteLive(&SISInfo) != 0) {
+    return MPA_SIS_ERR_RETIRED;
+  }
+  type_index = FindTypeInfoBySid(&SISInfo, type, sid);
+  check(type_index >= 0, "Type info[%d:%d] does not exist", type, sid);
+
+  TypeSlotFree(&SISInfo, (mpa_index_t)type_index);
+  TypeIndexRebuild(&SISInfo);
+  BumpGeneration(&SISInfo);
+  SeqWriteEnd(&SISInfo);
+  return 0;
 
+error:
+  SeqWriteEnd(&SISInfo);
+  return -1;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_Compact(const char *pMPAStart, size_t nBatch) { //{{{
+  size_t n = 0, nMoved = 0;
   MPA_SISInfo SISInfo;
 
+  if (nBatch == 0) {
+    nBatch = MPA_COMPACT_BATCH;
+  }
   GetSISInfo(pMPAStart, &SISInfo);
-  DisplaySISInfo(&SISInfo);
+  /** Every batch is a short write of its own, readers retry at most one
+   *  batch and the CPU is given up between batches */
+  do {
+    if (SeqWriteLive(&SISInfo) != 0) {
+      return MPA_SIS_ERR_RETIRED;
+    }
+    for (n = 0; n < nBatch && CompactServer(&SISInfo) == True; n++) {
+    }
+    for (; n < nBatch && CompactType(&SISInfo) == True; n++) {
+    }
+    if (n > 0) {
+      TypeIndexRebuild(&SISInfo);
+      BumpGeneration(&SISInfo);
+    }
+    SeqWriteEnd(&SISInfo);
+    nMoved += n;
+    sched_yield();
+  } while (n == nBatch);
+
+  /** Type counter slots are given back only when a type found none, under
+   *  a write so that types are not routed anew meanwhile */
+  if (SISInfo.pStats && __atomic_load_n(SISInfo.pdwStatFull, __ATOMIC_ACQUIRE) != 0) {
+    if (SeqWriteLive(&SISInfo) != 0) {
+      return MPA_SIS_ERR_RETIRED;
+    }
+    n = StatCompact(&SISInfo);
+    SeqWriteEnd(&SISInfo);
+    trace("[%zu] type traffic counter slot(s) given back.", n);
+  }
+  return (int)nMoved;
 } //}}}
 
-DLL_PUBLIC int MPA_SIS_End(const char *pMPAStart, Boolean bRelease) { //{{{
+DLL_PUBLIC int MPA_SIS_WaitChange(const char *pMPAStart, DWORD *pdwGeneration, //{{{
+                                  int nTimeout) {
+  int nRetCode = 0;
+  DWORD dwGeneration;
   MPA_SISInfo SISInfo;
+  struct timespec deadline, now, timeout;
 
   GetSISInfo(pMPAStart, &SISInfo);
-  if (bRelease == True) {
-    int i = 0, numOfServer = 0;
-    MPA_SIS_SrvInfo *pSvrInfo;
+  check(SISInfo.pdwGeneration, "Segment of version %u has no generation counter",
+        SISInfo.dwVersion);
+  if (nTimeout >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += nTimeout / 1000;
+    deadline.tv_nsec += (long)(nTimeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
 
-    numOfServer = (*SISInfo.pwSrvInfoSize);
-    for (i = 0; i < numOfServer; i++) {
-      pSvrInfo = SISInfo.pServerInfos + i;
-      MsqClose(pSvrInfo->dwQid);
-      (*SISInfo.pwSrvInfoSize)--;
+  /** Wakeups without a change, by signals or by a writer of the same value,
+   *  wait again for the rest of the timeout */
+  while ((dwGeneration = __atomic_load_n(SISInfo.pdwGeneration, __ATOMIC_ACQUIRE)) ==
+         (*pdwGeneration)) {
+    if (nTimeout >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      timeout.tv_sec = deadline.tv_sec - now.tv_sec;
+      timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (timeout.tv_nsec < 0) {
+        timeout.tv_sec--;
+        timeout.tv_nsec += 1000000000L;
+      }
+      if (timeout.tv_sec < 0) {
+        return 1;
+      }
+    }
+    nRetCode = WaitGeneration(SISInfo.pdwGeneration, dwGeneration,
+                              (nTimeout >= 0) ? &timeout : NULL);
+    check(nRetCode >= 0, "Cannot wait on generation counter, errno[%d]", errno);
+    if (nRetCode == 1) {
+      return 1;
     }
-  } else {
-    (*SISInfo.pwSrvInfoSize) = 0;
   }
-  (*SISInfo.pwTListSize) = 0;
+  (*pdwGeneration) = dwGeneration;
   return 0;
-} //}}}
 
-DLL_PUBLIC int MPA_SIS_LoadConfig(const char *pszSHMFileName, const char *pszFileName) { //{{{
-  return LoadFromFile(pszSHMFileName, pszFileName);
+error:
+  return -1;
 } //}}}
 
-DLL_PUBLIC int MPA_SIS_ExportConfig(const char *pMPAStart, const char *pszFileName) { //{{{
+DLL_PUBLIC void MPA_SIS_Display(const char *pMPAStart) { //{{{
+
   MPA_SISInfo SISInfo;
 
   GetSISInfo(pMPAStart, &SISInfo);
-  return DumpSISInfoToFile(&SISInfo, pszFileName);
+  DisplaySISInfo(&SISInfo);
 } //}}}
 
-DLL_PUBLIC void GetSISInfo(const char *pMPAStart, MPA_SISInfo *pSISInfo) { //{{{
-  WORD *pMPAWork = (WORD *)(pMPAStart + sizeof(DWORD));
+DLL_PUBLIC void MPA_SIS_StatServer(const MPA_SISInfo *pSISInfo, mpa_index_t index, //{{{
+                                   int nEvent, size_t nBytes) {
+  if (pSISInfo->pStats == NULL || index >= pSISInfo->dwMaxSvrInfo) {
+    return;
+  }
+  StatAdd(StatStripe(pSISInfo) + index, nEvent, nBytes);
+} //}}}
 
-  pSISInfo->dwTotalSize = *((DWORD *)pMPAStart);
-  pSISInfo->wMaxSvrInfo = (*pMPAWork++);
-  pSISInfo->wMaxTypeInfo = (*pMPAWork++);
-  pSISInfo->wSAddrOffset = (*pMPAWork++);
-  pSISInfo->wTAddrOffset = (*pMPAWork++);
-  pSISInfo->pwSrvInfoSize = pMPAWork++;
-  pSISInfo->pServerInfos = ((MPA_SIS_SrvInfo *)pMPAWork);
-  pMPAWork = (WORD *)(pMPAStart + pSISInfo->wTAddrOffset);
-  pSISInfo->wTListHeadOffset = (*pMPAWork++);
-  pSISInfo->pwTListSize = pMPAWork;
-  pSISInfo->pTypeInfos = (MPA_SIS_TypeInfo *)(pMPAStart + pSISInfo->wTListHeadOffset);
+DLL_PUBLIC void MPA_SIS_StatType(const MPA_SISInfo *pSISInfo, DWORD type, int nEvent, //{{{
+                                 size_t nBytes) {
+  mpa_index_t slot;
+
+  if (pSISInfo->pStats == NULL || type == MPA_SID_NONE ||
+      (slot = StatTypeSlot(pSISInfo, type, True)) == MPA_INDEX_NONE) {
+    return;
+  }
+  StatAdd(StatStripe(pSISInfo) + pSISInfo->dwMaxSvrInfo + slot, nEvent, nBytes);
 } //}}}
 
-DLL_PUBLIC int MPA_GetServerInfo(DWORD sid, MPA_SIS_SrvInfo *pSrvInfo,
-                                 const char *pMPAStart) { //{{{
-  int index = 0;
+DLL_PUBLIC DWORD *MPA_SIS_Doorbell(const MPA_SISInfo *pSISInfo, mpa_index_t index) { //{{{
+  if (pSISInfo->pStats == NULL || index >= pSISInfo->dwMaxSvrInfo) {
+    return NULL;
+  }
+  return pSISInfo->pdwDoorbells + (size_t)index * MPA_DOORBELL_STRIDE;
+} //}}}
+
+DLL_PUBLIC void MPA_SIS_RingDoorbell(DWORD *pdwDoorbell) { //{{{
+  if (__atomic_fetch_add(pdwDoorbell, 2, __ATOMIC_ACQ_REL) & 1) {
+    __atomic_and_fetch(pdwDoorbell, ~1U, __ATOMIC_RELAXED);
+    WakeWatchers(pdwDoorbell);
+  }
+} //}}}
+
+DLL_PUBLIC DWORD MPA_SIS_ArmDoorbell(DWORD *pdwDoorbell) { //{{{
+  return __atomic_or_fetch(pdwDoorbell, 1, __ATOMIC_ACQ_REL);
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_WaitDoorbell(DWORD *pdwDoorbell, DWORD dwSeen, //{{{
+                                    const struct timespec *pTimeout) {
+  return WaitGeneration(pdwDoorbell, dwSeen, pTimeout);
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_GetServerStat(const char *pMPAStart, DWORD sid, //{{{
+                                     MPA_SIS_Stat *pStat) {
+  int index = -1;
+  DWORD dwSeq;
   MPA_SISInfo SISInfo;
 
   GetSISInfo(pMPAStart, &SISInfo);
-  if ((index = FindServerInfo(&SISInfo, sid)) == -1) {
-    return -2;
+  if (SISInfo.pStats == NULL) {
+    return -1;
   }
-  memcpy(pSrvInfo, SISInfo.pServerInfos + index, sizeof(MPA_SIS_SrvInfo));
-  return index;
+  do {
+    dwSeq = SeqReadBegin(&SISInfo);
+    index = FindServerInfo(&SISInfo, sid);
+  } while (SeqReadRetry(&SISInfo, dwSeq) == True);
+  if (index < 0) {
+    return -1;
+  }
+  StatSum(&SISInfo, (size_t)index, pStat);
+  return 0;
 } //}}}
 
-DLL_PUBLIC int MPA_CheckMsgQ(key_t qkey) {
-  int nRetCode = MsqGet(qkey, IPC_EXCL);
-  if (nRetCode < 0) {
-    int err = errno;
-    if (err == ENOENT) {
-      return -1;
-    }
+DLL_PUBLIC int MPA_SIS_GetTypeStat(const char *pMPAStart, DWORD type, //{{{
+                                   MPA_SIS_Stat *pStat) {
+  mpa_index_t slot;
+  MPA_SISInfo SISInfo;
 
-    return -2;
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SISInfo.pStats == NULL || type == MPA_SID_NONE ||
+      (slot = StatTypeSlot(&SISInfo, type, False)) == MPA_INDEX_NONE) {
+    return -1;
   }
+  StatSum(&SISInfo, SISInfo.dwMaxSvrInfo + slot, pStat);
   return 0;
-}
+} //}}}
 
-DLL_PUBLIC size_t MPA_CheckQKey(key_t qkey, const char *pMPAStart) {
-  size_t count = 0, i;
+DLL_PUBLIC void MPA_SIS_DisplayStat(const char *pMPAStart) { //{{{
+  DWORD i;
   MPA_SISInfo SISInfo;
-  MPA_SIS_SrvInfo *pServerInfo;
+  MPA_SIS_Stat Stat;
 
   GetSISInfo(pMPAStart, &SISInfo);
-  for (i = 0, pServerInfo = SISInfo.pServerInfos; i < (size_t)(*SISInfo.pwSrvInfoSize);
-       i++, pServerInfo++) {
-    if (pServerInfo->dwQkey == qkey) {
-      count++;
+  if (SISInfo.pStats == NULL) {
+    printf("共享内存没有流量统计信息\n");
+    return;
+  }
+  printf("+++++++++++++++++++++++++++++++++++++++++++++\n");
+  printf("统计分段数:%u\n", SISInfo.dwStatStripes);
+  if ((*SISInfo.pdwStatFull) != 0) {
+    printf("类型统计槽位已满, 部分类型未统计, 请执行compact或重新加载配置\n");
+  }
+  printf("|系统标识号|  发送消息数  |  发送字节数  |  接收消息数  |  接收字节数  |"
+         " 失败次数 | 中断次数 |\n");
+  printf("|----------|--------------|--------------|--------------|--------------|"
+         "----------|----------|\n");
+  for (i = 0; i < (*SISInfo.pdwSrvInfoSize); i++) {
+    if ((SISInfo.pServerInfos + i)->dwSid == MPA_SID_NONE) {
+      continue;
     }
+    StatSum(&SISInfo, i, &Stat);
+    printf("|%10u|%14llu|%14llu|%14llu|%14llu|%10llu|%10llu|\n",
+           (SISInfo.pServerInfos + i)->dwSid, Stat.qwSent, Stat.qwSentBytes, Stat.qwRecv,
+           Stat.qwRecvBytes, Stat.qwErrors, Stat.qwIntr);
   }
+  printf("|  类型号  |  发送消息数  |  发送字节数  |  接收消息数  |  接收字节数  |"
+         " 失败次数 | 中断次数 |\n");
+  printf("|----------|--------------|--------------|--------------|--------------|"
+         "----------|----------|\n");
+  for (i = 0; i < SISInfo.dwStatTypeSlots; i++) {
+    if (SISInfo.pdwStatTypes[i] == MPA_SID_NONE) {
+      continue;
+    }
+    StatSum(&SISInfo, SISInfo.dwMaxSvrInfo + i, &Stat);
+    printf("|%10u|%14llu|%14llu|%14llu|%14llu|%10llu|%10llu|\n", SISInfo.pdwStatTypes[i],
+           Stat.qwSent, Stat.qwSentBytes, Stat.qwRecv, Stat.qwRecvBytes, Stat.qwErrors,
+           Stat.qwIntr);
+  }
+  printf("+++++++++++++++++++++++++++++++++++++++++++++\n");
+} //}}}
 
-  return count;
-}
-
-DLL_PUBLIC int MPA_GetServerInfoByIndex(mpa_index_t index, MPA_SIS_SrvInfo *pSrvInfo,
-                                        const char *pMPAStart) { //{{{
+DLL_PUBLIC int MPA_SIS_End(const char *pMPAStart, Boolean bRelease) { //{{{
   MPA_SISInfo SISInfo;
 
   GetSISInfo(pMPAStart, &SISInfo);
-  memcpy(pSrvInfo, SISInfo.pServerInfos + index, sizeof(MPA_SIS_SrvInfo));
+  SeqWriteBegin(&SISInfo);
+  if (bRelease == True) {
+    int i = 0, numOfServer = 0;
+    MPA_SIS_SrvInfo *pSvrInfo;
+
+    numOfServer = (*SISInfo.pdwSrvInfoSize);
+    for (i = 0; i < numOfServer; i++) {
+      pSvrInfo = SISInfo.pServerInfos + i;
+      if (pSvrInfo->dwSid != MPA_SID_NONE) {
+        MsqClose(pSvrInfo->dwQid);
+      }
+      (*SISInfo.pdwSrvInfoSize)--;
+    }
+  } else {
+    (*SISInfo.pdwSrvInfoSize) = 0;
+  }
+  SidIndexClear(&SISInfo);
+  (*SISInfo.pdwTListSize) = 0;
+  (*SISInfo.pdwSrvFree) = MPA_INDEX_NONE;
+  (*SISInfo.pdwTypeFree) = MPA_INDEX_NONE;
+  TypeIndexRebuild(&SISInfo);
+  BumpGeneration(&SISInfo);
+  SeqWriteEnd(&SISInfo);
   return 0;
 } //}}}
 
-DLL_PUBLIC int MPA_GetTypeInfo(mpa_index_t index_, DWORD type, MPA_SIS_TypeInfo *pTypeInfo,
-                               const char *pMPAStart) { //{{{
-  int index = 0;
-  MPA_SISInfo SISInfo;
+static int LoadConfigFile(const char *pszSHMFileName, const char *pszFileName) { //{{{
+  int n = 0;
+  char szTmpName[PATH_MAX];
+
+  n = snprintf(szTmpName, sizeof(szTmpName), "%s.reload", pszSHMFileName);
+  check(n > 0 && (size_t)n < sizeof(szTmpName), "File name[%s] is too long", pszSHMFileName);
+  n = -1; /**< The sibling file is removed on error from now on */
+  check(LoadFromFile(szTmpName, pszFileName, False) == 0, "Cannot load configuration file[%s]",
+        pszFileName);
+  check(PublishSegment(szTmpName, pszSHMFileName) == 0, "Cannot publish memory map file[%s]",
+        pszSHMFileName);
+  return 0;
 
-  GetSISInfo(pMPAStart, &SISInfo);
-  if ((index = FindTypeInfo(index_, &SISInfo, type)) == -1) {
-    return -2;
+error:
+  if (n == -1) {
+    unlink(szTmpName);
   }
-  memcpy(pTypeInfo, SISInfo.pTypeInfos + index, sizeof(MPA_SIS_TypeInfo));
-  return index;
+  return -1;
 } //}}}
 
-// Static functions {{{
-static int DumpSISInfoToFile(const MPA_SISInfo *pSISInfo,
-                             const char *pszFileName) { //{{{
-  int i;
+DLL_PUBLIC int MPA_SIS_LoadConfig(const char *pszSHMFileName, const char *pszFileName) { //{{{
+  int fd = AdminLock(pszSHMFileName), nRetCode = -1;
+
+  if (fd != -1) {
+    nRetCode = LoadConfigFile(pszSHMFileName, pszFileName);
+    AdminUnlock(fd);
+  }
+  return nRetCode;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_AdminLock(const char *pszSHMFileName) { //{{{
+  return AdminLock(pszSHMFileName);
+} //}}}
+
+DLL_PUBLIC void MPA_SIS_AdminUnlock(int fd) { //{{{
+  AdminUnlock(fd);
+} //}}}
+
+static int ApplyDiffFile(const char *pszSHMFileName, const char *pszFileName) { //{{{
+  int n = 0, nAdded = 0;
+  size_t nChanged = 0;
+  char szTmpName[PATH_MAX];
+  char *pMPAStart = NULL, *pNewStart = NULL;
+  unsigned char *pbAdd = NULL;
+  MPA_SISInfo SISInfo, NewInfo;
+  MPA_ConfigDiff Diff;
+
+  memset(&Diff, 0, sizeof(MPA_ConfigDiff));
+  n = snprintf(szTmpName, sizeof(szTmpName), "%s.diff", pszSHMFileName);
+  check(n > 0 && (size_t)n < sizeof(szTmpName), "File name[%s] is too long", pszSHMFileName);
+  pMPAStart = MapFile(pszSHMFileName, 0);
+  check(pMPAStart, "Cannot map memory map file[%s]", pszSHMFileName);
+  GetSISInfo(pMPAStart, &SISInfo);
+  check(SISInfo.dwVersion == MPA_SIS_VERSION,
+        "Memory map file[%s] is of version %u, upgrade it first", pszSHMFileName,
+        SISInfo.dwVersion);
+
+  /** The new configuration is loaded into a scratch segment without
+   *  message queues, which is compared with the live one by keys */
+  check(LoadFromFile(szTmpName, pszFileName, True) == 0, "Cannot load configuration file[%s]",
+        pszFileName);
+  pNewStart = MapFile(szTmpName, 0);
+  unlink(szTmpName);
+  check(pNewStart, "Cannot map memory map file[%s]", szTmpName);
+  GetSISInfo(pNewStart, &NewInfo);
+  if ((*NewInfo.pdwSrvInfoSize) > SISInfo.dwMaxSvrInfo ||
+      (*NewInfo.pdwTListSize) > SISInfo.dwMaxTypeInfo) {
+    /** The live segment is grown first and the difference applied to the
+     *  grown one */
+    munmap(pMPAStart, SISInfo.dwTotalSize);
+    pMPAStart = NULL;
+    check(GrowFile(pszSHMFileName,
+                       GrowCapacity(SISInfo.dwMaxSvrInfo, (*NewInfo.pdwSrvInfoSize)),
+                       GrowCapacity(SISInfo.dwMaxTypeInfo, (*NewInfo.pdwTListSize))) == 0,
+          "Cannot grow memory map file[%s] for [%u] server info(s) and [%u] type info(s)",
+          pszSHMFileName, (*NewInfo.pdwSrvInfoSize), (*NewInfo.pdwTListSize));
+    pMPAStart = MapFile(pszSHMFileName, 0);
+    check(pMPAStart, "Cannot map memory map file[%s]", pszSHMFileName);
+    GetSISInfo(pMPAStart, &SISInfo);
+  }
+  pbAdd = calloc((*NewInfo.pdwTListSize) + 1, 1);
+  check(pbAdd, "Out of memory");
+
+  /** Queues are created before the write, which only moves entries */
+  check(DiffQueues(&SISInfo, &NewInfo) == 0, "Cannot create message queues of file[%s]",
+        pszFileName);
+  SeqWriteBegin(&SISInfo);
+  DiffMarkTypes(&SISInfo, &NewInfo, pbAdd);
+  DiffRemove(&SISInfo, &NewInfo, &Diff);
+  nAdded = DiffAdd(&SISInfo, &NewInfo, pbAdd, &Diff);
+  nChanged = Diff.nSvrAdded + Diff.nSvrChanged + Diff.nSvrRemoved + Diff.nTypeAdded +
+             Diff.nTypeRemoved;
+  if (Diff.nTypeAdded + Diff.nTypeRemoved > 0) {
+    TypeIndexRebuild(&SISInfo);
+  }
+  if (nChanged > 0) {
+    BumpGeneration(&SISInfo);
+  }
+  SeqWriteEnd(&SISInfo);
+
+  trace("Applying [%s] to [%s]...Done.\n"
+        ">  Server info(s): [%zu] added, [%zu] changed, [%zu] removed.\n"
+        ">  Type info(s): [%zu] added, [%zu] removed.",
+        pszFileName, pszSHMFileName, Diff.nSvrAdded, Diff.nSvrChanged, Diff.nSvrRemoved,
+        Diff.nTypeAdded, Diff.nTypeRemoved);
+  /** The change is not rolled back, the segment is consistent with the
+   *  entries applied and the file can be applied again */
+  check(nAdded == 0, "Cannot add all entries of file[%s] to [%s]", pszFileName, pszSHMFileName);
+  free(pbAdd);
+  munmap(pNewStart, NewInfo.dwTotalSize);
+  munmap(pMPAStart, SISInfo.dwTotalSize);
+  return (int)nChanged;
+
+error:
+  free(pbAdd);
+  if (pNewStart) {
+    munmap(pNewStart, NewInfo.dwTotalSize);
+  }
+  if (pMPAStart) {
+    munmap(pMPAStart, SISInfo.dwTotalSize);
+  }
+  return -1;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_ApplyConfigDiff(const char *pszSHMFileName, //{{{
+                                       const char *pszFileName) {
+  int fd = AdminLock(pszSHMFileName), nRetCode = -1;
+
+  if (fd != -1) {
+    nRetCode = ApplyDiffFile(pszSHMFileName, pszFileName);
+    AdminUnlock(fd);
+  }
+  return nRetCode;
+} //}}}
+
+static int GrowFile(const char *pszSHMFileName, size_t nNumOfProcess, //{{{
+                    size_t nNumOfType) {
+  int n = 0, nTries = 0;
+  Boolean bLocked = False;
+  char szTmpName[PATH_MAX];
+  char *pMPAStart = NULL, *pNewStart = NULL;
+  DWORD dwSeq = 0;
+  MPA_SISInfo SISInfo, NewInfo;
+
+  n = snprintf(szTmpName, sizeof(szTmpName), "%s.grow", pszSHMFileName);
+  check(n > 0 && (size_t)n < sizeof(szTmpName), "File name[%s] is too long", pszSHMFileName);
+  pMPAStart = MapFile(pszSHMFileName, 0);
+  check(pMPAStart, "Cannot map memory map file[%s]", pszSHMFileName);
+  GetSISInfo(pMPAStart, &SISInfo);
+  check(SISInfo.dwVersion == MPA_SIS_VERSION,
+        "Memory map file[%s] is of version %u, upgrade it first", pszSHMFileName,
+        SISInfo.dwVersion);
+
+  if (nNumOfProcess == 0) {
+    nNumOfProcess = SISInfo.dwMaxSvrInfo;
+  }
+  if (nNumOfType == 0) {
+    nNumOfType = SISInfo.dwMaxTypeInfo;
+  }
+  check(nNumOfProcess >= SISInfo.dwMaxSvrInfo && nNumOfType >= SISInfo.dwMaxTypeInfo,
+        "Memory map file[%s] cannot shrink from [%u/%u] to [%zu/%zu]", pszSHMFileName,
+        SISInfo.dwMaxSvrInfo, SISInfo.dwMaxTypeInfo, nNumOfProcess, nNumOfType);
+  if (nNumOfProcess == SISInfo.dwMaxSvrInfo && nNumOfType == SISInfo.dwMaxTypeInfo) {
+    munmap(pMPAStart, SISInfo.dwTotalSize);
+    return 0;
+  }
+
+  n = -1; /**< The sibling file is removed on error from now on */
+  for (;;) {
+    check(MPA_SIS_Create(szTmpName, nNumOfProcess, nNumOfType) == 0,
+          "Cannot create memory map file[%s]", szTmpName);
+    pNewStart = MapFile(szTmpName, 0);
+    check(pNewStart, "Cannot map memory map file[%s]", szTmpName);
+    GetSISInfo(pNewStart, &NewInfo);
+
+    /** The segment is copied and synced like a reader, then writers wait
+     *  only for the rename. A copy a writer changed the segment under is
+     *  made again; after MPA_GROW_TRIES of them the copy is made in the
+     *  write, so no change is lost in between, and is not synced. */
+    if (++nTries > MPA_GROW_TRIES) {
+      SeqWriteBegin(&SISInfo);
+      bLocked = True;
+      GrowCopy(&SISInfo, &NewInfo);
+      break;
+    }
+    dwSeq = SeqReadBegin(&SISInfo);
+    GrowCopy(&SISInfo, &NewInfo);
+    check(msync(pNewStart, NewInfo.dwTotalSize, MS_SYNC) == 0,
+          "Cannot sync memory map file[%s]", szTmpName);
+    SeqWriteBegin(&SISInfo);
+    bLocked = True;
+    if (__atomic_load_n(SISInfo.pdwSeq, __ATOMIC_RELAXED) == dwSeq + 1) {
+      break;
+    }
+    SeqWriteEnd(&SISInfo);
+    bLocked = False;
+    munmap(pNewStart, NewInfo.dwTotalSize);
+    pNewStart = NULL;
+    unlink(szTmpName);
+  }
+  munmap(pNewStart, NewInfo.dwTotalSize);
+  pNewStart = NULL;
+  check(PublishSegment(szTmpName, pszSHMFileName) == 0, "Cannot publish memory map file[%s]",
+        pszSHMFileName);
+  SeqWriteEnd(&SISInfo);
+
+  trace("Memory map file[%s] grown from [%u/%u] to [%zu/%zu] server/type infos.",
+        pszSHMFileName, SISInfo.dwMaxSvrInfo, SISInfo.dwMaxTypeInfo, nNumOfProcess, nNumOfType);
+  munmap(pMPAStart, SISInfo.dwTotalSize);
+  return 0;
+
+error:
+  if (bLocked == True) {
+    SeqWriteEnd(&SISInfo);
+  }
+  if (pNewStart) {
+    munmap(pNewStart, NewInfo.dwTotalSize);
+  }
+  if (pMPAStart) {
+    munmap(pMPAStart, SISInfo.dwTotalSize);
+  }
+  if (n == -1) {
+    unlink(szTmpName);
+  }
+  return -1;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_Grow(const char *pszSHMFileName, size_t nNumOfProcess, //{{{
+                            size_t nNumOfType) {
+  int fd = AdminLock(pszSHMFileName), nRetCode = -1;
+
+  if (fd != -1) {
+    nRetCode = GrowFile(pszSHMFileName, nNumOfProcess, nNumOfType);
+    AdminUnlock(fd);
+  }
+  return nRetCode;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_CompileConfig(const char *pszImageFileName, //{{{
+                                     const char *pszFileName) {
+  int fd = -1;
+  char *pMPAStart = NULL;
+  DWORD dwFooter[2], dwRouteSize = 0, dwServers = 0, dwTypes = 0;
+  MPA_SISInfo SISInfo;
+
+  check(LoadFromFile(pszImageFileName, pszFileName, True) == 0,
+        "Cannot compile configuration file[%s]", pszFileName);
+  pMPAStart = MapFile(pszImageFileName, 0);
+  check(pMPAStart, "Cannot map image file[%s]", pszImageFileName);
+
+  /** Images of the same configuration are identical. They keep the routing
+   *  sections only, traffic counters and doorbells are laid out afresh by
+   *  MPA_SIS_LoadImage() */
+  GetSISInfo(pMPAStart, &SISInfo);
+  check(SISInfo.pdwGroupKeys, "Segment of image file[%s] has no group ids", pszImageFileName);
+  dwRouteSize = (DWORD)((char *)(SISInfo.pdwGroupKeys + SISInfo.dwMaxSvrInfo) - pMPAStart);
+  dwServers = (*SISInfo.pdwSrvInfoSize);
+  dwTypes = (*SISInfo.pdwTListSize);
+  (*SISInfo.pdwGeneration) = 0;
+  ((DWORD *)pMPAStart)[0] = dwRouteSize;
+  ((DWORD *)pMPAStart)[2] &= ~MPA_SIS_FEATURE_STATS;
+  dwFooter[0] = MPA_SIS_IMAGE_MAGIC;
+  dwFooter[1] = Crc32(pMPAStart, dwRouteSize);
+  munmap(pMPAStart, SISInfo.dwTotalSize);
+  pMPAStart = NULL;
+
+  fd = open(pszImageFileName, O_WRONLY | O_CLOEXEC);
+  check(fd != -1, "Cannot open image file[%s]", pszImageFileName);
+  check(ftruncate(fd, (off_t)dwRouteSize) == 0 &&
+            pwrite(fd, dwFooter, sizeof(dwFooter), (off_t)dwRouteSize) ==
+                (ssize_t)sizeof(dwFooter),
+        "Cannot write image file[%s]", pszImageFileName);
+  close(fd);
+  trace("Image file[%s] compiled, [%u] server info(s), [%u] type info(s), [%u] bytes.",
+        pszImageFileName, dwServers, dwTypes, dwRouteSize + (DWORD)sizeof(dwFooter));
+  return 0;
+
+error:
+  if (fd != -1) {
+    close(fd);
+  }
+  if (pMPAStart) {
+    munmap(pMPAStart, SISInfo.dwTotalSize);
+  }
+  unlink(pszImageFileName);
+  return -1;
+} //}}}
+
+static int LoadImageFile(const char *pszSHMFileName, const char *pszImageFileName) { //{{{
+  int fd = -1, n = 0, qid = -1;
+  key_t qkey = 0;
+  DWORD i = 0, dwStatStripes = 0, dwStatTypeSlots = 0;
+  size_t nRouteSize = 0, nSize = 0;
+  char szTmpName[PATH_MAX];
+  char *pImage = MAP_FAILED, *pMPAStart = NULL;
+  struct stat st;
+  MPA_SISInfo SISInfo;
+  MPA_SIS_SrvInfo *pSvrInfo = NULL;
+
+  n = snprintf(szTmpName, sizeof(szTmpName), "%s.reload", pszSHMFileName);
+  check(n > 0 && (size_t)n < sizeof(szTmpName), "File name[%s] is too long", pszSHMFileName);
+
+  fd = open(pszImageFileName, O_RDONLY | O_CLOEXEC);
+  check(fd != -1, "Cannot open image file[%s]", pszImageFileName);
+  check(fstat(fd, &st) == 0 && st.st_size > 0, "Cannot read image file[%s]", pszImageFileName);
+  pImage = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  check(pImage != MAP_FAILED, "Cannot map image file[%s]", pszImageFileName);
+  close(fd);
+  fd = -1;
+  check(ImageValid(pImage, (size_t)st.st_size) == True, "Invalid image file[%s]",
+        pszImageFileName);
+
+  /** The segment is the image as it is, but for the message queues of this
+   *  host and a new generation, followed by traffic counters and doorbells
+   *  laid out afresh like MPA_SIS_Create() does */
+  nRouteSize = *((const DWORD *)pImage);
+  nSize = StatLayout(nRouteSize, ((const DWORD *)pImage)[3], ((const DWORD *)pImage)[4],
+                     &dwStatStripes, &dwStatTypeSlots);
+  check(nSize <= UINT_MAX, "Memory map file size[%zu] is too large", nSize);
+  n = -1; /**< The sibling file is removed on error from now on */
+  pMPAStart = CreateMapFile(szTmpName, nSize);
+  check(pMPAStart, "Cannot create memory map file[%s]", szTmpName);
+  memcpy(pMPAStart, pImage, nRouteSize);
+  ((DWORD *)pMPAStart)[0] = (DWORD)nSize;
+  if (dwStatStripes > 0) {
+    StatInit(pMPAStart, StatOffset(nRouteSize), dwStatStripes, dwStatTypeSlots);
+  }
+  GetSISInfo(pMPAStart, &SISInfo);
+  for (i = 0, pSvrInfo = SISInfo.pServerInfos; i < (*SISInfo.pdwSrvInfoSize); i++, pSvrInfo++) {
+    if (pSvrInfo->dwSid == MPA_SID_NONE) {
+      continue;
+    }
+    /** Servers sharing a queue are usually listed together */
+    if (qid < 0 || pSvrInfo->dwQkey != qkey) {
+      qkey = pSvrInfo->dwQkey;
+      qid = MsqCreate(qkey, C_MsqRW);
+      check(qid >= 0, "Cannot create message queue[qkey=%d]", qkey);
+    }
+    pSvrInfo->dwQid = qid;
+  }
+  (*SISInfo.pdwGeneration) = (DWORD)time(NULL);
+  munmap(pMPAStart, SISInfo.dwTotalSize);
+  pMPAStart = NULL;
+  munmap(pImage, (size_t)st.st_size);
+  pImage = MAP_FAILED;
+
+  check(PublishSegment(szTmpName, pszSHMFileName) == 0, "Cannot publish memory map file[%s]",
+        pszSHMFileName);
+  return 0;
+
+error:
+  if (fd != -1) {
+    close(fd);
+  }
+  if (pMPAStart) {
+    munmap(pMPAStart, *((const DWORD *)pMPAStart));
+  }
+  if (pImage != MAP_FAILED) {
+    munmap(pImage, (size_t)st.st_size);
+  }
+  if (n == -1) {
+    unlink(szTmpName);
+  }
+  return -1;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_LoadImage(const char *pszSHMFileName, //{{{
+                                 const char *pszImageFileName) {
+  int fd = AdminLock(pszSHMFileName), nRetCode = -1;
+
+  if (fd != -1) {
+    nRetCode = LoadImageFile(pszSHMFileName, pszImageFileName);
+    AdminUnlock(fd);
+  }
+  return nRetCode;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_ExportConfig(const char *pMPAStart, const char *pszFileName) { //{{{
+  MPA_SISInfo SISInfo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  return DumpSISInfoToFile(&SISInfo, pszFileName);
+} //}}}
+
+DLL_PUBLIC void GetSISInfo(const char *pMPAStart, MPA_SISInfo *pSISInfo) { //{{{
+  DWORD *pMPAWork = (DWORD *)pMPAStart;
+  size_t nIdxOffset = 0;
+
+  memset(pSISInfo, 0, sizeof(MPA_SISInfo));
+  pSISInfo->dwTotalSize = (*pMPAWork++);
+  /** Version 1 segments have WORD max numbers where the magic number is */
+  if (pSISInfo->dwTotalSize < 3 * sizeof(DWORD) || (*pMPAWork++) != MPA_SIS_MAGIC) {
+    pSISInfo->dwVersion = 1;
+    return;
+  }
+  pSISInfo->dwVersion = (*pMPAWork) & ~MPA_SIS_FEATURE_MASK;
+  pSISInfo->dwFeatures = (*pMPAWork++) & MPA_SIS_FEATURE_MASK;
+  if (pSISInfo->dwVersion != MPA_SIS_VERSION) {
+    return;
+  }
+  pSISInfo->dwMaxSvrInfo = (*pMPAWork++);
+  pSISInfo->dwMaxTypeInfo = (*pMPAWork++);
+  pSISInfo->dwSAddrOffset = (*pMPAWork++);
+  pSISInfo->dwTAddrOffset = (*pMPAWork++);
+  pSISInfo->pdwSrvInfoSize = pMPAWork++;
+  pSISInfo->pServerInfos = ((MPA_SIS_SrvInfo *)pMPAWork);
+  pMPAWork = (DWORD *)(pMPAStart + pSISInfo->dwTAddrOffset);
+  pSISInfo->dwTListHeadOffset = (*pMPAWork++);
+  pSISInfo->pdwTListSize = pMPAWork;
+  pSISInfo->pTypeInfos = (MPA_SIS_TypeInfo *)(pMPAStart + pSISInfo->dwTListHeadOffset);
+
+  nIdxOffset = SidIndexOffset(pSISInfo->dwTListHeadOffset, pSISInfo->dwMaxTypeInfo);
+  pSISInfo->dwSidBuckets = *((DWORD *)(pMPAStart + nIdxOffset));
+  pSISInfo->pSidHash = (mpa_index_t *)(pMPAStart + nIdxOffset + sizeof(DWORD));
+
+  nIdxOffset = TypeIndexOffset(nIdxOffset, pSISInfo->dwSidBuckets);
+  pSISInfo->dwTypeBuckets = *((DWORD *)(pMPAStart + nIdxOffset));
+  pSISInfo->pTypeHash = (MPA_SIS_TypeBucket *)(pMPAStart + nIdxOffset + sizeof(DWORD));
+  pSISInfo->pSubscribers = (mpa_index_t *)(pSISInfo->pTypeHash + pSISInfo->dwTypeBuckets);
+
+  nIdxOffset = GenerationOffset(nIdxOffset, pSISInfo->dwTypeBuckets, pSISInfo->dwMaxTypeInfo);
+  pSISInfo->pdwGeneration = (DWORD *)(pMPAStart + nIdxOffset);
+  pSISInfo->pdwSeq = pSISInfo->pdwGeneration + 1;
+  pSISInfo->pdwWriter = pSISInfo->pdwGeneration + 2;
+  pSISInfo->pdwSrvFree = pSISInfo->pdwGeneration + 5;
+  pSISInfo->pdwTypeFree = pSISInfo->pdwGeneration + 6;
+  pSISInfo->pdwRetired = pSISInfo->pdwGeneration + 7;
+  pSISInfo->pdwSidKeys = pSISInfo->pdwGeneration + 8;
+  pSISInfo->pdwTypeKeys = pSISInfo->pdwSidKeys + pSISInfo->dwMaxSvrInfo;
+
+  /** Optional sections are there only if their flags are set, the header
+   *  of traffic counters is still checked against the size of the segment */
+  nIdxOffset = (size_t)((char *)(pSISInfo->pdwTypeKeys + pSISInfo->dwMaxTypeInfo) - pMPAStart);
+  if ((pSISInfo->dwFeatures & MPA_SIS_FEATURE_GROUPS) == 0 ||
+      pSISInfo->dwTotalSize < nIdxOffset + pSISInfo->dwMaxSvrInfo * sizeof(DWORD)) {
+    return;
+  }
+  pSISInfo->pdwGroupKeys = pSISInfo->pdwTypeKeys + pSISInfo->dwMaxTypeInfo;
+
+  nIdxOffset = StatOffset(nIdxOffset + pSISInfo->dwMaxSvrInfo * sizeof(DWORD));
+  if ((pSISInfo->dwFeatures & MPA_SIS_FEATURE_STATS) == 0 ||
+      pSISInfo->dwTotalSize < nIdxOffset + MPA_CACHE_LINE) {
+    return;
+  }
+  pMPAWork = (DWORD *)(pMPAStart + nIdxOffset);
+  if (pMPAWork[0] == 0 || pMPAWork[0] > MPA_STAT_STRIPES_MAX ||
+      (pMPAWork[0] & (pMPAWork[0] - 1)) != 0 || pMPAWork[1] == 0 ||
+      pMPAWork[1] > 2 * (MPA_SIS_MAX_INFO + 1) || (pMPAWork[1] & (pMPAWork[1] - 1)) != 0 ||
+      nIdxOffset + StatSize(pSISInfo->dwMaxSvrInfo, pMPAWork[0], pMPAWork[1]) !=
+          pSISInfo->dwTotalSize) {
+    return;
+  }
+  pSISInfo->dwStatStripes = pMPAWork[0];
+  pSISInfo->dwStatTypeSlots = pMPAWork[1];
+  pSISInfo->pdwStatFull = pMPAWork + 2;
+  pSISInfo->pdwStatTypes = (DWORD *)(pMPAStart + nIdxOffset + MPA_CACHE_LINE);
+  pSISInfo->pdwDoorbells =
+      (DWORD *)(pMPAStart + nIdxOffset + MPA_CACHE_LINE +
+                StatOffset(pSISInfo->dwStatTypeSlots * sizeof(DWORD)));
+  pSISInfo->pStats = (MPA_SIS_Stat *)(pMPAStart + pSISInfo->dwTotalSize) -
+                     (size_t)pSISInfo->dwStatStripes *
+                         (pSISInfo->dwMaxSvrInfo + pSISInfo->dwStatTypeSlots);
+} //}}}
+
+DLL_PUBLIC int MPA_GetServerInfo(DWORD sid, MPA_SIS_SrvInfo *pSrvInfo,
+                                 const char *pMPAStart) { //{{{
+  int index = 0;
+  DWORD dwSeq;
+  MPA_SISInfo SISInfo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  do {
+    dwSeq = SeqReadBegin(&SISInfo);
+    if ((index = FindServerInfo(&SISInfo, sid)) >= 0) {
+      memcpy(pSrvInfo, SISInfo.pServerInfos + index, sizeof(MPA_SIS_SrvInfo));
+    }
+  } while (SeqReadRetry(&SISInfo, dwSeq) == True);
+
+  if (index == -1) {
+    return -2;
+  }
+  return index;
+} //}}}
+
+DLL_PUBLIC int MPA_CheckMsgQ(key_t qkey) {
+  int nRetCode = MsqGet(qkey, IPC_EXCL);
+  if (nRetCode < 0) {
+    int err = errno;
+    if (err == ENOENT) {
+      return -1;
+    }
+
+    return -2;
+  }
+  return 0;
+}
+
+DLL_PUBLIC size_t MPA_CheckQKey(key_t qkey, const char *pMPAStart) {
+  size_t count = 0, i;
+  DWORD dwSeq;
+  MPA_SISInfo SISInfo;
+  MPA_SIS_SrvInfo *pServerInfo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  do {
+    dwSeq = SeqReadBegin(&SISInfo);
+    for (count = 0, i = 0, pServerInfo = SISInfo.pServerInfos;
+         i < (size_t)(*SISInfo.pdwSrvInfoSize); i++, pServerInfo++) {
+      if (pServerInfo->dwSid != MPA_SID_NONE && pServerInfo->dwQkey == qkey) {
+        count++;
+      }
+    }
+  } while (SeqReadRetry(&SISInfo, dwSeq) == True);
+
+  return count;
+}
+
+DLL_PUBLIC int MPA_GetServerInfoByIndex(mpa_index_t index, MPA_SIS_SrvInfo *pSrvInfo,
+                                        const char *pMPAStart) { //{{{
+  DWORD dwSeq;
+  MPA_SISInfo SISInfo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  do {
+    dwSeq = SeqReadBegin(&SISInfo);
+    memcpy(pSrvInfo, SISInfo.pServerInfos + index, sizeof(MPA_SIS_SrvInfo));
+  } while (SeqReadRetry(&SISInfo, dwSeq) == True);
+  return 0;
+} //}}}
+
+DLL_PUBLIC int MPA_GetTypeInfo(mpa_index_t index_, DWORD type, MPA_SIS_TypeInfo *pTypeInfo,
+                               const char *pMPAStart) { //{{{
+  int index = 0;
+  DWORD dwSeq;
+  MPA_SISInfo SISInfo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  do {
+    dwSeq = SeqReadBegin(&SISInfo);
+    if ((index = FindTypeInfo(index_, &SISInfo, type)) >= 0) {
+      memcpy(pTypeInfo, SISInfo.pTypeInfos + index, sizeof(MPA_SIS_TypeInfo));
+    }
+  } while (SeqReadRetry(&SISInfo, dwSeq) == True);
+
+  if (index == -1) {
+    return -2;
+  }
+  return index;
+} //}}}
+
+DLL_PUBLIC int MPA_GetSubscribers(DWORD type, mpa_index_t index_, MPA_SIS_SrvInfo *pSrvInfos,
+                                  size_t nSize, const char *pMPAStart) { //{{{
+  size_t i;
+  int nCount;
+  DWORD dwSeq;
+  MPA_SISInfo SISInfo;
+  MPA_SIS_TypeBucket Bucket;
+  mpa_index_t index;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SISInfo.pTypeHash == NULL) {
+    return -1;
+  }
+
+  do {
+    dwSeq = SeqReadBegin(&SISInfo);
+    memcpy(&Bucket, TypeIndexBucket(&SISInfo, type), sizeof(MPA_SIS_TypeBucket));
+    nCount = (int)Bucket.dwCount;
+    /** A torn bucket may point out of the list, check before following it */
+    if ((size_t)Bucket.dwStart + Bucket.dwCount > SISInfo.dwMaxTypeInfo) {
+      nCount = 0;
+      continue;
+    }
+    for (i = 0; i < nSize && index_ + i < Bucket.dwCount; i++) {
+      index = SISInfo.pSubscribers[Bucket.dwStart + index_ + i];
+      if (index >= SISInfo.dwMaxSvrInfo) {
+        break;
+      }
+      memcpy(pSrvInfos + i, SISInfo.pServerInfos + index, sizeof(MPA_SIS_SrvInfo));
+    }
+  } while (SeqReadRetry(&SISInfo, dwSeq) == True);
+  return nCount;
+} //}}}
+
+DLL_PUBLIC int MPA_GetGroupMembers(DWORD gid, MPA_SIS_SrvInfo *pSrvInfos, size_t nSize, //{{{
+                                   const char *pMPAStart) {
+  size_t i, n;
+  int nCount;
+  DWORD dwSeq;
+  MPA_SISInfo SISInfo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SISInfo.pdwGroupKeys == NULL) {
+    return -1;
+  }
+  if (gid == 0) {
+    return 0; /**< Server infos out of any group */
+  }
+
+  do {
+    dwSeq = SeqReadBegin(&SISInfo);
+    nCount = 0;
+    n = (size_t)(*SISInfo.pdwSrvInfoSize);
+    if (n > SISInfo.dwMaxSvrInfo) {
+      continue; /**< Torn size */
+    }
+    for (i = ScanKeys(SISInfo.pdwGroupKeys, 0, n, gid); i < n;
+         i = ScanKeys(SISInfo.pdwGroupKeys, i + 1, n, gid)) {
+      if ((size_t)nCount < nSize) {
+        memcpy(pSrvInfos + nCount, SISInfo.pServerInfos + i, sizeof(MPA_SIS_SrvInfo));
+      }
+      nCount++;
+    }
+  } while (SeqReadRetry(&SISInfo, dwSeq) == True);
+  return nCount;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_QueueStats(const char *pMPAStart, MPA_SIS_QueueStat *pStats, //{{{
+                                  size_t nSize) {
+  size_t i, m = 0, n = 0;
+  DWORD j, dwSeq;
+  MPA_SISInfo SISInfo;
+  MPA_SIS_SrvInfo *pSvrInfo;
+  MPA_SIS_QueueStat *pStat, *pFirst;
+  MPA_QueueRef *pRefs = NULL;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SISInfo.dwVersion != MPA_SIS_VERSION) {
+    return -1;
+  }
+  do {
+    dwSeq = SeqReadBegin(&SISInfo);
+    n = 0;
+    for (j = 0, pSvrInfo = SISInfo.pServerInfos;
+         j < (*SISInfo.pdwSrvInfoSize) && j < SISInfo.dwMaxSvrInfo; j++, pSvrInfo++) {
+      if (pSvrInfo->dwSid == MPA_SID_NONE) {
+        continue;
+      }
+      if (n < nSize) {
+        pStats[n].dwSid = pSvrInfo->dwSid;
+        pStats[n].dwQkey = pSvrInfo->dwQkey;
+        pStats[n].dwQid = pSvrInfo->dwQid;
+        pStats[n].dwQtype = pSvrInfo->dwQtype;
+      }
+      n++;
+    }
+  } while (SeqReadRetry(&SISInfo, dwSeq) == True);
+
+  /** Entries are sorted by queue id, so every queue is read once however
+   *  its servers are listed. Without memory every entry is read. */
+  m = (n < nSize) ? n : nSize;
+  if ((pRefs = malloc(m * sizeof(MPA_QueueRef) + 1)) == NULL) {
+    for (i = 0; i < m; i++) {
+      QueueStatRead(pStats + i);
+    }
+    return (int)n;
+  }
+  for (i = 0; i < m; i++) {
+    pRefs[i].qid = pStats[i].dwQid;
+    pRefs[i].nIndex = i;
+  }
+  qsort(pRefs, m, sizeof(MPA_QueueRef), QueueRefCompare);
+  for (i = 0; i < m; i++) {
+    pStat = pStats + pRefs[i].nIndex;
+    if (i == 0 || pRefs[i].qid != pRefs[i - 1].qid) {
+      QueueStatRead(pStat);
+      continue;
+    }
+    pFirst = pStats + pRefs[i - 1].nIndex;
+    pStat->nErrno = pFirst->nErrno;
+    pStat->nMsgs = pFirst->nMsgs;
+    pStat->nBytes = pFirst->nBytes;
+    pStat->nMaxBytes = pFirst->nMaxBytes;
+    pStat->tSend = pFirst->tSend;
+    pStat->tRecv = pFirst->tRecv;
+  }
+  free(pRefs);
+  return (int)n;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_QueueTypeDepth(int qid, const DWORD *pdwTypes, size_t *pnMsgs, //{{{
+                                      size_t nTypes) {
+  size_t i, nScanned = 0;
+  ssize_t nMsgLen;
+  T_MsgbufM *pBuf = NULL;
+  struct msqid_ds qds;
+
+  memset(pnMsgs, 0, nTypes * sizeof(size_t));
+#ifdef MSG_COPY
+  check(MsqInfo(qid, &qds) == 0, "Cannot read message queue[%d]", qid);
+  pBuf = malloc(sizeof(T_MsgbufM));
+  check(pBuf, "Out of memory");
+  /** MSG_COPY takes the message at a position without removing it, later
+   *  messages shift down when one is received meanwhile */
+  for (nScanned = 0; nScanned < (size_t)qds.msg_qnum && nScanned < MPA_QSCAN_MAX; nScanned++) {
+    nMsgLen = msgrcv(qid, pBuf, C_MsgbufM, (long)nScanned, IPC_NOWAIT | MSG_COPY | MSG_NOERROR);
+    if (nMsgLen < 0) {
+      check(errno == ENOMSG, "Cannot copy message of queue[%d], errno=%d", qid, errno);
+      break;
+    }
+    for (i = 0; i < nTypes; i++) {
+      if ((long)pdwTypes[i] == pBuf->mtype) {
+        pnMsgs[i]++;
+        break;
+      }
+    }
+  }
+  free(pBuf);
+  return (int)nScanned;
+#else
+  (void)qid;
+  (void)pdwTypes;
+  (void)qds;
+  (void)i;
+  (void)nMsgLen;
+  errno = ENOSYS;
+  check(0, "Messages of a queue cannot be copied on this system");
+#endif
+
+error:
+  free(pBuf);
+  return -1;
+} //}}}
+
+DLL_PUBLIC int MPA_SIS_SplitQueue(const char *pMPAStart, DWORD sid, key_t qkey) { //{{{
+  int index = -1, qid = -1, nRetCode = -1;
+  ssize_t nMoved = 0, n = 0;
+  T_MsgbufM *pBuf = NULL;
+  MPA_SISInfo SISInfo;
+  MPA_SIS_SrvInfo SrvInfo, *pSvrInfo = NULL;
+  struct timespec grace = {0, MPA_SPLIT_GRACE_NS};
+  struct msqid_ds qds, qdsTo;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  check(SISInfo.dwVersion == MPA_SIS_VERSION, "Segment is of version %u", SISInfo.dwVersion);
+  check(MPA_GetServerInfo(sid, &SrvInfo, pMPAStart) >= 0, "Server info[%u] does not exist", sid);
+  check(SrvInfo.dwQkey != qkey && MPA_CheckQKey(qkey, pMPAStart) == 0,
+        "Queue key[%d] is used by other server infos", qkey);
+  pBuf = malloc(sizeof(T_MsgbufM));
+  check(pBuf, "Out of memory");
+  qid = MsqCreate(qkey, C_MsqRW);
+  check(qid >= 0, "Cannot create message queue[qkey=%d]", qkey);
+
+  /** The new queue gets the room of the old one, so that the messages
+   *  waiting fit in it. Raising it above msgmnb takes privilege: if that
+   *  fails and they may not fit, nothing is moved. */
+  check(MsqInfo(SrvInfo.dwQid, &qds) == 0, "Cannot read message queue[qkey=%d]",
+        SrvInfo.dwQkey);
+  check(MsqInfo(qid, &qdsTo) == 0, "Cannot read message queue[qkey=%d]", qkey);
+  if (qdsTo.msg_qbytes < qds.msg_qbytes) {
+    qdsTo.msg_qbytes = qds.msg_qbytes;
+    msgctl(qid, IPC_SET, &qdsTo);
+    check(MsqInfo(qid, &qdsTo) == 0, "Cannot read message queue[qkey=%d]", qkey);
+  }
+  check(qdsTo.msg_cbytes + qds.msg_cbytes <= qdsTo.msg_qbytes,
+        "[%lu] bytes waiting in queue[qkey=%d] do not fit in queue[qkey=%d]",
+        (unsigned long)qds.msg_cbytes, SrvInfo.dwQkey, qkey);
+
+  /** 1. Messages waiting for the server are moved while senders still use
+   *  the old queue, so that they are received ahead of the messages sent to
+   *  the new queue after the switch. Messages sent to the old queue from
+   *  now on are moved in step 3, behind those. Nobody receives from the new
+   *  queue yet, so no more are moved than were waiting, and than fit. */
+  check((n = MoveMessages(SrvInfo.dwQid, qid, SrvInfo.dwQtype, pBuf,
+                          (size_t)qds.msg_qnum + 1, False)) >= 0,
+        "Cannot move messages of server[%u]", sid);
+  nMoved += n;
+
+  /** 2. Route the server to its own queue */
+  nRetCode = SeqWriteLive(&SISInfo);
+  check(nRetCode == 0, "Server info[%u] is not moved", sid);
+  nRetCode = -1;
+  index = FindServerInfo(&SISInfo, sid);
+  pSvrInfo = (index >= 0) ? SISInfo.pServerInfos + index : NULL;
+  if (pSvrInfo == NULL || pSvrInfo->dwQid != SrvInfo.dwQid) {
+    SeqWriteEnd(&SISInfo);
+    check(0, "Server info[%u] has been changed meanwhile", sid);
+  }
+  pSvrInfo->dwQkey = qkey;
+  pSvrInfo->dwQid = qid;
+  BumpGeneration(&SISInfo);
+  SeqWriteEnd(&SISInfo);
+
+  /** 3. Senders which looked up the route before may still send to the old
+   *  queue. Receivers blocked on the old queue are woken by an empty
+   *  message, which MPA clients take as a sign to look up their route
+   *  again; each of them passes it on to the next before it moves. Once
+   *  they have had the time to, the last move drops it, so that it is not
+   *  counted as waiting in the old queue. */
+  check((n = MoveMessages(SrvInfo.dwQid, qid, SrvInfo.dwQtype, pBuf, 0, False)) >= 0,
+        "Cannot move messages of server[%u]", sid);
+  nMoved += n;
+  pBuf->mtype = (long)SrvInfo.dwQtype;
+  check(MsqSend(SrvInfo.dwQid, (T_Msgbuf *)pBuf, 0) == 0, "Cannot wake receiver of server[%u]",
+        sid);
+  nanosleep(&grace, NULL);
+  check((n = MoveMessages(SrvInfo.dwQid, qid, SrvInfo.dwQtype, pBuf, 0, True)) >= 0,
+        "Cannot move messages of server[%u]", sid);
+  nMoved += n;
+
+  trace("Server[%u] moved from queue[qkey=%d] to queue[qkey=%d], [%zd] message(s) moved.", sid,
+        SrvInfo.dwQkey, qkey, nMoved);
+  free(pBuf);
+  return (int)nMoved;
+
+error:
+  free(pBuf);
+  return nRetCode;
+} //}}}
+
+// Static functions {{{
+static int DumpSISInfoToFile(const MPA_SISInfo *pSISInfo,
+                             const char *pszFileName) { //{{{
+  int i, n;
   FILE *fp;
   MPA_SIS_SrvInfo *pServerInfos;
   MPA_SIS_TypeInfo *pTypeInfos;
@@ -454,8 +1774,8 @@ static int DumpSISInfoToFile(const MPA_SISInfo *pSISInfo,
   fprintf(fp, "################################################################"
               "######\n");
   fprintf(fp, "[main]\n");
-  fprintf(fp, "max_serverinfo_nums = %d\n", pSISInfo->wMaxSvrInfo);
-  fprintf(fp, "max_typeinfo_nums = %d\n", pSISInfo->wMaxTypeInfo);
+  fprintf(fp, "max_serverinfo_nums = %d\n", pSISInfo->dwMaxSvrInfo);
+  fprintf(fp, "max_typeinfo_nums = %d\n", pSISInfo->dwMaxTypeInfo);
   fprintf(fp, "\n");
   fprintf(fp, "################################################################"
               "######\n");
@@ -465,13 +1785,27 @@ static int DumpSISInfoToFile(const MPA_SISInfo *pSISInfo,
               "     #\n");
   fprintf(fp, "# s#=sid:qkey:qtype   进程标识:消息队列键值:消息类型            "
               "     #\n");
+  fprintf(fp, "# s#=sid:qkey:qtype:gid 同上，gid为所属服务组标识              "
+              "     #\n");
   fprintf(fp, "################################################################"
               "######\n");
   fprintf(fp, "[server]\n");
-  fprintf(fp, "server_nums=%d\n", (*pSISInfo->pwSrvInfoSize));
-  for (i = 0, pServerInfos = pSISInfo->pServerInfos; i < (*pSISInfo->pwSrvInfoSize);
+  for (i = 0, n = 0, pServerInfos = pSISInfo->pServerInfos; i < (int)(*pSISInfo->pdwSrvInfoSize);
        i++, pServerInfos++) {
-    fprintf(fp, "s%d=%d:%d:%d\n", i, pServerInfos->dwSid, pServerInfos->dwQkey,
+    n += (pServerInfos->dwSid != MPA_SID_NONE) ? 1 : 0;
+  }
+  fprintf(fp, "server_nums=%d\n", n);
+  for (i = 0, n = 0, pServerInfos = pSISInfo->pServerInfos; i < (int)(*pSISInfo->pdwSrvInfoSize);
+       i++, pServerInfos++) {
+    if (pServerInfos->dwSid == MPA_SID_NONE) {
+      continue; /**< Deleted server info */
+    }
+    if (ServerGroup(pSISInfo, (mpa_index_t)i) != 0) {
+      fprintf(fp, "s%d=%d:%d:%d:%u\n", n++, pServerInfos->dwSid, pServerInfos->dwQkey,
+              pServerInfos->dwQtype, ServerGroup(pSISInfo, (mpa_index_t)i));
+      continue;
+    }
+    fprintf(fp, "s%d=%d:%d:%d\n", n++, pServerInfos->dwSid, pServerInfos->dwQkey,
             pServerInfos->dwQtype);
   }
   fprintf(fp, "\n");
@@ -486,305 +1820,1833 @@ static int DumpSISInfoToFile(const MPA_SISInfo *pSISInfo,
   fprintf(fp, "################################################################"
               "######\n");
   fprintf(fp, "[type]\n");
-  fprintf(fp, "type_nums=%d\n", (*pSISInfo->pwTListSize));
-  for (i = 0, pTypeInfos = pSISInfo->pTypeInfos; i < (*pSISInfo->pwTListSize); i++, pTypeInfos++) {
-    fprintf(fp, "t%d=%d:%d\n", i, pTypeInfos->dwType,
-            (pSISInfo->pServerInfos + pTypeInfos->wSidIndex)->dwSid);
+  for (i = 0, n = 0, pTypeInfos = pSISInfo->pTypeInfos; i < (int)(*pSISInfo->pdwTListSize);
+       i++, pTypeInfos++) {
+    n += (pTypeInfos->dwSidIndex != MPA_INDEX_NONE) ? 1 : 0;
+  }
+  fprintf(fp, "type_nums=%d\n", n);
+  for (i = 0, n = 0, pTypeInfos = pSISInfo->pTypeInfos; i < (int)(*pSISInfo->pdwTListSize);
+       i++, pTypeInfos++) {
+    if (pTypeInfos->dwSidIndex == MPA_INDEX_NONE) {
+      continue; /**< Deleted type info */
+    }
+    fprintf(fp, "t%d=%d:%d\n", n++, pTypeInfos->dwType,
+            (pSISInfo->pServerInfos + pTypeInfos->dwSidIndex)->dwSid);
+  }
+  fprintf(fp, "\n");
+  fprintf(fp, "###############################end##############################"
+              "######\n");
+  fclose(fp);
+  return 0;
+} //}}}
+
+static void DisplaySISInfo(const MPA_SISInfo *pSISInfo) { //{{{
+  int i;
+  MPA_SIS_SrvInfo *pServerInfos;
+  MPA_SIS_TypeInfo *pTypeInfos;
+
+  printf("+++++++++++++++++++++++++++++++++++++++++++++\n");
+  printf("最大系统信息数:%d\n", pSISInfo->dwMaxSvrInfo);
+  printf("最大交易类型数:%d\n", pSISInfo->dwMaxTypeInfo);
+  printf("当前系统信息数:%d\n", (*pSISInfo->pdwSrvInfoSize));
+  printf("|进程索引号|系统标识号|消息队列Key|消息队列ID|消息类型|服务组标识|\n");
+  printf("|----------|----------|-----------|----------|--------|----------|\n");
+  for (i = 0, pServerInfos = pSISInfo->pServerInfos; i < (int)(*pSISInfo->pdwSrvInfoSize);
+       i++, pServerInfos++) {
+    if (pServerInfos->dwSid == MPA_SID_NONE) {
+      printf("|%10d|%-52s|\n", i, "(已删除)");
+      continue;
+    }
+    printf("|%10d|%10d|%11d|0x%08x|%8d|%10u|\n", i, pServerInfos->dwSid, pServerInfos->dwQkey,
+           pServerInfos->dwQid, pServerInfos->dwQtype, ServerGroup(pSISInfo, (mpa_index_t)i));
+  }
+  printf("当前消息类型数:%d\n", (*pSISInfo->pdwTListSize));
+  printf("|类型索引号|  类型号  |系统索引号|进程索引号|\n");
+  printf("|----------|----------|----------|----------|\n");
+  for (i = 0, pTypeInfos = pSISInfo->pTypeInfos; i < (int)(*pSISInfo->pdwTListSize);
+       i++, pTypeInfos++) {
+    if (pTypeInfos->dwSidIndex == MPA_INDEX_NONE) {
+      printf("|%10d|%-32s|\n", i, "(已删除)");
+      continue;
+    }
+    printf("|%10d|%10d|%10d|%10d|\n", i, pTypeInfos->dwType, pTypeInfos->dwSidIndex,
+           (pSISInfo->pServerInfos + pTypeInfos->dwSidIndex)->dwSid);
+  }
+  printf("+++++++++++++++++++++++++++++++++++++++++++++\n");
+} //}}}
+
+static int FindTypeInfo(mpa_index_t index, const MPA_SISInfo *pSISInfo,
+                        DWORD type) { //{{{
+  size_t i, n = (size_t)(*pSISInfo->pdwTListSize);
+
+  for (i = ScanKeys(pSISInfo->pdwTypeKeys, index, n, type); i < n;
+       i = ScanKeys(pSISInfo->pdwTypeKeys, i + 1, n, type)) {
+    if ((pSISInfo->pTypeInfos + i)->dwSidIndex != MPA_INDEX_NONE) {
+      return (int)i;
+    }
+  }
+  return -1;
+} //}}}
+
+static int FindTypeInfoBySid(const MPA_SISInfo *pSISInfo, DWORD type,
+                             DWORD sid) { //{{{
+  int index;
+  size_t i, n = (size_t)(*pSISInfo->pdwTListSize);
+
+  if ((index = FindServerInfo(pSISInfo, sid)) == -1) {
+    fprintf(stderr, "该系统标识%d没有注册。请先注册系统信息。\n", sid);
+    return -2;
+  }
+  for (i = ScanKeys(pSISInfo->pdwTypeKeys, 0, n, type); i < n;
+       i = ScanKeys(pSISInfo->pdwTypeKeys, i + 1, n, type)) {
+    if ((pSISInfo->pTypeInfos + i)->dwSidIndex == (DWORD)index) {
+      return (int)i;
+    }
+  }
+  return -1;
+} //}}}
+
+static int FindServerInfo(const MPA_SISInfo *pSISInfo, DWORD sid) { //{{{
+  size_t i, n = (size_t)(*pSISInfo->pdwSrvInfoSize);
+  DWORD mask = pSISInfo->dwSidBuckets - 1;
+  DWORD h = HashKey(sid) & mask;
+  mpa_index_t index;
+
+  if (sid == MPA_SID_NONE) {
+    return -1;
+  }
+  /** Short lists are scanned, which touches fewer cache lines than hashing */
+  if (n <= MPA_SCAN_MAX) {
+    i = ScanKeys(pSISInfo->pdwSidKeys, 0, n, sid);
+    return (i < n) ? (int)i : -1;
+  }
+
+  for (i = 0; i < pSISInfo->dwSidBuckets; i++, h = (h + 1) & mask) {
+    index = pSISInfo->pSidHash[h];
+    if (index == MPA_INDEX_NONE) {
+      break;
+    }
+    if (index < n && pSISInfo->pdwSidKeys[index] == sid) {
+      return (int)index;
+    }
+  }
+  return -1;
+} //}}}
+
+/** Index of the first key equal to key in pKeys[nFrom, nTo), or nTo if
+ *  there is none */
+static size_t ScanKeys(const DWORD *pKeys, size_t nFrom, size_t nTo, DWORD key) { //{{{
+#ifdef MPA_SCAN_SIMD
+  if (__builtin_cpu_supports("avx2")) {
+    return ScanKeysAVX2(pKeys, nFrom, nTo, key);
+  }
+  return ScanKeysSSE2(pKeys, nFrom, nTo, key);
+#else
+  return ScanKeysScalar(pKeys, nFrom, nTo, key);
+#endif
+} //}}}
+
+static size_t ScanKeysScalar(const DWORD *pKeys, size_t nFrom, size_t nTo, DWORD key) { //{{{
+  for (; nFrom < nTo && pKeys[nFrom] != key; nFrom++) {
+  }
+  return nFrom;
+} //}}}
+
+#ifdef MPA_SCAN_SIMD
+/** Compare 4 keys at a time, the rest are compared one by one */
+static size_t ScanKeysSSE2(const DWORD *pKeys, size_t nFrom, size_t nTo, DWORD key) { //{{{
+  const __m128i k = _mm_set1_epi32((int)key);
+  int mask;
+
+  for (; nFrom + 4 <= nTo; nFrom += 4) {
+    mask = _mm_movemask_ps(
+        _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(pKeys + nFrom)), k)));
+    if (mask != 0) {
+      return nFrom + (size_t)__builtin_ctz((unsigned int)mask);
+    }
+  }
+  return ScanKeysScalar(pKeys, nFrom, nTo, key);
+} //}}}
+
+/** Compare 8 keys at a time, the rest are compared one by one */
+__attribute__((target("avx2"))) static size_t ScanKeysAVX2(const DWORD *pKeys, size_t nFrom,
+                                                           size_t nTo, DWORD key) { //{{{
+  const __m256i k = _mm256_set1_epi32((int)key);
+  int mask;
+
+  for (; nFrom + 8 <= nTo; nFrom += 8) {
+    mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+        _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(pKeys + nFrom)), k)));
+    if (mask != 0) {
+      return nFrom + (size_t)__builtin_ctz((unsigned int)mask);
+    }
+  }
+  return ScanKeysScalar(pKeys, nFrom, nTo, key);
+} //}}}
+#endif
+
+static DWORD HashKey(DWORD key) { //{{{
+  key ^= key >> 16;
+  key *= 0x45d9f3bU;
+  key ^= key >> 16;
+  key *= 0x45d9f3bU;
+  key ^= key >> 16;
+  return key;
+} //}}}
+
+static size_t SidIndexOffset(size_t nTListHeadOffset, size_t nNumOfType) { //{{{
+  size_t n = nTListHeadOffset + nNumOfType * sizeof(MPA_SIS_TypeInfo);
+  return (n + sizeof(DWORD) - 1) & ~(sizeof(DWORD) - 1);
+} //}}}
+
+static DWORD SidIndexBuckets(size_t nNumOfProcess) { //{{{
+  DWORD n = 8;
+
+  /** Keep load factor under 0.5 so that probe sequences stay short */
+  while (n < nNumOfProcess * 2) {
+    n <<= 1;
+  }
+  return n;
+} //}}}
+
+static void SidIndexInsert(const MPA_SISInfo *pSISInfo, DWORD sid, mpa_index_t index) { //{{{
+  DWORD mask, h;
+
+  if (pSISInfo->pSidHash == NULL) {
+    return;
+  }
+  mask = pSISInfo->dwSidBuckets - 1;
+  for (h = HashKey(sid) & mask; pSISInfo->pSidHash[h] != MPA_INDEX_NONE; h = (h + 1) & mask) {
+  }
+  pSISInfo->pSidHash[h] = index;
+} //}}}
+
+static void SidIndexRemove(const MPA_SISInfo *pSISInfo, DWORD sid) { //{{{
+  DWORD mask, h, i, home;
+  mpa_index_t index;
+
+  if (pSISInfo->pSidHash == NULL) {
+    return;
+  }
+  mask = pSISInfo->dwSidBuckets - 1;
+  for (h = HashKey(sid) & mask;; h = (h + 1) & mask) {
+    index = pSISInfo->pSidHash[h];
+    if (index == MPA_INDEX_NONE) {
+      return;
+    }
+    if ((pSISInfo->pServerInfos + index)->dwSid == sid) {
+      break;
+    }
+  }
+
+  /** Backward shift deletion: pull following entries of the same probe
+   *  sequence into the hole, so lookups never need tombstones */
+  for (i = (h + 1) & mask;; i = (i + 1) & mask) {
+    index = pSISInfo->pSidHash[i];
+    if (index == MPA_INDEX_NONE) {
+      break;
+    }
+    home = HashKey((pSISInfo->pServerInfos + index)->dwSid) & mask;
+    if (((i - home) & mask) >= ((i - h) & mask)) {
+      pSISInfo->pSidHash[h] = index;
+      h = i;
+    }
+  }
+  pSISInfo->pSidHash[h] = MPA_INDEX_NONE;
+} //}}}
+
+static void SidIndexClear(const MPA_SISInfo *pSISInfo) { //{{{
+  if (pSISInfo->pSidHash) {
+    memset(pSISInfo->pSidHash, 0xFF, pSISInfo->dwSidBuckets * sizeof(mpa_index_t));
+  }
+} //}}}
+
+static size_t TypeIndexOffset(size_t nSidIdxOffset, DWORD dwSidBuckets) { //{{{
+  size_t n = nSidIdxOffset + sizeof(DWORD) + dwSidBuckets * sizeof(mpa_index_t);
+  return (n + sizeof(DWORD) - 1) & ~(sizeof(DWORD) - 1);
+} //}}}
+
+static MPA_SIS_TypeBucket *TypeIndexBucket(const MPA_SISInfo *pSISInfo, DWORD type) { //{{{
+  DWORD mask = pSISInfo->dwTypeBuckets - 1;
+  DWORD h;
+  MPA_SIS_TypeBucket *pBucket;
+
+  for (h = HashKey(type) & mask;; h = (h + 1) & mask) {
+    pBucket = pSISInfo->pTypeHash + h;
+    if (pBucket->dwCount == 0 || pBucket->dwType == type) {
+      return pBucket;
+    }
+  }
+} //}}}
+
+/** Rebuild type hash index and subscriber list from type info list with
+ *  a counting sort: count subscribers per type, point dwStart of every type
+ *  to the end of its range, then fill the ranges backwards walking type
+ *  info list from its tail, so subscribers keep the type info list order. */
+static void TypeIndexRebuild(const MPA_SISInfo *pSISInfo) { //{{{
+  DWORD h;
+  DWORD dwEnd = 0, i;
+  MPA_SIS_TypeInfo *pTypeInfo;
+  MPA_SIS_TypeBucket *pBucket;
+
+  if (pSISInfo->pTypeHash == NULL) {
+    return;
+  }
+
+  memset(pSISInfo->pTypeHash, 0, pSISInfo->dwTypeBuckets * sizeof(MPA_SIS_TypeBucket));
+  for (i = 0, pTypeInfo = pSISInfo->pTypeInfos; i < (*pSISInfo->pdwTListSize); i++, pTypeInfo++) {
+    if (pTypeInfo->dwSidIndex == MPA_INDEX_NONE) {
+      continue; /**< Deleted type info */
+    }
+    pBucket = TypeIndexBucket(pSISInfo, pTypeInfo->dwType);
+    pBucket->dwType = pTypeInfo->dwType;
+    pBucket->dwCount++;
+  }
+  for (h = 0, pBucket = pSISInfo->pTypeHash; h < pSISInfo->dwTypeBuckets; h++, pBucket++) {
+    if (pBucket->dwCount > 0) {
+      dwEnd += pBucket->dwCount;
+      pBucket->dwStart = dwEnd;
+    }
+  }
+  for (i = (*pSISInfo->pdwTListSize), pTypeInfo = pSISInfo->pTypeInfos + i; i > 0; i--) {
+    pTypeInfo--;
+    if (pTypeInfo->dwSidIndex == MPA_INDEX_NONE) {
+      continue;
+    }
+    pBucket = TypeIndexBucket(pSISInfo, pTypeInfo->dwType);
+    pBucket->dwStart--;
+    pSISInfo->pSubscribers[pBucket->dwStart] = pTypeInfo->dwSidIndex;
+  }
+} //}}}
+
+/** Add one subscriber of a type to type hash index and subscriber list
+ *  without a rebuild: the subscribers after the end of the range of the type
+ *  move up by one and so do dwStart of their buckets, a new type gets a range
+ *  after all others. The subscriber goes to the end of its type, the next
+ *  rebuild puts it back in type info list order. */
+static void TypeIndexInsert(const MPA_SISInfo *pSISInfo, DWORD type, mpa_index_t index) { //{{{
+  DWORD h;
+  DWORD dwEnd = 0, dwPos;
+  MPA_SIS_TypeBucket *pBucket, *pType;
+
+  if (pSISInfo->pTypeHash == NULL) {
+    return;
+  }
+
+  for (h = 0, pBucket = pSISInfo->pTypeHash; h < pSISInfo->dwTypeBuckets; h++, pBucket++) {
+    if (pBucket->dwCount > 0 && pBucket->dwStart + pBucket->dwCount > dwEnd) {
+      dwEnd = pBucket->dwStart + pBucket->dwCount;
+    }
+  }
+  pType = TypeIndexBucket(pSISInfo, type);
+  if (pType->dwCount == 0) {
+    pType->dwType = type;
+    pType->dwStart = dwEnd;
+    dwPos = dwEnd;
+  } else {
+    dwPos = pType->dwStart + pType->dwCount;
+    memmove(pSISInfo->pSubscribers + dwPos + 1, pSISInfo->pSubscribers + dwPos,
+            (dwEnd - dwPos) * sizeof(mpa_index_t));
+    for (h = 0, pBucket = pSISInfo->pTypeHash; h < pSISInfo->dwTypeBuckets; h++, pBucket++) {
+      if (pBucket->dwCount > 0 && pBucket->dwStart >= dwPos) {
+        pBucket->dwStart++;
+      }
+    }
+  }
+  pSISInfo->pSubscribers[dwPos] = index;
+  pType->dwCount++;
+} //}}}
+
+/** Add a server info, its message queue is left to be created later if
+ *  bCreateQueue is False */
+static int AddServerInfo(const MPA_SISInfo *pSISInfo, DWORD sid, key_t qkey, //{{{
+                         DWORD qtype, DWORD gid, Boolean bCreateQueue) {
+  int index = -1;
+  int qid = -1;
+  mpa_index_t slot = MPA_INDEX_NONE;
+  MPA_SIS_SrvInfo *pSvrInfo = NULL;
+
+  check((*pSISInfo->pdwSrvFree) != MPA_INDEX_NONE ||
+            (*pSISInfo->pdwSrvInfoSize) < pSISInfo->dwMaxSvrInfo,
+        "Maximum server info number[%d] reached", pSISInfo->dwMaxSvrInfo);
+  check(sid != MPA_SID_NONE, "Invalid server id[%u]", sid);
+  check(gid == 0 || pSISInfo->pdwGroupKeys, "Segment has no server groups for group[%u]", gid);
+
+  index = FindServerInfo(pSISInfo, sid);
+  check(index == -1, "Server info[%d] already exists", sid);
+
+  if (bCreateQueue == True) {
+    qid = MsqCreate(qkey, C_MsqRW);
+    check(qid >= 0, "Cannot create message queue[qkey=%d]", qkey);
+  }
+
+  slot = ServerSlotAlloc(pSISInfo);
+  pSvrInfo = pSISInfo->pServerInfos + slot;
+  pSvrInfo->dwSid = sid;
+  pSISInfo->pdwSidKeys[slot] = sid;
+  pSvrInfo->dwQkey = qkey;
+  pSvrInfo->dwQid = qid;
+  pSvrInfo->dwQtype = qtype;
+  if (pSISInfo->pdwGroupKeys) {
+    pSISInfo->pdwGroupKeys[slot] = gid;
+  }
+  SidIndexInsert(pSISInfo, sid, slot);
+  StatReset(pSISInfo, slot); /**< Counters of the server deleted before */
+  return 0;
+
+error:
+  return -1;
+} //}}}
+
+/** Group id of the server info of the index, 0 if the segment has none */
+static DWORD ServerGroup(const MPA_SISInfo *pSISInfo, mpa_index_t index) { //{{{
+  return (pSISInfo->pdwGroupKeys) ? pSISInfo->pdwGroupKeys[index] : 0;
+} //}}}
+
+static int AddTypeInfo(const MPA_SISInfo *pSISInfo, DWORD type, DWORD sid) { //{{{
+  int index = 0;
+  mpa_index_t slot = MPA_INDEX_NONE;
+  MPA_SIS_TypeInfo *pTypeInfo = NULL;
+
+  check((*pSISInfo->pdwTypeFree) != MPA_INDEX_NONE ||
+            (*pSISInfo->pdwTListSize) < pSISInfo->dwMaxTypeInfo,
+        "Maximum type info number[%d] reached", pSISInfo->dwMaxTypeInfo);
+
+  index = FindServerInfo(pSISInfo, sid);
+  check(index >= 0, "Cannot find server info[%d]", sid);
+
+  slot = TypeSlotAlloc(pSISInfo);
+  pTypeInfo = pSISInfo->pTypeInfos + slot;
+  pTypeInfo->dwType = type;
+  pSISInfo->pdwTypeKeys[slot] = type;
+  pTypeInfo->dwSidIndex = (DWORD)index;
+  return 0;
+
+error:
+  return -1;
+} //}}}
+
+/** Deleted server infos are kept in place with MPA_SID_NONE as server id,
+ *  and linked into a free list by dwQtype, so indexes of other server infos
+ *  held by type infos stay valid. Deleted type infos are linked the same
+ *  way by dwType, with MPA_INDEX_NONE as server index. A deleted entry at
+ *  the tail of a list is dropped from the list instead. */
+static mpa_index_t ServerSlotAlloc(const MPA_SISInfo *pSISInfo) { //{{{
+  mpa_index_t index = (*pSISInfo->pdwSrvFree);
+
+  if (index != MPA_INDEX_NONE) {
+    (*pSISInfo->pdwSrvFree) = (pSISInfo->pServerInfos + index)->dwQtype;
+    return index;
+  }
+  if ((*pSISInfo->pdwSrvInfoSize) >= pSISInfo->dwMaxSvrInfo) {
+    return MPA_INDEX_NONE;
+  }
+  return (*pSISInfo->pdwSrvInfoSize)++;
+} //}}}
+
+static void ServerSlotFree(const MPA_SISInfo *pSISInfo, mpa_index_t index) { //{{{
+  MPA_SIS_SrvInfo *pSvrInfo = pSISInfo->pServerInfos + index;
+
+  pSvrInfo->dwSid = MPA_SID_NONE;
+  pSISInfo->pdwSidKeys[index] = MPA_SID_NONE;
+  if (pSISInfo->pdwGroupKeys) {
+    pSISInfo->pdwGroupKeys[index] = 0;
+  }
+  pSvrInfo->dwQkey = 0;
+  pSvrInfo->dwQid = -1;
+  if (index + 1 == (*pSISInfo->pdwSrvInfoSize)) {
+    (*pSISInfo->pdwSrvInfoSize)--;
+    ServerSlotTrim(pSISInfo);
+    return;
+  }
+  pSvrInfo->dwQtype = (*pSISInfo->pdwSrvFree);
+  (*pSISInfo->pdwSrvFree) = index;
+} //}}}
+
+static void ServerSlotTrim(const MPA_SISInfo *pSISInfo) { //{{{
+  DWORD *pdwNext;
+  mpa_index_t index;
+
+  while ((*pSISInfo->pdwSrvInfoSize) > 0) {
+    index = (*pSISInfo->pdwSrvInfoSize) - 1;
+    if ((pSISInfo->pServerInfos + index)->dwSid != MPA_SID_NONE) {
+      break;
+    }
+    for (pdwNext = pSISInfo->pdwSrvFree; (*pdwNext) != index;
+         pdwNext = &(pSISInfo->pServerInfos + (*pdwNext))->dwQtype) {
+    }
+    (*pdwNext) = (pSISInfo->pServerInfos + index)->dwQtype;
+    (*pSISInfo->pdwSrvInfoSize)--;
+  }
+} //}}}
+
+static mpa_index_t TypeSlotAlloc(const MPA_SISInfo *pSISInfo) { //{{{
+  mpa_index_t index = (*pSISInfo->pdwTypeFree);
+
+  if (index != MPA_INDEX_NONE) {
+    (*pSISInfo->pdwTypeFree) = (pSISInfo->pTypeInfos + index)->dwType;
+    return index;
+  }
+  if ((*pSISInfo->pdwTListSize) >= pSISInfo->dwMaxTypeInfo) {
+    return MPA_INDEX_NONE;
+  }
+  return (*pSISInfo->pdwTListSize)++;
+} //}}}
+
+static void TypeSlotFree(const MPA_SISInfo *pSISInfo, mpa_index_t index) { //{{{
+  MPA_SIS_TypeInfo *pTypeInfo = pSISInfo->pTypeInfos + index;
+
+  pTypeInfo->dwSidIndex = MPA_INDEX_NONE;
+  if (index + 1 == (*pSISInfo->pdwTListSize)) {
+    (*pSISInfo->pdwTListSize)--;
+    TypeSlotTrim(pSISInfo);
+    return;
+  }
+  pTypeInfo->dwType = (*pSISInfo->pdwTypeFree);
+  (*pSISInfo->pdwTypeFree) = index;
+} //}}}
+
+static void TypeSlotTrim(const MPA_SISInfo *pSISInfo) { //{{{
+  DWORD *pdwNext;
+  mpa_index_t index;
+
+  while ((*pSISInfo->pdwTListSize) > 0) {
+    index = (*pSISInfo->pdwTListSize) - 1;
+    if ((pSISInfo->pTypeInfos + index)->dwSidIndex != MPA_INDEX_NONE) {
+      break;
+    }
+    for (pdwNext = pSISInfo->pdwTypeFree; (*pdwNext) != index;
+         pdwNext = &(pSISInfo->pTypeInfos + (*pdwNext))->dwType) {
+    }
+    (*pdwNext) = (pSISInfo->pTypeInfos + index)->dwType;
+    (*pSISInfo->pdwTListSize)--;
+  }
+} //}}}
+
+/** Move the last server info into a free slot, and point type infos
+ *  to its new index. Type hash index must be rebuilt by the caller. */
+static Boolean CompactServer(const MPA_SISInfo *pSISInfo) { //{{{
+  DWORD i;
+  mpa_index_t from, to;
+  MPA_SIS_TypeInfo *pTypeInfo;
+
+  ServerSlotTrim(pSISInfo);
+  if ((*pSISInfo->pdwSrvFree) == MPA_INDEX_NONE) {
+    return False;
+  }
+  to = ServerSlotAlloc(pSISInfo);
+  from = (*pSISInfo->pdwSrvInfoSize) - 1;
+
+  SidIndexRemove(pSISInfo, (pSISInfo->pServerInfos + from)->dwSid);
+  memcpy(pSISInfo->pServerInfos + to, pSISInfo->pServerInfos + from, sizeof(MPA_SIS_SrvInfo));
+  pSISInfo->pdwSidKeys[to] = pSISInfo->pdwSidKeys[from];
+  if (pSISInfo->pdwGroupKeys) {
+    pSISInfo->pdwGroupKeys[to] = pSISInfo->pdwGroupKeys[from];
+  }
+  StatMove(pSISInfo, from, to);
+  SidIndexInsert(pSISInfo, (pSISInfo->pServerInfos + to)->dwSid, to);
+  for (i = 0, pTypeInfo = pSISInfo->pTypeInfos; i < (*pSISInfo->pdwTListSize); i++, pTypeInfo++) {
+    if (pTypeInfo->dwSidIndex == from) {
+      pTypeInfo->dwSidIndex = to;
+    }
+  }
+  ServerSlotFree(pSISInfo, from);
+  return True;
+} //}}}
+
+/** Move the last type info into a free slot */
+static Boolean CompactType(const MPA_SISInfo *pSISInfo) { //{{{
+  mpa_index_t from, to;
+
+  TypeSlotTrim(pSISInfo);
+  if ((*pSISInfo->pdwTypeFree) == MPA_INDEX_NONE) {
+    return False;
+  }
+  to = TypeSlotAlloc(pSISInfo);
+  from = (*pSISInfo->pdwTListSize) - 1;
+
+  memcpy(pSISInfo->pTypeInfos + to, pSISInfo->pTypeInfos + from, sizeof(MPA_SIS_TypeInfo));
+  pSISInfo->pdwTypeKeys[to] = pSISInfo->pdwTypeKeys[from];
+  TypeSlotFree(pSISInfo, from);
+  return True;
+} //}}}
+
+static size_t GenerationOffset(size_t nTypeIdxOffset, DWORD dwTypeBuckets,
+                               size_t nNumOfType) { //{{{
+  size_t n = nTypeIdxOffset + sizeof(DWORD) + dwTypeBuckets * sizeof(MPA_SIS_TypeBucket) +
+             nNumOfType * sizeof(mpa_index_t);
+  return (n + sizeof(DWORD) - 1) & ~(sizeof(DWORD) - 1);
+} //}}}
+
+static size_t StatOffset(size_t nKeysEnd) { //{{{
+  return (nKeysEnd + MPA_CACHE_LINE - 1) & ~((size_t)MPA_CACHE_LINE - 1);
+} //}}}
+
+/** Header line, type slots padded to a cache line, a line for the doorbell
+ *  of every server info and the records */
+static size_t StatSize(size_t nNumOfProcess, DWORD dwStripes, DWORD dwTypeSlots) { //{{{
+  return MPA_CACHE_LINE + StatOffset(dwTypeSlots * sizeof(DWORD)) +
+         nNumOfProcess * MPA_CACHE_LINE +
+         (size_t)dwStripes * (nNumOfProcess + dwTypeSlots) * sizeof(MPA_SIS_Stat);
+} //}}}
+
+/** MPA_STAT_STRIPES_MAX stripes, or as many as fit in MPA_STAT_MAX_SIZE, 0
+ *  if even one stripe of nSlots records does not fit. The number does not
+ *  depend on the host, so segments and images are the same everywhere. */
+static DWORD StatStripes(size_t nSlots) { //{{{
+  DWORD n = MPA_STAT_STRIPES_MAX;
+
+  while (n > 0 && n * nSlots * sizeof(MPA_SIS_Stat) > MPA_STAT_MAX_SIZE) {
+    n >>= 1;
+  }
+  return n;
+} //}}}
+
+/** Size of a segment whose group keys end at nKeysEnd, with traffic counters
+ *  and doorbells appended unless even one stripe is too large, which sets
+ *  *pdwStripes to 0 */
+static size_t StatLayout(size_t nKeysEnd, size_t nNumOfProcess, size_t nNumOfType, //{{{
+                         DWORD *pdwStripes, DWORD *pdwTypeSlots) {
+  *pdwTypeSlots = SidIndexBuckets(nNumOfType);
+  if ((*pdwStripes = StatStripes(nNumOfProcess + *pdwTypeSlots)) == 0) {
+    return nKeysEnd;
+  }
+  return StatOffset(nKeysEnd) + StatSize(nNumOfProcess, *pdwStripes, *pdwTypeSlots);
+} //}}}
+
+/** Set stripes and type slots of the zero-filled traffic counters at
+ *  nStatOffset, all type slots free, and the feature flag of them */
+static void StatInit(char *pMPAStart, size_t nStatOffset, DWORD dwStripes, //{{{
+                     DWORD dwTypeSlots) {
+  DWORD *pMPAWork = (DWORD *)(pMPAStart + nStatOffset);
+
+  pMPAWork[0] = dwStripes;
+  pMPAWork[1] = dwTypeSlots;
+  memset(pMPAStart + nStatOffset + MPA_CACHE_LINE, 0xFF, dwTypeSlots * sizeof(DWORD));
+  ((DWORD *)pMPAStart)[2] |= MPA_SIS_FEATURE_STATS;
+} //}}}
+
+/** Records of the stripe of the running CPU */
+static MPA_SIS_Stat *StatStripe(const MPA_SISInfo *pSISInfo) { //{{{
+  int cpu = 0;
+
+#ifdef __linux__
+  if ((cpu = sched_getcpu()) < 0) {
+    cpu = 0;
+  }
+#endif
+  return pSISInfo->pStats + (size_t)((DWORD)cpu & (pSISInfo->dwStatStripes - 1)) *
+                                (pSISInfo->dwMaxSvrInfo + pSISInfo->dwStatTypeSlots);
+} //}}}
+
+/** Find the counter slot of a type, or claim a free one for it if bClaim
+ *  is True. At most MPA_STAT_PROBE_MAX slots are probed; when none of them
+ *  is free the table is marked full and the type is not counted. Slots are
+ *  given back only by StatCompact(). */
+static mpa_index_t StatTypeSlot(const MPA_SISInfo *pSISInfo, DWORD type, //{{{
+                                Boolean bClaim) {
+  DWORD mask = pSISInfo->dwStatTypeSlots - 1;
+  DWORD h = HashKey(type) & mask;
+  DWORD i, key;
+
+  for (i = 0; i < pSISInfo->dwStatTypeSlots && i < MPA_STAT_PROBE_MAX;
+       i++, h = (h + 1) & mask) {
+    key = __atomic_load_n(pSISInfo->pdwStatTypes + h, __ATOMIC_ACQUIRE);
+    if (key == MPA_SID_NONE) {
+      if (bClaim == False) {
+        return MPA_INDEX_NONE;
+      }
+      if (__atomic_compare_exchange_n(pSISInfo->pdwStatTypes + h, &key, type, False,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return h;
+      }
+    }
+    if (key == type) {
+      return h;
+    }
+  }
+  if (bClaim == True && __atomic_load_n(pSISInfo->pdwStatFull, __ATOMIC_RELAXED) == 0) {
+    __atomic_store_n(pSISInfo->pdwStatFull, 1, __ATOMIC_RELAXED);
+  }
+  return MPA_INDEX_NONE;
+} //}}}
+
+/** Give back the counter slots of types which no type info routes any
+ *  more, by claiming slots again from an empty table for the other types
+ *  and adding their counters back. Counts added by senders while the table
+ *  is rebuilt may be lost. Returns the number of slots given back. */
+static size_t StatCompact(const MPA_SISInfo *pSISInfo) { //{{{
+  DWORD i, n = 0, *pdwTypes = NULL;
+  size_t nStride = pSISInfo->dwMaxSvrInfo + pSISInfo->dwStatTypeSlots, nFreed = 0;
+  mpa_index_t slot;
+  MPA_SIS_Stat *pSaved = NULL, *pStat;
+
+  pdwTypes = malloc(pSISInfo->dwStatTypeSlots * sizeof(DWORD));
+  pSaved = malloc(pSISInfo->dwStatTypeSlots * sizeof(MPA_SIS_Stat));
+  check(pdwTypes && pSaved, "Out of memory");
+  for (i = 0; i < pSISInfo->dwStatTypeSlots; i++) {
+    if (pSISInfo->pdwStatTypes[i] == MPA_SID_NONE) {
+      continue;
+    }
+    if (TypeIndexBucket(pSISInfo, pSISInfo->pdwStatTypes[i])->dwCount == 0) {
+      nFreed++;
+      continue;
+    }
+    pdwTypes[n] = pSISInfo->pdwStatTypes[i];
+    StatSum(pSISInfo, pSISInfo->dwMaxSvrInfo + i, pSaved + n);
+    n++;
+  }
+
+  for (i = 0; i < pSISInfo->dwStatTypeSlots; i++) {
+    __atomic_store_n(pSISInfo->pdwStatTypes + i, MPA_SID_NONE, __ATOMIC_RELAXED);
+  }
+  for (i = 0; i < pSISInfo->dwStatStripes; i++) {
+    memset(pSISInfo->pStats + i * nStride + pSISInfo->dwMaxSvrInfo, 0,
+           pSISInfo->dwStatTypeSlots * sizeof(MPA_SIS_Stat));
+  }
+  __atomic_store_n(pSISInfo->pdwStatFull, 0, __ATOMIC_RELEASE);
+
+  for (i = 0; i < n; i++) {
+    if ((slot = StatTypeSlot(pSISInfo, pdwTypes[i], True)) == MPA_INDEX_NONE) {
+      continue;
+    }
+    pStat = pSISInfo->pStats + pSISInfo->dwMaxSvrInfo + slot;
+    __atomic_add_fetch(&pStat->qwSent, pSaved[i].qwSent, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pStat->qwSentBytes, pSaved[i].qwSentBytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pStat->qwRecv, pSaved[i].qwRecv, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pStat->qwRecvBytes, pSaved[i].qwRecvBytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pStat->qwErrors, pSaved[i].qwErrors, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pStat->qwIntr, pSaved[i].qwIntr, __ATOMIC_RELAXED);
+  }
+
+error:
+  free(pdwTypes);
+  free(pSaved);
+  return nFreed;
+} //}}}
+
+static void StatAdd(MPA_SIS_Stat *pStat, int nEvent, size_t nBytes) { //{{{
+  switch (nEvent) {
+  case MPA_STAT_SENT:
+    __atomic_add_fetch(&pStat->qwSent, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pStat->qwSentBytes, nBytes, __ATOMIC_RELAXED);
+    break;
+  case MPA_STAT_RECV:
+    __atomic_add_fetch(&pStat->qwRecv, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pStat->qwRecvBytes, nBytes, __ATOMIC_RELAXED);
+    break;
+  case MPA_STAT_ERROR:
+    __atomic_add_fetch(&pStat->qwErrors, 1, __ATOMIC_RELAXED);
+    break;
+  case MPA_STAT_INTR:
+    __atomic_add_fetch(&pStat->qwIntr, 1, __ATOMIC_RELAXED);
+    break;
+  default:
+    break;
+  }
+} //}}}
+
+/** Add up the records of a slot over all stripes */
+static void StatSum(const MPA_SISInfo *pSISInfo, size_t nSlot, MPA_SIS_Stat *pStat) { //{{{
+  DWORD i;
+  size_t nStride = pSISInfo->dwMaxSvrInfo + pSISInfo->dwStatTypeSlots;
+  const MPA_SIS_Stat *p = pSISInfo->pStats + nSlot;
+
+  memset(pStat, 0, sizeof(MPA_SIS_Stat));
+  for (i = 0; i < pSISInfo->dwStatStripes; i++, p += nStride) {
+    pStat->qwSent += __atomic_load_n(&p->qwSent, __ATOMIC_RELAXED);
+    pStat->qwSentBytes += __atomic_load_n(&p->qwSentBytes, __ATOMIC_RELAXED);
+    pStat->qwRecv += __atomic_load_n(&p->qwRecv, __ATOMIC_RELAXED);
+    pStat->qwRecvBytes += __atomic_load_n(&p->qwRecvBytes, __ATOMIC_RELAXED);
+    pStat->qwErrors += __atomic_load_n(&p->qwErrors, __ATOMIC_RELAXED);
+    pStat->qwIntr += __atomic_load_n(&p->qwIntr, __ATOMIC_RELAXED);
+  }
+} //}}}
+
+static void StatReset(const MPA_SISInfo *pSISInfo, size_t nSlot) { //{{{
+  DWORD i;
+  size_t nStride = pSISInfo->dwMaxSvrInfo + pSISInfo->dwStatTypeSlots;
+
+  for (i = 0; i < pSISInfo->dwStatStripes; i++) {
+    memset(pSISInfo->pStats + i * nStride + nSlot, 0, sizeof(MPA_SIS_Stat));
+  }
+  if (pSISInfo->dwStatStripes > 0) { /**< Waiters look up their server again */
+    WakeWatchers(pSISInfo->pdwDoorbells + nSlot * MPA_DOORBELL_STRIDE);
+  }
+} //}}}
+
+/** Move counters of a server info along with it */
+static void StatMove(const MPA_SISInfo *pSISInfo, size_t nFrom, size_t nTo) { //{{{
+  DWORD i;
+  size_t nStride = pSISInfo->dwMaxSvrInfo + pSISInfo->dwStatTypeSlots;
+
+  for (i = 0; i < pSISInfo->dwStatStripes; i++) {
+    memcpy(pSISInfo->pStats + i * nStride + nTo, pSISInfo->pStats + i * nStride + nFrom,
+           sizeof(MPA_SIS_Stat));
+    memset(pSISInfo->pStats + i * nStride + nFrom, 0, sizeof(MPA_SIS_Stat));
+  }
+  if (pSISInfo->dwStatStripes > 0) {
+    WakeWatchers(pSISInfo->pdwDoorbells + nFrom * MPA_DOORBELL_STRIDE);
+  }
+} //}}}
+
+static int QueueRefCompare(const void *p1, const void *p2) { //{{{
+  const MPA_QueueRef *pRef1 = (const MPA_QueueRef *)p1, *pRef2 = (const MPA_QueueRef *)p2;
+
+  if (pRef1->qid != pRef2->qid) {
+    return (pRef1->qid < pRef2->qid) ? -1 : 1;
+  }
+  return (pRef1->nIndex < pRef2->nIndex) ? -1 : (pRef1->nIndex > pRef2->nIndex);
+} //}}}
+
+/** Read the depth of the queue of an entry with IPC_STAT */
+static void QueueStatRead(MPA_SIS_QueueStat *pStat) { //{{{
+  struct msqid_ds qds;
+
+  memset(&qds, 0, sizeof(struct msqid_ds));
+  pStat->nErrno = (MsqInfo(pStat->dwQid, &qds) == 0) ? 0 : errno;
+  pStat->nMsgs = (size_t)qds.msg_qnum;
+  pStat->nBytes = (size_t)qds.msg_cbytes;
+  pStat->nMaxBytes = (size_t)qds.msg_qbytes;
+  pStat->tSend = qds.msg_stime;
+  pStat->tRecv = qds.msg_rtime;
+} //}}}
+
+static void BumpGeneration(const MPA_SISInfo *pSISInfo) { //{{{
+  if (pSISInfo->pdwGeneration) {
+    __atomic_add_fetch(pSISInfo->pdwGeneration, 1, __ATOMIC_RELEASE);
+    WakeWatchers(pSISInfo->pdwGeneration);
+  }
+} //}}}
+
+/** Wake processes blocked in MPA_SIS_WaitChange() or on a doorbell. The
+ *  futex is shared, not private, as the segment is mapped by many processes. */
+static void WakeWatchers(DWORD *pdwGeneration) { //{{{
+#ifdef __linux__
+  syscall(SYS_futex, pdwGeneration, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+  (void)pdwGeneration;
+#endif
+} //}}}
+
+/** Block while the generation is still dwGeneration, at most for the
+ *  relative timeout or forever if pTimeout is NULL. Returns 0 when woken,
+ *  1 on timeout, 2 when interrupted by a signal, -1 on error. Without futex
+ *  it sleeps for a poll interval and the caller checks the generation
+ *  again. */
+static int WaitGeneration(DWORD *pdwGeneration, DWORD dwGeneration, //{{{
+                          const struct timespec *pTimeout) {
+#ifdef __linux__
+  if (syscall(SYS_futex, pdwGeneration, FUTEX_WAIT, dwGeneration, pTimeout, NULL, 0) == 0) {
+    return 0;
+  }
+  if (errno == ETIMEDOUT) {
+    return 1;
+  }
+  if (errno == EINTR) {
+    return 2;
+  }
+  return (errno == EAGAIN) ? 0 : -1;
+#else
+  struct timespec interval = {0, MPA_WAIT_POLL_NS};
+
+  if (pTimeout && pTimeout->tv_sec == 0 && pTimeout->tv_nsec < interval.tv_nsec) {
+    interval = *pTimeout;
+  }
+  return (nanosleep(&interval, NULL) != 0 && errno == EINTR) ? 2 : 0;
+#endif
+} //}}}
+
+/** Start time of a process in clock ticks after boot, field 22 of
+ *  /proc/<pid>/stat. A pid is reused by later processes, the pid and the
+ *  start time together are not.
+ *
+ *  @return 0 Success
+ *  @return -1 No such process
+ *  @return -2 The start time cannot be read */
+static int ProcessStart(pid_t pid, DWORD *pdwStart) { //{{{
+  int i, fd = -1;
+  ssize_t n;
+  char szPath[32], szStat[512], *psz, *pszEnd;
+  unsigned long long qwStart;
+
+  snprintf(szPath, sizeof(szPath), "/proc/%d/stat", (int)pid);
+  if ((fd = open(szPath, O_RDONLY | O_CLOEXEC)) == -1) {
+    return (errno == ENOENT) ? -1 : -2;
+  }
+  n = read(fd, szStat, sizeof(szStat) - 1);
+  close(fd);
+  if (n <= 0) {
+    return -2;
+  }
+  szStat[n] = '\0';
+  /** The command name in field 2 may hold spaces and parentheses, fields
+   *  are counted from its closing parenthesis */
+  if ((psz = strrchr(szStat, ')')) == NULL) {
+    return -2;
+  }
+  for (i = 2; i < 22 && psz != NULL; i++) {
+    psz = strchr(psz + 1, ' ');
+  }
+  if (psz == NULL) {
+    return -2;
+  }
+  errno = 0;
+  qwStart = strtoull(psz + 1, &pszEnd, 10);
+  if (errno != 0 || pszEnd == psz + 1) {
+    return -2;
+  }
+  (*pdwStart) = (DWORD)qwStart;
+  return 0;
+} //}}}
+
+/** Inode of the pid namespace of the calling process, 0 if it is unknown.
+ *  Pids recorded by processes of another namespace mean nothing here. */
+static DWORD PidNamespace(void) { //{{{
+  struct stat st;
+
+  if (stat("/proc/self/ns/pid", &st) != 0) {
+    return 0;
+  }
+  return (DWORD)st.st_ino;
+} //}}}
+
+/** Called while waiting on an odd sequence. Spins for a while, then yields
+ *  the CPU. If the writer holding the sequence has died, the sequence is
+ *  released on its behalf, otherwise readers and writers would wait forever.
+ *  The writer is taken as dead only if it ran in the same pid namespace and
+ *  no process of its pid and start time exists any more, a writer which
+ *  cannot be checked that way is waited for. */
+static void SeqWait(const MPA_SISInfo *pSISInfo, unsigned int *pnSpins) { //{{{
+  DWORD dwSeq, dwWriter, dwStart, dwNs, dwNow = 0;
+  int nRetCode, err = errno;
+
+  if (++(*pnSpins) < MPA_SEQ_SPINS) {
+    return;
+  }
+  (*pnSpins) = 0;
+
+  dwSeq = __atomic_load_n(pSISInfo->pdwSeq, __ATOMIC_ACQUIRE);
+  /** The pid is stored last by the writer, so the start time and namespace
+   *  read after it are those of the same writer */
+  dwWriter = __atomic_load_n(pSISInfo->pdwWriter, __ATOMIC_ACQUIRE);
+  dwStart = __atomic_load_n(pSISInfo->pdwWriter + 1, __ATOMIC_RELAXED);
+  dwNs = __atomic_load_n(pSISInfo->pdwWriter + 2, __ATOMIC_RELAXED);
+  if ((dwSeq & 1) && dwWriter > 0 && dwNs != 0 && dwNs == PidNamespace()) {
+    nRetCode = ProcessStart((pid_t)dwWriter, &dwNow);
+    if ((nRetCode == -1 || (nRetCode == 0 && dwNow != dwStart)) &&
+        __atomic_compare_exchange_n(pSISInfo->pdwSeq, &dwSeq, dwSeq + 1, 0, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED)) {
+      trace("Released sequence of MPA segment held by dead writer[%u]", dwWriter);
+    }
+  }
+  sched_yield();
+  errno = err;
+} //}}}
+
+static void SeqWriteBegin(const MPA_SISInfo *pSISInfo) { //{{{
+  DWORD dwSeq, dwStart = 0;
+  unsigned int nSpins = 0;
+
+  if (pSISInfo->pdwSeq == NULL) {
+    return;
+  }
+  for (;;) {
+    dwSeq = __atomic_load_n(pSISInfo->pdwSeq, __ATOMIC_RELAXED);
+    if ((dwSeq & 1) == 0 &&
+        __atomic_compare_exchange_n(pSISInfo->pdwSeq, &dwSeq, dwSeq + 1, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      break;
+    }
+    SeqWait(pSISInfo, &nSpins);
+  }
+  /** Without its start time the writer is never taken as dead */
+  if (ProcessStart(getpid(), &dwStart) != 0) {
+    dwStart = 0;
+  }
+  __atomic_store_n(pSISInfo->pdwWriter + 1, dwStart, __ATOMIC_RELAXED);
+  __atomic_store_n(pSISInfo->pdwWriter + 2, (dwStart != 0) ? PidNamespace() : 0,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(pSISInfo->pdwWriter, (DWORD)getpid(), __ATOMIC_RELEASE);
+  /** Odd sequence must be visible before any change of the segment */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+} //}}}
+
+static void SeqWriteEnd(const MPA_SISInfo *pSISInfo) { //{{{
+  if (pSISInfo->pdwSeq == NULL) {
+    return;
+  }
+  __atomic_store_n(pSISInfo->pdwWriter, 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch(pSISInfo->pdwSeq, 1, __ATOMIC_RELEASE);
+} //}}}
+
+/** Begin a write of the segment unless it has been retired: a reload or
+ *  grow publishes the new segment, and retires the old one, under the
+ *  write lock of the old one, so a change made to it after that is lost */
+static int SeqWriteLive(const MPA_SISInfo *pSISInfo) { //{{{
+  SeqWriteBegin(pSISInfo);
+  if (pSISInfo->pdwRetired && __atomic_load_n(pSISInfo->pdwRetired, __ATOMIC_ACQUIRE) != 0) {
+    SeqWriteEnd(pSISInfo);
+    trace("Segment has been retired, map its file again");
+    return MPA_SIS_ERR_RETIRED;
   }
-  fprintf(fp, "\n");
-  fprintf(fp, "###############################end##############################"
-              "######\n");
-  fclose(fp);
   return 0;
 } //}}}
 
-static void DisplaySISInfo(const MPA_SISInfo *pSISInfo) { //{{{
-  int i;
-  MPA_SIS_SrvInfo *pServerInfos;
-  MPA_SIS_TypeInfo *pTypeInfos;
+static DWORD SeqReadBegin(const MPA_SISInfo *pSISInfo) { //{{{
+  DWORD dwSeq;
+  unsigned int nSpins = 0;
 
-  printf("+++++++++++++++++++++++++++++++++++++++++++++\n");
-  printf("最大系统信息数:%d\n", pSISInfo->wMaxSvrInfo);
-  printf("最大交易类型数:%d\n", pSISInfo->wMaxTypeInfo);
-  printf("当前系统信息数:%d\n", (*pSISInfo->pwSrvInfoSize));
-  printf("|进程索引号|系统标识号|消息队列Key|消息队列ID|消息类型|\n");
-  printf("|----------|----------|-----------|----------|--------|\n");
-  for (i = 0, pServerInfos = pSISInfo->pServerInfos; i < (*pSISInfo->pwSrvInfoSize);
-       i++, pServerInfos++) {
-    printf("|%10d|%10d|%11d|0x%08x|%8d|\n", i, pServerInfos->dwSid, pServerInfos->dwQkey,
-           pServerInfos->dwQid, pServerInfos->dwQtype);
+  if (pSISInfo->pdwSeq == NULL) {
+    return 0;
   }
-  printf("当前消息类型数:%d\n", (*pSISInfo->pwTListSize));
-  printf("|类型索引号|  类型号  |系统索引号|进程索引号|\n");
-  printf("|----------|----------|----------|----------|\n");
-  for (i = 0, pTypeInfos = pSISInfo->pTypeInfos; i < (*pSISInfo->pwTListSize); i++, pTypeInfos++) {
-    printf("|%10d|%10d|%10d|%10d|\n", i, pTypeInfos->dwType, pTypeInfos->wSidIndex,
-           (pSISInfo->pServerInfos + pTypeInfos->wSidIndex)->dwSid);
+  while ((dwSeq = __atomic_load_n(pSISInfo->pdwSeq, __ATOMIC_ACQUIRE)) & 1) {
+    SeqWait(pSISInfo, &nSpins);
   }
-  printf("+++++++++++++++++++++++++++++++++++++++++++++\n");
+  return dwSeq;
 } //}}}
 
-static int FindTypeInfo(mpa_index_t index, const MPA_SISInfo *pSISInfo,
-                        DWORD type) { //{{{
-  int i;
-  MPA_SIS_TypeInfo *pTypeInfo;
+static Boolean SeqReadRetry(const MPA_SISInfo *pSISInfo, DWORD dwSeq) { //{{{
+  if (pSISInfo->pdwSeq == NULL) {
+    return False;
+  }
+  /** Reads of the segment must complete before the sequence is checked */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (__atomic_load_n(pSISInfo->pdwSeq, __ATOMIC_RELAXED) != dwSeq) ? True : False;
+} //}}}
+
+static char *MapFile(const char *pszFileName, int nFlags) { //{{{
+  int fd = -1;
+  DWORD dw = 0;
+  char *shmPtr = NULL;
+
+  /**< Open queue information memory map file */
+  fd = open(pszFileName, O_RDWR | O_CLOEXEC, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  check(fd != -1, "Open memory map file error");
 
-  for (i = 0 + index, pTypeInfo = (pSISInfo->pTypeInfos + index); i < (*pSISInfo->pwTListSize);
-       i++, pTypeInfo++) {
-    if (pTypeInfo->dwType == type) {
-      return i;
+  read(fd, &dw, sizeof(DWORD)); /**< Get its size stored in head */
+  check(dw > 0, "Invalid memory map file format");
+
+  lseek(fd, 0, SEEK_SET); /**< Reallocate offset to file head */
+  /**< Map file to memory */
+  /** With huge pages the segment is prefaulted after the advice, or it
+   *  would be populated with small pages */
+  shmPtr = mmap(NULL, (size_t)dw, PROT_READ | PROT_WRITE,
+                MAP_SHARED | ((nFlags & MPA_SIS_MAP_POPULATE) &&
+                                      !(nFlags & MPA_SIS_MAP_HUGEPAGE)
+                                  ? MAP_POPULATE
+                                  : 0),
+                fd, 0);
+  check(shmPtr != MAP_FAILED, "Map file to memory failed");
+  close(fd);
+
+  if (nFlags & MPA_SIS_MAP_HUGEPAGE) {
+#ifdef MADV_HUGEPAGE
+    if (madvise(shmPtr, (size_t)dw, MADV_HUGEPAGE) != 0) {
+      trace("Cannot use huge pages for memory map file[%s], errno=%d", pszFileName, errno);
     }
+#endif
+    if (nFlags & MPA_SIS_MAP_POPULATE) {
+      PrefaultSegment(shmPtr, (size_t)dw);
+    }
+  }
+  if ((nFlags & MPA_SIS_MAP_MLOCK) && mlock(shmPtr, (size_t)dw) != 0) {
+    trace("Cannot lock memory map file[%s] in memory, errno=%d", pszFileName, errno);
+  }
+  return shmPtr;
+
+error:
+  if (fd > 0) {
+    close(fd);
   }
+  return NULL;
+} //}}}
+
+/** Create a file of nSize zeros and map it to memory, shared among
+ *  processes */
+static char *CreateMapFile(const char *pszFileName, size_t nSize) { //{{{
+  int fd = -1, n = 0;
+  char *shmPtr = NULL;
+
+  fd = open(pszFileName, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+            (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  check(fd != -1, "Create memory map file[%s] error", pszFileName);
+  check(ftruncate(fd, (off_t)nSize) == 0, "Resize memory map file[%s] error", pszFileName);
+  /** Allocate its blocks now, so that writes to the mapping cannot fail
+   *  with SIGBUS later when the file system is full */
+  n = posix_fallocate(fd, 0, (off_t)nSize);
+  check(n == 0, "Allocate memory map file[%s] error[%s]", pszFileName, strerror(n));
+
+  shmPtr = mmap(NULL, nSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  check(shmPtr != MAP_FAILED, "Map file[%s] to memory failed", pszFileName);
+  close(fd);
+  return shmPtr;
+
+error:
+  if (fd != -1) {
+    close(fd);
+  }
+  return NULL;
+} //}}}
+
+/** Touch every page of a mapped segment so that it is faulted in */
+static void PrefaultSegment(const char *pMPAStart, size_t nSize) { //{{{
+  size_t nPage = (size_t)sysconf(_SC_PAGESIZE), i = 0;
+  volatile char c;
+
+  for (i = 0; i < nSize; i += nPage) {
+    c = pMPAStart[i];
+  }
+  (void)c;
+} //}}}
+
+/** Version 1 layout, see MPA_SIS_Create() in mpaknl.h. Nothing in the
+ *  header is trusted: the sizes and offsets must keep both lists inside the
+ *  file before any entry is followed, a damaged file is refused instead of
+ *  read out of bounds. */
+static int GetSISInfoV1(const char *pMPAStart, size_t nFileSize, //{{{
+                        MPA_SISInfoV1 *pSISInfo) {
+  WORD *pMPAWork = (WORD *)(pMPAStart + sizeof(DWORD));
+  WORD wTAddrOffset = 0, wTListHeadOffset = 0;
+  size_t nSize;
+
+  check(nFileSize >= sizeof(DWORD) + 5 * sizeof(WORD), "File of [%zu] bytes is too small",
+        nFileSize);
+  pSISInfo->dwTotalSize = *((DWORD *)pMPAStart);
+  check(pSISInfo->dwTotalSize <= nFileSize, "Size[%u] is beyond the end of file[%zu]",
+        pSISInfo->dwTotalSize, nFileSize);
+  nSize = pSISInfo->dwTotalSize;
+  pSISInfo->wMaxSvrInfo = (*pMPAWork++);
+  pSISInfo->wMaxTypeInfo = (*pMPAWork++);
+  pMPAWork++; /**< Server info list follows the server list size */
+  wTAddrOffset = (*pMPAWork++);
+  pSISInfo->pwSrvInfoSize = pMPAWork++;
+  pSISInfo->pServerInfos = ((MPA_SIS_SrvInfo *)pMPAWork);
+  check((size_t)((char *)pMPAWork - pMPAStart) +
+                pSISInfo->wMaxSvrInfo * sizeof(MPA_SIS_SrvInfo) <=
+            nSize,
+        "Server info list of [%u] is beyond the end of segment", pSISInfo->wMaxSvrInfo);
+  check((size_t)wTAddrOffset + 2 * sizeof(WORD) <= nSize,
+        "Type info section[%u] is beyond the end of segment", wTAddrOffset);
+  pMPAWork = (WORD *)(pMPAStart + wTAddrOffset);
+  wTListHeadOffset = (*pMPAWork++);
+  pSISInfo->pTypeInfos = (MPA_SIS_TypeInfoV1 *)(pMPAStart + wTListHeadOffset);
+  pSISInfo->pwTListSize = pMPAWork;
+  check((size_t)wTListHeadOffset + pSISInfo->wMaxTypeInfo * sizeof(MPA_SIS_TypeInfoV1) <= nSize,
+        "Type info list of [%u] is beyond the end of segment", pSISInfo->wMaxTypeInfo);
+  check((*pSISInfo->pwSrvInfoSize) <= pSISInfo->wMaxSvrInfo &&
+            (*pSISInfo->pwTListSize) <= pSISInfo->wMaxTypeInfo,
+        "List sizes[%u/%u] exceed max sizes[%u/%u]", (*pSISInfo->pwSrvInfoSize),
+        (*pSISInfo->pwTListSize), pSISInfo->wMaxSvrInfo, pSISInfo->wMaxTypeInfo);
+  return 0;
+
+error:
   return -1;
 } //}}}
 
-static int FindTypeInfoBySid(const MPA_SISInfo *pSISInfo, DWORD type,
-                             DWORD sid) { //{{{
-  int index, i;
-  MPA_SIS_TypeInfo *pTypeInfo;
+/** Rename a completely built segment over the live one, then retire the
+ *  old segment so its users map the file again */
+static int PublishSegment(const char *pszTmpName, const char *pszFileName) { //{{{
+  char *pOldStart = NULL;
+  MPA_SISInfo OldInfo;
+
+  memset(&OldInfo, 0, sizeof(MPA_SISInfo));
+  if (access(pszFileName, F_OK) == 0) {
+    pOldStart = MapFile(pszFileName, 0);
+    check(pOldStart, "Cannot map memory map file[%s]", pszFileName);
+    GetSISInfo(pOldStart, &OldInfo);
+  }
 
-  if ((index = FindServerInfo(pSISInfo, sid)) == -1) {
-    fprintf(stderr, "该系统标识%d没有注册。请先注册系统信息。\n", sid);
-    return -2;
+  check(rename(pszTmpName, pszFileName) == 0, "Cannot rename [%s] to [%s]", pszTmpName,
+        pszFileName);
+
+  /** Version 1 segments have no retired flag, their users must restart */
+  if (pOldStart && OldInfo.dwVersion == MPA_SIS_VERSION) {
+    __atomic_store_n(OldInfo.pdwRetired, 1, __ATOMIC_RELEASE);
+    BumpGeneration(&OldInfo);
   }
-  for (i = 0, pTypeInfo = (pSISInfo->pTypeInfos); i < (*pSISInfo->pwTListSize); i++, pTypeInfo++) {
-    if (pTypeInfo->dwType == type && pTypeInfo->wSidIndex == index) {
-      return i;
-    }
+  if (pOldStart) {
+    munmap(pOldStart, OldInfo.dwTotalSize);
+  }
+  return 0;
+
+error:
+  if (pOldStart) {
+    munmap(pOldStart, OldInfo.dwTotalSize);
   }
   return -1;
 } //}}}
 
-static int FindServerInfo(const MPA_SISInfo *pSISInfo, DWORD sid) { //{{{
-  int i;
-  MPA_SIS_SrvInfo *pServerInfo;
+/** Take the admin lock of a memory map file, an exclusive flock() on the
+ *  sibling file named `<pszFileName>.lock`. Functions which replace the file
+ *  or change it by its name hold it, so that none of them works on a
+ *  segment retired by another one. Returns the descriptor to pass to
+ *  AdminUnlock(), or -1 on error. */
+static int AdminLock(const char *pszFileName) { //{{{
+  int fd = -1, n = 0;
+  char szLockName[PATH_MAX];
+
+  n = snprintf(szLockName, sizeof(szLockName), "%s.lock", pszFileName);
+  check(n > 0 && (size_t)n < sizeof(szLockName), "File name[%s] is too long", pszFileName);
+  fd = open(szLockName, O_RDWR | O_CREAT | O_CLOEXEC, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+  check(fd != -1, "Cannot open lock file[%s]", szLockName);
+  while (flock(fd, LOCK_EX) != 0) {
+    check(errno == EINTR, "Cannot lock file[%s]", szLockName);
+  }
+  return fd;
 
-  for (i = 0, pServerInfo = pSISInfo->pServerInfos; i < (*pSISInfo->pwSrvInfoSize);
-       i++, pServerInfo++) {
-    if (pServerInfo->dwSid == sid) {
-      return i;
-    }
+error:
+  if (fd != -1) {
+    close(fd);
   }
   return -1;
 } //}}}
 
-static void freeArray(char ***parr, size_t num) {
-  if (*parr == NULL) {
-    return;
+static void AdminUnlock(int fd) { //{{{
+  if (fd != -1) {
+    close(fd);
   }
+} //}}}
+
+/** Capacity to grow to for nNeed entries: twice the current one, or as
+ *  many as needed if that is not enough */
+static size_t GrowCapacity(DWORD dwMax, size_t nNeed) { //{{{
+  size_t n = 2 * (size_t)dwMax;
 
-  char **pp = *parr;
-  for (size_t i = 0; i < num; i++) {
-    free(*(pp + i));
+  if (nNeed <= dwMax) {
+    return dwMax;
   }
-  free(pp);
-  *parr = NULL;
-}
+  if (n > MPA_SIS_MAX_INFO) {
+    n = MPA_SIS_MAX_INFO;
+  }
+  return (n < nNeed) ? nNeed : n;
+} //}}}
 
-static int parseServerInfo(const char *sBuf, DWORD *n1, int *n2, DWORD *n3) {
-  char **pp = NULL;
-  ssize_t m = SplitStrToArray(sBuf, &pp, ":");
-  if (m != 3) {
-    trace("Server info format error[%s]", sBuf);
-    if (m > 0) {
-      freeArray(&pp, (size_t)m);
+/** Copy the entries of a segment into an empty larger one. Entries keep
+ *  their indexes, deleted ones and free lists included, so server indexes
+ *  of type infos stay valid. Hash indexes are rebuilt for the new sizes and
+ *  traffic counters are summed into the first stripe. */
+static void GrowCopy(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo) { //{{{
+  DWORD i, nSize = (*pSISInfo->pdwSrvInfoSize);
+  mpa_index_t slot;
+  MPA_SIS_Stat Stat;
+
+  memcpy(pNewInfo->pServerInfos, pSISInfo->pServerInfos, nSize * sizeof(MPA_SIS_SrvInfo));
+  memcpy(pNewInfo->pdwSidKeys, pSISInfo->pdwSidKeys, nSize * sizeof(DWORD));
+  if (pSISInfo->pdwGroupKeys && pNewInfo->pdwGroupKeys) {
+    memcpy(pNewInfo->pdwGroupKeys, pSISInfo->pdwGroupKeys, nSize * sizeof(DWORD));
+  }
+  (*pNewInfo->pdwSrvInfoSize) = nSize;
+  (*pNewInfo->pdwSrvFree) = (*pSISInfo->pdwSrvFree);
+  for (i = 0; i < nSize; i++) {
+    if (pSISInfo->pdwSidKeys[i] != MPA_SID_NONE) {
+      SidIndexInsert(pNewInfo, pSISInfo->pdwSidKeys[i], (mpa_index_t)i);
     }
-    return -1;
   }
 
-  if (0 != DecimalStrToUInt(*pp, n1)) {
-    trace("Server info format error[%s]", sBuf);
-    freeArray(&pp, (size_t)m);
+  memcpy(pNewInfo->pTypeInfos, pSISInfo->pTypeInfos,
+         (*pSISInfo->pdwTListSize) * sizeof(MPA_SIS_TypeInfo));
+  memcpy(pNewInfo->pdwTypeKeys, pSISInfo->pdwTypeKeys, (*pSISInfo->pdwTListSize) * sizeof(DWORD));
+  (*pNewInfo->pdwTListSize) = (*pSISInfo->pdwTListSize);
+  (*pNewInfo->pdwTypeFree) = (*pSISInfo->pdwTypeFree);
+  TypeIndexRebuild(pNewInfo);
+
+  if (pSISInfo->pStats && pNewInfo->pStats) {
+    for (i = 0; i < nSize; i++) {
+      StatSum(pSISInfo, i, &Stat);
+      memcpy(pNewInfo->pStats + i, &Stat, sizeof(MPA_SIS_Stat));
+    }
+    for (i = 0; i < pSISInfo->dwStatTypeSlots; i++) {
+      if (pSISInfo->pdwStatTypes[i] == MPA_SID_NONE ||
+          (slot = StatTypeSlot(pNewInfo, pSISInfo->pdwStatTypes[i], True)) == MPA_INDEX_NONE) {
+        continue;
+      }
+      StatSum(pSISInfo, pSISInfo->dwMaxSvrInfo + i, &Stat);
+      memcpy(pNewInfo->pStats + pNewInfo->dwMaxSvrInfo + slot, &Stat, sizeof(MPA_SIS_Stat));
+    }
+  }
+  /** Watchers of the old segment move on to a later generation */
+  (*pNewInfo->pdwGeneration) = (*pSISInfo->pdwGeneration) + 1;
+} //}}}
+
+/** Move at most nMax messages of qtype from one queue to another without
+ *  blocking on the source. Unless nMax is 0, which moves all of them and
+ *  waits for room in the destination, a message is taken only if it fits in
+ *  the room left in the destination: it is received with at most as many
+ *  bytes, which leaves a longer one at its place, and moving stops there.
+ *  An empty message, which wakes the receiver of a split queue, is dropped
+ *  if bDropWake is True, otherwise it is put back at the end of the source
+ *  if it has not been taken yet.
+ *  Returns the number of messages moved, or -1 on error, in which case a
+ *  message which cannot be sent is put back at the end of the source. */
+static ssize_t MoveMessages(int qidFrom, int qidTo, DWORD qtype, T_MsgbufM *pBuf, //{{{
+                            size_t nMax, Boolean bDropWake) {
+  ssize_t nMoved = 0, nMsgLen;
+  size_t nRoom = C_MsgbufM;
+  struct msqid_ds qds;
+  Boolean bWake = False;
+
+  if (nMax != 0) {
+    if (MsqInfo(qidTo, &qds) != 0) {
+      return -1;
+    }
+    nRoom = (qds.msg_qbytes > qds.msg_cbytes) ? (size_t)(qds.msg_qbytes - qds.msg_cbytes) : 0;
+  }
+  while ((nMax == 0 || (size_t)nMoved < nMax) &&
+         (nMsgLen = msgrcv(qidFrom, pBuf, (nRoom < C_MsgbufM) ? nRoom : C_MsgbufM, (long)qtype,
+                           IPC_NOWAIT)) >= 0) {
+    if (nMsgLen == 0) {
+      bWake = True;
+      continue;
+    }
+    if (msgsnd(qidTo, pBuf, (size_t)nMsgLen, (nMax == 0) ? 0 : IPC_NOWAIT) != 0) {
+      MsqSend(qidFrom, (T_Msgbuf *)pBuf, (size_t)nMsgLen);
+      nMoved = -1;
+      break;
+    }
+    nMoved++;
+    nRoom -= (nMax == 0) ? 0 : (size_t)nMsgLen;
+  }
+  if (bWake == True && bDropWake == False) {
+    pBuf->mtype = (long)qtype;
+    MsqSend(qidFrom, (T_Msgbuf *)pBuf, 0);
+  }
+  return nMoved;
+} //}}}
+
+/** CRC-32 (IEEE 802.3) of n bytes */
+static DWORD Crc32(const char *p, size_t n) { //{{{
+  DWORD table[256], crc = 0, i = 0, k = 0;
+
+  for (i = 0; i < 256; i++) {
+    for (crc = i, k = 0; k < 8; k++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320U : crc >> 1;
+    }
+    table[i] = crc;
+  }
+  for (crc = 0xFFFFFFFFU; n > 0; n--, p++) {
+    crc = table[(crc ^ (BYTE)*p) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFU;
+} //}}}
+
+/** Check footer, checksum and the layout of a compiled image, and that the
+ *  indexes of the image only refer to entries inside it */
+static Boolean ImageValid(const char *pImage, size_t nSize) { //{{{
+  const DWORD *pdwHead = (const DWORD *)pImage;
+  const DWORD *pdwFooter = NULL;
+  const char *pEnd = NULL;
+  MPA_SISInfo SISInfo;
+  MPA_SIS_TypeBucket *pBucket = NULL;
+  size_t nOffset = 0;
+  DWORD dwBuckets = 0, i = 0, j = 0;
+
+  check(nSize >= 12 * sizeof(DWORD), "Image is too small[%zu]", nSize);
+  check(pdwHead[0] % sizeof(DWORD) == 0 && (size_t)pdwHead[0] + 2 * sizeof(DWORD) == nSize,
+        "Size of image[%u] does not match its file[%zu]", pdwHead[0], nSize);
+  pdwFooter = (const DWORD *)(pImage + pdwHead[0]);
+  check(pdwFooter[0] == MPA_SIS_IMAGE_MAGIC, "Invalid magic number of image[0x%08X]",
+        pdwFooter[0]);
+  check(pdwFooter[1] == Crc32(pImage, pdwHead[0]), "Checksum of image mismatched");
+  check(pdwHead[1] == MPA_SIS_MAGIC && (pdwHead[2] & ~MPA_SIS_FEATURE_MASK) == MPA_SIS_VERSION,
+        "Image is not of version %d", MPA_SIS_VERSION);
+  check(pdwHead[3] <= MPA_SIS_MAX_INFO && pdwHead[4] <= MPA_SIS_MAX_INFO &&
+            pdwHead[5] < pdwHead[0] && pdwHead[6] < pdwHead[0],
+        "Invalid header of image");
+
+  /** Offsets which GetSISInfo() reads from the image itself */
+  check(8 * sizeof(DWORD) + (size_t)pdwHead[3] * sizeof(MPA_SIS_SrvInfo) <= pdwHead[6] &&
+            pdwHead[6] % sizeof(DWORD) == 0 &&
+            (size_t)pdwHead[6] + 2 * sizeof(DWORD) <= pdwHead[0],
+        "Invalid server info section of image");
+  nOffset = SidIndexOffset(*((const DWORD *)(pImage + pdwHead[6])), pdwHead[4]);
+  check(nOffset + sizeof(DWORD) <= pdwHead[0], "Invalid type info section of image");
+  dwBuckets = *((const DWORD *)(pImage + nOffset));
+  check(dwBuckets != 0 && (dwBuckets & (dwBuckets - 1)) == 0, "Invalid sid buckets of image[%u]",
+        dwBuckets);
+  nOffset = TypeIndexOffset(nOffset, dwBuckets);
+  check(nOffset + sizeof(DWORD) <= pdwHead[0], "Invalid sid index of image");
+  dwBuckets = *((const DWORD *)(pImage + nOffset));
+  check(dwBuckets != 0 && (dwBuckets & (dwBuckets - 1)) == 0,
+        "Invalid type buckets of image[%u]", dwBuckets);
+  nOffset = GenerationOffset(nOffset, dwBuckets, pdwHead[4]);
+  check(nOffset + (8 + (size_t)pdwHead[3] + pdwHead[4]) * sizeof(DWORD) <= pdwHead[0],
+        "Invalid type index of image");
+
+  /** Images end with the group ids */
+  GetSISInfo(pImage, &SISInfo);
+  pEnd = (SISInfo.pdwGroupKeys) ? (const char *)(SISInfo.pdwGroupKeys + SISInfo.dwMaxSvrInfo)
+                                : NULL;
+  check(pEnd == pImage + pdwHead[0] && (pdwHead[2] & MPA_SIS_FEATURE_STATS) == 0,
+        "Invalid layout of image");
+  check((*SISInfo.pdwSrvInfoSize) <= SISInfo.dwMaxSvrInfo &&
+            (*SISInfo.pdwTListSize) <= SISInfo.dwMaxTypeInfo,
+        "Invalid list size of image");
+  for (i = 0; i < (*SISInfo.pdwTListSize); i++) {
+    check((SISInfo.pTypeInfos + i)->dwSidIndex == MPA_INDEX_NONE ||
+              (SISInfo.pTypeInfos + i)->dwSidIndex < (*SISInfo.pdwSrvInfoSize),
+          "Invalid server index of type info[%u]", i);
+  }
+  for (i = 0; i < SISInfo.dwSidBuckets; i++) {
+    check(SISInfo.pSidHash[i] == MPA_INDEX_NONE || SISInfo.pSidHash[i] < SISInfo.dwMaxSvrInfo,
+          "Invalid sid index bucket of image[%u]", i);
+  }
+  for (i = 0; i < SISInfo.dwTypeBuckets; i++) {
+    pBucket = SISInfo.pTypeHash + i;
+    check((size_t)pBucket->dwStart + pBucket->dwCount <= SISInfo.dwMaxTypeInfo,
+          "Invalid type index bucket of image[%u]", i);
+    for (j = 0; j < pBucket->dwCount; j++) {
+      check(SISInfo.pSubscribers[pBucket->dwStart + j] < (*SISInfo.pdwSrvInfoSize),
+            "Invalid subscriber of type index bucket of image[%u]", i);
+    }
+  }
+  return True;
+
+error:
+  return False;
+} //}}}
+
+/** Cut white spaces off both ends of a string in place */
+static char *TrimSpace(char *psz) { //{{{
+  char *pEnd;
+
+  while (isspace((unsigned char)*psz)) {
+    psz++;
+  }
+  for (pEnd = psz + strlen(psz); pEnd > psz && isspace((unsigned char)pEnd[-1]); pEnd--) {
+  }
+  *pEnd = '\0';
+  return psz;
+} //}}}
+
+/** Parse a decimal number ending at sep or at the end of string, and move
+ *  *ppsz past the separator */
+static int ParseNumber(const char **ppsz, char sep, long long *pValue) { //{{{
+  char *pEnd;
+
+  errno = 0;
+  *pValue = strtoll(*ppsz, &pEnd, 10);
+  if (pEnd == *ppsz || errno != 0) {
     return -1;
   }
-  if (0 != DecimalStrToInt(*(pp + 1), n2)) {
-    trace("Server info format error[%s]", sBuf);
-    freeArray(&pp, (size_t)m);
+  while (isspace((unsigned char)*pEnd)) {
+    pEnd++;
+  }
+  if (*pEnd != sep) {
     return -1;
   }
-  if (0 != DecimalStrToUInt(*(pp + 2), n3)) {
+  *ppsz = (sep == '\0') ? pEnd : pEnd + 1;
+  return 0;
+} //}}}
+
+/** Check a number parsed for a DWORD field, MPA_SID_NONE is reserved for
+ *  deleted and empty entries */
+static Boolean DwordValid(long long n) { //{{{
+  return (n >= 0 && n < (long long)MPA_SID_NONE) ? True : False;
+} //}}}
+
+/** Parse `sid:qkey:qtype`, followed by `:gid` for members of a group */
+static int parseServerInfo(const char *sBuf, DWORD *n1, int *n2, DWORD *n3, DWORD *n4) {
+  const char *p = sBuf, *pQtype = NULL;
+  long long sid, qkey, qtype, gid = 0;
+
+  if (0 != ParseNumber(&p, ':', &sid) || 0 != ParseNumber(&p, ':', &qkey)) {
     trace("Server info format error[%s]", sBuf);
-    freeArray(&pp, (size_t)m);
     return -1;
   }
-  freeArray(&pp, (size_t)m);
+  pQtype = p;
+  if (0 != ParseNumber(&p, '\0', &qtype)) {
+    p = pQtype;
+    if (0 != ParseNumber(&p, ':', &qtype) || 0 != ParseNumber(&p, '\0', &gid) || gid < 0) {
+      trace("Server info format error[%s]", sBuf);
+      return -1;
+    }
+  }
+  if (DwordValid(sid) == False || DwordValid(qtype) == False || DwordValid(gid) == False ||
+      qkey < INT_MIN || qkey > UINT_MAX) {
+    trace("Server info out of range[%s]", sBuf);
+    return -1;
+  }
+  *n1 = (DWORD)sid;
+  *n2 = (int)(DWORD)qkey; /**< Keys above INT_MAX are written unsigned */
+  *n3 = (DWORD)qtype;
+  *n4 = (DWORD)gid;
   return 0;
 }
 
 static int parseTypeInfo(const char *sBuf, DWORD *n1, DWORD *n3) {
-  char **pp = NULL;
-  ssize_t m = SplitStrToArray(sBuf, &pp, ":");
-  if (m != 2) {
-    trace("Type info format error[%s]", sBuf);
-    if (m > 0) {
-      freeArray(&pp, (size_t)m);
-    }
-    return -1;
-  }
+  const char *p = sBuf;
+  long long type, sid;
 
-  if (0 != DecimalStrToUInt(*pp, n1)) {
+  if (0 != ParseNumber(&p, ':', &type) || 0 != ParseNumber(&p, '\0', &sid)) {
     trace("Type info format error[%s]", sBuf);
-    freeArray(&pp, (size_t)m);
     return -1;
   }
-  if (0 != DecimalStrToUInt(*(pp + 1), n3)) {
-    trace("Type info format error[%s]", sBuf);
-    freeArray(&pp, (size_t)m);
+  if (DwordValid(type) == False || DwordValid(sid) == False) {
+    trace("Type info out of range[%s]", sBuf);
     return -1;
   }
-  freeArray(&pp, (size_t)m);
+  *n1 = (DWORD)type;
+  *n3 = (DWORD)sid;
   return 0;
 }
 
-static int LoadFromFile(const char *pszSHMFileName,
-                        const char *pszINIFileName) { //{{{
-  ssize_t nRetCode = -1;
-  int i = 0;
+/** Read a profile from the beginning to the end in one pass without any
+ *  allocation, and call pfnHandler with the section, key and value of each
+ *  line of `key = value`. Blank lines, comments and lines too long are
+ *  skipped. pfnHandler returns 0 to go on, 1 to stop or -1 on error. */
+static int StreamProfile(const char *pszFileName, ProfileHandler pfnHandler, //{{{
+                         void *pCtx) {
+  FILE *fp = NULL;
+  char sLine[1024], sSection[64] = "";
+  char *pKey, *pValue;
+  size_t n;
+  int c, nRetCode = 0;
+
+  fp = fopen(pszFileName, "re");
+  check(fp, "Cannot open file[%s]", pszFileName);
+  while (nRetCode == 0 && fgets(sLine, sizeof(sLine), fp)) {
+    n = strlen(sLine);
+    if (n == sizeof(sLine) - 1 && sLine[n - 1] != '\n') {
+      trace("Line too long in file[%s], skipped[%.32s...]", pszFileName, sLine);
+      while ((c = fgetc(fp)) != EOF && c != '\n') {
+      }
+      continue;
+    }
+    pKey = TrimSpace(sLine);
+    if (*pKey == '\0' || *pKey == '#' || *pKey == ';') {
+      continue;
+    }
+    if (*pKey == '[') {
+      if ((pValue = strchr(pKey, ']')) != NULL) {
+        *pValue = '\0';
+        snprintf(sSection, sizeof(sSection), "%s", TrimSpace(pKey + 1));
+      }
+      continue;
+    }
+    if ((pValue = strchr(pKey, '=')) == NULL) {
+      continue;
+    }
+    *pValue++ = '\0';
+    nRetCode = pfnHandler(sSection, TrimSpace(pKey), TrimSpace(pValue), pCtx);
+  }
+  fclose(fp);
+  return (nRetCode < 0) ? -1 : 0;
 
-  char *pMPAStart = NULL;
+error:
+  return -1;
+} //}}}
 
-  int nMaxServerInfoNums = 0, nMaxTypeInfoNums = 0;
-  int nCurServerInfoNums = 99, nCurTypeInfoNums = 99;
-  int version = 1;
-  char sBuf[1024], sBuf1[11];
-  key_t n2 = 0;
-  DWORD n1 = 0, n3 = 0;
+/** Read keys of [main], stop at the first key of the next section */
+static int HandleMainKey(const char *pszSection, const char *pszKey, //{{{
+                         const char *pszValue, void *pCtx) {
+  MPA_ProfileLoad *pLoad = (MPA_ProfileLoad *)pCtx;
+  const char *p = pszValue;
+  long long n = 0;
 
-  check(0 == GetProfileInt(MPA_PF_MAIN_SEC, MPA_PF_MAXSVRINFONUM, 10, pszINIFileName,
-                           &nMaxServerInfoNums),
-        "Cannot read max server number from file[%s]", pszINIFileName);
-  check(nMaxServerInfoNums >= 0, "Invalid max server number[%d]", nMaxServerInfoNums);
-  check(nMaxServerInfoNums <= USHRT_MAX, "Invalid max server number[%d]", nMaxServerInfoNums);
+  if (strcmp(pszSection, MPA_PF_MAIN_SEC) != 0) {
+    return (pLoad->bMainSeen == True) ? 1 : 0;
+  }
+  pLoad->bMainSeen = True;
+  if (strcmp(pszKey, MPA_PF_MAXSVRINFONUM) == 0) {
+    check(ParseNumber(&p, '\0', &n) == 0 && n >= 0 && n <= (long long)MPA_SIS_MAX_INFO,
+          "Invalid max server number[%s]", pszValue);
+    pLoad->nMaxSvrInfo = (size_t)n;
+  } else if (strcmp(pszKey, MPA_PF_MAXMSGTYPEINFONUM) == 0) {
+    check(ParseNumber(&p, '\0', &n) == 0 && n >= 0 && n <= (long long)MPA_SIS_MAX_INFO,
+          "Invalid max type number[%s]", pszValue);
+    pLoad->nMaxTypeInfo = (size_t)n;
+  } else if (strcmp(pszKey, MPA_PF_VERSION) == 0) {
+    check(ParseNumber(&p, '\0', &n) == 0, "Invalid version[%s]", pszValue);
+    pLoad->nVersion = (int)n;
+  }
+  return 0;
 
-  check(0 == GetProfileInt(MPA_PF_MAIN_SEC, MPA_PF_MAXMSGTYPEINFONUM, 100, pszINIFileName,
-                           &nMaxTypeInfoNums),
-        "Cannot read max type number from file[%s]", pszINIFileName);
-  check(nMaxTypeInfoNums >= 0, "Invalid max type number[%d]", nMaxTypeInfoNums);
-  check(nMaxTypeInfoNums <= USHRT_MAX, "Invalid max type number[%d]", nMaxTypeInfoNums);
+error:
+  return -1;
+} //}}}
 
-  // create share memory
-  nRetCode = MPA_SIS_Create(pszSHMFileName, (size_t)nMaxServerInfoNums, (size_t)nMaxTypeInfoNums);
-  check(nRetCode == 0, "Cannot initialize MPA memory map file[%s]", pszSHMFileName);
-  pMPAStart = MPA_SIS_Init(pszSHMFileName);
-  check(pMPAStart, "Cannot mount MPA memory map file[%s] to memory", pszSHMFileName);
+/** Version 2 profiles take every key of a list section, version 1 profiles
+ *  take `<prefix><n>` with n less than the number of the section */
+static Boolean EntryKeyAccepted(const MPA_ProfileLoad *pLoad, const char *pszKey, //{{{
+                                char prefix, long long nNum) {
+  const char *p = pszKey + 1;
+  long long n = 0;
 
-  check(0 == GetProfileInt(MPA_PF_MAIN_SEC, MPA_PF_VERSION, version, pszINIFileName, &version),
-        "Cannot read version from file[%s]", pszINIFileName);
-  if (version == 2) {
-    return LoadFromList(pMPAStart, pszINIFileName, (size_t)nMaxServerInfoNums,
-                        (size_t)nMaxTypeInfoNums);
+  if (pLoad->nVersion == 2) {
+    return True;
   }
+  return (pszKey[0] == prefix && ParseNumber(&p, '\0', &n) == 0 && n >= 0 && n < nNum) ? True
+                                                                                       : False;
+} //}}}
 
-  // Version 1.0 Loading Procedure
-  check(0 == GetProfileInt(MPA_PF_SERVER_SEC, MPA_PF_SVRNUM, nCurServerInfoNums, pszINIFileName,
-                           &nCurServerInfoNums),
-        "Cannot read current server number from file[%s]", pszINIFileName);
-  check(0 == GetProfileInt(MPA_PF_MSGTYPE_SEC, MPA_PF_TYPE_NUM, nCurTypeInfoNums, pszINIFileName,
-                           &nCurTypeInfoNums),
-        "Cannot read current type number from file[%s]", pszINIFileName);
-
-  // load server info
-  for (i = 0; i < nCurServerInfoNums; i++) {
-    sprintf(sBuf1, "s%d", i);
+/** Add server and type infos, type infos listed before [server] are left
+ *  to a second pass of types only */
+static int HandleEntryKey(const char *pszSection, const char *pszKey, //{{{
+                          const char *pszValue, void *pCtx) {
+  MPA_ProfileLoad *pLoad = (MPA_ProfileLoad *)pCtx;
+  const char *p = pszValue;
+  long long n = 0;
+  DWORD n1 = 0, n3 = 0, n4 = 0;
+  key_t n2 = 0;
+  Boolean bNewQueue = False;
 
-    if ((nRetCode = GetProfileString(MPA_PF_SERVER_SEC, sBuf1, "", sBuf, 1024, pszINIFileName)) <=
-        0) {
-      break;
+  if (strcmp(pszSection, MPA_PF_SERVER_SEC) == 0) {
+    pLoad->bServerSeen = True;
+    if (pLoad->bTypesOnly == True) {
+      return 1;
     }
-
-    if (0 != parseServerInfo(sBuf, &n1, &n2, &n3)) {
-      continue;
+    if (strcmp(pszKey, MPA_PF_SVRNUM) == 0) {
+      check(ParseNumber(&p, '\0', &n) == 0, "Invalid server number[%s]", pszValue);
+      pLoad->nSvrNum = n;
+      return 0;
+    }
+    if (EntryKeyAccepted(pLoad, pszKey, 's', pLoad->nSvrNum) == False) {
+      return 0;
+    }
+    if (pLoad->nServers >= pLoad->nMaxSvrInfo) {
+      pLoad->bCapped = True;
+      return 0;
+    }
+    if (0 != parseServerInfo(pszValue, &n1, &n2, &n3, &n4)) {
+      return 0;
+    }
+    /** Queue does not exist, it is created by AddServerInfo() */
+    bNewQueue = (pLoad->bCompile == False && MPA_CheckMsgQ(n2) == -1) ? True : False;
+    if (AddServerInfo(pLoad->pSISInfo, n1, n2, n3, n4,
+                      (pLoad->bCompile == True) ? False : True) == 0) {
+      pLoad->nServers++;
+      pLoad->nQueues += (bNewQueue == True) ? 1 : 0;
+    }
+  } else if (strcmp(pszSection, MPA_PF_MSGTYPE_SEC) == 0) {
+    if (strcmp(pszKey, MPA_PF_TYPE_NUM) == 0) {
+      check(ParseNumber(&p, '\0', &n) == 0, "Invalid type number[%s]", pszValue);
+      pLoad->nTypeNum = n;
+      return 0;
+    }
+    if (pLoad->bServerSeen == False && pLoad->bTypesOnly == False) {
+      pLoad->bTypesDeferred = True;
+      return 0;
+    }
+    if (EntryKeyAccepted(pLoad, pszKey, 't', pLoad->nTypeNum) == False) {
+      return 0;
+    }
+    if (pLoad->nTypes >= pLoad->nMaxTypeInfo) {
+      pLoad->bCapped = True;
+      return 0;
+    }
+    if (0 != parseTypeInfo(pszValue, &n1, &n3)) {
+      return 0;
+    }
+    if (AddTypeInfo(pLoad->pSISInfo, n1, n3) == 0) {
+      pLoad->nTypes++;
     }
-
-    MPA_SIS_SInfoAdd(pMPAStart, n1, n2, n3);
   }
-  // load type info
-  for (i = 0; i < nCurTypeInfoNums; i++) {
-    sprintf(sBuf1, "t%d", i);
+  return 0;
 
-    if ((nRetCode = GetProfileString(MPA_PF_MSGTYPE_SEC, sBuf1, "", sBuf, 1024, pszINIFileName)) <=
-        0) {
-      break;
+error:
+  return -1;
+} //}}}
+
+/** Check if the type has the server of the index as a subscriber, by the
+ *  type hash index */
+static Boolean TypeSubscribed(const MPA_SISInfo *pSISInfo, DWORD type, //{{{
+                              mpa_index_t index) {
+  DWORD i;
+  MPA_SIS_TypeBucket *pBucket = TypeIndexBucket(pSISInfo, type);
+
+  for (i = 0; i < pBucket->dwCount; i++) {
+    if (pSISInfo->pSubscribers[pBucket->dwStart + i] == index) {
+      return True;
     }
+  }
+  return False;
+} //}}}
 
-    if (0 != parseTypeInfo(sBuf, &n1, &n3)) {
+/** Create the message queue of every new server info whose queue key is not
+ *  in the live segment yet and keep its id in the scratch segment. Server
+ *  infos whose queue key is unchanged keep the live queue id. */
+static int DiffQueues(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo) { //{{{
+  int index = -1, qid = -1;
+  key_t qkey = 0;
+  DWORD i;
+  MPA_SIS_SrvInfo *pNewSvr;
+
+  for (i = 0, pNewSvr = pNewInfo->pServerInfos; i < (*pNewInfo->pdwSrvInfoSize); i++, pNewSvr++) {
+    index = FindServerInfo(pSISInfo, pNewSvr->dwSid);
+    if (index >= 0 && (pSISInfo->pServerInfos + index)->dwQkey == pNewSvr->dwQkey) {
+      pNewSvr->dwQid = (pSISInfo->pServerInfos + index)->dwQid;
       continue;
     }
-
-    MPA_SIS_TInfoAdd(pMPAStart, n1, n3);
+    if (qid < 0 || pNewSvr->dwQkey != qkey) {
+      qkey = pNewSvr->dwQkey;
+      qid = MsqCreate(qkey, C_MsqRW);
+      check(qid >= 0, "Cannot create message queue[qkey=%d]", qkey);
+    }
+    pNewSvr->dwQid = qid;
   }
   return 0;
 
 error:
   return -1;
-} // }}}
-
-static int LoadFromList(const char *pMPAStart, const char *pszINIFileName, //{{{
-                        size_t nMaxServerInfoNums, size_t nMaxTypeInfoNums) {
-  node_t *serverList = NULL;
-  node_t *typeList = NULL;
-  ssize_t serverNums = 0, typeNums = 0;
-  char sBuf[1024];
-  key_t n2 = 0;
-  int qcount = 0;
-  DWORD n1 = 0, n3 = 0;
+} //}}}
 
-  trace("Loading server information from [%s]...", pszINIFileName);
-  serverNums = GetProfileList(MPA_PF_SERVER_SEC, &serverList, nMaxServerInfoNums, pszINIFileName);
-  check(serverNums >= 0, "Cannot read list of [%s]", MPA_PF_SERVER_SEC);
-  check(serverNums <= USHRT_MAX, "Too many server infos[%ld]", serverNums);
-  while (serverList) {
-    serverList = remove_node(serverList, sBuf, 1024);
+/** Mark type infos of the scratch segment missing in the live one, before
+ *  the live type hash index is changed by removals */
+static void DiffMarkTypes(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo, //{{{
+                          unsigned char *pbAdd) {
+  int index = -1;
+  DWORD i;
+  MPA_SIS_TypeInfo *pNewType;
 
-    if (0 != parseServerInfo(sBuf, &n1, &n2, &n3)) {
-      continue;
+  for (i = 0, pNewType = pNewInfo->pTypeInfos; i < (*pNewInfo->pdwTListSize); i++, pNewType++) {
+    index = FindServerInfo(pSISInfo, (pNewInfo->pServerInfos + pNewType->dwSidIndex)->dwSid);
+    if (index < 0 || TypeSubscribed(pSISInfo, pNewType->dwType, (mpa_index_t)index) == False) {
+      pbAdd[i] = 1;
     }
+  }
+} //}}}
+
+/** Remove live type infos and server infos missing in the scratch segment,
+ *  and update server infos whose queue changed. Type infos go first as they
+ *  hold indexes of server infos. */
+static void DiffRemove(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo, //{{{
+                       MPA_ConfigDiff *pDiff) {
+  int index = -1;
+  DWORD i;
+  MPA_SIS_SrvInfo *pSvrInfo, *pNewSvr;
+  MPA_SIS_TypeInfo *pTypeInfo;
 
-    if (MPA_CheckQKey(n2, pMPAStart) == 0) {
-      qcount++;
+  for (i = (*pSISInfo->pdwTListSize); i > 0; i--) {
+    pTypeInfo = pSISInfo->pTypeInfos + i - 1;
+    if (pTypeInfo->dwSidIndex == MPA_INDEX_NONE) {
+      continue;
+    }
+    index = FindServerInfo(pNewInfo, (pSISInfo->pServerInfos + pTypeInfo->dwSidIndex)->dwSid);
+    if (index < 0 || TypeSubscribed(pNewInfo, pTypeInfo->dwType, (mpa_index_t)index) == False) {
+      TypeSlotFree(pSISInfo, i - 1);
+      pDiff->nTypeRemoved++;
     }
-    MPA_SIS_SInfoAdd(pMPAStart, n1, n2, n3);
   }
-  trace("Loading server information...Done.\n"
-        ">  Loaded [%d] item(s).\n"
-        ">  Created [%d] message queue(s).",
-        serverNums, qcount);
-
-  if (serverNums >= (ssize_t)nMaxServerInfoNums) {
-    trace("WARNING: Some server informations may not be loaded due to the "
-          "max_serverinfo_nums cap setting[%d] in [%s]",
-          nMaxServerInfoNums, pszINIFileName);
+  for (i = (*pSISInfo->pdwSrvInfoSize); i > 0; i--) {
+    pSvrInfo = pSISInfo->pServerInfos + i - 1;
+    if (pSvrInfo->dwSid == MPA_SID_NONE) {
+      continue;
+    }
+    if ((index = FindServerInfo(pNewInfo, pSvrInfo->dwSid)) < 0) {
+      SidIndexRemove(pSISInfo, pSvrInfo->dwSid);
+      ServerSlotFree(pSISInfo, i - 1);
+      pDiff->nSvrRemoved++;
+      continue;
+    }
+    pNewSvr = pNewInfo->pServerInfos + index;
+    if (pSvrInfo->dwQkey != pNewSvr->dwQkey || pSvrInfo->dwQtype != pNewSvr->dwQtype ||
+        ServerGroup(pSISInfo, i - 1) != ServerGroup(pNewInfo, (mpa_index_t)index)) {
+      pSvrInfo->dwQkey = pNewSvr->dwQkey;
+      pSvrInfo->dwQid = pNewSvr->dwQid;
+      pSvrInfo->dwQtype = pNewSvr->dwQtype;
+      if (pSISInfo->pdwGroupKeys) {
+        pSISInfo->pdwGroupKeys[i - 1] = ServerGroup(pNewInfo, (mpa_index_t)index);
+      }
+      pDiff->nSvrChanged++;
+    }
   }
+} //}}}
 
-  trace("Loading type information from [%s]...", pszINIFileName);
-  typeNums = GetProfileList(MPA_PF_MSGTYPE_SEC, &typeList, nMaxTypeInfoNums, pszINIFileName);
-  check(typeNums >= 0, "Cannot read list of [%s]", MPA_PF_MSGTYPE_SEC);
-  check(typeNums <= USHRT_MAX, "Too many type infos[%ld]", typeNums);
-  while (typeList) {
-    typeList = remove_node(typeList, sBuf, 1024);
-
-    if (0 != parseTypeInfo(sBuf, &n1, &n3)) {
+/** Add server infos and marked type infos of the scratch segment to the
+ *  live one, in free slots first. An entry which cannot be added is skipped
+ *  and the others are still added. Returns 0 if all of them are added, -1
+ *  otherwise. */
+static int DiffAdd(const MPA_SISInfo *pSISInfo, const MPA_SISInfo *pNewInfo, //{{{
+                   const unsigned char *pbAdd, MPA_ConfigDiff *pDiff) {
+  int index = -1, nRetCode = 0;
+  DWORD i, sid;
+  MPA_SIS_SrvInfo *pNewSvr;
+  MPA_SIS_TypeInfo *pNewType;
+
+  for (i = 0, pNewSvr = pNewInfo->pServerInfos; i < (*pNewInfo->pdwSrvInfoSize); i++, pNewSvr++) {
+    if (FindServerInfo(pSISInfo, pNewSvr->dwSid) >= 0) {
       continue;
     }
-
-    MPA_SIS_TInfoAdd(pMPAStart, n1, n3);
+    if (AddServerInfo(pSISInfo, pNewSvr->dwSid, pNewSvr->dwQkey, pNewSvr->dwQtype,
+                      ServerGroup(pNewInfo, i), False) != 0) {
+      trace("Cannot add server info[sid=%u]", pNewSvr->dwSid);
+      nRetCode = -1;
+      continue;
+    }
+    index = FindServerInfo(pSISInfo, pNewSvr->dwSid);
+    (pSISInfo->pServerInfos + index)->dwQid = pNewSvr->dwQid;
+    pDiff->nSvrAdded++;
+  }
+  for (i = 0, pNewType = pNewInfo->pTypeInfos; i < (*pNewInfo->pdwTListSize); i++, pNewType++) {
+    if (pbAdd[i] == 0) {
+      continue;
+    }
+    sid = (pNewInfo->pServerInfos + pNewType->dwSidIndex)->dwSid;
+    if (AddTypeInfo(pSISInfo, pNewType->dwType, sid) != 0) {
+      trace("Cannot add type info[type=%u, sid=%u]", pNewType->dwType, sid);
+      nRetCode = -1;
+      continue;
+    }
+    pDiff->nTypeAdded++;
   }
-  trace("Loading type information...Done.\n>  Loaded [%d] item(s).", typeNums);
+  return nRetCode;
+} //}}}
+
+static int LoadFromFile(const char *pszSHMFileName, const char *pszINIFileName, //{{{
+                        Boolean bCompile) {
+  int nRetCode = -1;
+  char *pMPAStart = NULL;
+  MPA_SISInfo SISInfo;
+  MPA_ProfileLoad Load;
+
+  memset(&Load, 0, sizeof(MPA_ProfileLoad));
+  Load.nMaxSvrInfo = 10;
+  Load.nMaxTypeInfo = 100;
+  Load.nVersion = 1;
+  Load.nSvrNum = 99;
+  Load.nTypeNum = 99;
+  Load.bCompile = bCompile;
+  check(0 == StreamProfile(pszINIFileName, HandleMainKey, &Load),
+        "Cannot read section [%s] from file[%s]", MPA_PF_MAIN_SEC, pszINIFileName);
+
+  // create share memory
+  nRetCode = MPA_SIS_Create(pszSHMFileName, Load.nMaxSvrInfo, Load.nMaxTypeInfo);
+  check(nRetCode == 0, "Cannot initialize MPA memory map file[%s]", pszSHMFileName);
+  pMPAStart = MPA_SIS_Init(pszSHMFileName);
+  check(pMPAStart, "Cannot mount MPA memory map file[%s] to memory", pszSHMFileName);
 
-  if (typeNums >= (ssize_t)nMaxTypeInfoNums) {
-    trace("WARNING: Some type informations may not be loaded due to the "
-          "max_typeinfo_nums cap setting[%d] in [%s]",
-          nMaxTypeInfoNums, pszINIFileName);
+  /** Entries are added under one write and the type hash index is rebuilt
+   *  once after all are added */
+  trace("Loading server and type information from [%s]...", pszINIFileName);
+  GetSISInfo(pMPAStart, &SISInfo);
+  Load.pSISInfo = &SISInfo;
+  SeqWriteBegin(&SISInfo);
+  nRetCode = StreamProfile(pszINIFileName, HandleEntryKey, &Load);
+  if (nRetCode == 0 && Load.bTypesDeferred == True) {
+    Load.bTypesOnly = True;
+    Load.bServerSeen = False;
+    nRetCode = StreamProfile(pszINIFileName, HandleEntryKey, &Load);
+  }
+  TypeIndexRebuild(&SISInfo);
+  BumpGeneration(&SISInfo);
+  SeqWriteEnd(&SISInfo);
+  munmap(pMPAStart, SISInfo.dwTotalSize);
+  check(nRetCode == 0, "Cannot load file[%s]", pszINIFileName);
+
+  trace("Loading server and type information...Done.\n"
+        ">  Loaded [%zu] server info(s).\n"
+        ">  Created [%d] message queue(s).\n"
+        ">  Loaded [%zu] type info(s).",
+        Load.nServers, Load.nQueues, Load.nTypes);
+  if (Load.bCapped == True) {
+    trace("WARNING: Some informations are not loaded due to the max_serverinfo_nums[%zu] or "
+          "max_typeinfo_nums[%zu] cap setting in [%s]",
+          Load.nMaxSvrInfo, Load.nMaxTypeInfo, pszINIFileName);
   }
   return 0;
 
 error:
-  if (serverList) {
-    close_list(serverList);
-  }
-  if (typeList) {
-    close_list(typeList);
-  }
   return -1;
 } //}}}
   //}}}
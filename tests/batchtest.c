@@ -0,0 +1,197 @@
+/**
+ * MPA batch send test
+ *
+ * Loads servers 1 to 3, each on a queue of its own from <qkey>+1 on, sends
+ * from server 9 and removes the queue of server 3. Server 77 is unknown.
+ * 1. Sends a batch of 8 messages to server 1, two of them NULL and one
+ *   longer than MPA_MESSAGESIZE: those 3 must get MPA_ERR_PARAM and the 5
+ *   others must be received in order;
+ * 2. Sends batches to server 3 and to server 77, every message must get
+ *   MPA_ERR_SEND_NOQ and MPA_ERR_SVRINFO;
+ * 3. Sends one message to servers 1, 77, 2, 3, 1, ... over 35 entries,
+ *   crossing the batches routes are resolved in: every server must get the
+ *   status of its own, and servers 1 and 2 the messages;
+ * 4. Sends the long message to servers 1 and 2, it must be refused with
+ *   MPA_ERR_PARAM and reach none of them.
+ * */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/msg.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+#include "mpatype.h"
+
+#define BATCHTEST_SENDER 9
+#define BATCHTEST_UNKNOWN 77
+#define BATCHTEST_MULTI 35
+
+static int Drain(MPA_Ctx *pCtx, char *pszBodies, size_t nSize);
+static int CheckStatus(const char *pszName, const int *pnStatus, const int *pnExpected,
+                       size_t nCount);
+
+/** Receives every message waiting, and joins their bodies */
+static int Drain(MPA_Ctx *pCtx, char *pszBodies, size_t nSize) {
+  MPAMessage message;
+  size_t nBodySize;
+  int n;
+
+  pszBodies[0] = '\0';
+  for (n = 0; MPA_CtxRecvNonBlock(pCtx, &message) > 0; n++) {
+    strncat(pszBodies, MPA_GetMsgBody(NULL, &nBodySize, &message),
+            nSize - strlen(pszBodies) - 1);
+  }
+  return n;
+}
+
+static int CheckStatus(const char *pszName, const int *pnStatus, const int *pnExpected,
+                       size_t nCount) {
+  size_t i;
+  int nErrors = 0;
+
+  for (i = 0; i < nCount; i++) {
+    if (pnStatus[i] != pnExpected[i]) {
+      printf("%s status[%zu] is %d, %d expected\n", pszName, i, pnStatus[i], pnExpected[i]);
+      nErrors++;
+    }
+  }
+  return nErrors;
+}
+
+int main(int argc, char **argv) {
+  static MPAMessage messages[8], longMessage;
+  MPAMessage *ppMessages[8];
+  MPA_MSG_Body *pBody;
+  MPA_Ctx *pCtxs[3];
+  MPA_SIS_SrvInfo ServerInfo;
+  char *pMPAStart = NULL;
+  MPATest_Config config;
+  char szBodies[256], szBody[2] = "0";
+  DWORD dwSids[BATCHTEST_MULTI];
+  int nStatus[BATCHTEST_MULTI], nExpected[BATCHTEST_MULTI];
+  int i, n, nCounts[3] = {0}, nErrors = 0;
+  size_t nSize;
+  key_t qkey;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  for (i = 1; i <= 3; i++) {
+    MPATest_ConfigServer(&config, (DWORD)i, qkey + i, 1);
+  }
+  MPATest_ConfigServer(&config, BATCHTEST_SENDER, qkey + BATCHTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], BATCHTEST_SENDER) || (pMPAStart = MPA_SIS_Init(argv[1])) == NULL ||
+      (pCtxs[1] = MPA_CtxOpen(argv[1], 1, 0)) == NULL ||
+      (pCtxs[2] = MPA_CtxOpen(argv[1], 2, 0)) == NULL ||
+      MPA_GetServerInfo(3, &ServerInfo, pMPAStart) < 0) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  msgctl(ServerInfo.dwQid, IPC_RMID, NULL);
+
+  for (i = 0; i < 8; i++) {
+    MPA_MsgInit(&messages[i]);
+    szBody[0] = (char)('0' + i);
+    MPA_SetMsgBody(szBody, sizeof(szBody), &messages[i]);
+    ppMessages[i] = &messages[i];
+  }
+  /** A body length no message fits in */
+  MPA_MsgInit(&longMessage);
+  MPA_SetMsgBody("L", 2, &longMessage);
+  pBody = (MPA_MSG_Body *)(MPA_GetMsgBody(NULL, &nSize, &longMessage) -
+                           offsetof(MPA_MSG_Body, text));
+  pBody->wBodyLen = MPA_MESSAGESIZE;
+
+  /** 1. Bad messages of a batch are skipped */
+  ppMessages[1] = NULL;
+  ppMessages[3] = &longMessage;
+  ppMessages[6] = NULL;
+  for (i = 0; i < 8; i++) {
+    nExpected[i] = (i == 1 || i == 3 || i == 6) ? MPA_ERR_PARAM : 0;
+  }
+  if ((n = MPA_SendBatch(1, ppMessages, 8, nStatus)) != 5) {
+    printf("Batch sent %d messages, 5 expected\n", n);
+    nErrors++;
+  }
+  nErrors += CheckStatus("Batch", nStatus, nExpected, 8);
+  if (Drain(pCtxs[1], szBodies, sizeof(szBodies)) != 5 || strcmp(szBodies, "02457") != 0) {
+    printf("Server[1] received [%s], [02457] expected\n", szBodies);
+    nErrors++;
+  }
+
+  /** 2. Every message of a batch gets the error of the route */
+  ppMessages[1] = ppMessages[6] = &messages[0];
+  ppMessages[3] = &messages[3];
+  for (i = 0; i < 8; i++) {
+    nExpected[i] = MPA_ERR_SEND_NOQ;
+  }
+  if ((n = MPA_SendBatch(3, ppMessages, 8, nStatus)) != 0) {
+    printf("Batch to a removed queue sent %d messages\n", n);
+    nErrors++;
+  }
+  nErrors += CheckStatus("Batch to a removed queue", nStatus, nExpected, 8);
+  for (i = 0; i < 8; i++) {
+    nExpected[i] = MPA_ERR_SVRINFO;
+  }
+  if ((n = MPA_SendBatch(BATCHTEST_UNKNOWN, ppMessages, 8, nStatus)) != 0) {
+    printf("Batch to an unknown server sent %d messages\n", n);
+    nErrors++;
+  }
+  nErrors += CheckStatus("Batch to an unknown server", nStatus, nExpected, 8);
+
+  /** 3. Each server gets a status of its own */
+  for (n = 0, i = 0; i < BATCHTEST_MULTI; i++) {
+    switch (i % 5) {
+    case 1:
+      dwSids[i] = BATCHTEST_UNKNOWN;
+      nExpected[i] = MPA_ERR_SVRINFO;
+      break;
+    case 3:
+      dwSids[i] = 3;
+      nExpected[i] = MPA_ERR_SEND_NOQ;
+      break;
+    default:
+      dwSids[i] = (i % 5 == 2) ? 2 : 1;
+      nExpected[i] = 0;
+      nCounts[dwSids[i]]++;
+      n++;
+    }
+  }
+  if ((i = MPA_SendMulti(dwSids, BATCHTEST_MULTI, &messages[0], nStatus)) != n) {
+    printf("Multi sent %d messages, %d expected\n", i, n);
+    nErrors++;
+  }
+  nErrors += CheckStatus("Multi", nStatus, nExpected, BATCHTEST_MULTI);
+  for (i = 1; i <= 2; i++) {
+    if ((n = Drain(pCtxs[i], szBodies, sizeof(szBodies))) != nCounts[i]) {
+      printf("Server[%d] received %d messages, %d expected\n", i, n, nCounts[i]);
+      nErrors++;
+    }
+  }
+
+  /** 4. A message too long is sent to none */
+  if ((n = MPA_SendMulti(dwSids, 3, &longMessage, nStatus)) != MPA_ERR_PARAM) {
+    printf("Multi of a long message returned %d\n", n);
+    nErrors++;
+  }
+  n = Drain(pCtxs[1], szBodies, sizeof(szBodies));
+  if (n + Drain(pCtxs[2], szBodies, sizeof(szBodies)) != 0) {
+    printf("Long message received\n");
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_CtxClose(pCtxs[1]);
+  MPA_CtxClose(pCtxs[2]);
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,87 @@
+/**
+ * Helpers of MPA test programs, see mpatest.h
+ * */
+#include <string.h>
+
+#include "mpatest.h"
+
+int MPATest_Args(int argc, char **argv, const char *pszOptional) {
+  const char *pszName = strrchr(argv[0], '/');
+
+  if (argc == 3 || (argc == 4 && pszOptional != NULL)) {
+    return 0;
+  }
+  printf("%s <mpa.mmap> <qkey>%s%s%s\n", (pszName != NULL) ? pszName + 1 : argv[0],
+         (pszOptional != NULL) ? " [" : "", (pszOptional != NULL) ? pszOptional : "",
+         (pszOptional != NULL) ? "]" : "");
+  return -1;
+}
+
+int MPATest_ConfigOpen(MPATest_Config *pConfig, const char *pszSHMFileName,
+                       const char *pszSuffix, DWORD dwMaxSvrInfo, DWORD dwMaxTypeInfo) {
+  memset(pConfig, 0, sizeof(MPATest_Config));
+  snprintf(pConfig->szFileName, sizeof(pConfig->szFileName), "%s%s", pszSHMFileName,
+           pszSuffix);
+  if ((pConfig->fp = fopen(pConfig->szFileName, "w")) == NULL) {
+    printf("Error creating config file[%s]\n", pConfig->szFileName);
+    return -1;
+  }
+  fprintf(pConfig->fp, "[main]\nmax_serverinfo_nums = %u\nmax_typeinfo_nums = %u\nversion = 2\n",
+          dwMaxSvrInfo, dwMaxTypeInfo);
+  fprintf(pConfig->fp, "[server]\n");
+  return 0;
+}
+
+void MPATest_ConfigServer(MPATest_Config *pConfig, DWORD sid, key_t qkey, DWORD qtype) {
+  if (pConfig->fp != NULL) {
+    fprintf(pConfig->fp, "s=%u:%d:%u\n", sid, qkey, qtype);
+  }
+}
+
+void MPATest_ConfigMember(MPATest_Config *pConfig, DWORD sid, key_t qkey, DWORD qtype,
+                          DWORD gid) {
+  if (pConfig->fp != NULL) {
+    fprintf(pConfig->fp, "s=%u:%d:%u:%u\n", sid, qkey, qtype, gid);
+  }
+}
+
+void MPATest_ConfigType(MPATest_Config *pConfig, DWORD type, DWORD sid) {
+  if (pConfig->fp == NULL) {
+    return;
+  }
+  if (pConfig->bTypes == False) {
+    fprintf(pConfig->fp, "[msgtype]\n");
+    pConfig->bTypes = True;
+  }
+  fprintf(pConfig->fp, "t=%u:%u\n", type, sid);
+}
+
+int MPATest_ConfigClose(MPATest_Config *pConfig) {
+  int nRetCode;
+
+  if (pConfig->fp == NULL) {
+    return -1;
+  }
+  if (pConfig->bTypes == False) {
+    fprintf(pConfig->fp, "[msgtype]\n");
+    pConfig->bTypes = True;
+  }
+  nRetCode = fclose(pConfig->fp);
+  pConfig->fp = NULL;
+  if (nRetCode != 0) {
+    printf("Error writing config file[%s]\n", pConfig->szFileName);
+    return -1;
+  }
+  return 0;
+}
+
+int MPATest_ConfigLoad(MPATest_Config *pConfig, const char *pszSHMFileName) {
+  if (0 != MPATest_ConfigClose(pConfig) ||
+      0 != MPA_SIS_LoadConfig(pszSHMFileName, pConfig->szFileName)) {
+    printf("Loading config file error\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,67 @@
+/**
+ * Helpers of MPA test programs
+ *
+ * Every test takes `<mpa.mmap> <qkey>` and maybe one more argument, and
+ * writes the configuration it loads into a file beside the memory map file.
+ * */
+#ifndef __MPATEST_H__
+#define __MPATEST_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "mpaknl.h"
+
+/** Configuration file being written, see MPATest_ConfigOpen() */
+typedef struct MPATest_Config {
+  FILE *fp;
+  char szFileName[1024];
+  Boolean bTypes; /**< [msgtype] section begun */
+} MPATest_Config;
+
+/** @brief Check arguments `<mpa.mmap> <qkey> [pszOptional]`, print usage if
+ *  they are wrong.
+ *
+ *  @param[in] pszOptional Name of the optional argument, NULL for none
+ *  @return 0 Arguments are right
+ *  @return -1 Usage printed
+ */
+int MPATest_Args(int argc, char **argv, const char *pszOptional);
+
+/** @brief Create configuration file `<pszSHMFileName><pszSuffix>` and write
+ *  its [main] section of the current version.
+ *
+ *  @return 0 Success
+ *  @return -1 Error, printed
+ */
+int MPATest_ConfigOpen(MPATest_Config *pConfig, const char *pszSHMFileName,
+                       const char *pszSuffix, DWORD dwMaxSvrInfo, DWORD dwMaxTypeInfo);
+
+/** @brief Write a server info. All server infos come before type infos. */
+void MPATest_ConfigServer(MPATest_Config *pConfig, DWORD sid, key_t qkey, DWORD qtype);
+
+/** @brief Write a server info which is a member of group gid. */
+void MPATest_ConfigMember(MPATest_Config *pConfig, DWORD sid, key_t qkey, DWORD qtype,
+                          DWORD gid);
+
+/** @brief Write a type info. */
+void MPATest_ConfigType(MPATest_Config *pConfig, DWORD type, DWORD sid);
+
+/** @brief Finish the configuration file.
+ *
+ *  @return 0 Success
+ *  @return -1 Error, printed
+ */
+int MPATest_ConfigClose(MPATest_Config *pConfig);
+
+/** @brief Finish the configuration file and load it into pszSHMFileName by
+ *  MPA_SIS_LoadConfig().
+ *
+ *  @return 0 Success
+ *  @return -1 Error, printed
+ */
+int MPATest_ConfigLoad(MPATest_Config *pConfig, const char *pszSHMFileName);
+
+#endif
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,219 @@
+/**
+ * MPA delete and compact test
+ *
+ * Loads servers 1 to 12, each on a queue of its own from <qkey>+1 on and
+ * all subscribed to type 100, and publishes from server 20.
+ * 1. Publishes a message: each of the 12 subscribers must get it;
+ * 2. Deletes the even servers from type 100 and then deletes them, and
+ *   publishes again with the same publisher: only the 6 odd servers must
+ *   get it, the plan of subscribers it kept must not reach the others;
+ * 3. Forks server 20, which publishes messages 0 to 49 1 ms apart, while
+ *   the lists are compacted one entry per write: entries must be moved,
+ *   every odd server must get the 50 messages in order and the even ones
+ *   none, the 52 messages each received must be counted on its moved
+ *   counters, and type 100 must be found with its 6 subscribers.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define COMPACTTEST_SERVERS 12
+#define COMPACTTEST_PUBLISHER 20
+#define COMPACTTEST_TYPE 100
+#define COMPACTTEST_ROUNDS 50
+
+static int Publisher(const char *pszSHMFileName, int nCount);
+static int CheckNumbers(MPA_Ctx *pCtx, DWORD sid, int nCount);
+static int CheckQueue(key_t qkey, DWORD sid);
+
+/** Publishes messages numbered 0 to nCount - 1, 1 ms apart */
+static int Publisher(const char *pszSHMFileName, int nCount) {
+  struct timespec ts = {0, 1000000};
+  MPAMessage message;
+  MPA_Ctx *pCtx;
+  char szBody[16];
+  int i, nRetCode = 0;
+
+  if ((pCtx = MPA_CtxOpen(pszSHMFileName, COMPACTTEST_PUBLISHER, 0)) == NULL) {
+    return 1;
+  }
+  for (i = 0; i < nCount && nRetCode == 0; i++) {
+    snprintf(szBody, sizeof(szBody), "m%d", i);
+    MPA_MsgInit(&message);
+    MPA_SetMsgBody(szBody, strlen(szBody) + 1, &message);
+    if ((nRetCode = MPA_CtxPub(pCtx, COMPACTTEST_TYPE, &message)) != 0) {
+      printf("Message %d not published: %d\n", i, nRetCode);
+    }
+    nanosleep(&ts, NULL);
+  }
+  MPA_CtxClose(pCtx);
+  return (nRetCode == 0) ? 0 : 1;
+}
+
+/** Receives every message waiting for the server, which must be numbered 0
+ *  to nCount - 1 in order */
+static int CheckNumbers(MPA_Ctx *pCtx, DWORD sid, int nCount) {
+  static MPAMessage message;
+  char *pszBody;
+  size_t nSize;
+  int i, nErrors = 0;
+
+  for (i = 0; pCtx != NULL && MPA_CtxRecvNonBlock(pCtx, &message) > 0; i++) {
+    pszBody = MPA_GetMsgBody(NULL, &nSize, &message);
+    if (nSize < 2 || atoi(pszBody + 1) != i) {
+      printf("Message %d received as [%.16s]\n", i, pszBody);
+      nErrors++;
+    }
+  }
+  if (i != nCount) {
+    printf("Server[%u] received %d messages, %d expected\n", sid, i, nCount);
+    nErrors++;
+  }
+  return nErrors;
+}
+
+/** The queue of a deleted server must be left empty */
+static int CheckQueue(key_t qkey, DWORD sid) {
+  struct msqid_ds qds;
+  int qid;
+
+  if ((qid = msgget(qkey + (key_t)sid, 0)) < 0 || msgctl(qid, IPC_STAT, &qds) != 0) {
+    printf("Queue of server[%u] not found\n", sid);
+    return 1;
+  }
+  if (qds.msg_qnum != 0) {
+    printf("Deleted server[%u] received %lu messages\n", sid, (unsigned long)qds.msg_qnum);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct timespec ts = {0, 10000000};
+  MPA_Ctx *pCtxs[COMPACTTEST_SERVERS + 1] = {NULL};
+  MPA_Ctx *pPubCtx = NULL;
+  MPA_SIS_SrvInfo ServerInfos[COMPACTTEST_SERVERS];
+  MPA_SIS_Stat stat;
+  MPATest_Config config;
+  MPAMessage message;
+  char *pMPAStart = NULL;
+  key_t qkey;
+  pid_t pid;
+  int i, n, nStatus, nErrors = 0;
+  DWORD sid;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 32, 32)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  for (sid = 1; sid <= COMPACTTEST_SERVERS; sid++) {
+    MPATest_ConfigServer(&config, sid, qkey + (key_t)sid, 1);
+  }
+  MPATest_ConfigServer(&config, COMPACTTEST_PUBLISHER, qkey + COMPACTTEST_PUBLISHER, 1);
+  for (sid = 1; sid <= COMPACTTEST_SERVERS; sid++) {
+    MPATest_ConfigType(&config, COMPACTTEST_TYPE, sid);
+  }
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL ||
+      (pPubCtx = MPA_CtxOpen(argv[1], COMPACTTEST_PUBLISHER, 0)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  for (sid = 1; sid <= COMPACTTEST_SERVERS; sid++) {
+    if ((pCtxs[sid] = MPA_CtxOpen(argv[1], sid, 0)) == NULL) {
+      printf("Error opening server[%u]\n", sid);
+      return -1;
+    }
+  }
+  MPA_MsgInit(&message);
+  MPA_SetMsgBody("m0", 3, &message);
+
+  /** 1. Every subscriber gets a publication */
+  if ((n = MPA_CtxPub(pPubCtx, COMPACTTEST_TYPE, &message)) != 0) {
+    printf("Publishing returned %d\n", n);
+    nErrors++;
+  }
+  for (sid = 1; sid <= COMPACTTEST_SERVERS; sid++) {
+    nErrors += CheckNumbers(pCtxs[sid], sid, 1);
+  }
+
+  /** 2. Deleted subscribers are left out of the kept plan */
+  for (sid = 2; sid <= COMPACTTEST_SERVERS; sid += 2) {
+    MPA_CtxClose(pCtxs[sid]);
+    pCtxs[sid] = NULL;
+    if (0 != MPA_SIS_TInfoDelete(pMPAStart, COMPACTTEST_TYPE, sid) ||
+        0 != MPA_SIS_SInfoDelete(pMPAStart, sid)) {
+      printf("Server info[%u] not deleted\n", sid);
+      nErrors++;
+    }
+  }
+  if ((n = MPA_CtxPub(pPubCtx, COMPACTTEST_TYPE, &message)) != 0) {
+    printf("Publishing after deletes returned %d\n", n);
+    nErrors++;
+  }
+  for (sid = 1; sid <= COMPACTTEST_SERVERS; sid++) {
+    nErrors += (sid % 2 == 1) ? CheckNumbers(pCtxs[sid], sid, 1) : CheckQueue(qkey, sid);
+  }
+
+  /** 3. Compact while a publisher runs */
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    _exit(Publisher(argv[1], COMPACTTEST_ROUNDS));
+  }
+  nanosleep(&ts, NULL);
+  if ((n = MPA_SIS_Compact(pMPAStart, 1)) <= 0) {
+    printf("Compacting moved %d entries\n", n);
+    nErrors++;
+  }
+  waitpid(pid, &nStatus, 0);
+  if (!WIFEXITED(nStatus) || WEXITSTATUS(nStatus) != 0) {
+    printf("Publisher failed\n");
+    nErrors++;
+  }
+  for (sid = 1; sid <= COMPACTTEST_SERVERS; sid++) {
+    nErrors += (sid % 2 == 1) ? CheckNumbers(pCtxs[sid], sid, COMPACTTEST_ROUNDS)
+                              : CheckQueue(qkey, sid);
+  }
+  for (sid = 1; sid <= COMPACTTEST_SERVERS; sid += 2) {
+    if (0 != MPA_SIS_GetServerStat(pMPAStart, sid, &stat) ||
+        stat.qwRecv != COMPACTTEST_ROUNDS + 2) {
+      printf("Server[%u] counted %llu messages received, %d expected\n", sid, stat.qwRecv,
+             COMPACTTEST_ROUNDS + 2);
+      nErrors++;
+    }
+  }
+  if ((n = MPA_GetSubscribers(COMPACTTEST_TYPE, 0, ServerInfos, COMPACTTEST_SERVERS,
+                              pMPAStart)) != COMPACTTEST_SERVERS / 2) {
+    printf("Type[%d] has %d subscribers, %d expected\n", COMPACTTEST_TYPE, n,
+           COMPACTTEST_SERVERS / 2);
+    nErrors++;
+  }
+  for (i = 0; i < n && i < COMPACTTEST_SERVERS; i++) {
+    if (ServerInfos[i].dwSid % 2 == 0 ||
+        ServerInfos[i].dwQkey != qkey + (key_t)ServerInfos[i].dwSid) {
+      printf("Subscriber %d is server[%u] on queue %d\n", i, ServerInfos[i].dwSid,
+             ServerInfos[i].dwQkey);
+      nErrors++;
+    }
+  }
+  printf("%d errors\n", nErrors);
+
+  for (sid = 1; sid <= COMPACTTEST_SERVERS; sid += 2) {
+    MPA_CtxClose(pCtxs[sid]);
+  }
+  MPA_CtxClose(pPubCtx);
+  MPA_SIS_End(pMPAStart, True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
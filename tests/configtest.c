@@ -0,0 +1,182 @@
+/**
+ * MPA configuration file test
+ *
+ * Writes configuration files by hand beside <mpa.mmap> and loads them, on
+ * queues <qkey> and <qkey>+1:
+ * 1. a version 2 file with comments, blank lines, spaces around sections,
+ *   keys and numbers, CRLF line ends, [msgtype] before [server], a line
+ *   longer than the line buffer and malformed or out of range entries:
+ *   servers 1, 2, 3 and 10 and types 100 and 101 must be loaded, server 2
+ *   with its qkey, qtype and group, and nothing else;
+ * 2. a version 1 file: only keys `s<n>` and `t<n>` below server_nums and
+ *   type_nums must be loaded;
+ * 3. a file of 4 servers with max_serverinfo_nums 2: the first 2 must be
+ *   loaded;
+ * 4. a file with a malformed max_serverinfo_nums, and a missing file: both
+ *   must be refused and leave the segment of 3 as it is.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "mpatest.h"
+
+#define CONFIGTEST_LONG 1100 /**< Longer than the line buffer of the loader */
+
+static FILE *Open(const char *pszSHMFileName, char *pszFileName, size_t nSize);
+static int CheckLoad(const char *pszSHMFileName, const char *pszFileName, const char *pszCase,
+                     const DWORD *pdwFound, size_t nFound, const DWORD *pdwMissing,
+                     size_t nMissing);
+static int CheckSubscribers(const char *pMPAStart, DWORD type, DWORD sid);
+
+static FILE *Open(const char *pszSHMFileName, char *pszFileName, size_t nSize) {
+  FILE *fp;
+
+  snprintf(pszFileName, nSize, "%s.ini", pszSHMFileName);
+  if ((fp = fopen(pszFileName, "w")) == NULL) {
+    printf("Error creating config file[%s]\n", pszFileName);
+  }
+  return fp;
+}
+
+/** Loads the file, which must succeed if pdwFound is not NULL and fail
+ *  otherwise, and checks the servers found and missing */
+static int CheckLoad(const char *pszSHMFileName, const char *pszFileName, const char *pszCase,
+                     const DWORD *pdwFound, size_t nFound, const DWORD *pdwMissing,
+                     size_t nMissing) {
+  MPA_SIS_SrvInfo ServerInfo;
+  char *pMPAStart;
+  size_t i;
+  int nRetCode, nErrors = 0;
+
+  nRetCode = MPA_SIS_LoadConfig(pszSHMFileName, pszFileName);
+  if (nRetCode != ((pdwFound != NULL) ? 0 : -1)) {
+    printf("Loading %s returned %d\n", pszCase, nRetCode);
+    return 1;
+  }
+  if ((pMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return 1;
+  }
+  for (i = 0; pdwFound != NULL && i < nFound; i++) {
+    if (MPA_GetServerInfo(pdwFound[i], &ServerInfo, pMPAStart) < 0) {
+      printf("%s: server info[%u] not found\n", pszCase, pdwFound[i]);
+      nErrors++;
+    }
+  }
+  for (i = 0; i < nMissing; i++) {
+    if (MPA_GetServerInfo(pdwMissing[i], &ServerInfo, pMPAStart) >= 0) {
+      printf("%s: server info[%u] found\n", pszCase, pdwMissing[i]);
+      nErrors++;
+    }
+  }
+  munmap(pMPAStart, *((DWORD *)pMPAStart));
+  return nErrors;
+}
+
+/** The type must have the server as its only subscriber */
+static int CheckSubscribers(const char *pMPAStart, DWORD type, DWORD sid) {
+  MPA_SIS_SrvInfo ServerInfos[4];
+  int n;
+
+  if ((n = MPA_GetSubscribers(type, 0, ServerInfos, 4, pMPAStart)) != 1 ||
+      ServerInfos[0].dwSid != sid) {
+    printf("Type[%u] has %d subscribers, server[%u] expected\n", type, n, sid);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static const DWORD dwFound1[] = {1, 2, 3, 10}, dwMissing1[] = {4, 5, 6, 9};
+  static const DWORD dwFound2[] = {1, 2}, dwMissing2[] = {3, 4};
+  char szFileName[1024], szLong[CONFIGTEST_LONG + 1];
+  MPA_SIS_SrvInfo ServerInfo, ServerInfos[4];
+  char *pMPAStart = NULL;
+  FILE *fp;
+  key_t qkey;
+  int nErrors = 0;
+
+  if (0 != MPATest_Args(argc, argv, NULL)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  memset(szLong, ' ', sizeof(szLong));
+  szLong[CONFIGTEST_LONG] = '\0';
+
+  /** 1. Edges of the format */
+  if ((fp = Open(argv[1], szFileName, sizeof(szFileName))) == NULL) {
+    return -1;
+  }
+  fprintf(fp, "# comment\n; comment\n\n  [ main ]  \r\nmax_serverinfo_nums = 8\r\n");
+  fprintf(fp, "max_typeinfo_nums=8\nversion = 2\n");
+  fprintf(fp, "[msgtype]\nt = 100 : 1\nt=101:3\r\n");
+  fprintf(fp, "[server]\ns=1:%d:1\n  s = 2 : %d : 2 : 7  \ns=3:%d:3\r\n", qkey, qkey + 1, qkey);
+  fprintf(fp, "s=abc\ns=4:%d\ns=5:%d:x\ns=4294967295:%d:1\ns=6:%d:1:-1\n", qkey, qkey, qkey,
+          qkey);
+  fprintf(fp, "s=9:%d:1%s\nno value\ns=10:%d:1\n", qkey, szLong, qkey);
+  fclose(fp);
+  nErrors += CheckLoad(argv[1], szFileName, "version 2", dwFound1, 4, dwMissing1, 4);
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  if (MPA_GetServerInfo(2, &ServerInfo, pMPAStart) < 0 || ServerInfo.dwQkey != qkey + 1 ||
+      ServerInfo.dwQtype != 2 || MPA_GetGroupMembers(7, ServerInfos, 4, pMPAStart) != 1) {
+    printf("Server info[2] not loaded with its queue and group\n");
+    nErrors++;
+  }
+  nErrors += CheckSubscribers(pMPAStart, 100, 1);
+  nErrors += CheckSubscribers(pMPAStart, 101, 3);
+  munmap(pMPAStart, *((DWORD *)pMPAStart));
+
+  /** 2. Version 1 keys */
+  if ((fp = Open(argv[1], szFileName, sizeof(szFileName))) == NULL) {
+    return -1;
+  }
+  fprintf(fp, "[main]\nmax_serverinfo_nums=8\nmax_typeinfo_nums=8\n");
+  fprintf(fp, "[server]\nserver_nums=2\ns0=1:%d:1\ns1=2:%d:1\ns2=3:%d:1\nx0=4:%d:1\n", qkey,
+          qkey, qkey, qkey);
+  fprintf(fp, "[msgtype]\ntype_nums=1\nt0=100:1\nt1=100:2\n");
+  fclose(fp);
+  nErrors += CheckLoad(argv[1], szFileName, "version 1", dwFound2, 2, dwMissing2, 2);
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  nErrors += CheckSubscribers(pMPAStart, 100, 1);
+  munmap(pMPAStart, *((DWORD *)pMPAStart));
+
+  /** 3. Entries over the max numbers */
+  if ((fp = Open(argv[1], szFileName, sizeof(szFileName))) == NULL) {
+    return -1;
+  }
+  fprintf(fp, "[main]\nmax_serverinfo_nums=2\nmax_typeinfo_nums=1\nversion=2\n");
+  fprintf(fp, "[server]\ns=1:%d:1\ns=2:%d:1\ns=3:%d:1\ns=4:%d:1\n[msgtype]\n", qkey, qkey, qkey,
+          qkey);
+  fclose(fp);
+  nErrors += CheckLoad(argv[1], szFileName, "capped", dwFound2, 2, dwMissing2, 2);
+
+  /** 4. Refused files leave the segment */
+  if ((fp = Open(argv[1], szFileName, sizeof(szFileName))) == NULL) {
+    return -1;
+  }
+  fprintf(fp, "[main]\nmax_serverinfo_nums=12abc\nversion=2\n[server]\ns=3:%d:1\n", qkey);
+  fclose(fp);
+  nErrors += CheckLoad(argv[1], szFileName, "malformed [main]", NULL, 0, dwMissing2, 2);
+  nErrors += CheckLoad(argv[1], "/nonexistent/mpa.ini", "missing file", NULL, 0, dwMissing2, 2);
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL ||
+      MPA_GetServerInfo(1, &ServerInfo, pMPAStart) < 0) {
+    printf("Segment lost after a refused file\n");
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  if (pMPAStart != NULL) {
+    MPA_SIS_End(pMPAStart, True);
+  }
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
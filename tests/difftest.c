@@ -0,0 +1,163 @@
+/**
+ * MPA configuration difference test
+ *
+ * Loads configuration A, server infos 1 to 50 on queue <qkey>, each
+ * subscribed to type 100 + sid % 5, into a segment of 64 entries. Then
+ * applies configuration B by difference: servers 41 to 50 are removed,
+ * servers 1 to 10 move to queue <qkey>+1 with another qtype, and servers 51
+ * to 64 are added. Every server and subscriber list is checked, B applied
+ * again must change nothing, and A applied back must give A again.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/msg.h>
+
+#include "mpatest.h"
+
+#define DIFFTEST_TYPES 5
+#define DIFFTEST_TYPE_BASE 100
+#define DIFFTEST_MAX_SID 64
+
+static int WriteConfig(MPATest_Config *pConfig, const char *pszSHMFileName, Boolean bConfigB,
+                       key_t qkey);
+static Boolean Present(DWORD sid, Boolean bConfigB);
+static key_t Qkey(DWORD sid, Boolean bConfigB, key_t qkey);
+static DWORD Qtype(DWORD sid, Boolean bConfigB);
+static int Check(const char *pszSHMFileName, Boolean bConfigB, key_t qkey, const int *qids);
+
+static int WriteConfig(MPATest_Config *pConfig, const char *pszSHMFileName, Boolean bConfigB,
+                       key_t qkey) {
+  DWORD sid;
+
+  if (0 != MPATest_ConfigOpen(pConfig, pszSHMFileName, (bConfigB == True) ? ".b.ini" : ".a.ini",
+                              DIFFTEST_MAX_SID, DIFFTEST_MAX_SID)) {
+    return -1;
+  }
+  for (sid = 1; sid <= DIFFTEST_MAX_SID; sid++) {
+    if (Present(sid, bConfigB) == True) {
+      MPATest_ConfigServer(pConfig, sid, Qkey(sid, bConfigB, qkey), Qtype(sid, bConfigB));
+    }
+  }
+  for (sid = 1; sid <= DIFFTEST_MAX_SID; sid++) {
+    if (Present(sid, bConfigB) == True) {
+      MPATest_ConfigType(pConfig, DIFFTEST_TYPE_BASE + sid % DIFFTEST_TYPES, sid);
+    }
+  }
+  return MPATest_ConfigClose(pConfig);
+}
+
+static Boolean Present(DWORD sid, Boolean bConfigB) {
+  if (bConfigB == True) {
+    return (sid <= 40 || sid > 50) ? True : False;
+  }
+  return (sid <= 50) ? True : False;
+}
+
+/** Servers 1 to 10 of B are moved to <qkey>+1 with another qtype */
+static key_t Qkey(DWORD sid, Boolean bConfigB, key_t qkey) {
+  return (bConfigB == True && sid <= 10) ? qkey + 1 : qkey;
+}
+
+static DWORD Qtype(DWORD sid, Boolean bConfigB) {
+  return (bConfigB == True && sid <= 10) ? sid + 1000 : sid;
+}
+
+static int Check(const char *pszSHMFileName, Boolean bConfigB, key_t qkey, const int *qids) {
+  char *pMPAStart;
+  MPA_SIS_SrvInfo ServerInfo, SrvInfos[DIFFTEST_MAX_SID];
+  DWORD sid, type;
+  int i, nTotal, nExpected, nErrors = 0;
+
+  if ((pMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return 1;
+  }
+  for (sid = 1; sid <= DIFFTEST_MAX_SID; sid++) {
+    if (MPA_GetServerInfo(sid, &ServerInfo, pMPAStart) < 0) {
+      if (Present(sid, bConfigB) == True) {
+        printf("Server info[%u] not found\n", sid);
+        nErrors++;
+      }
+    } else if (Present(sid, bConfigB) == False) {
+      printf("Removed server info[%u] found\n", sid);
+      nErrors++;
+    } else if (ServerInfo.dwQtype != Qtype(sid, bConfigB) ||
+               ServerInfo.dwQkey != Qkey(sid, bConfigB, qkey) ||
+               ServerInfo.dwQid != qids[ServerInfo.dwQkey - qkey]) {
+      printf("Server info[%u] has queue %d/%d, qtype %u\n", sid, ServerInfo.dwQkey,
+             ServerInfo.dwQid, ServerInfo.dwQtype);
+      nErrors++;
+    }
+  }
+  for (type = DIFFTEST_TYPE_BASE; type < DIFFTEST_TYPE_BASE + DIFFTEST_TYPES; type++) {
+    nTotal = MPA_GetSubscribers(type, 0, SrvInfos, DIFFTEST_MAX_SID, pMPAStart);
+    for (nExpected = 0, sid = 1; sid <= DIFFTEST_MAX_SID; sid++) {
+      if (DIFFTEST_TYPE_BASE + sid % DIFFTEST_TYPES == type && Present(sid, bConfigB) == True) {
+        nExpected++;
+      }
+    }
+    if (nTotal != nExpected) {
+      printf("Type[%u] has %d subscribers, %d expected\n", type, nTotal, nExpected);
+      nErrors++;
+      continue;
+    }
+    for (i = 0; i < nTotal; i++) {
+      sid = SrvInfos[i].dwSid;
+      if (DIFFTEST_TYPE_BASE + sid % DIFFTEST_TYPES != type || Present(sid, bConfigB) == False) {
+        printf("Type[%u] has wrong subscriber[%u]\n", type, sid);
+        nErrors++;
+      }
+    }
+  }
+  munmap(pMPAStart, *((DWORD *)pMPAStart));
+  return nErrors;
+}
+
+int main(int argc, char **argv) {
+  char *pMPAStart = NULL;
+  MPATest_Config configA, configB;
+  int qids[2], nRetCode, nErrors = 0;
+  key_t qkey;
+
+  if (0 != MPATest_Args(argc, argv, NULL)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  if (0 != WriteConfig(&configA, argv[1], False, qkey) ||
+      0 != WriteConfig(&configB, argv[1], True, qkey) ||
+      0 != MPA_SIS_LoadConfig(argv[1], configA.szFileName)) {
+    printf("Loading config file error\n");
+    return -1;
+  }
+  qids[0] = msgget(qkey, IPC_CREAT | 0666);
+  nErrors += Check(argv[1], False, qkey, qids);
+
+  /** 14 servers and types added, 10 servers changed, 10 of each removed */
+  if ((nRetCode = MPA_SIS_ApplyConfigDiff(argv[1], configB.szFileName)) != 58) {
+    printf("Applying B changed %d entries, 58 expected\n", nRetCode);
+    nErrors++;
+  }
+  qids[1] = msgget(qkey + 1, 0666);
+  nErrors += Check(argv[1], True, qkey, qids);
+  if ((nRetCode = MPA_SIS_ApplyConfigDiff(argv[1], configB.szFileName)) != 0) {
+    printf("Applying B again changed %d entries\n", nRetCode);
+    nErrors++;
+  }
+  nErrors += Check(argv[1], True, qkey, qids);
+
+  if ((nRetCode = MPA_SIS_ApplyConfigDiff(argv[1], configA.szFileName)) != 58) {
+    printf("Applying A back changed %d entries, 58 expected\n", nRetCode);
+    nErrors++;
+  }
+  nErrors += Check(argv[1], False, qkey, qids);
+  printf("%d errors\n", nErrors);
+
+  msgctl(qids[1], IPC_RMID, NULL);
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) != NULL) {
+    MPA_SIS_End(pMPAStart, True);
+  }
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,132 @@
+/**
+ * MPA server group test
+ *
+ * Loads group 1 of servers 1 to 4 and group 2 of servers 5 and 6, each
+ * server on a queue of its own from <qkey>+1 on, and sends from server 9.
+ * 1. Sends 200 messages round robin to group 1 and group 2 in turn, every
+ *   member of group 1 must get 50 and every member of group 2 100;
+ * 2. Empties the queues, puts 30 messages in the queue of server 1 and 20
+ *   in the one of server 2, then sends 60 messages by least depth to group
+ *   1: server 1 must get none, the others must end within one message of
+ *   each other.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/msg.h>
+#include <time.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define GROUPTEST_SERVERS 6
+#define GROUPTEST_SENDER 9
+
+static int Depths(const char *pMPAStart, size_t *pnDepths, int *pnQids);
+static int SendTo(DWORD sid, int nCount, MPAMessage *pMessage);
+
+/** Depths and queue ids of servers 1 to GROUPTEST_SERVERS, by sid */
+static int Depths(const char *pMPAStart, size_t *pnDepths, int *pnQids) {
+  MPA_SIS_QueueStat Stats[16];
+  int i, n;
+
+  if ((n = MPA_SIS_QueueStats(pMPAStart, Stats, 16)) < 0) {
+    return -1;
+  }
+  for (i = 0; i < n && i < 16; i++) {
+    if (Stats[i].dwSid >= 1 && Stats[i].dwSid <= GROUPTEST_SERVERS) {
+      pnDepths[Stats[i].dwSid] = Stats[i].nMsgs;
+      pnQids[Stats[i].dwSid] = Stats[i].dwQid;
+    }
+  }
+  return 0;
+}
+
+static int SendTo(DWORD sid, int nCount, MPAMessage *pMessage) {
+  int i;
+
+  for (i = 0; i < nCount; i++) {
+    if (0 != MPA_Send(sid, pMessage)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static MPAMessage message, received;
+  struct timespec ts = {0, 2000000};
+  char *pMPAStart = NULL;
+  MPATest_Config config;
+  size_t nDepths[GROUPTEST_SERVERS + 1], nMin, nMax;
+  int nQids[GROUPTEST_SERVERS + 1], i, nErrors = 0;
+  key_t qkey;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 16, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  for (i = 1; i <= GROUPTEST_SERVERS; i++) {
+    MPATest_ConfigMember(&config, (DWORD)i, qkey + i, 1, (i <= 4) ? 1 : 2);
+  }
+  MPATest_ConfigServer(&config, GROUPTEST_SENDER, qkey + GROUPTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], GROUPTEST_SENDER) || (pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  MPA_MsgInit(&message);
+  MPA_SetMsgBody("group", 6, &message);
+
+  /** 1. Round robin, each group keeps its own position */
+  for (i = 0; i < 200; i++) {
+    if (0 != MPA_SendGroup(1, MPA_GROUP_ROUND_ROBIN, &message) ||
+        0 != MPA_SendGroup(2, MPA_GROUP_ROUND_ROBIN, &message)) {
+      printf("Error sending to group\n");
+      nErrors++;
+      break;
+    }
+  }
+  Depths(pMPAStart, nDepths, nQids);
+  for (i = 1; i <= GROUPTEST_SERVERS; i++) {
+    printf("round robin server %d: %zu\n", i, nDepths[i]);
+    if (nDepths[i] != ((i <= 4) ? 50U : 100U)) {
+      nErrors++;
+    }
+    while (msgrcv(nQids[i], &received, sizeof(received) - sizeof(long), 0, IPC_NOWAIT) >= 0) {
+    }
+  }
+
+  /** 2. Least depth fills the shallowest queues first */
+  if (0 != SendTo(1, 30, &message) || 0 != SendTo(2, 20, &message)) {
+    printf("Error sending to server\n");
+    nErrors++;
+  }
+  nanosleep(&ts, NULL);
+  for (i = 0; i < 60; i++) {
+    if (0 != MPA_SendGroup(1, MPA_GROUP_LEAST_DEPTH, &message)) {
+      printf("Error sending to group\n");
+      nErrors++;
+      break;
+    }
+  }
+  Depths(pMPAStart, nDepths, nQids);
+  for (nMin = nMax = nDepths[2], i = 1; i <= 4; i++) {
+    printf("least depth server %d: %zu\n", i, nDepths[i]);
+    if (i > 1) {
+      nMin = (nDepths[i] < nMin) ? nDepths[i] : nMin;
+      nMax = (nDepths[i] > nMax) ? nDepths[i] : nMax;
+    }
+  }
+  if (nDepths[1] != 30 || nMax - nMin > 1 || nDepths[2] + nDepths[3] + nDepths[4] != 80) {
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
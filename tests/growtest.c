@@ -0,0 +1,182 @@
+/**
+ * MPA segment grow test
+ *
+ * Loads server infos 1 to 8 on queue <qkey> into a segment of 8 entries.
+ * 1. Maps the segment, grows it to 16 entries and edits the old mapping:
+ *   every edit must be refused with MPA_SIS_ERR_RETIRED and change nothing,
+ *   and the same edit on the file mapped again must be seen by lookups;
+ * 2. Forks a writer which adds server infos 10 to 250, mapping the file
+ *   again whenever its mapping is retired, while the segment is grown to
+ *   256 entries step by step: every server the writer added must be found
+ *   in the grown segment;
+ * 3. Applies a configuration of servers 1 to 300 by difference, more than
+ *   the segment holds: the segment must be grown and hold all of them.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpatest.h"
+
+#define GROWTEST_WRITER_FIRST 10
+#define GROWTEST_WRITER_LAST 250
+#define GROWTEST_DIFF_LAST 300
+
+static int Writer(const char *pszSHMFileName, key_t qkey);
+static int CheckServers(const char *pszSHMFileName, DWORD dwFirst, DWORD dwLast);
+
+/** Adds server infos, retrying on a retired mapping and on a full segment */
+static int Writer(const char *pszSHMFileName, key_t qkey) {
+  struct timespec ts = {0, 1000000};
+  char *pMPAStart;
+  int nRetCode, nRemaps = 0, nTries;
+  DWORD sid;
+
+  if ((pMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+    return 1;
+  }
+  for (sid = GROWTEST_WRITER_FIRST; sid <= GROWTEST_WRITER_LAST; sid++) {
+    for (nTries = 0; (nRetCode = MPA_SIS_SInfoAdd(pMPAStart, sid, qkey, 1)) != 0; nTries++) {
+      if (nTries == 1000) {
+        printf("Server info[%u] not added: %d\n", sid, nRetCode);
+        return 1;
+      }
+      if (nRetCode == MPA_SIS_ERR_RETIRED) {
+        munmap(pMPAStart, *((DWORD *)pMPAStart));
+        if ((pMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+          return 1;
+        }
+        nRemaps++;
+      } else {
+        nanosleep(&ts, NULL);
+      }
+    }
+  }
+  printf("writer mapped the segment again %d times\n", nRemaps);
+  fflush(stdout);
+  munmap(pMPAStart, *((DWORD *)pMPAStart));
+  return 0;
+}
+
+static int CheckServers(const char *pszSHMFileName, DWORD dwFirst, DWORD dwLast) {
+  char *pMPAStart;
+  MPA_SIS_SrvInfo ServerInfo;
+  DWORD sid;
+  int nErrors = 0;
+
+  if ((pMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return 1;
+  }
+  for (sid = dwFirst; sid <= dwLast; sid++) {
+    if (MPA_GetServerInfo(sid, &ServerInfo, pMPAStart) < 0) {
+      printf("Server info[%u] not found\n", sid);
+      nErrors++;
+    }
+  }
+  munmap(pMPAStart, *((DWORD *)pMPAStart));
+  return nErrors;
+}
+
+int main(int argc, char **argv) {
+  struct timespec ts = {0, 5000000};
+  char *pMPAStart = NULL, *pOldStart = NULL;
+  MPATest_Config config;
+  MPA_SIS_SrvInfo ServerInfo;
+  size_t nSize;
+  key_t qkey;
+  pid_t pid;
+  int nRetCode, nStatus, nErrors = 0;
+  DWORD sid;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 8)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  for (sid = 1; sid <= 8; sid++) {
+    MPATest_ConfigServer(&config, sid, qkey, 1);
+  }
+  MPATest_ConfigType(&config, 100, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+
+  /** 1. Edits of a retired mapping are refused */
+  if ((pOldStart = MPA_SIS_Init(argv[1])) == NULL || 0 != MPA_SIS_Grow(argv[1], 16, 16)) {
+    printf("Error growing shared memory\n");
+    return -1;
+  }
+  if ((nRetCode = MPA_SIS_SInfoAdd(pOldStart, 9, qkey, 1)) != MPA_SIS_ERR_RETIRED ||
+      MPA_SIS_SInfoModify(pOldStart, 2, qkey, 2) != MPA_SIS_ERR_RETIRED ||
+      MPA_SIS_TInfoAdd(pOldStart, 100, 2) != MPA_SIS_ERR_RETIRED ||
+      MPA_SIS_Compact(pOldStart, 0) != MPA_SIS_ERR_RETIRED) {
+    printf("Edit of a retired segment returned %d\n", nRetCode);
+    nErrors++;
+  }
+  munmap(pOldStart, *((DWORD *)pOldStart));
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  if (MPA_GetServerInfo(9, &ServerInfo, pMPAStart) >= 0 ||
+      MPA_GetServerInfo(2, &ServerInfo, pMPAStart) < 0 || ServerInfo.dwQtype != 1) {
+    printf("Edit of a retired segment reached the grown one\n");
+    nErrors++;
+  }
+  if (0 != MPA_SIS_SInfoAdd(pMPAStart, 9, qkey, 1) ||
+      MPA_GetServerInfo(9, &ServerInfo, pMPAStart) < 0) {
+    printf("Server info[9] not added to the grown segment\n");
+    nErrors++;
+  }
+  munmap(pMPAStart, *((DWORD *)pMPAStart));
+
+  /** 2. Grow while a writer adds entries */
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    _exit(Writer(argv[1], qkey));
+  }
+  for (nSize = 32; nSize <= 256; nSize *= 2) {
+    nanosleep(&ts, NULL);
+    if (0 != MPA_SIS_Grow(argv[1], nSize, 16)) {
+      printf("Error growing shared memory to %zu entries\n", nSize);
+      nErrors++;
+    }
+  }
+  waitpid(pid, &nStatus, 0);
+  if (!WIFEXITED(nStatus) || WEXITSTATUS(nStatus) != 0) {
+    printf("Writer failed\n");
+    nErrors++;
+  }
+  nErrors += CheckServers(argv[1], 1, GROWTEST_WRITER_LAST);
+
+  /** 3. A difference larger than the segment grows it */
+  if (0 != MPATest_ConfigOpen(&config, argv[1], ".diff.ini", 512, 16)) {
+    return -1;
+  }
+  for (sid = 1; sid <= GROWTEST_DIFF_LAST; sid++) {
+    MPATest_ConfigServer(&config, sid, qkey, 1);
+  }
+  MPATest_ConfigType(&config, 100, 1);
+  if (0 != MPATest_ConfigClose(&config)) {
+    return -1;
+  }
+  if ((nRetCode = MPA_SIS_ApplyConfigDiff(argv[1], config.szFileName)) !=
+      GROWTEST_DIFF_LAST - GROWTEST_WRITER_LAST) {
+    printf("Applying a larger configuration changed %d entries, %d expected\n", nRetCode,
+           GROWTEST_DIFF_LAST - GROWTEST_WRITER_LAST);
+    nErrors++;
+  }
+  nErrors += CheckServers(argv[1], 1, GROWTEST_DIFF_LAST);
+  printf("%d errors\n", nErrors);
+
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) != NULL) {
+    MPA_SIS_End(pMPAStart, True);
+  }
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,211 @@
+/**
+ * MPA routing image test
+ *
+ * Writes a configuration of 100 server infos on queue <qkey>, some in
+ * groups, and 300 type infos, then:
+ * 1. loads it into <mpa.mmap> and compiles it twice into <mpa.mmap>.img,
+ *   the two images must be identical;
+ * 2. loads the image into <mpa.mmap>.2, and exports both segments, the
+ *   exported configurations must be identical. The image must hold no
+ *   traffic counters, and the segment loaded from it must have them as
+ *   <mpa.mmap> does; counted traffic must be gone once it is loaded again;
+ * 3. loads a copy of the image with one byte flipped, and one cut short,
+ *   both must be refused and leave <mpa.mmap>.2 untouched.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "mpatest.h"
+
+#define IMAGETEST_MAX_SIZE (16 << 20)
+
+static long ReadFile(const char *pszFileName, char *pBuf, size_t nSize);
+static int WriteFile(const char *pszFileName, const char *pBuf, size_t nSize);
+static int SameFiles(const char *pszFileName1, const char *pszFileName2);
+static int Export(const char *pszSHMFileName, const char *pszFileName);
+static int CheckStats(const char *pszSHMFileName, const char *pszImageFileName,
+                      DWORD dwTotalSize);
+
+static long ReadFile(const char *pszFileName, char *pBuf, size_t nSize) {
+  FILE *fp;
+  size_t n;
+
+  if ((fp = fopen(pszFileName, "rb")) == NULL) {
+    return -1;
+  }
+  n = fread(pBuf, 1, nSize, fp);
+  fclose(fp);
+  return (long)n;
+}
+
+static int WriteFile(const char *pszFileName, const char *pBuf, size_t nSize) {
+  FILE *fp;
+
+  if ((fp = fopen(pszFileName, "wb")) == NULL) {
+    return -1;
+  }
+  if (fwrite(pBuf, 1, nSize, fp) != nSize) {
+    fclose(fp);
+    return -1;
+  }
+  return fclose(fp);
+}
+
+static int SameFiles(const char *pszFileName1, const char *pszFileName2) {
+  static char buf1[IMAGETEST_MAX_SIZE], buf2[IMAGETEST_MAX_SIZE];
+  long n1 = ReadFile(pszFileName1, buf1, sizeof(buf1));
+  long n2 = ReadFile(pszFileName2, buf2, sizeof(buf2));
+
+  return (n1 > 0 && n1 == n2 && memcmp(buf1, buf2, (size_t)n1) == 0) ? 1 : 0;
+}
+
+static int Export(const char *pszSHMFileName, const char *pszFileName) {
+  char *pMPAStart;
+  int nRetCode;
+
+  if ((pMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+    return -1;
+  }
+  nRetCode = MPA_SIS_ExportConfig(pMPAStart, pszFileName);
+  munmap(pMPAStart, *((DWORD *)pMPAStart));
+  return nRetCode;
+}
+
+/** Counts a message sent to server 1 of the segment, loads the image into it
+ *  again and checks the traffic counters of the loaded segment, which must
+ *  be as large as those of <mpa.mmap> */
+static int CheckStats(const char *pszSHMFileName, const char *pszImageFileName,
+                      DWORD dwTotalSize) {
+  char *pMPAStart;
+  MPA_SISInfo SISInfo;
+  MPA_SIS_SrvInfo ServerInfo;
+  MPA_SIS_Stat stat;
+  int index, nErrors = 0;
+
+  if ((pMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+    return 1;
+  }
+  GetSISInfo(pMPAStart, &SISInfo);
+  if ((index = MPA_GetServerInfo(1, &ServerInfo, pMPAStart)) >= 0) {
+    MPA_SIS_StatServer(&SISInfo, (mpa_index_t)index, MPA_STAT_SENT, 100);
+  }
+  munmap(pMPAStart, SISInfo.dwTotalSize);
+  if (0 != MPA_SIS_LoadImage(pszSHMFileName, pszImageFileName) ||
+      (pMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+    return 1;
+  }
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SISInfo.pStats == NULL || SISInfo.pdwDoorbells == NULL ||
+      SISInfo.dwTotalSize != dwTotalSize) {
+    printf("Segment loaded from image has no traffic counters\n");
+    nErrors++;
+  } else if (0 != MPA_SIS_GetServerStat(pMPAStart, 1, &stat) || stat.qwSent != 0) {
+    printf("Traffic counted before the image was loaded is kept\n");
+    nErrors++;
+  }
+  munmap(pMPAStart, SISInfo.dwTotalSize);
+  return nErrors;
+}
+
+int main(int argc, char **argv) {
+  static char buf[IMAGETEST_MAX_SIZE];
+  MPATest_Config config;
+  char szImage[1024], szImage2[1024], szBad[1024], szSHM2[1024];
+  char szExport[1024], szExport2[1024];
+  char *pMPAStart = NULL;
+  MPA_SISInfo SISInfo;
+  long nSize;
+  int nErrors = 0;
+  DWORD i;
+
+  if (0 != MPATest_Args(argc, argv, NULL)) {
+    return -1;
+  }
+  snprintf(szImage, sizeof(szImage), "%s.img", argv[1]);
+  snprintf(szImage2, sizeof(szImage2), "%s.img2", argv[1]);
+  snprintf(szBad, sizeof(szBad), "%s.bad", argv[1]);
+  snprintf(szSHM2, sizeof(szSHM2), "%s.2", argv[1]);
+  snprintf(szExport, sizeof(szExport), "%s.export", argv[1]);
+  snprintf(szExport2, sizeof(szExport2), "%s.2.export", argv[1]);
+
+  if (0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 128, 512)) {
+    return -1;
+  }
+  for (i = 1; i <= 100; i++) {
+    if (i % 10 == 0) {
+      MPATest_ConfigMember(&config, i, (key_t)atoi(argv[2]), i, i / 50 + 1);
+    } else {
+      MPATest_ConfigServer(&config, i, (key_t)atoi(argv[2]), i);
+    }
+  }
+  for (i = 0; i < 300; i++) {
+    MPATest_ConfigType(&config, 1000 + i % 37, i % 100 + 1);
+  }
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+
+  /** 1. Same configuration, same image */
+  if (0 != MPA_SIS_CompileConfig(szImage, config.szFileName) ||
+      0 != MPA_SIS_CompileConfig(szImage2, config.szFileName)) {
+    printf("Compiling config file error\n");
+    return -1;
+  }
+  if (!SameFiles(szImage, szImage2)) {
+    printf("Images of the same configuration differ\n");
+    nErrors++;
+  }
+
+  /** 2. Round trip */
+  if (0 != MPA_SIS_LoadImage(szSHM2, szImage) || 0 != Export(argv[1], szExport) ||
+      0 != Export(szSHM2, szExport2)) {
+    printf("Loading image error\n");
+    return -1;
+  }
+  if (!SameFiles(szExport, szExport2)) {
+    printf("Segment loaded from image differs from [%s]\n", argv[1]);
+    nErrors++;
+  }
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  GetSISInfo(pMPAStart, &SISInfo);
+  munmap(pMPAStart, SISInfo.dwTotalSize);
+  if ((nSize = ReadFile(szImage, buf, sizeof(buf))) <= 0 ||
+      (size_t)nSize >= SISInfo.dwTotalSize) {
+    printf("Image of %ld bytes holds traffic counters\n", nSize);
+    nErrors++;
+  }
+  nErrors += CheckStats(szSHM2, szImage, SISInfo.dwTotalSize);
+
+  /** 3. Damaged images */
+  if ((nSize = ReadFile(szImage, buf, sizeof(buf))) <= 0) {
+    printf("Reading image error\n");
+    return -1;
+  }
+  buf[nSize / 2] ^= 0x10;
+  if (0 != WriteFile(szBad, buf, (size_t)nSize) || 0 == MPA_SIS_LoadImage(szSHM2, szBad)) {
+    printf("Image with a flipped byte is loaded\n");
+    nErrors++;
+  }
+  buf[nSize / 2] ^= 0x10;
+  if (0 != WriteFile(szBad, buf, (size_t)nSize - 64) || 0 == MPA_SIS_LoadImage(szSHM2, szBad)) {
+    printf("Image cut short is loaded\n");
+    nErrors++;
+  }
+  if (0 != Export(szSHM2, szExport2) || !SameFiles(szExport, szExport2)) {
+    printf("Damaged image changed [%s]\n", szSHM2);
+    nErrors++;
+  }
+
+  printf("image %ld bytes, %d errors\n", nSize, nErrors);
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) != NULL) {
+    MPA_SIS_End(pMPAStart, True);
+  }
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,151 @@
+/**
+ * MPA in place receive test
+ *
+ * Loads servers 1 and 2, each on a queue of its own from <qkey>+1 on, and
+ * sends from server 9.
+ * 1. Sends a short message to server 1 and receives it with MPA_Recv()
+ *   into a message filled with 0xAA: its length, body and property must
+ *   be right and the bytes after its length left as they were;
+ * 2. Sends a message to server 1, receives it into a reserved buffer as
+ *   server 1 and commits the buffer on to server 2: server 2 must get the
+ *   body and property, with server 1 as the source;
+ * 3. Receives by type into a reserved buffer: an empty queue must return
+ *   MPA_ERR_RECV_NOMSG, and a message sent must be received;
+ * 4. Receives into NULL: it must be refused.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define INPLACETEST_SENDER 9
+
+static void MakeMessage(MPAMessage *pMessage, const char *pszBody, const char *pszProp);
+static int CheckMessage(const char *pszCase, const MPAMessage *pMessage, const char *pszBody,
+                        const char *pszProp, DWORD dwSource);
+
+static void MakeMessage(MPAMessage *pMessage, const char *pszBody, const char *pszProp) {
+  MPA_MsgInit(pMessage);
+  MPA_SetMsgBody(pszBody, strlen(pszBody) + 1, pMessage);
+  MPA_SetMsgProp("k", pszProp, pMessage);
+}
+
+/** The message must have the body, the property "k" of value pszProp and
+ *  the source given */
+static int CheckMessage(const char *pszCase, const MPAMessage *pMessage, const char *pszBody,
+                        const char *pszProp, DWORD dwSource) {
+  char szValue[16] = {0};
+  size_t nSize;
+  DWORD dwMsgSource = 0;
+
+  MPA_GetMsgProp("k", szValue, sizeof(szValue), pMessage);
+  MPA_GetMsgSource(pMessage, &dwMsgSource);
+  if (strcmp(MPA_GetMsgBody(NULL, &nSize, pMessage), pszBody) != 0 ||
+      strcmp(szValue, pszProp) != 0 || dwMsgSource != dwSource) {
+    printf("%s: received [%.16s] k=[%s] from %u, [%s] k=[%s] from %u expected\n", pszCase,
+           MPA_GetMsgBody(NULL, &nSize, pMessage), szValue, dwMsgSource, pszBody, pszProp,
+           dwSource);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  MPATest_Config config;
+  MPAMessage message, received, *pMessage = NULL;
+  MPA_Ctx *pCtxs[3] = {NULL};
+  const unsigned char *p;
+  ssize_t nMsgLen;
+  size_t i;
+  key_t qkey;
+  int nErrors = 0;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  MPATest_ConfigServer(&config, 1, qkey + 1, 1);
+  MPATest_ConfigServer(&config, 2, qkey + 2, 1);
+  MPATest_ConfigServer(&config, INPLACETEST_SENDER, qkey + INPLACETEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], INPLACETEST_SENDER) ||
+      (pCtxs[1] = MPA_CtxOpen(argv[1], 1, 0)) == NULL ||
+      (pCtxs[2] = MPA_CtxOpen(argv[1], 2, 0)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  if ((pMessage = MPA_SendReserve()) == NULL) {
+    printf("Error reserving send buffer\n");
+    return -1;
+  }
+
+  /** 1. Only the received bytes are copied */
+  MakeMessage(&message, "short", "v");
+  memset(&received, 0xAA, sizeof(received));
+  if (0 != MPA_Send(1, &message) || (nMsgLen = MPA_CtxRecv(pCtxs[1], &received)) <= 0) {
+    printf("Error sending message to server[1]\n");
+    return -1;
+  }
+  if (nMsgLen != MPA_GetMsgLength(&received)) {
+    printf("Received %zd bytes, message of %zd\n", nMsgLen, MPA_GetMsgLength(&received));
+    nErrors++;
+  }
+  nErrors += CheckMessage("copy", &received, "short", "v", INPLACETEST_SENDER);
+  for (i = (size_t)nMsgLen, p = (const unsigned char *)&received; i < sizeof(received); i++) {
+    if (p[i] != 0xAA) {
+      printf("Byte %zu after the %zd received changed to 0x%02x\n", i, nMsgLen, p[i]);
+      nErrors++;
+      break;
+    }
+  }
+
+  /** 2. Received in place and forwarded */
+  MakeMessage(&message, "forward", "w");
+  if (0 != MPA_Send(1, &message) || MPA_CtxRecvReserved(pCtxs[1], pMessage) <= 0) {
+    printf("Message not received into the reserved buffer\n");
+    nErrors++;
+  } else if (0 != MPA_CtxSendCommit(pCtxs[1], 2, pMessage)) {
+    printf("Received message not forwarded\n");
+    nErrors++;
+  } else if (MPA_CtxRecvNonBlock(pCtxs[2], &received) <= 0) {
+    printf("Forwarded message not received\n");
+    nErrors++;
+  } else {
+    nErrors += CheckMessage("forward", &received, "forward", "w", 1);
+  }
+
+  /** 3. Received by type in place */
+  if (MPA_CtxRecvTypeNonBlockReserved(pCtxs[2], 1, pMessage) != MPA_ERR_RECV_NOMSG) {
+    printf("Message received from an empty queue\n");
+    nErrors++;
+  }
+  MakeMessage(&message, "type", "t");
+  if (0 != MPA_Send(2, &message) ||
+      MPA_CtxRecvTypeNonBlockReserved(pCtxs[2], 1, pMessage) <= 0) {
+    printf("Message not received by type into the reserved buffer\n");
+    nErrors++;
+  } else {
+    nErrors += CheckMessage("type", pMessage, "type", "t", INPLACETEST_SENDER);
+  }
+
+  /** 4. No buffer */
+  if (MPA_CtxRecvReserved(pCtxs[1], NULL) != MPA_ERR_PARAM ||
+      MPA_CtxRecvTypeNonBlockReserved(pCtxs[1], 1, NULL) != MPA_ERR_PARAM) {
+    printf("Received into NULL\n");
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_SendRelease(pMessage);
+  MPA_CtxClose(pCtxs[1]);
+  MPA_CtxClose(pCtxs[2]);
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
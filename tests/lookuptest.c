@@ -0,0 +1,135 @@
+/**
+ * MPA segment lookup test
+ *
+ * Loads 1000 server infos (or the number given) with sparse sids, all on
+ * queue <qkey>, and subscribes each of them to type sid % 16. Every server
+ * must then be found through the sid hash index with its own qtype, sids
+ * in between must not be found, and the subscriber list of every type must
+ * hold exactly its servers. Then every third server is unsubscribed and
+ * deleted, and both lookups are checked again.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mpatest.h"
+
+#define LOOKUPTEST_TYPES 16
+#define LOOKUPTEST_STEP 7919 /**< Distance between sids, a prime */
+
+static Boolean Deleted(DWORD i, Boolean bDeleted);
+static int CheckServers(const char *pMPAStart, DWORD dwNum, Boolean bDeleted);
+static int CheckTypes(const char *pMPAStart, DWORD dwNum, Boolean bDeleted);
+
+/** Every third server is deleted in the second pass */
+static Boolean Deleted(DWORD i, Boolean bDeleted) {
+  return (bDeleted == True && i % 3 == 0) ? True : False;
+}
+
+static int CheckServers(const char *pMPAStart, DWORD dwNum, Boolean bDeleted) {
+  MPA_SIS_SrvInfo ServerInfo;
+  DWORD i;
+  int nErrors = 0;
+
+  for (i = 1; i <= dwNum; i++) {
+    if (MPA_GetServerInfo(i * LOOKUPTEST_STEP, &ServerInfo, pMPAStart) < 0) {
+      if (Deleted(i, bDeleted) == False) {
+        printf("Server info[%u] not found\n", i * LOOKUPTEST_STEP);
+        nErrors++;
+      }
+    } else if (Deleted(i, bDeleted) == True) {
+      printf("Deleted server info[%u] found\n", i * LOOKUPTEST_STEP);
+      nErrors++;
+    } else if (ServerInfo.dwSid != i * LOOKUPTEST_STEP || ServerInfo.dwQtype != i) {
+      printf("Server info[%u] found as [%u] of qtype %u\n", i * LOOKUPTEST_STEP, ServerInfo.dwSid,
+             ServerInfo.dwQtype);
+      nErrors++;
+    }
+    if (MPA_GetServerInfo(i * LOOKUPTEST_STEP + 1, &ServerInfo, pMPAStart) >= 0) {
+      printf("Missing server info[%u] found\n", i * LOOKUPTEST_STEP + 1);
+      nErrors++;
+    }
+  }
+  return nErrors;
+}
+
+static int CheckTypes(const char *pMPAStart, DWORD dwNum, Boolean bDeleted) {
+  MPA_SIS_SrvInfo *pSrvInfos;
+  DWORD type, i;
+  int j, nTotal, nExpected, nErrors = 0;
+
+  if ((pSrvInfos = malloc(dwNum * sizeof(MPA_SIS_SrvInfo))) == NULL) {
+    return 1;
+  }
+  for (type = 0; type < LOOKUPTEST_TYPES; type++) {
+    nTotal = MPA_GetSubscribers(type, 0, pSrvInfos, dwNum, pMPAStart);
+    for (nExpected = 0, i = 1; i <= dwNum; i++) {
+      if (i % LOOKUPTEST_TYPES == type && Deleted(i, bDeleted) == False) {
+        nExpected++;
+      }
+    }
+    if (nTotal != nExpected) {
+      printf("Type[%u] has %d subscribers, %d expected\n", type, nTotal, nExpected);
+      nErrors++;
+      continue;
+    }
+    for (j = 0; j < nTotal; j++) {
+      i = pSrvInfos[j].dwSid / LOOKUPTEST_STEP;
+      if (pSrvInfos[j].dwSid % LOOKUPTEST_STEP != 0 || i % LOOKUPTEST_TYPES != type ||
+          Deleted(i, bDeleted) == True) {
+        printf("Type[%u] has wrong subscriber[%u]\n", type, pSrvInfos[j].dwSid);
+        nErrors++;
+      }
+    }
+  }
+  free(pSrvInfos);
+  return nErrors;
+}
+
+int main(int argc, char **argv) {
+  char *pMPAStart = NULL;
+  MPATest_Config config;
+  DWORD dwNum = 1000, i;
+  int nErrors;
+
+  if (0 != MPATest_Args(argc, argv, "entries")) {
+    return -1;
+  }
+  if (argc == 4) {
+    dwNum = (DWORD)atoi(argv[3]);
+  }
+
+  if (0 != MPATest_ConfigOpen(&config, argv[1], ".ini", dwNum, dwNum)) {
+    return -1;
+  }
+  for (i = 1; i <= dwNum; i++) {
+    MPATest_ConfigServer(&config, i * LOOKUPTEST_STEP, (key_t)atoi(argv[2]), i);
+  }
+  for (i = 1; i <= dwNum; i++) {
+    MPATest_ConfigType(&config, i % LOOKUPTEST_TYPES, i * LOOKUPTEST_STEP);
+  }
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+
+  nErrors = CheckServers(pMPAStart, dwNum, False) + CheckTypes(pMPAStart, dwNum, False);
+  printf("loaded  %u server infos, %d errors\n", dwNum, nErrors);
+
+  for (i = 3; i <= dwNum; i += 3) {
+    if (0 != MPA_SIS_TInfoDelete(pMPAStart, i % LOOKUPTEST_TYPES, i * LOOKUPTEST_STEP) ||
+        0 != MPA_SIS_SInfoDelete(pMPAStart, i * LOOKUPTEST_STEP)) {
+      printf("Error deleting server info[%u]\n", i * LOOKUPTEST_STEP);
+      nErrors++;
+    }
+  }
+  nErrors += CheckServers(pMPAStart, dwNum, True) + CheckTypes(pMPAStart, dwNum, True);
+  printf("deleted %u server infos, %d errors\n", dwNum / 3, nErrors);
+
+  MPA_SIS_End(pMPAStart, True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,143 @@
+/**
+ * MPA queue depth test
+ *
+ * Loads servers 1 and 2 sharing queue <qkey>+1 with qtypes 1 and 2, server
+ * 3 on queue <qkey>+3, and sends from server 9 on queue <qkey>+9.
+ * 1. Sends 3 messages to server 1, 2 to server 2 and 4 to server 3: the
+ *   depths of all 4 servers must be given in one call, servers 1 and 2
+ *   with the 5 messages of their shared queue, server 3 with its 4 and
+ *   their bytes;
+ * 2. Counts the shared queue by type: 3 messages of qtype 1 and 2 of qtype
+ *   2 must be found, unless MSG_COPY is not supported;
+ * 3. Gives room for 2 entries: the total of 4 must still be returned and
+ *   the entries after the 2 must be left alone;
+ * 4. Removes the queue of server 3: its entry must carry the error.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/msg.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define QUEUESTATTEST_SENDER 9
+
+static int Send(DWORD sid, int nCount, const MPAMessage *pMessage);
+static const MPA_SIS_QueueStat *Find(const MPA_SIS_QueueStat *pStats, int nCount, DWORD sid);
+
+static int Send(DWORD sid, int nCount, const MPAMessage *pMessage) {
+  int i;
+
+  for (i = 0; i < nCount; i++) {
+    if (0 != MPA_Send(sid, pMessage)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static const MPA_SIS_QueueStat *Find(const MPA_SIS_QueueStat *pStats, int nCount, DWORD sid) {
+  int i;
+
+  for (i = 0; i < nCount; i++) {
+    if (pStats[i].dwSid == sid) {
+      return pStats + i;
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  static const DWORD dwTypes[] = {1, 2};
+  MPA_SIS_QueueStat stats[8];
+  const MPA_SIS_QueueStat *pStat1, *pStat2, *pStat3;
+  MPATest_Config config;
+  MPAMessage message;
+  char *pMPAStart = NULL;
+  size_t nMsgLen, nMsgs[2];
+  key_t qkey;
+  int n, qid3, nErrors = 0;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  MPATest_ConfigServer(&config, 1, qkey + 1, 1);
+  MPATest_ConfigServer(&config, 2, qkey + 1, 2);
+  MPATest_ConfigServer(&config, 3, qkey + 3, 1);
+  MPATest_ConfigServer(&config, QUEUESTATTEST_SENDER, qkey + QUEUESTATTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], QUEUESTATTEST_SENDER) ||
+      (pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  MPA_MsgInit(&message);
+  MPA_SetMsgBody("depth", 6, &message);
+
+  /** 1. Depths of all servers in one call */
+  if (0 != Send(1, 3, &message) || 0 != Send(2, 2, &message) || 0 != Send(3, 4, &message)) {
+    printf("Error sending messages\n");
+    return -1;
+  }
+  nMsgLen = (size_t)MPA_GetMsgLength(&message);
+  memset(stats, 0, sizeof(stats));
+  if ((n = MPA_SIS_QueueStats(pMPAStart, stats, 8)) != 4) {
+    printf("Queue stats of %d servers, 4 expected\n", n);
+    return -1;
+  }
+  pStat1 = Find(stats, n, 1);
+  pStat2 = Find(stats, n, 2);
+  pStat3 = Find(stats, n, 3);
+  if (pStat1 == NULL || pStat2 == NULL || pStat3 == NULL) {
+    printf("Queue stats of servers 1 to 3 not found\n");
+    return -1;
+  }
+  if (pStat1->nErrno != 0 || pStat1->nMsgs != 5 || pStat1->nBytes != 5 * nMsgLen ||
+      pStat2->dwQid != pStat1->dwQid || pStat2->nMsgs != 5 || pStat2->dwQtype != 2) {
+    printf("Shared queue has %zu and %zu messages, 5 expected\n", pStat1->nMsgs, pStat2->nMsgs);
+    nErrors++;
+  }
+  if (pStat3->nErrno != 0 || pStat3->nMsgs != 4 || pStat3->nBytes != 4 * nMsgLen ||
+      pStat3->nMaxBytes < pStat3->nBytes || pStat3->tSend == 0) {
+    printf("Queue of server[3] has %zu messages of %zu bytes, 4 of %zu expected\n",
+           pStat3->nMsgs, pStat3->nBytes, 4 * nMsgLen);
+    nErrors++;
+  }
+  qid3 = pStat3->dwQid;
+
+  /** 2. Depth of a shared queue by type */
+  if ((n = MPA_SIS_QueueTypeDepth(pStat1->dwQid, dwTypes, nMsgs, 2)) < 0) {
+    printf("MSG_COPY not supported, depth by type skipped\n");
+  } else if (n != 5 || nMsgs[0] != 3 || nMsgs[1] != 2) {
+    printf("Shared queue has %zu and %zu messages of qtypes 1 and 2, 3 and 2 expected\n",
+           nMsgs[0], nMsgs[1]);
+    nErrors++;
+  }
+
+  /** 3. Entries after the room given are left out */
+  memset(stats, 0xFF, sizeof(stats));
+  if ((n = MPA_SIS_QueueStats(pMPAStart, stats, 2)) != 4 || stats[2].dwSid != 0xFFFFFFFF) {
+    printf("Queue stats of 2 entries returned %d, or wrote past them\n", n);
+    nErrors++;
+  }
+
+  /** 4. A queue which cannot be read */
+  msgctl(qid3, IPC_RMID, NULL);
+  memset(stats, 0, sizeof(stats));
+  if ((n = MPA_SIS_QueueStats(pMPAStart, stats, 8)) != 4 ||
+      (pStat3 = Find(stats, n, 3)) == NULL || pStat3->nErrno == 0) {
+    printf("Removed queue of server[3] read without error\n");
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,159 @@
+/**
+ * MPA batch receive test
+ *
+ * Loads servers 1 and 2 sharing queue <qkey>+1 with qtypes 1 and 2, and
+ * sends from server 9.
+ * 1. Sends 10 messages of growing lengths to server 1 and 3 to server 2
+ *   between them, and receives server 1 in batches of 4 without waiting:
+ *   4, 4 and 2 messages must come, in order and each of its own length,
+ *   then 0 from the drained queue; server 2 must still get its 3;
+ * 2. The counters of server 1 must hold the 10 messages and their bytes;
+ * 3. Forks server 9, which sends one message 50 ms later, and waits for
+ *   it with no timeout: the batch of 1 must come;
+ * 4. Receives into no room: it must be refused.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define RECVMANYTEST_SENDER 9
+#define RECVMANYTEST_ROUNDS 10
+#define RECVMANYTEST_BATCH 4
+
+static void MakeMessage(MPAMessage *pMessage, int n);
+static int CheckBatch(const MPAMessage *pMessages, ssize_t nCount, int nFrom, size_t *pnBytes);
+
+/** Message n has a body of n * 50 + 1 bytes of 'a' + n */
+static void MakeMessage(MPAMessage *pMessage, int n) {
+  char szBody[RECVMANYTEST_ROUNDS * 50];
+
+  memset(szBody, 'a' + n, sizeof(szBody));
+  MPA_MsgInit(pMessage);
+  MPA_SetMsgBody(szBody, (size_t)n * 50 + 1, pMessage);
+}
+
+/** The messages must be numbered nFrom on, their bytes are added to
+ *  *pnBytes */
+static int CheckBatch(const MPAMessage *pMessages, ssize_t nCount, int nFrom, size_t *pnBytes) {
+  const char *pszBody;
+  size_t nSize;
+  ssize_t i;
+
+  for (i = 0; i < nCount; i++) {
+    pszBody = MPA_GetMsgBody(NULL, &nSize, pMessages + i);
+    if (nSize != (size_t)(nFrom + i) * 50 + 1 || pszBody[0] != 'a' + nFrom + i ||
+        pszBody[nSize - 1] != 'a' + nFrom + i) {
+      printf("Message %zd of the batch has %zu bytes of [%c], message %zd expected\n", i, nSize,
+             pszBody[0], nFrom + i);
+      return 1;
+    }
+    *pnBytes += (size_t)MPA_GetMsgLength(pMessages + i);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static MPAMessage messages[RECVMANYTEST_ROUNDS];
+  struct timespec ts = {0, 50000000};
+  MPATest_Config config;
+  MPAMessage message;
+  MPA_SIS_Stat stat;
+  MPA_Ctx *pCtxs[3] = {NULL};
+  char *pMPAStart = NULL;
+  size_t nBytes = 0;
+  ssize_t n;
+  key_t qkey;
+  pid_t pid;
+  int i, nStatus, nReceived = 0, nErrors = 0;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  MPATest_ConfigServer(&config, 1, qkey + 1, 1);
+  MPATest_ConfigServer(&config, 2, qkey + 1, 2);
+  MPATest_ConfigServer(&config, RECVMANYTEST_SENDER, qkey + RECVMANYTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], RECVMANYTEST_SENDER) ||
+      (pMPAStart = MPA_SIS_Init(argv[1])) == NULL ||
+      (pCtxs[1] = MPA_CtxOpen(argv[1], 1, 0)) == NULL ||
+      (pCtxs[2] = MPA_CtxOpen(argv[1], 2, 0)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+
+  /** 1. Batches of a backlog */
+  for (i = 0; i < RECVMANYTEST_ROUNDS; i++) {
+    MakeMessage(&message, i);
+    if (0 != MPA_Send(1, &message) || (i % 3 == 0 && i > 0 && 0 != MPA_Send(2, &message))) {
+      printf("Error sending message %d\n", i);
+      return -1;
+    }
+  }
+  while ((n = MPA_CtxRecvMany(pCtxs[1], messages, RECVMANYTEST_BATCH, 0)) > 0) {
+    if (n != ((RECVMANYTEST_ROUNDS - nReceived < RECVMANYTEST_BATCH)
+                  ? RECVMANYTEST_ROUNDS - nReceived
+                  : RECVMANYTEST_BATCH)) {
+      printf("Batch of %zd messages after %d\n", n, nReceived);
+      nErrors++;
+    }
+    nErrors += CheckBatch(messages, n, nReceived, &nBytes);
+    nReceived += (int)n;
+  }
+  if (n != 0 || nReceived != RECVMANYTEST_ROUNDS) {
+    printf("Server[1] received %d messages and then %zd, %d and 0 expected\n", nReceived, n,
+           RECVMANYTEST_ROUNDS);
+    nErrors++;
+  }
+  if ((n = MPA_CtxRecvMany(pCtxs[2], messages, RECVMANYTEST_ROUNDS, 0)) != 3) {
+    printf("Server[2] received %zd messages, 3 expected\n", n);
+    nErrors++;
+  }
+
+  /** 2. Every message of the batches is counted */
+  if (0 != MPA_SIS_GetServerStat(pMPAStart, 1, &stat) ||
+      stat.qwRecv != RECVMANYTEST_ROUNDS || stat.qwRecvBytes != nBytes) {
+    printf("Server[1] counted %llu received of %llu bytes, %d of %zu expected\n", stat.qwRecv,
+           stat.qwRecvBytes, RECVMANYTEST_ROUNDS, nBytes);
+    nErrors++;
+  }
+
+  /** 3. Waiting for the first message */
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    nanosleep(&ts, NULL);
+    MakeMessage(&message, 1);
+    _exit((0 == MPA_Init(argv[1], RECVMANYTEST_SENDER) && 0 == MPA_Send(1, &message)) ? 0 : 1);
+  }
+  nBytes = 0;
+  if ((n = MPA_CtxRecvMany(pCtxs[1], messages, RECVMANYTEST_BATCH, -1)) != 1 ||
+      0 != CheckBatch(messages, n, 1, &nBytes)) {
+    printf("Waiting for a batch received %zd messages, 1 expected\n", n);
+    nErrors++;
+  }
+  waitpid(pid, &nStatus, 0);
+
+  /** 4. No room */
+  if (MPA_CtxRecvMany(pCtxs[1], messages, 0, 0) != MPA_ERR_PARAM ||
+      MPA_CtxRecvMany(pCtxs[1], NULL, RECVMANYTEST_BATCH, 0) != MPA_ERR_PARAM) {
+    printf("Received into no room\n");
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_CtxClose(pCtxs[1]);
+  MPA_CtxClose(pCtxs[2]);
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,179 @@
+/**
+ * MPA reload test
+ *
+ * Loads server 1 on queue <qkey>+1 and server 9, which sends, on queue
+ * <qkey>+9, then:
+ * 1. Forks a watcher of server 9 blocked in MPA_CtxWaitChange(), and a
+ *   sender of server 9 which sends messages 0 to 199 to server 1, 1 ms
+ *   apart, through one context kept open all along;
+ * 2. Reloads meanwhile a configuration moving server 1 onto queue <qkey>+2:
+ *   the watcher must be woken within 1 s, every send must succeed, the old
+ *   queue must hold the first messages and the new queue the others, in
+ *   order, some in each and 200 in all;
+ * 3. Sends once more with the default context opened before the reload:
+ *   the message must reach the new queue.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define RELOADTEST_SENDER 9
+#define RELOADTEST_ROUNDS 200
+
+static int Sender(const char *pszSHMFileName);
+static int Watcher(const char *pszSHMFileName, int fd);
+static int TakeNumbers(key_t qkey, int nFrom);
+
+/** Sends messages numbered 0 to RELOADTEST_ROUNDS - 1, 1 ms apart, and
+ *  returns the number of failed sends */
+static int Sender(const char *pszSHMFileName) {
+  struct timespec ts = {0, 1000000};
+  MPAMessage message;
+  MPA_Ctx *pCtx;
+  char szBody[16];
+  int i, nFailed = 0;
+
+  if ((pCtx = MPA_CtxOpen(pszSHMFileName, RELOADTEST_SENDER, 0)) == NULL) {
+    return RELOADTEST_ROUNDS;
+  }
+  for (i = 0; i < RELOADTEST_ROUNDS; i++) {
+    snprintf(szBody, sizeof(szBody), "m%d", i);
+    MPA_MsgInit(&message);
+    MPA_SetMsgBody(szBody, strlen(szBody) + 1, &message);
+    if (0 != MPA_CtxSend(pCtx, 1, &message)) {
+      nFailed++;
+    }
+    nanosleep(&ts, NULL);
+  }
+  MPA_CtxClose(pCtx);
+  return (nFailed < 255) ? nFailed : 255;
+}
+
+/** Writes a byte to fd once the generation is known, and waits for it to
+ *  change */
+static int Watcher(const char *pszSHMFileName, int fd) {
+  MPA_Ctx *pCtx;
+  DWORD dwGeneration = 0;
+  int nRetCode;
+
+  if ((pCtx = MPA_CtxOpen(pszSHMFileName, RELOADTEST_SENDER, 0)) == NULL ||
+      MPA_CtxWaitChange(pCtx, &dwGeneration, 0) < 0 || write(fd, "w", 1) != 1) {
+    return 1;
+  }
+  nRetCode = MPA_CtxWaitChange(pCtx, &dwGeneration, 1000);
+  MPA_CtxClose(pCtx);
+  return (nRetCode == 0) ? 0 : 1;
+}
+
+/** Receives every message left in the queue, which must be numbered nFrom
+ *  on in order, and returns the number after the last one */
+static int TakeNumbers(key_t qkey, int nFrom) {
+  static struct {
+    long mtype;
+    MPAMessage message;
+  } MsgBuf;
+  char *pszBody;
+  size_t nSize;
+  int qid;
+
+  if ((qid = msgget(qkey, 0)) < 0) {
+    printf("Queue %d not found\n", qkey);
+    return -1;
+  }
+  while (msgrcv(qid, &MsgBuf, sizeof(MPAMessage), 0, IPC_NOWAIT) > 0) {
+    pszBody = MPA_GetMsgBody(NULL, &nSize, &MsgBuf.message);
+    if (nSize < 2 || atoi(pszBody + 1) != nFrom) {
+      printf("Message %d received from queue %d as [%.16s]\n", nFrom, qkey, pszBody);
+      return -1;
+    }
+    nFrom++;
+  }
+  return nFrom;
+}
+
+int main(int argc, char **argv) {
+  struct timespec ts = {0, 50000000};
+  MPATest_Config config;
+  MPAMessage message;
+  pid_t pidSender, pidWatcher;
+  key_t qkey;
+  int fds[2], nStatus, nOld, nNew, nErrors = 0;
+  char c;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  MPATest_ConfigServer(&config, 1, qkey + 1, 1);
+  MPATest_ConfigServer(&config, RELOADTEST_SENDER, qkey + RELOADTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], RELOADTEST_SENDER) || pipe(fds) != 0) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+
+  /** 1. A watcher and a sender run */
+  fflush(stdout);
+  if ((pidWatcher = fork()) == 0) {
+    _exit(Watcher(argv[1], fds[1]));
+  }
+  if (read(fds[0], &c, 1) != 1) {
+    printf("Watcher failed to start\n");
+    return -1;
+  }
+  if ((pidSender = fork()) == 0) {
+    _exit(Sender(argv[1]));
+  }
+
+  /** 2. Reload under them */
+  nanosleep(&ts, NULL);
+  if (0 != MPATest_ConfigOpen(&config, argv[1], ".2.ini", 8, 1)) {
+    return -1;
+  }
+  MPATest_ConfigServer(&config, 1, qkey + 2, 1);
+  MPATest_ConfigServer(&config, RELOADTEST_SENDER, qkey + RELOADTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    nErrors++;
+  }
+  waitpid(pidWatcher, &nStatus, 0);
+  if (!WIFEXITED(nStatus) || WEXITSTATUS(nStatus) != 0) {
+    printf("Watcher was not woken by the reload\n");
+    nErrors++;
+  }
+  waitpid(pidSender, &nStatus, 0);
+  if (!WIFEXITED(nStatus) || WEXITSTATUS(nStatus) != 0) {
+    printf("Sender failed %d sends\n", WIFEXITED(nStatus) ? WEXITSTATUS(nStatus) : -1);
+    nErrors++;
+  }
+  nOld = TakeNumbers(qkey + 1, 0);
+  nNew = TakeNumbers(qkey + 2, nOld);
+  printf("old queue got %d messages, new queue %d\n", nOld, nNew - nOld);
+  if (nOld <= 0 || nNew != RELOADTEST_ROUNDS || nNew == nOld) {
+    printf("Messages split %d and %d between the queues\n", nOld, nNew - nOld);
+    nErrors++;
+  }
+
+  /** 3. The default context follows the reload */
+  MPA_MsgInit(&message);
+  MPA_SetMsgBody("m0", 3, &message);
+  if (0 != MPA_Send(1, &message) || TakeNumbers(qkey + 2, 0) != 1) {
+    printf("Message sent after the reload did not reach queue %d\n", qkey + 2);
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,160 @@
+/**
+ * MPA server group ring test
+ *
+ * Loads group 5 of servers 1 to 4, each on a queue of its own from
+ * <qkey>+1 on, and sends from server 9 by the "acct" property of 200
+ * messages, "k0" to "k199":
+ * 1. sends them twice, every key must reach the same server both times and
+ *   every server must get some of them;
+ * 2. removes the queue of server 2, and then of server 3, and sends them
+ *   again each time: every send must still succeed, and keys of the servers
+ *   left must not move;
+ * 3. removes the queues of all servers, every send must fail.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/msg.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define RINGTEST_GID 5
+#define RINGTEST_SERVERS 4
+#define RINGTEST_SENDER 9
+#define RINGTEST_KEYS 200
+
+static int SendKeys(void);
+static int Collect(MPA_Ctx **ppCtxs, DWORD *pdwSids);
+static int Compare(const DWORD *pdwBefore, const DWORD *pdwAfter, DWORD dwRemoved);
+
+/** Returns the number of sends failed */
+static int SendKeys() {
+  MPAMessage message;
+  char szKey[16];
+  int i, nFailed = 0;
+
+  for (i = 0; i < RINGTEST_KEYS; i++) {
+    snprintf(szKey, sizeof(szKey), "k%d", i);
+    MPA_MsgInit(&message);
+    MPA_SetMsgProp("acct", szKey, &message);
+    MPA_SetMsgBody("ring", 5, &message);
+    if (0 != MPA_SendGroupByProp(RINGTEST_GID, "acct", &message)) {
+      nFailed++;
+    }
+  }
+  return nFailed;
+}
+
+/** Empties the queues and records the server every key reached */
+static int Collect(MPA_Ctx **ppCtxs, DWORD *pdwSids) {
+  MPAMessage message;
+  char szKey[16];
+  DWORD sid;
+  int nKey, nErrors = 0;
+
+  for (nKey = 0; nKey < RINGTEST_KEYS; nKey++) {
+    pdwSids[nKey] = 0;
+  }
+  for (sid = 1; sid <= RINGTEST_SERVERS; sid++) {
+    while (MPA_CtxRecvNonBlock(ppCtxs[sid], &message) > 0) {
+      if (MPA_GetMsgProp("acct", szKey, sizeof(szKey), &message) <= 0 ||
+          (nKey = atoi(szKey + 1)) < 0 || nKey >= RINGTEST_KEYS || pdwSids[nKey] != 0) {
+        printf("Unexpected message on server[%u]\n", sid);
+        nErrors++;
+        continue;
+      }
+      pdwSids[nKey] = sid;
+    }
+  }
+  return nErrors;
+}
+
+/** Keys must stay where they were but for those of removed servers */
+static int Compare(const DWORD *pdwBefore, const DWORD *pdwAfter, DWORD dwRemoved) {
+  int i, nErrors = 0;
+
+  for (i = 0; i < RINGTEST_KEYS; i++) {
+    if (pdwAfter[i] == 0 || (pdwAfter[i] <= dwRemoved && pdwAfter[i] > 1) ||
+        (pdwBefore[i] != pdwAfter[i] && (pdwBefore[i] == 1 || pdwBefore[i] > dwRemoved))) {
+      printf("Key k%d moved from server[%u] to [%u]\n", i, pdwBefore[i], pdwAfter[i]);
+      nErrors++;
+    }
+  }
+  return nErrors;
+}
+
+int main(int argc, char **argv) {
+  static DWORD dwFirst[RINGTEST_KEYS], dwAgain[RINGTEST_KEYS];
+  char *pMPAStart = NULL;
+  MPATest_Config config;
+  MPA_SIS_SrvInfo ServerInfo;
+  MPA_Ctx *pCtxs[RINGTEST_SERVERS + 1];
+  int nQids[RINGTEST_SERVERS + 1], nCounts[RINGTEST_SERVERS + 1] = {0}, i, nErrors = 0;
+  key_t qkey;
+  DWORD sid;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  for (sid = 1; sid <= RINGTEST_SERVERS; sid++) {
+    MPATest_ConfigMember(&config, sid, qkey + (key_t)sid, 1, RINGTEST_GID);
+  }
+  MPATest_ConfigServer(&config, RINGTEST_SENDER, qkey + RINGTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], RINGTEST_SENDER) || (pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  for (sid = 1; sid <= RINGTEST_SERVERS; sid++) {
+    if ((pCtxs[sid] = MPA_CtxOpen(argv[1], sid, 0)) == NULL) {
+      printf("Error opening context of server[%u]\n", sid);
+      return -1;
+    }
+    MPA_GetServerInfo(sid, &ServerInfo, pMPAStart);
+    nQids[sid] = ServerInfo.dwQid;
+  }
+
+  /** 1. Key affinity */
+  nErrors += SendKeys() + Collect(pCtxs, dwFirst);
+  nErrors += SendKeys() + Collect(pCtxs, dwAgain) + Compare(dwFirst, dwAgain, 0);
+  for (i = 0; i < RINGTEST_KEYS; i++) {
+    nCounts[dwFirst[i]]++;
+  }
+  for (sid = 1; sid <= RINGTEST_SERVERS; sid++) {
+    printf("server %u: %d keys\n", sid, nCounts[sid]);
+    if (nCounts[sid] == 0) {
+      nErrors++;
+    }
+  }
+
+  /** 2. Failover skips every member already tried */
+  for (sid = 2; sid <= 3; sid++) {
+    msgctl(nQids[sid], IPC_RMID, NULL);
+    if ((i = SendKeys()) != 0) {
+      printf("%d sends failed without server[2..%u]\n", i, sid);
+      nErrors++;
+    }
+    nErrors += Collect(pCtxs, dwAgain) + Compare(dwFirst, dwAgain, sid);
+  }
+
+  /** 3. No member left */
+  msgctl(nQids[1], IPC_RMID, NULL);
+  msgctl(nQids[4], IPC_RMID, NULL);
+  if ((i = SendKeys()) != RINGTEST_KEYS) {
+    printf("%d sends succeeded without servers\n", RINGTEST_KEYS - i);
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  for (sid = 1; sid <= RINGTEST_SERVERS; sid++) {
+    MPA_CtxClose(pCtxs[sid]);
+  }
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
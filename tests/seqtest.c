@@ -0,0 +1,110 @@
+/**
+ * MPA segment sequence lock test
+ *
+ * Loads server infos 1 to 64 on two queues, <qkey> and <qkey>+1, then forks
+ * a writer which keeps moving every server between the two queues, giving
+ * it the qtype of the queue, and deleting and adding back the last one.
+ * The parent looks the servers up meanwhile and counts the lookups whose
+ * queue key, queue id and qtype do not belong together. Any such torn read
+ * fails the test.
+ * */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpatest.h"
+
+#define SEQTEST_SERVERS 64
+
+static volatile sig_atomic_t g_bStop = 0;
+
+static void OnTerm(int nSignal);
+static void Writer(const char *pMPAStart, key_t qkey);
+
+static void OnTerm(int nSignal) {
+  (void)nSignal;
+  g_bStop = 1;
+}
+
+/** Stops between writes when told, a writer killed inside one would hold
+ *  the sequence lock until readers find it dead */
+static void Writer(const char *pMPAStart, key_t qkey) {
+  DWORD i, dwRound;
+
+  signal(SIGTERM, OnTerm);
+  for (dwRound = 0; g_bStop == 0; dwRound++) {
+    for (i = 1; i <= SEQTEST_SERVERS; i++) {
+      MPA_SIS_SInfoModify(pMPAStart, i, qkey + (key_t)(dwRound & 1), (dwRound & 1) + 1);
+    }
+    MPA_SIS_SInfoDelete(pMPAStart, SEQTEST_SERVERS);
+    MPA_SIS_SInfoAdd(pMPAStart, SEQTEST_SERVERS, qkey, 1);
+  }
+}
+
+int main(int argc, char **argv) {
+  char *pMPAStart = NULL;
+  MPATest_Config config;
+  MPA_SIS_SrvInfo ServerInfo;
+  unsigned long long qwLookups = 0, qwMissing = 0, qwTorn = 0;
+  int qids[2], nSeconds = 3, nStatus;
+  key_t qkey;
+  pid_t pid;
+  time_t tEnd;
+  DWORD sid;
+
+  if (0 != MPATest_Args(argc, argv, "seconds")) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  if (argc == 4) {
+    nSeconds = atoi(argv[3]);
+  }
+
+  if (0 != MPATest_ConfigOpen(&config, argv[1], ".ini", SEQTEST_SERVERS, 1)) {
+    return -1;
+  }
+  for (sid = 1; sid <= SEQTEST_SERVERS; sid++) {
+    MPATest_ConfigServer(&config, sid, qkey, 1);
+  }
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  qids[0] = msgget(qkey, IPC_CREAT | 0666);
+  qids[1] = msgget(qkey + 1, IPC_CREAT | 0666);
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL || qids[0] < 0 || qids[1] < 0) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+
+  if ((pid = fork()) == 0) {
+    Writer(pMPAStart, qkey);
+    _exit(0);
+  }
+  for (tEnd = time(NULL) + nSeconds; time(NULL) < tEnd;) {
+    for (sid = 1; sid <= SEQTEST_SERVERS; sid++, qwLookups++) {
+      if (MPA_GetServerInfo(sid, &ServerInfo, pMPAStart) < 0) {
+        qwMissing++;
+        continue;
+      }
+      if (ServerInfo.dwSid != sid ||
+          (ServerInfo.dwQkey != qkey && ServerInfo.dwQkey != qkey + 1) ||
+          ServerInfo.dwQtype != (DWORD)(ServerInfo.dwQkey - qkey) + 1 ||
+          ServerInfo.dwQid != qids[ServerInfo.dwQkey - qkey]) {
+        qwTorn++;
+      }
+    }
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, &nStatus, 0);
+
+  printf("lookups %llu, missing %llu, torn %llu\n", qwLookups, qwMissing, qwTorn);
+  msgctl(qids[1], IPC_RMID, NULL);
+  MPA_SIS_End(pMPAStart, True);
+  return (qwTorn == 0 && qwLookups > 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,121 @@
+/**
+ * MPA segment startup benchmark
+ *
+ * Creates an empty segment with room for 65536 server and type infos (or
+ * the number given), loads as many from a generated configuration file
+ * `<mpa.mmap>.ini`, then maps it with each MPA_SIS_MAP_* option and times
+ * the first and the second pass of route lookups over all servers. The
+ * first pass shows the page faults a cold start pays, the second one the
+ * steady state.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "mpatest.h"
+#include "rscommon/debug.h"
+#include "rscommon/strfunc.h"
+
+#define SISBENCH_TYPES 1024 /**< Message types the type infos are spread over */
+
+static double Elapsed(const struct timespec *pStart);
+static double LookupAll(const char *pMPAStart, DWORD dwNum);
+
+static double Elapsed(const struct timespec *pStart) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)(now.tv_sec - pStart->tv_sec) * 1000.0 +
+         (double)(now.tv_nsec - pStart->tv_nsec) / 1000000.0;
+}
+
+static double LookupAll(const char *pMPAStart, DWORD dwNum) {
+  struct timespec start;
+  MPA_SIS_SrvInfo ServerInfo;
+  DWORD sid;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (sid = 1; sid <= dwNum; sid++) {
+    if (MPA_GetServerInfo(sid, &ServerInfo, pMPAStart) < 0) {
+      printf("Server info[%u] not found\n", sid);
+      break;
+    }
+  }
+  return Elapsed(&start);
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    const char *pszName;
+    int nFlags;
+  } options[] = {
+      {"none", 0},
+      {"populate", MPA_SIS_MAP_POPULATE},
+      {"populate+mlock", MPA_SIS_MAP_POPULATE | MPA_SIS_MAP_MLOCK},
+      {"populate+hugepage", MPA_SIS_MAP_POPULATE | MPA_SIS_MAP_HUGEPAGE},
+  };
+  struct timespec start;
+  char *pMPAStart = NULL;
+  MPATest_Config config;
+  DWORD dwNum = 65536, i = 0;
+  key_t qkey;
+  double dMap, dCold;
+
+  if (0 != MPATest_Args(argc, argv, "entries")) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  if (argc == 4) {
+    dwNum = (DWORD)atoi(argv[3]);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (0 != MPA_SIS_Create(argv[1], dwNum, dwNum)) {
+    printf("Error creating shared memory\n");
+    return -1;
+  }
+  printf("create  %8.3f ms\n", Elapsed(&start));
+
+  if (0 != MPATest_ConfigOpen(&config, argv[1], ".ini", dwNum, dwNum)) {
+    return -1;
+  }
+  for (i = 1; i <= dwNum; i++) {
+    MPATest_ConfigServer(&config, i, qkey, 1);
+  }
+  for (i = 1; i <= dwNum; i++) {
+    MPATest_ConfigType(&config, i % SISBENCH_TYPES, i);
+  }
+  if (0 != MPATest_ConfigClose(&config)) {
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (0 != MPA_SIS_LoadConfig(argv[1], config.szFileName)) {
+    printf("Loading config file error\n");
+    return -1;
+  }
+  printf("load    %8.3f ms, %u server and type infos\n", Elapsed(&start), dwNum);
+
+  for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((pMPAStart = MPA_SIS_InitEx(argv[1], options[i].nFlags)) == NULL) {
+      printf("Error mapping shared memory\n");
+      return -1;
+    }
+    dMap = Elapsed(&start);
+    dCold = LookupAll(pMPAStart, dwNum);
+    printf("%-18s map %8.3f ms, first pass %8.3f ms, second pass %8.3f ms\n", options[i].pszName,
+           dMap, dCold, LookupAll(pMPAStart, dwNum));
+    munmap(pMPAStart, *((DWORD *)pMPAStart));
+  }
+
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  if (0 != MPA_SIS_End(pMPAStart, True)) {
+    printf("Error releasing shared memory\n");
+    return -1;
+  }
+  return 0;
+}
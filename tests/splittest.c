@@ -0,0 +1,205 @@
+/**
+ * MPA queue split test
+ *
+ * Loads servers 1 and 2 sharing queue <qkey>, and sends from server 9.
+ * 1. Sends messages 0 to 9 to server 1 and 5 messages to server 2, splits
+ *   server 1 onto queue <qkey>+1 and sends messages 10 to 19: all 10 must
+ *   be moved, server 1 must receive the 20 messages in order from its new
+ *   queue, and server 2 its 5 from the old one;
+ * 2. Forks 3 receivers of server 2 blocked on the old queue, splits server
+ *   2 onto queue <qkey>+2 and sends 3 messages: every receiver must wake up
+ *   and get one of them, and the empty message waking them must not be
+ *   left in the old queue;
+ * 3. Sends 12 messages of 1000 bytes to server 3 and splits it onto queue
+ *   <qkey>+3, made to hold 2000 bytes: the split must either raise the room
+ *   of the new queue and move all of them, or be refused and move none, and
+ *   server 3 must receive them in order either way.
+ * */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define SPLITTEST_SENDER 9
+#define SPLITTEST_RECEIVERS 3
+#define SPLITTEST_BACKLOG 12
+#define SPLITTEST_LONG 1000
+
+static int SendNumbers(DWORD sid, int nFrom, int nTo, size_t nLen);
+static int CheckNumbers(MPA_Ctx *pCtx, DWORD sid, int nCount);
+static int Receiver(const char *pszSHMFileName);
+
+/** Sends messages numbered nFrom to nTo - 1, with bodies padded to nLen */
+static int SendNumbers(DWORD sid, int nFrom, int nTo, size_t nLen) {
+  MPAMessage message;
+  char szBody[SPLITTEST_LONG];
+
+  for (; nFrom < nTo; nFrom++) {
+    memset(szBody, ' ', sizeof(szBody));
+    snprintf(szBody, sizeof(szBody), "m%d", nFrom);
+    MPA_MsgInit(&message);
+    MPA_SetMsgBody(szBody, (nLen > strlen(szBody) + 1) ? nLen : strlen(szBody) + 1, &message);
+    if (0 != MPA_Send(sid, &message)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Receives every message waiting for the server, which must be numbered 0
+ *  to nCount - 1 in order */
+static int CheckNumbers(MPA_Ctx *pCtx, DWORD sid, int nCount) {
+  static MPAMessage message;
+  char *pszBody;
+  size_t nSize;
+  int i, nErrors = 0;
+
+  for (i = 0; pCtx != NULL && MPA_CtxRecvNonBlock(pCtx, &message) > 0; i++) {
+    pszBody = MPA_GetMsgBody(NULL, &nSize, &message);
+    if (nSize < 2 || atoi(pszBody + 1) != i) {
+      printf("Message %d received as [%.16s]\n", i, pszBody);
+      nErrors++;
+    }
+  }
+  if (i != nCount) {
+    printf("Server[%u] received %d messages, %d expected\n", sid, i, nCount);
+    nErrors++;
+  }
+  return nErrors;
+}
+
+/** Blocks on the queue of server 2 until a message comes */
+static int Receiver(const char *pszSHMFileName) {
+  MPAMessage message;
+  MPA_Ctx *pCtx;
+  ssize_t nMsgLen;
+
+  if ((pCtx = MPA_CtxOpen(pszSHMFileName, 2, 0)) == NULL) {
+    return 1;
+  }
+  nMsgLen = MPA_CtxRecv(pCtx, &message);
+  MPA_CtxClose(pCtx);
+  return (nMsgLen > 0) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  static MPAMessage message;
+  struct timespec ts = {0, 10000000};
+  struct msqid_ds qds;
+  char *pMPAStart = NULL;
+  MPATest_Config config;
+  MPA_Ctx *pCtx;
+  MPA_SIS_SrvInfo ServerInfo;
+  pid_t pids[SPLITTEST_RECEIVERS];
+  key_t qkey;
+  int i, n, qid, nStatus, nWoken = 0, nErrors = 0;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  MPATest_ConfigServer(&config, 1, qkey, 1);
+  MPATest_ConfigServer(&config, 2, qkey, 2);
+  MPATest_ConfigServer(&config, 3, qkey, 3);
+  MPATest_ConfigServer(&config, SPLITTEST_SENDER, qkey + SPLITTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], SPLITTEST_SENDER) || (pMPAStart = MPA_SIS_Init(argv[1])) == NULL ||
+      (pCtx = MPA_CtxOpen(argv[1], 1, 0)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+
+  /** 1. Messages waiting in the shared queue follow the server */
+  if (0 != SendNumbers(1, 0, 10, 0) || 0 != SendNumbers(2, 0, 5, 0)) {
+    printf("Error sending messages\n");
+    return -1;
+  }
+  if ((n = MPA_SIS_SplitQueue(pMPAStart, 1, qkey + 1)) != 10) {
+    printf("Split moved %d messages, 10 expected\n", n);
+    nErrors++;
+  }
+  if (MPA_GetServerInfo(1, &ServerInfo, pMPAStart) < 0 || ServerInfo.dwQkey != qkey + 1) {
+    printf("Server info[1] is not on queue %d\n", qkey + 1);
+    nErrors++;
+  }
+  SendNumbers(1, 10, 20, 0);
+  nErrors += CheckNumbers(pCtx, 1, 20);
+  MPA_CtxClose(pCtx);
+  pCtx = MPA_CtxOpen(argv[1], 2, 0);
+  for (i = 0; pCtx != NULL && MPA_CtxRecvNonBlock(pCtx, &message) > 0; i++) {
+  }
+  MPA_CtxClose(pCtx);
+  if (i != 5) {
+    printf("Server[2] received %d messages, 5 expected\n", i);
+    nErrors++;
+  }
+
+  /** 2. Every receiver blocked on the old queue is woken */
+  for (i = 0; i < SPLITTEST_RECEIVERS; i++) {
+    if ((pids[i] = fork()) == 0) {
+      _exit(Receiver(argv[1]));
+    }
+  }
+  sleep(1);
+  MPA_SIS_SplitQueue(pMPAStart, 2, qkey + 2);
+  SendNumbers(2, 0, SPLITTEST_RECEIVERS, 0);
+  for (n = 0; n < 200 && nWoken < SPLITTEST_RECEIVERS; n++) {
+    nanosleep(&ts, NULL);
+    for (i = 0; i < SPLITTEST_RECEIVERS; i++) {
+      if (pids[i] > 0 && waitpid(pids[i], &nStatus, WNOHANG) == pids[i]) {
+        nWoken += (WIFEXITED(nStatus) && WEXITSTATUS(nStatus) == 0) ? 1 : 0;
+        pids[i] = 0;
+      }
+    }
+  }
+  for (i = 0; i < SPLITTEST_RECEIVERS; i++) {
+    if (pids[i] > 0) {
+      kill(pids[i], SIGKILL);
+      waitpid(pids[i], &nStatus, 0);
+    }
+  }
+  printf("receivers woken %d/%d\n", nWoken, SPLITTEST_RECEIVERS);
+  if (nWoken != SPLITTEST_RECEIVERS) {
+    nErrors++;
+  }
+  if (msgctl(msgget(qkey, 0), IPC_STAT, &qds) != 0 || qds.msg_qnum != 0) {
+    printf("%lu messages left in the old queue\n", (unsigned long)qds.msg_qnum);
+    nErrors++;
+  }
+
+  /** 3. A backlog larger than the new queue */
+  if ((qid = msgget(qkey + 3, IPC_CREAT | 0666)) < 0 || msgctl(qid, IPC_STAT, &qds) != 0) {
+    printf("Error creating queue %d\n", qkey + 3);
+    return -1;
+  }
+  qds.msg_qbytes = 2 * SPLITTEST_LONG;
+  msgctl(qid, IPC_SET, &qds);
+  SendNumbers(3, 0, SPLITTEST_BACKLOG, SPLITTEST_LONG);
+  n = MPA_SIS_SplitQueue(pMPAStart, 3, qkey + 3);
+  msgctl(qid, IPC_STAT, &qds);
+  printf("backlog split %d, new queue of %lu bytes\n", n, (unsigned long)qds.msg_qbytes);
+  if (n != SPLITTEST_BACKLOG && (n != -1 || qds.msg_qnum != 0)) {
+    printf("Split of a backlog moved %d messages\n", n);
+    nErrors++;
+  }
+  pCtx = MPA_CtxOpen(argv[1], 3, 0);
+  nErrors += CheckNumbers(pCtx, 3, SPLITTEST_BACKLOG);
+  MPA_CtxClose(pCtx);
+  printf("%d errors\n", nErrors);
+
+  msgctl(msgget(qkey, 0), IPC_RMID, NULL);
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
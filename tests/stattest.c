@@ -0,0 +1,223 @@
+/**
+ * MPA traffic counter test
+ *
+ * Loads servers 1 and 2, each on a queue of its own from <qkey>+1 on and
+ * both subscribed to type 100, and sends from server 9.
+ * 1. Forks 4 senders, each pinned to a CPU of its own if there are enough,
+ *   which send 25 messages to server 1, sends one more itself and receives
+ *   them as server 1: the counters of server 1, added up over the stripes
+ *   of the CPUs, must hold the 101 messages sent and received and their
+ *   bytes, and the ones of server 2 nothing;
+ * 2. Publishes 10 messages of type 100 and receives them as servers 1 and
+ *   2: type 100 must count 20 sent and received, and server 1 the 10 it
+ *   received on top of the 101 but no more sent;
+ * 3. Removes the queue of server 2 and sends to it: server 2 must count
+ *   one error and nothing sent;
+ * 4. Type 555 never sent and server 77 unknown must have no counters.
+ * */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /**< For sched_setaffinity() */
+#endif
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define STATTEST_SENDER 9
+#define STATTEST_SENDERS 4
+#define STATTEST_ROUNDS 25
+#define STATTEST_PUBS 10
+#define STATTEST_TYPE 100
+
+static int Sender(const char *pszSHMFileName, int nCpu);
+static int Drain(MPA_Ctx *pCtx);
+static int CheckStat(const char *pszName, const MPA_SIS_Stat *pStat,
+                     unsigned long long qwSent, unsigned long long qwRecv,
+                     unsigned long long qwErrors, size_t nMsgLen);
+
+/** Sends STATTEST_ROUNDS messages to server 1 from the CPU given */
+static int Sender(const char *pszSHMFileName, int nCpu) {
+  MPAMessage message;
+  cpu_set_t set;
+  int i;
+
+  CPU_ZERO(&set);
+  CPU_SET(nCpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+  if (0 != MPA_Init(pszSHMFileName, STATTEST_SENDER)) {
+    return 1;
+  }
+  MPA_MsgInit(&message);
+  MPA_SetMsgBody("stat", 5, &message);
+  for (i = 0; i < STATTEST_ROUNDS; i++) {
+    if (0 != MPA_Send(1, &message)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int Drain(MPA_Ctx *pCtx) {
+  MPAMessage message;
+  int n;
+
+  for (n = 0; MPA_CtxRecvNonBlock(pCtx, &message) > 0; n++) {
+  }
+  return n;
+}
+
+static int CheckStat(const char *pszName, const MPA_SIS_Stat *pStat,
+                     unsigned long long qwSent, unsigned long long qwRecv,
+                     unsigned long long qwErrors, size_t nMsgLen) {
+  printf("%-10s sent %llu/%llu recv %llu/%llu errors %llu\n", pszName, pStat->qwSent,
+         pStat->qwSentBytes, pStat->qwRecv, pStat->qwRecvBytes, pStat->qwErrors);
+  if (pStat->qwSent != qwSent || pStat->qwSentBytes != qwSent * nMsgLen ||
+      pStat->qwRecv != qwRecv || pStat->qwRecvBytes != qwRecv * nMsgLen ||
+      pStat->qwErrors != qwErrors) {
+    printf("%s expected sent %llu recv %llu errors %llu of %zu bytes\n", pszName, qwSent,
+           qwRecv, qwErrors, nMsgLen);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  MPATest_Config config;
+  MPAMessage message;
+  MPA_SIS_SrvInfo ServerInfo;
+  MPA_SIS_Stat stat;
+  MPA_Ctx *pCtxs[3] = {NULL};
+  char *pMPAStart = NULL;
+  size_t nMsgLen;
+  key_t qkey;
+  pid_t pids[STATTEST_SENDERS];
+  long nCpus;
+  int i, n, nStatus, nErrors = 0;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 8)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  MPATest_ConfigServer(&config, 1, qkey + 1, 1);
+  MPATest_ConfigServer(&config, 2, qkey + 2, 1);
+  MPATest_ConfigServer(&config, STATTEST_SENDER, qkey + STATTEST_SENDER, 1);
+  MPATest_ConfigType(&config, STATTEST_TYPE, 1);
+  MPATest_ConfigType(&config, STATTEST_TYPE, 2);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL ||
+      (pCtxs[1] = MPA_CtxOpen(argv[1], 1, 0)) == NULL ||
+      (pCtxs[2] = MPA_CtxOpen(argv[1], 2, 0)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  MPA_MsgInit(&message);
+  MPA_SetMsgBody("stat", 5, &message);
+
+  /** 1. Counts of senders on many CPUs add up */
+  if ((nCpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+    nCpus = 1;
+  }
+  fflush(stdout);
+  for (i = 0; i < STATTEST_SENDERS; i++) {
+    if ((pids[i] = fork()) == 0) {
+      _exit(Sender(argv[1], (int)(i % nCpus)));
+    }
+  }
+  for (i = 0; i < STATTEST_SENDERS; i++) {
+    waitpid(pids[i], &nStatus, 0);
+    if (!WIFEXITED(nStatus) || WEXITSTATUS(nStatus) != 0) {
+      printf("Sender %d failed\n", i);
+      nErrors++;
+    }
+  }
+  if ((n = Drain(pCtxs[1])) != STATTEST_SENDERS * STATTEST_ROUNDS) {
+    printf("Server[1] received %d messages\n", n);
+    nErrors++;
+  }
+  if (0 != MPA_Init(argv[1], STATTEST_SENDER) || 0 != MPA_Send(1, &message)) {
+    printf("Error sending message\n");
+    return -1;
+  }
+  Drain(pCtxs[1]);
+  nMsgLen = (size_t)MPA_GetMsgLength(&message);
+  n = STATTEST_SENDERS * STATTEST_ROUNDS + 1;
+  if (0 != MPA_SIS_GetServerStat(pMPAStart, 1, &stat)) {
+    printf("Server[1] has no counters\n");
+    nErrors++;
+  } else {
+    nErrors += CheckStat("server 1", &stat, (unsigned long long)n, (unsigned long long)n, 0,
+                         nMsgLen);
+  }
+  if (0 != MPA_SIS_GetServerStat(pMPAStart, 2, &stat)) {
+    printf("Server[2] has no counters\n");
+    nErrors++;
+  } else {
+    nErrors += CheckStat("server 2", &stat, 0, 0, 0, nMsgLen);
+  }
+
+  /** 2. Published messages are counted on the type */
+  for (i = 0; i < STATTEST_PUBS; i++) {
+    if (0 != MPA_Pub(STATTEST_TYPE, &message)) {
+      printf("Error publishing message\n");
+      nErrors++;
+    }
+  }
+  nMsgLen = (size_t)MPA_GetMsgLength(&message);
+  if (Drain(pCtxs[1]) != STATTEST_PUBS || Drain(pCtxs[2]) != STATTEST_PUBS) {
+    printf("Subscribers did not receive %d messages each\n", STATTEST_PUBS);
+    nErrors++;
+  }
+  if (0 != MPA_SIS_GetTypeStat(pMPAStart, STATTEST_TYPE, &stat)) {
+    printf("Type[%d] has no counters\n", STATTEST_TYPE);
+    nErrors++;
+  } else {
+    nErrors += CheckStat("type 100", &stat, 2 * STATTEST_PUBS, 2 * STATTEST_PUBS, 0, nMsgLen);
+  }
+  if (0 != MPA_SIS_GetServerStat(pMPAStart, 1, &stat) || stat.qwSent != (unsigned long long)n ||
+      stat.qwRecv != (unsigned long long)(n + STATTEST_PUBS)) {
+    printf("Server[1] counted %llu sent and %llu received, %d and %d expected\n", stat.qwSent,
+           stat.qwRecv, n, n + STATTEST_PUBS);
+    nErrors++;
+  }
+
+  /** 3. Failed sends are counted as errors */
+  if (MPA_GetServerInfo(2, &ServerInfo, pMPAStart) < 0) {
+    printf("Server info[2] not found\n");
+    return -1;
+  }
+  msgctl(ServerInfo.dwQid, IPC_RMID, NULL);
+  if (0 == MPA_Send(2, &message)) {
+    printf("Send to a removed queue succeeded\n");
+    nErrors++;
+  }
+  if (0 != MPA_SIS_GetServerStat(pMPAStart, 2, &stat)) {
+    printf("Server[2] has no counters\n");
+    nErrors++;
+  } else {
+    nErrors += CheckStat("server 2", &stat, 0, STATTEST_PUBS, 1, nMsgLen);
+  }
+
+  /** 4. No counters for unknown keys */
+  if (0 == MPA_SIS_GetTypeStat(pMPAStart, 555, &stat) ||
+      0 == MPA_SIS_GetServerStat(pMPAStart, 77, &stat)) {
+    printf("Counters found for type[555] or server[77]\n");
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_CtxClose(pCtxs[1]);
+  MPA_CtxClose(pCtxs[2]);
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,227 @@
+/**
+ * MPA client context thread test
+ *
+ * Loads servers 1 to 4, each on a queue of its own from <qkey>+1 on, and
+ * server 9 which sends, into a segment of 8 entries.
+ * 1. Runs 4 threads, thread i with a context of its own for server i,
+ *   sending messages 0 to 99 to server i % 4 + 1 and receiving its 100:
+ *   every thread must get the messages of its one sender in order;
+ * 2. Runs 4 threads sending 50 messages each to server 1 through the
+ *   default context of server 9, and 2 threads receiving them through one
+ *   context of server 1, while the segment is grown under them: every
+ *   message must be received once. Server 10 is then added to the grown
+ *   segment on the queue of server 1 with qtype 2, and both contexts must
+ *   send to it.
+ * */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define THREADTEST_SENDER 9
+#define THREADTEST_SERVERS 4
+#define THREADTEST_ROUNDS 100
+#define THREADTEST_SHARED_ROUNDS 50
+#define THREADTEST_RECEIVERS 2
+#define THREADTEST_ADDED 10 /**< Server added to the grown segment */
+
+typedef struct ThreadTest_Arg {
+  const char *pszSHMFileName;
+  MPA_Ctx *pCtx;
+  DWORD sid;
+  int nErrors;
+  int nReceived;
+} ThreadTest_Arg;
+
+static pthread_mutex_t g_Lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char g_bSeen[THREADTEST_SERVERS][THREADTEST_SHARED_ROUNDS];
+
+static void MakeMessage(MPAMessage *pMessage, DWORD dwFrom, int n);
+static void *OwnContext(void *pArg);
+static void *SharedSender(void *pArg);
+static void *SharedReceiver(void *pArg);
+
+static void MakeMessage(MPAMessage *pMessage, DWORD dwFrom, int n) {
+  char szBody[32];
+
+  snprintf(szBody, sizeof(szBody), "%u:%d", dwFrom, n);
+  MPA_MsgInit(pMessage);
+  MPA_SetMsgBody(szBody, strlen(szBody) + 1, pMessage);
+}
+
+/** Sends to the next server and receives from the previous one, through a
+ *  context of its own */
+static void *OwnContext(void *pArg) {
+  ThreadTest_Arg *pTest = (ThreadTest_Arg *)pArg;
+  MPAMessage message;
+  MPA_Ctx *pCtx;
+  DWORD dwFrom = (pTest->sid + THREADTEST_SERVERS - 2) % THREADTEST_SERVERS + 1;
+  char szExpected[32];
+  size_t nSize;
+  int i;
+
+  if ((pCtx = MPA_CtxOpen(pTest->pszSHMFileName, pTest->sid, 0)) == NULL) {
+    pTest->nErrors++;
+    return NULL;
+  }
+  for (i = 0; i < THREADTEST_ROUNDS; i++) {
+    MakeMessage(&message, pTest->sid, i);
+    if (0 != MPA_CtxSend(pCtx, pTest->sid % THREADTEST_SERVERS + 1, &message)) {
+      pTest->nErrors++;
+    }
+  }
+  for (i = 0; i < THREADTEST_ROUNDS; i++) {
+    if (MPA_CtxRecvTimeout(pCtx, &message, 2000000) <= 0) {
+      printf("Server[%u] received %d messages\n", pTest->sid, i);
+      pTest->nErrors++;
+      break;
+    }
+    snprintf(szExpected, sizeof(szExpected), "%u:%d", dwFrom, i);
+    if (strcmp(MPA_GetMsgBody(NULL, &nSize, &message), szExpected) != 0) {
+      printf("Server[%u] received [%.16s], [%s] expected\n", pTest->sid,
+             MPA_GetMsgBody(NULL, &nSize, &message), szExpected);
+      pTest->nErrors++;
+    }
+  }
+  MPA_CtxClose(pCtx);
+  return NULL;
+}
+
+/** Sends through the default context */
+static void *SharedSender(void *pArg) {
+  ThreadTest_Arg *pTest = (ThreadTest_Arg *)pArg;
+  MPAMessage message;
+  int i;
+
+  for (i = 0; i < THREADTEST_SHARED_ROUNDS; i++) {
+    MakeMessage(&message, pTest->sid, i);
+    if (0 != MPA_Send(1, &message)) {
+      pTest->nErrors++;
+    }
+  }
+  return NULL;
+}
+
+/** Receives through the context shared with the other receiver, until no
+ *  message comes for 200 ms */
+static void *SharedReceiver(void *pArg) {
+  ThreadTest_Arg *pTest = (ThreadTest_Arg *)pArg;
+  MPAMessage message;
+  unsigned int dwFrom;
+  size_t nSize;
+  int n;
+
+  while (MPA_CtxRecvTimeout(pTest->pCtx, &message, 200000) > 0) {
+    if (sscanf(MPA_GetMsgBody(NULL, &nSize, &message), "%u:%d", &dwFrom, &n) != 2 ||
+        dwFrom >= THREADTEST_SERVERS || n < 0 || n >= THREADTEST_SHARED_ROUNDS) {
+      pTest->nErrors++;
+      continue;
+    }
+    pthread_mutex_lock(&g_Lock);
+    if (g_bSeen[dwFrom][n]++ != 0) {
+      printf("Message %u:%d received twice\n", dwFrom, n);
+      pTest->nErrors++;
+    }
+    pthread_mutex_unlock(&g_Lock);
+    pTest->nReceived++;
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct timespec ts = {0, 2000000};
+  ThreadTest_Arg args[THREADTEST_SERVERS + THREADTEST_RECEIVERS];
+  pthread_t threads[THREADTEST_SERVERS + THREADTEST_RECEIVERS];
+  MPATest_Config config;
+  MPAMessage message;
+  MPA_Ctx *pCtx = NULL;
+  char *pMPAStart = NULL;
+  key_t qkey;
+  int i, nReceived = 0, nErrors = 0;
+  DWORD sid;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  for (sid = 1; sid <= THREADTEST_SERVERS; sid++) {
+    MPATest_ConfigServer(&config, sid, qkey + (key_t)sid, 1);
+  }
+  MPATest_ConfigServer(&config, THREADTEST_SENDER, qkey + THREADTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], THREADTEST_SENDER) ||
+      (pCtx = MPA_CtxOpen(argv[1], 1, 0)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+
+  /** 1. A context for each thread */
+  memset(args, 0, sizeof(args));
+  for (i = 0; i < THREADTEST_SERVERS; i++) {
+    args[i].pszSHMFileName = argv[1];
+    args[i].sid = (DWORD)i + 1;
+    pthread_create(&threads[i], NULL, OwnContext, &args[i]);
+  }
+  for (i = 0; i < THREADTEST_SERVERS; i++) {
+    pthread_join(threads[i], NULL);
+    nErrors += args[i].nErrors;
+  }
+
+  /** 2. Contexts shared by threads, while the segment grows */
+  memset(args, 0, sizeof(args));
+  for (i = 0; i < THREADTEST_RECEIVERS; i++) {
+    args[THREADTEST_SERVERS + i].pCtx = pCtx;
+    pthread_create(&threads[THREADTEST_SERVERS + i], NULL, SharedReceiver,
+                   &args[THREADTEST_SERVERS + i]);
+  }
+  for (i = 0; i < THREADTEST_SERVERS; i++) {
+    args[i].sid = (DWORD)i;
+    pthread_create(&threads[i], NULL, SharedSender, &args[i]);
+  }
+  nanosleep(&ts, NULL);
+  if (0 != MPA_SIS_Grow(argv[1], 16, 4)) {
+    printf("Error growing shared memory\n");
+    nErrors++;
+  }
+  for (i = 0; i < THREADTEST_SERVERS + THREADTEST_RECEIVERS; i++) {
+    pthread_join(threads[i], NULL);
+    nErrors += args[i].nErrors;
+    nReceived += args[i].nReceived;
+  }
+  if (nReceived != THREADTEST_SERVERS * THREADTEST_SHARED_ROUNDS) {
+    printf("Shared context received %d messages, %d expected\n", nReceived,
+           THREADTEST_SERVERS * THREADTEST_SHARED_ROUNDS);
+    nErrors++;
+  }
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) == NULL ||
+      0 != MPA_SIS_SInfoAdd(pMPAStart, THREADTEST_ADDED, qkey + 1, 2)) {
+    printf("Server info[%d] not added to the grown segment\n", THREADTEST_ADDED);
+    nErrors++;
+  }
+  MakeMessage(&message, THREADTEST_SENDER, 0);
+  if (0 != MPA_Send(THREADTEST_ADDED, &message) ||
+      0 != MPA_CtxSend(pCtx, THREADTEST_ADDED, &message) ||
+      MPA_CtxRecvTypeNonBlock(pCtx, 2, &message) <= 0 ||
+      MPA_CtxRecvTypeNonBlock(pCtx, 2, &message) <= 0) {
+    printf("Contexts do not follow the grown segment\n");
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_CtxClose(pCtx);
+  if (pMPAStart != NULL) {
+    munmap(pMPAStart, *((DWORD *)pMPAStart));
+  }
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
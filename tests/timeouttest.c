@@ -0,0 +1,169 @@
+/**
+ * MPA timed receive test
+ *
+ * Loads server 1 on queue <qkey>+1, which receives, and server 9 on queue
+ * <qkey>+9, which sends.
+ * 1. Receives from the empty queue with MPA_RecvTimeout() for 0 and 100 ms,
+ *   MPA_RecvDeadline() 50 ms ahead and MPA_RecvMany() for 100 ms: each must
+ *   time out, which MPA_RecvMany() tells by 0 messages, no sooner and less
+ *   than 20 ms later than asked;
+ * 2. Forks server 9, which sends 10 messages 50 ms apart, each holding the
+ *   time it is sent: the doorbell must wake the receiver within 10 ms of
+ *   every send, before the 20 ms re-check of the queue would;
+ * 3. Receives for 2 s with a timer firing after 50 ms: the receive must
+ *   return MPA_ERR_INTR when the signal comes.
+ * */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define TIMEOUTTEST_SENDER 9
+#define TIMEOUTTEST_ROUNDS 10
+#define TIMEOUTTEST_LATE 20000 /**< Microseconds a timeout may be late by */
+#define TIMEOUTTEST_WAKE 10000 /**< Microseconds a doorbell may take */
+
+static long long Now(void);
+static void OnAlarm(int nSignal);
+static int CheckTimeout(const char *pszName, ssize_t nRetCode, ssize_t nTimedOut,
+                        long long llStart, long nTimeout);
+static void Sender(const char *pszSHMFileName);
+
+/** Microseconds of CLOCK_MONOTONIC, the same in every process */
+static long long Now() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void OnAlarm(int nSignal) { (void)nSignal; }
+
+/** nTimedOut is what the call returns on timeout, nTimeout in microseconds */
+static int CheckTimeout(const char *pszName, ssize_t nRetCode, ssize_t nTimedOut,
+                        long long llStart, long nTimeout) {
+  long long llElapsed = Now() - llStart;
+
+  printf("%-22s %zd after %lld us\n", pszName, nRetCode, llElapsed);
+  if (nRetCode != nTimedOut || llElapsed < nTimeout ||
+      llElapsed >= nTimeout + TIMEOUTTEST_LATE) {
+    return 1;
+  }
+  return 0;
+}
+
+static void Sender(const char *pszSHMFileName) {
+  struct timespec ts = {0, 50000000};
+  MPAMessage message;
+  MPA_Ctx *pCtx;
+  char szBody[32];
+  int i;
+
+  if ((pCtx = MPA_CtxOpen(pszSHMFileName, TIMEOUTTEST_SENDER, 0)) == NULL) {
+    return;
+  }
+  for (i = 0; i < TIMEOUTTEST_ROUNDS; i++) {
+    nanosleep(&ts, NULL);
+    snprintf(szBody, sizeof(szBody), "%lld", Now());
+    MPA_MsgInit(&message);
+    MPA_SetMsgBody(szBody, strlen(szBody) + 1, &message);
+    MPA_CtxSend(pCtx, 1, &message);
+  }
+  MPA_CtxClose(pCtx);
+}
+
+int main(int argc, char **argv) {
+  static MPAMessage messages[4];
+  MPATest_Config config;
+  struct timespec deadline;
+  struct sigaction action;
+  struct itimerval timer;
+  long long llStart, llLatency, llMax = 0;
+  ssize_t nRetCode;
+  size_t nSize;
+  key_t qkey;
+  pid_t pid;
+  int i, nStatus, nErrors = 0;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 1)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  MPATest_ConfigServer(&config, 1, qkey + 1, 1);
+  MPATest_ConfigServer(&config, TIMEOUTTEST_SENDER, qkey + TIMEOUTTEST_SENDER, 1);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], 1)) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+
+  /** 1. Timeouts */
+  llStart = Now();
+  nErrors += CheckTimeout("MPA_RecvTimeout(0)", MPA_RecvTimeout(messages, 0),
+                          MPA_ERR_RECV_TIMEOUT, llStart, 0);
+  llStart = Now();
+  nErrors += CheckTimeout("MPA_RecvTimeout(100ms)", MPA_RecvTimeout(messages, 100000),
+                          MPA_ERR_RECV_TIMEOUT, llStart, 100000);
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  llStart = Now();
+  deadline.tv_nsec += 50000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  nErrors += CheckTimeout("MPA_RecvDeadline(50ms)", MPA_RecvDeadline(messages, &deadline),
+                          MPA_ERR_RECV_TIMEOUT, llStart, 50000);
+  llStart = Now();
+  nErrors += CheckTimeout("MPA_RecvMany(100ms)", MPA_RecvMany(messages, 4, 100000), 0,
+                          llStart, 100000);
+
+  /** 2. Doorbell wake latency */
+  if ((pid = fork()) == 0) {
+    Sender(argv[1]);
+    _exit(0);
+  }
+  for (i = 0; i < TIMEOUTTEST_ROUNDS; i++) {
+    if ((nRetCode = MPA_RecvTimeout(messages, 1000000)) <= 0) {
+      printf("Message %d not received: %zd\n", i, nRetCode);
+      nErrors++;
+      break;
+    }
+    llLatency = Now() - atoll(MPA_GetMsgBody(NULL, &nSize, messages));
+    llMax = (llLatency > llMax) ? llLatency : llMax;
+  }
+  waitpid(pid, &nStatus, 0);
+  printf("%-22s max %lld us\n", "wake latency", llMax);
+  if (llMax >= TIMEOUTTEST_WAKE) {
+    nErrors++;
+  }
+
+  /** 3. A signal ends the wait */
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = OnAlarm;
+  sigaction(SIGALRM, &action, NULL);
+  memset(&timer, 0, sizeof(timer));
+  timer.it_value.tv_usec = 50000;
+  setitimer(ITIMER_REAL, &timer, NULL);
+  llStart = Now();
+  nRetCode = MPA_RecvTimeout(messages, 2000000);
+  printf("%-22s %zd after %lld us\n", "interrupted", nRetCode, Now() - llStart);
+  if (nRetCode != MPA_ERR_INTR || Now() - llStart >= 50000 + TIMEOUTTEST_LATE) {
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -0,0 +1,208 @@
+/**
+ * MPA layout upgrade test
+ *
+ * Writes a version 1 segment by hand into <mpa.mmap>, laid out as the
+ * version 1 MPA_SIS_Create() did: servers 1 and 2 on queues <qkey>+1 and
+ * <qkey>+2 and server 9 on <qkey>+9, type 100 subscribed by servers 1 and 2
+ * and type 101 by server 2, in room for 4 servers and 4 types.
+ * 1. The segment must be refused by MPA_SIS_Init() and upgraded by
+ *   MPA_SIS_Upgrade(): servers must keep their queues, types their
+ *   subscribers, and a message sent by server 9 to server 1 must be
+ *   received;
+ * 2. Upgrading the upgraded segment must do nothing;
+ * 3. A version 1 segment cut short, and one with a type info pointing past
+ *   the server list, must be refused and left as they were.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/msg.h>
+#include <unistd.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define UPGRADETEST_SENDER 9
+#define UPGRADETEST_MAX 4 /**< Servers and types the version 1 segment has room for */
+#define UPGRADETEST_HEAD (sizeof(DWORD) + 5 * sizeof(WORD))
+#define UPGRADETEST_TYPE_SIZE 8 /**< Version 1 type info, a DWORD and a WORD padded */
+#define UPGRADETEST_SIZE                                                                           \
+  (UPGRADETEST_HEAD + UPGRADETEST_MAX * sizeof(MPA_SIS_SrvInfo) + 2 * sizeof(WORD) +              \
+   UPGRADETEST_MAX * UPGRADETEST_TYPE_SIZE)
+
+static size_t MakeV1(char *pBuf, key_t qkey, WORD wBadIndex);
+static long ReadFile(const char *pszFileName, char *pBuf, size_t nSize);
+static int WriteFile(const char *pszFileName, const char *pBuf, size_t nSize);
+static int CheckRefused(const char *pszFileName, const char *pszCase, const char *pBuf,
+                        size_t nSize);
+
+/** Lays out a version 1 segment in pBuf, with the server index of the last
+ *  type info set to wBadIndex if it is not 0, and returns its size */
+static size_t MakeV1(char *pBuf, key_t qkey, WORD wBadIndex) {
+  static const DWORD dwSids[] = {1, 2, UPGRADETEST_SENDER};
+  static const DWORD dwTypes[] = {100, 100, 101};
+  static const WORD wIndexes[] = {0, 1, 1};
+  MPA_SIS_SrvInfo ServerInfo;
+  DWORD dw = UPGRADETEST_SIZE;
+  WORD w, wTAddrOffset = UPGRADETEST_HEAD + UPGRADETEST_MAX * sizeof(MPA_SIS_SrvInfo);
+  char *p;
+  int i;
+
+  memset(pBuf, 0, UPGRADETEST_SIZE);
+  memcpy(pBuf, &dw, sizeof(dw));
+  p = pBuf + sizeof(DWORD);
+  w = UPGRADETEST_MAX;
+  memcpy(p, &w, sizeof(w));                   /**< Max server infos */
+  memcpy(p + sizeof(WORD), &w, sizeof(w));     /**< Max type infos */
+  w = UPGRADETEST_HEAD;
+  memcpy(p + 2 * sizeof(WORD), &w, sizeof(w)); /**< Server info offset */
+  memcpy(p + 3 * sizeof(WORD), &wTAddrOffset, sizeof(w));
+  w = 3;
+  memcpy(p + 4 * sizeof(WORD), &w, sizeof(w)); /**< Server info size */
+  for (i = 0; i < 3; i++) {
+    ServerInfo.dwSid = dwSids[i];
+    ServerInfo.dwQkey = qkey + (key_t)dwSids[i];
+    ServerInfo.dwQid = msgget(ServerInfo.dwQkey, IPC_CREAT | 0666);
+    ServerInfo.dwQtype = 1;
+    memcpy(pBuf + UPGRADETEST_HEAD + (size_t)i * sizeof(ServerInfo), &ServerInfo,
+           sizeof(ServerInfo));
+  }
+  p = pBuf + wTAddrOffset;
+  w = (WORD)(wTAddrOffset + 2 * sizeof(WORD));
+  memcpy(p, &w, sizeof(w)); /**< Type list offset */
+  w = 3;
+  memcpy(p + sizeof(WORD), &w, sizeof(w)); /**< Type list size */
+  for (i = 0, p += 2 * sizeof(WORD); i < 3; i++, p += UPGRADETEST_TYPE_SIZE) {
+    w = (i == 2 && wBadIndex != 0) ? wBadIndex : wIndexes[i];
+    memcpy(p, dwTypes + i, sizeof(DWORD));
+    memcpy(p + sizeof(DWORD), &w, sizeof(w));
+  }
+  return UPGRADETEST_SIZE;
+}
+
+static long ReadFile(const char *pszFileName, char *pBuf, size_t nSize) {
+  FILE *fp;
+  size_t n;
+
+  if ((fp = fopen(pszFileName, "rb")) == NULL) {
+    return -1;
+  }
+  n = fread(pBuf, 1, nSize, fp);
+  fclose(fp);
+  return (long)n;
+}
+
+static int WriteFile(const char *pszFileName, const char *pBuf, size_t nSize) {
+  FILE *fp;
+
+  if ((fp = fopen(pszFileName, "wb")) == NULL) {
+    return -1;
+  }
+  if (fwrite(pBuf, 1, nSize, fp) != nSize) {
+    fclose(fp);
+    return -1;
+  }
+  return fclose(fp);
+}
+
+/** The file of pBuf must be refused and left as it is */
+static int CheckRefused(const char *pszFileName, const char *pszCase, const char *pBuf,
+                        size_t nSize) {
+  char buf[UPGRADETEST_SIZE + 1];
+
+  if (0 != WriteFile(pszFileName, pBuf, nSize)) {
+    printf("Error writing %s\n", pszCase);
+    return 1;
+  }
+  if (0 == MPA_SIS_Upgrade(pszFileName)) {
+    printf("%s upgraded\n", pszCase);
+    return 1;
+  }
+  if (ReadFile(pszFileName, buf, sizeof(buf)) != (long)nSize || memcmp(buf, pBuf, nSize) != 0) {
+    printf("%s changed\n", pszCase);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static char image[UPGRADETEST_SIZE];
+  MPA_SIS_SrvInfo ServerInfo, ServerInfos[UPGRADETEST_MAX];
+  MPAMessage message;
+  MPA_Ctx *pCtx = NULL;
+  char *pMPAStart = NULL;
+  size_t nSize;
+  key_t qkey;
+  DWORD dwTotalSize = 0;
+  int i, qid1, nErrors = 0;
+
+  if (0 != MPATest_Args(argc, argv, NULL)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  nSize = MakeV1(image, qkey, 0);
+  if (0 != WriteFile(argv[1], image, nSize)) {
+    printf("Error writing version 1 segment\n");
+    return -1;
+  }
+  qid1 = msgget(qkey + 1, 0);
+
+  /** 1. Upgraded with its entries */
+  if ((pMPAStart = MPA_SIS_Init(argv[1])) != NULL) {
+    printf("Version 1 segment mapped without upgrade\n");
+    munmap(pMPAStart, *((DWORD *)pMPAStart));
+    nErrors++;
+  }
+  if (0 != MPA_SIS_Upgrade(argv[1]) || (pMPAStart = MPA_SIS_Init(argv[1])) == NULL) {
+    printf("Error upgrading version 1 segment\n");
+    return -1;
+  }
+  for (i = 1; i <= 2; i++) {
+    if (MPA_GetServerInfo((DWORD)i, &ServerInfo, pMPAStart) < 0 ||
+        ServerInfo.dwQkey != qkey + i || ServerInfo.dwQid != msgget(qkey + i, 0)) {
+      printf("Server info[%d] not upgraded with its queue\n", i);
+      nErrors++;
+    }
+  }
+  if (MPA_GetSubscribers(100, 0, ServerInfos, UPGRADETEST_MAX, pMPAStart) != 2 ||
+      MPA_GetSubscribers(101, 0, ServerInfos, UPGRADETEST_MAX, pMPAStart) != 1 ||
+      ServerInfos[0].dwSid != 2) {
+    printf("Type infos not upgraded with their subscribers\n");
+    nErrors++;
+  }
+  dwTotalSize = *((DWORD *)pMPAStart);
+  MPA_MsgInit(&message);
+  MPA_SetMsgBody("upgraded", 9, &message);
+  if (0 != MPA_Init(argv[1], UPGRADETEST_SENDER) ||
+      (pCtx = MPA_CtxOpen(argv[1], 1, 0)) == NULL || 0 != MPA_Send(1, &message) ||
+      MPA_CtxRecvNonBlock(pCtx, &message) <= 0) {
+    printf("Message not sent on the upgraded segment to queue %d\n", qid1);
+    nErrors++;
+  }
+  MPA_CtxClose(pCtx);
+
+  /** 2. Nothing to upgrade */
+  if (0 != MPA_SIS_Upgrade(argv[1]) || MPA_GetServerInfo(1, &ServerInfo, pMPAStart) < 0 ||
+      *((DWORD *)pMPAStart) != dwTotalSize) {
+    printf("Upgraded segment changed by a second upgrade\n");
+    nErrors++;
+  }
+  munmap(pMPAStart, dwTotalSize);
+  MPA_End(True);
+
+  /** 3. Damaged version 1 segments */
+  nSize = MakeV1(image, qkey, 0);
+  nErrors += CheckRefused(argv[1], "Segment cut short", image, nSize - UPGRADETEST_TYPE_SIZE);
+  nSize = MakeV1(image, qkey, UPGRADETEST_MAX);
+  nErrors += CheckRefused(argv[1], "Segment with a bad server index", image, nSize);
+  printf("%d errors\n", nErrors);
+
+  for (i = 1; i <= UPGRADETEST_SENDER; i++) {
+    msgctl(msgget(qkey + i, 0), IPC_RMID, NULL);
+  }
+  unlink(argv[1]);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
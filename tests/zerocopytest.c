@@ -0,0 +1,136 @@
+/**
+ * MPA reserved send buffer test
+ *
+ * Loads servers 1 and 2, each on a queue of its own from <qkey>+1 on and
+ * both subscribed to type 100, and sends from server 9.
+ * 1. Reserves a send buffer, fills in a property and a body and commits it
+ *   to server 1, then changes the body and commits the same buffer again:
+ *   server 1 must receive both messages in order, with the property and
+ *   server 9 as their source;
+ * 2. Publishes the buffer to type 100: servers 1 and 2 must receive it;
+ * 3. Fills the buffer up to MPA_MESSAGESIZE: the message must be sent and
+ *   received whole;
+ * 4. Commits NULL: it must be refused.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpacli.h"
+#include "mpatest.h"
+
+#define ZEROCOPYTEST_SENDER 9
+#define ZEROCOPYTEST_TYPE 100
+
+static int CheckRecv(MPA_Ctx *pCtx, const char *pszBody, const char *pszProp);
+
+/** Receives a message which must have the body, the property "k" of value
+ *  pszProp and server 9 as its source */
+static int CheckRecv(MPA_Ctx *pCtx, const char *pszBody, const char *pszProp) {
+  MPAMessage message;
+  char szValue[16] = {0};
+  size_t nSize;
+  DWORD dwSource = 0;
+
+  if (MPA_CtxRecvNonBlock(pCtx, &message) <= 0) {
+    printf("Server[%u] received no message [%s]\n", MPA_CtxGetSID(pCtx), pszBody);
+    return 1;
+  }
+  MPA_GetMsgProp("k", szValue, sizeof(szValue), &message);
+  MPA_GetMsgSource(&message, &dwSource);
+  if (strcmp(MPA_GetMsgBody(NULL, &nSize, &message), pszBody) != 0 ||
+      strcmp(szValue, pszProp) != 0 || dwSource != ZEROCOPYTEST_SENDER) {
+    printf("Server[%u] received [%.16s] k=[%s] from %u, [%s] k=[%s] from %d expected\n",
+           MPA_CtxGetSID(pCtx), MPA_GetMsgBody(NULL, &nSize, &message), szValue, dwSource,
+           pszBody, pszProp, ZEROCOPYTEST_SENDER);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static char szFull[MPA_MESSAGESIZE];
+  MPATest_Config config;
+  MPAMessage message, *pMessage = NULL;
+  MPA_Ctx *pCtxs[3] = {NULL};
+  size_t nBodySize, nSize;
+  key_t qkey;
+  int nErrors = 0;
+
+  if (0 != MPATest_Args(argc, argv, NULL) ||
+      0 != MPATest_ConfigOpen(&config, argv[1], ".ini", 8, 8)) {
+    return -1;
+  }
+  qkey = (key_t)atoi(argv[2]);
+  MPATest_ConfigServer(&config, 1, qkey + 1, 1);
+  MPATest_ConfigServer(&config, 2, qkey + 2, 1);
+  MPATest_ConfigServer(&config, ZEROCOPYTEST_SENDER, qkey + ZEROCOPYTEST_SENDER, 1);
+  MPATest_ConfigType(&config, ZEROCOPYTEST_TYPE, 1);
+  MPATest_ConfigType(&config, ZEROCOPYTEST_TYPE, 2);
+  if (0 != MPATest_ConfigLoad(&config, argv[1])) {
+    return -1;
+  }
+  if (0 != MPA_Init(argv[1], ZEROCOPYTEST_SENDER) ||
+      (pCtxs[1] = MPA_CtxOpen(argv[1], 1, 0)) == NULL ||
+      (pCtxs[2] = MPA_CtxOpen(argv[1], 2, 0)) == NULL) {
+    printf("Error mapping shared memory\n");
+    return -1;
+  }
+  if ((pMessage = MPA_SendReserve()) == NULL) {
+    printf("Error reserving send buffer\n");
+    return -1;
+  }
+
+  /** 1. One buffer committed twice */
+  MPA_SetMsgProp("k", "v", pMessage);
+  MPA_SetMsgBody("r0", 3, pMessage);
+  if (0 != MPA_SendCommit(1, pMessage)) {
+    printf("Error committing message\n");
+    nErrors++;
+  }
+  MPA_SetMsgBody("r1", 3, pMessage);
+  if (0 != MPA_SendCommit(1, pMessage)) {
+    printf("Error committing message again\n");
+    nErrors++;
+  }
+  nErrors += CheckRecv(pCtxs[1], "r0", "v");
+  nErrors += CheckRecv(pCtxs[1], "r1", "v");
+
+  /** 2. Published to each subscriber */
+  MPA_SetMsgBody("pub", 4, pMessage);
+  if (0 != MPA_PubCommit(ZEROCOPYTEST_TYPE, pMessage)) {
+    printf("Error publishing message\n");
+    nErrors++;
+  }
+  nErrors += CheckRecv(pCtxs[1], "pub", "v");
+  nErrors += CheckRecv(pCtxs[2], "pub", "v");
+
+  /** 3. A message of MPA_MESSAGESIZE */
+  MPA_MsgInit(pMessage);
+  memset(szFull, 'f', sizeof(szFull));
+  nBodySize = MPA_MESSAGESIZE - (size_t)MPA_GetMsgLength(pMessage);
+  szFull[nBodySize - 1] = '\0';
+  if (0 != MPA_SetMsgBody(szFull, nBodySize, pMessage) || 0 != MPA_SendCommit(1, pMessage)) {
+    printf("Message of %d bytes not committed\n", MPA_MESSAGESIZE);
+    nErrors++;
+  } else if (MPA_CtxRecvNonBlock(pCtxs[1], &message) != MPA_MESSAGESIZE ||
+             strcmp(MPA_GetMsgBody(NULL, &nSize, &message), szFull) != 0) {
+    printf("Message of %d bytes not received whole\n", MPA_MESSAGESIZE);
+    nErrors++;
+  }
+
+  /** 4. No buffer */
+  if (0 == MPA_SendCommit(1, NULL) || 0 == MPA_PubCommit(ZEROCOPYTEST_TYPE, NULL)) {
+    printf("NULL message committed\n");
+    nErrors++;
+  }
+  printf("%d errors\n", nErrors);
+
+  MPA_SendRelease(pMessage);
+  MPA_CtxClose(pCtxs[1]);
+  MPA_CtxClose(pCtxs[2]);
+  MPA_End(True);
+  return (nErrors == 0) ? 0 : -1;
+}
+
+/* vim: set ts=2 sw=2 sts=2 tw=0 expandtab : */
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <sys/ipc.h>
 #include <sys/mman.h>
+#include <sys/msg.h>
 #include <sys/types.h>
 
 #include "mpaknl.h"
@@ -18,11 +19,19 @@ static int FormatCommandString(char *pszCommand);
 static int FreeCommandBuf(int num, char **ppCmds);
 static int Interact(const char *pszSHMFileName);
 static void CommandHelp(void);
+static int ShowQueueStats(const char *pMPAStart);
+static int QueueStatCompare(const void *p1, const void *p2);
+static key_t UnusedQKey(const MPA_SIS_QueueStat *pStats, int n);
+static int ShowSharedQueues(const char *pszSHMFileName, const char *pMPAStart);
+static int SplitQueue(const char *pszSHMFileName, int argc, char **argv);
+static int Grow(const char *pszSHMFileName, int argc, char **argv);
+static Boolean Remap(const char *pszSHMFileName, char **ppMPAStart);
+static Boolean IsEdit(const char *pszCommand);
 static void CopyRight(void);
 
 static void Usage(char *sAppName) {
-  printf("Usage:%s FILE {init|s+|s=|s-|t+|t=|t-|load|export|show|end args "
-         "...}\n",
+  printf("Usage:%s FILE {init|s+|s=|sg|s-|t+|t=|t-|load|apply|export|show|end|upgrade|"
+         "compact|grow|compile|image|watch|stat|qstat|qshare|qsplit args ...}\n",
          sAppName);
   puts("FILE: 共享内存文件");
   CommandHelp();
@@ -35,22 +44,263 @@ static void CommandHelp() {
   puts("\ts+ sid qkey qtype");
   puts("s=: 修改服务器信息");
   puts("\ts= sid new-qkey new-qtype");
-  puts("s-: 删除最后一条服务器信息");
-  puts("\ts-");
+  puts("sg: 设置服务器所属的服务组(gid为0时移出服务组)");
+  puts("\tsg sid gid");
+  puts("s-: 删除指定的服务器信息(不指定sid时删除最后一条)");
+  puts("\ts- <sid>");
   puts("t+: 添加类型信息");
   puts("\tt+ type sid");
   puts("t=: 修改类型信息");
   puts("\tt= old-type old-sid new-type new-sid");
-  puts("t-: 删除最后一条类型信息");
-  puts("\tt-");
+  puts("t-: 删除指定的类型信息(不指定type和sid时删除最后一条)");
+  puts("\tt- <type sid>");
   puts("load: 从指定文件装载配置信息");
   puts("\tload filename");
+  puts("apply: 将指定配置文件与当前配置信息的差异应用到共享内存，不重建共享内存");
+  puts("\tapply filename");
   puts("export: 将当前配置信息导出到指定文件");
   puts("\texport filename");
   puts("show: 显示当前配置信息");
   puts("\tshow");
   puts("end: 清除所有配置信息，并释放使用的消息队列(不指定norelease选项)");
   puts("\tend <norelease> ");
+  puts("upgrade: 将旧版本共享内存文件升级为当前版本");
+  puts("\tupgrade");
+  puts("compact: 整理共享内存，回收已删除信息占用的位置");
+  puts("\tcompact <batch>");
+  puts("grow: 扩大共享内存可容纳的服务器信息和类型信息数量，不重建共享内存"
+       "(不指定数量时扩大一倍，数量为0时不变)");
+  puts("\tgrow <max_server_nums max_type_nums>");
+  puts("compile: 将指定配置文件编译为共享内存映像，FILE为映像文件");
+  puts("\tcompile filename");
+  puts("image: 从指定映像文件装载配置信息");
+  puts("\timage filename");
+  puts("watch: 等待配置信息变更(不指定timeout时一直等待，单位毫秒)");
+  puts("\twatch <timeout>");
+  puts("stat: 显示各系统和消息类型的流量统计信息");
+  puts("\tstat");
+  puts("qstat: 显示各系统消息队列的积压情况");
+  puts("\tqstat");
+  puts("qshare: 显示多个系统共用的消息队列，及各系统消息类型的积压消息数");
+  puts("\tqshare");
+  puts("qsplit: 将系统迁移到单独的消息队列，积压消息一并迁移，不中断服务");
+  puts("\tqsplit sid new-qkey");
+}
+
+static int Grow(const char *pszSHMFileName, int argc, char **argv) {
+  int snum = 0, tnum = 0, nRetCode;
+  char *mpa_start;
+  MPA_SISInfo SISInfo;
+
+  if (argc >= 2) {
+    if (0 != DecimalStrToInt(argv[0], &snum) || 0 != DecimalStrToInt(argv[1], &tnum) ||
+        snum < 0 || tnum < 0) {
+      fprintf(stderr, "无效的参数\n");
+      return -2;
+    }
+  } else {
+    if ((mpa_start = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    GetSISInfo(mpa_start, &SISInfo);
+    snum = (int)SISInfo.dwMaxSvrInfo * 2;
+    tnum = (int)SISInfo.dwMaxTypeInfo * 2;
+    munmap(mpa_start, SISInfo.dwTotalSize);
+  }
+  if ((nRetCode = MPA_SIS_Grow(pszSHMFileName, (size_t)snum, (size_t)tnum)) != 0) {
+    fprintf(stderr, "扩大共享内存失败，错误码%d\n", nRetCode);
+    return -5;
+  }
+  return 0;
+}
+
+static int ShowQueueStats(const char *pMPAStart) {
+  int i, n;
+  char szSend[22], szRecv[22];
+  MPA_SISInfo SISInfo;
+  MPA_SIS_QueueStat *pStats = NULL;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SISInfo.dwVersion != MPA_SIS_VERSION) {
+    return -1;
+  }
+  if ((pStats = calloc(SISInfo.dwMaxSvrInfo + 1, sizeof(MPA_SIS_QueueStat))) == NULL) {
+    return -2;
+  }
+  n = MPA_SIS_QueueStats(pMPAStart, pStats, SISInfo.dwMaxSvrInfo);
+  if (n > (int)SISInfo.dwMaxSvrInfo) {
+    n = (int)SISInfo.dwMaxSvrInfo;
+  }
+  printf("|系统标识号|消息队列Key|消息队列ID|  消息数  |   字节数   | 最大字节数 |"
+         "    最后发送时间   |    最后接收时间   |\n");
+  printf("|----------|-----------|----------|----------|------------|------------|"
+         "-------------------|-------------------|\n");
+  for (i = 0; i < n; i++) {
+    if (pStats[i].nErrno != 0) {
+      printf("|%10u|%11d|0x%08x|%-84s|\n", pStats[i].dwSid, pStats[i].dwQkey, pStats[i].dwQid,
+             strerror(pStats[i].nErrno));
+      continue;
+    }
+    strcpy(szSend, "-");
+    strcpy(szRecv, "-");
+    if (pStats[i].tSend != 0) {
+      ConvertTimeToString(szSend, sizeof(szSend), "%Y/%m/%d.%H:%M:%S", pStats[i].tSend);
+    }
+    if (pStats[i].tRecv != 0) {
+      ConvertTimeToString(szRecv, sizeof(szRecv), "%Y/%m/%d.%H:%M:%S", pStats[i].tRecv);
+    }
+    printf("|%10u|%11d|0x%08x|%10zu|%12zu|%12zu|%19s|%19s|\n", pStats[i].dwSid,
+           pStats[i].dwQkey, pStats[i].dwQid, pStats[i].nMsgs, pStats[i].nBytes,
+           pStats[i].nMaxBytes, szSend, szRecv);
+  }
+  free(pStats);
+  return 0;
+}
+
+static int QueueStatCompare(const void *p1, const void *p2) {
+  const MPA_SIS_QueueStat *pStat1 = (const MPA_SIS_QueueStat *)p1;
+  const MPA_SIS_QueueStat *pStat2 = (const MPA_SIS_QueueStat *)p2;
+
+  if (pStat1->dwQkey != pStat2->dwQkey) {
+    return (pStat1->dwQkey < pStat2->dwQkey) ? -1 : 1;
+  }
+  return (pStat1->dwSid < pStat2->dwSid) ? -1 : (pStat1->dwSid > pStat2->dwSid);
+}
+
+/* 找一个未被系统使用、也不存在消息队列的qkey，供迁移时参考 */
+static key_t UnusedQKey(const MPA_SIS_QueueStat *pStats, int n) {
+  key_t qkey = 0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (pStats[i].dwQkey > qkey) {
+      qkey = pStats[i].dwQkey;
+    }
+  }
+  for (qkey++; qkey > 0 && msgget(qkey, 0) >= 0; qkey++) {
+  }
+  return qkey;
+}
+
+static int ShowSharedQueues(const char *pszSHMFileName, const char *pMPAStart) {
+  int i, j, k, n, nScanned, nHot, nShared = 0;
+  MPA_SISInfo SISInfo;
+  MPA_SIS_QueueStat *pStats = NULL;
+  DWORD *pdwTypes = NULL;
+  size_t *pnMsgs = NULL;
+
+  GetSISInfo(pMPAStart, &SISInfo);
+  if (SISInfo.dwVersion != MPA_SIS_VERSION) {
+    return -1;
+  }
+  pStats = calloc(SISInfo.dwMaxSvrInfo + 1, sizeof(MPA_SIS_QueueStat));
+  pdwTypes = calloc(SISInfo.dwMaxSvrInfo + 1, sizeof(DWORD));
+  pnMsgs = calloc(SISInfo.dwMaxSvrInfo + 1, sizeof(size_t));
+  if (pStats == NULL || pdwTypes == NULL || pnMsgs == NULL) {
+    free(pStats);
+    free(pdwTypes);
+    free(pnMsgs);
+    return -2;
+  }
+  n = MPA_SIS_QueueStats(pMPAStart, pStats, SISInfo.dwMaxSvrInfo);
+  if (n > (int)SISInfo.dwMaxSvrInfo) {
+    n = (int)SISInfo.dwMaxSvrInfo;
+  }
+  qsort(pStats, (size_t)n, sizeof(MPA_SIS_QueueStat), QueueStatCompare);
+
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && pStats[j].dwQkey == pStats[i].dwQkey; j++) {
+    }
+    if (j - i < 2) {
+      continue;
+    }
+    nShared++;
+    printf("消息队列Key %d(ID 0x%08x)由%d个系统共用，积压%zu条消息", pStats[i].dwQkey,
+           pStats[i].dwQid, j - i, pStats[i].nMsgs);
+    for (k = i; k < j; k++) {
+      pdwTypes[k - i] = pStats[k].dwQtype;
+    }
+    if ((nScanned = MPA_SIS_QueueTypeDepth(pStats[i].dwQid, pdwTypes, pnMsgs, (size_t)(j - i))) <
+        0) {
+      printf("，无法按消息类型统计\n");
+      continue;
+    }
+    if ((size_t)nScanned < pStats[i].nMsgs) {
+      printf("，只统计了前%d条", nScanned);
+    }
+    printf("\n|系统标识号| 消息类型 |积压消息数|\n");
+    printf("|----------|----------|----------|\n");
+    for (k = i, nHot = -1; k < j; k++) {
+      printf("|%10u|%10u|%10zu|\n", pStats[k].dwSid, pStats[k].dwQtype, pnMsgs[k - i]);
+      if (pnMsgs[k - i] > 0 && (nHot < 0 || pnMsgs[k - i] > pnMsgs[nHot - i])) {
+        nHot = k;
+      }
+    }
+    if (nHot >= 0) {
+      printf("积压最多的系统可迁移到单独的消息队列: mpaadm %s qsplit %u %d\n", pszSHMFileName,
+             pStats[nHot].dwSid, UnusedQKey(pStats, n));
+    }
+  }
+  if (nShared == 0) {
+    puts("没有共用的消息队列");
+  }
+  free(pStats);
+  free(pdwTypes);
+  free(pnMsgs);
+  return 0;
+}
+
+/** Map the file again after an edit found its segment retired by a reload or
+ *  grow, so that the edit can be made again on the segment replacing it */
+static Boolean Remap(const char *pszSHMFileName, char **ppMPAStart) {
+  munmap(*ppMPAStart, *((DWORD *)*ppMPAStart));
+  if ((*ppMPAStart = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+    fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+    return False;
+  }
+  return True;
+}
+
+/** Commands changing entries of the mapped segment, which run under the admin
+ *  lock of the file so that no reload or grow retires the segment meanwhile */
+static Boolean IsEdit(const char *pszCommand) {
+  static const char *pszEdits[] = {"s+", "s=", "sg", "s-", "t+", "t=", "t-", "compact", "qsplit"};
+  size_t i;
+
+  for (i = 0; i < sizeof(pszEdits) / sizeof(pszEdits[0]); i++) {
+    if (strcmp(pszCommand, pszEdits[i]) == 0) {
+      return True;
+    }
+  }
+  return False;
+}
+
+static int SplitQueue(const char *pszSHMFileName, int argc, char **argv) {
+  int nRetCode, qkey = 0;
+  DWORD sid = 0;
+  char *mpa_start;
+
+  if (argc < 2) {
+    fprintf(stderr, "命令行参数无效\n");
+    return -1;
+  }
+  if (0 != DecimalStrToUInt(argv[0], &sid) || 0 != DecimalStrToInt(argv[1], &qkey)) {
+    return -3;
+  }
+  if ((mpa_start = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+    fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+    return -2;
+  }
+  do {
+    nRetCode = MPA_SIS_SplitQueue(mpa_start, sid, (key_t)qkey);
+  } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(pszSHMFileName, &mpa_start));
+  if (nRetCode < 0) {
+    fprintf(stderr, "迁移消息队列失败，错误码%d\n", nRetCode);
+    return -5;
+  }
+  printf("已迁移%d条消息\n", nRetCode);
+  return 0;
 }
 
 static void CopyRight() {
@@ -59,12 +309,15 @@ static void CopyRight() {
 }
 
 int main(int argc, char **argv) {
-  int nRetCode;
+  int nRetCode, fd = -1;
 
-  if ((nRetCode = CreateServer(argc, argv)) != 0) {
-    return nRetCode;
+  if (argc > 2 && IsEdit(argv[2]) && (fd = MPA_SIS_AdminLock(argv[1])) == -1) {
+    fprintf(stderr, "锁定共享内存文件失败，错误码%d\n", errno);
+    return -2;
   }
-  return 0;
+  nRetCode = CreateServer(argc, argv);
+  MPA_SIS_AdminUnlock(fd);
+  return nRetCode;
 }
 
 static int CreateServer(int argc, char **argv) {
@@ -122,7 +375,10 @@ static int CreateServer(int argc, char **argv) {
     if (0 != DecimalStrToUInt(argv[5], &n3)) {
       return -3;
     }
-    if ((nRetCode = MPA_SIS_SInfoAdd(mpa_start, n1, n2, n3)) != 0) {
+    do {
+      nRetCode = MPA_SIS_SInfoAdd(mpa_start, n1, n2, n3);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(argv[1], &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "添加服务器信息失败，错误码%d\n", nRetCode);
       return -3;
     }
@@ -147,16 +403,50 @@ static int CreateServer(int argc, char **argv) {
     if (0 != DecimalStrToUInt(argv[5], &n3)) {
       return -3;
     }
-    if ((nRetCode = MPA_SIS_SInfoModify(mpa_start, n1, n2, n3)) != 0) {
+    do {
+      nRetCode = MPA_SIS_SInfoModify(mpa_start, n1, n2, n3);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(argv[1], &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "修改服务器信息失败，错误码%d\n", nRetCode);
       return -3;
     }
+  } else if (strcmp(argv[2], "sg") == 0) {
+    if (argc < 5) {
+      fprintf(stderr, "命令行参数无效\n");
+      Usage(argv[0]);
+      return -1;
+    }
+    if ((mpa_start = MPA_SIS_Init(argv[1])) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    DWORD n1 = 0, n2 = 0;
+    if (0 != DecimalStrToUInt(argv[3], &n1)) {
+      return -3;
+    }
+    if (0 != DecimalStrToUInt(argv[4], &n2)) {
+      return -3;
+    }
+    do {
+      nRetCode = MPA_SIS_SInfoSetGroup(mpa_start, n1, n2);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(argv[1], &mpa_start));
+    if (nRetCode != 0) {
+      fprintf(stderr, "设置服务组失败，错误码%d\n", nRetCode);
+      return -3;
+    }
   } else if (strcmp(argv[2], "s-") == 0) {
     if ((mpa_start = MPA_SIS_Init(argv[1])) == NULL) {
       fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
       return -2;
     }
-    if ((nRetCode = MPA_SIS_SInfoDelLast(mpa_start)) != 0) {
+    DWORD n1 = 0;
+    if (argc > 3 && 0 != DecimalStrToUInt(argv[3], &n1)) {
+      return -3;
+    }
+    do {
+      nRetCode = (argc > 3) ? MPA_SIS_SInfoDelete(mpa_start, n1) : MPA_SIS_SInfoDelLast(mpa_start);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(argv[1], &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "删除服务器信息失败，错误码%d\n", nRetCode);
       return -3;
     }
@@ -177,7 +467,10 @@ static int CreateServer(int argc, char **argv) {
     if (0 != DecimalStrToUInt(argv[5], &n3)) {
       return -3;
     }
-    if ((nRetCode = MPA_SIS_TInfoAdd(mpa_start, n1, n3)) != 0) {
+    do {
+      nRetCode = MPA_SIS_TInfoAdd(mpa_start, n1, n3);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(argv[1], &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "添加类型信息失败，错误码%d\n", nRetCode);
       return -4;
     }
@@ -204,7 +497,10 @@ static int CreateServer(int argc, char **argv) {
     if (0 != DecimalStrToUInt(argv[6], &n4)) {
       return -3;
     }
-    if ((nRetCode = MPA_SIS_TInfoModify(mpa_start, n1, n2, n3, n4)) != 0) {
+    do {
+      nRetCode = MPA_SIS_TInfoModify(mpa_start, n1, n2, n3, n4);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(argv[1], &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "修改类型信息失败，错误码%d\n", nRetCode);
       return -4;
     }
@@ -213,7 +509,16 @@ static int CreateServer(int argc, char **argv) {
       fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
       return -2;
     }
-    if ((nRetCode = MPA_SIS_TInfoDelLast(mpa_start)) != 0) {
+    DWORD n1 = 0, n3 = 0;
+    if (argc > 4 &&
+        (0 != DecimalStrToUInt(argv[3], &n1) || 0 != DecimalStrToUInt(argv[4], &n3))) {
+      return -3;
+    }
+    do {
+      nRetCode = (argc > 4) ? MPA_SIS_TInfoDelete(mpa_start, n1, n3)
+                           : MPA_SIS_TInfoDelLast(mpa_start);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(argv[1], &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "删除类型信息失败，错误码%d\n", nRetCode);
       return -4;
     }
@@ -233,6 +538,37 @@ static int CreateServer(int argc, char **argv) {
       fprintf(stderr, "导入服务器信息失败，错误码%d\n", nRetCode);
       return -5;
     }
+  } else if (strcmp(argv[2], "apply") == 0) {
+    if (argc < 4) {
+      fprintf(stderr, "命令行参数无效\n");
+      Usage(argv[0]);
+      return -1;
+    }
+    if ((nRetCode = MPA_SIS_ApplyConfigDiff(argv[1], argv[3])) < 0) {
+      fprintf(stderr, "应用配置信息差异失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+    printf("已更新%d条配置信息\n", nRetCode);
+  } else if (strcmp(argv[2], "compile") == 0) {
+    if (argc < 4) {
+      fprintf(stderr, "命令行参数无效\n");
+      Usage(argv[0]);
+      return -1;
+    }
+    if ((nRetCode = MPA_SIS_CompileConfig(argv[1], argv[3])) != 0) {
+      fprintf(stderr, "编译共享内存映像失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+  } else if (strcmp(argv[2], "image") == 0) {
+    if (argc < 4) {
+      fprintf(stderr, "命令行参数无效\n");
+      Usage(argv[0]);
+      return -1;
+    }
+    if ((nRetCode = MPA_SIS_LoadImage(argv[1], argv[3])) != 0) {
+      fprintf(stderr, "装载共享内存映像失败，错误码%d\n", nRetCode);
+      return -5;
+    }
   } else if (strcmp(argv[2], "export") == 0) {
     if ((mpa_start = MPA_SIS_Init(argv[1])) == NULL) {
       fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
@@ -255,13 +591,97 @@ static int CreateServer(int argc, char **argv) {
       fprintf(stderr, "注销系统信息失败，错误码%d\n", nRetCode);
       return -4;
     }
+  } else if (strcmp(argv[2], "upgrade") == 0) {
+    if ((nRetCode = MPA_SIS_Upgrade(argv[1])) != 0) {
+      fprintf(stderr, "升级共享内存文件失败，错误码%d\n", nRetCode);
+      return -6;
+    }
+  } else if (strcmp(argv[2], "compact") == 0) {
+    int batch = 0;
+    if ((mpa_start = MPA_SIS_Init(argv[1])) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    if ((argc > 3) && (0 != DecimalStrToInt(argv[3], &batch) || batch < 0)) {
+      return -3;
+    }
+    do {
+      nRetCode = MPA_SIS_Compact(mpa_start, (size_t)batch);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(argv[1], &mpa_start));
+    if (nRetCode < 0) {
+      fprintf(stderr, "整理共享内存失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+    printf("已移动%d条信息\n", nRetCode);
+    nRetCode = 0;
+  } else if (strcmp(argv[2], "grow") == 0) {
+    if ((nRetCode = Grow(argv[1], argc - 3, argv + 3)) != 0) {
+      return nRetCode;
+    }
+  } else if (strcmp(argv[2], "stat") == 0) {
+    if ((mpa_start = MPA_SIS_Init(argv[1])) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    MPA_SIS_DisplayStat(mpa_start);
+  } else if (strcmp(argv[2], "qstat") == 0) {
+    if ((mpa_start = MPA_SIS_Init(argv[1])) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    if ((nRetCode = ShowQueueStats(mpa_start)) != 0) {
+      fprintf(stderr, "获取消息队列信息失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+  } else if (strcmp(argv[2], "qshare") == 0) {
+    if ((mpa_start = MPA_SIS_Init(argv[1])) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    if ((nRetCode = ShowSharedQueues(argv[1], mpa_start)) != 0) {
+      fprintf(stderr, "获取消息队列信息失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+  } else if (strcmp(argv[2], "qsplit") == 0) {
+    if ((nRetCode = SplitQueue(argv[1], argc - 3, argv + 3)) != 0) {
+      return nRetCode;
+    }
+  } else if (strcmp(argv[2], "watch") == 0) {
+    int timeout = -1;
+    DWORD generation = 0;
+    MPA_SISInfo SISInfo;
+    if ((mpa_start = MPA_SIS_Init(argv[1])) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    if ((argc > 3) && (0 != DecimalStrToInt(argv[3], &timeout))) {
+      return -3;
+    }
+    GetSISInfo(mpa_start, &SISInfo);
+    if (SISInfo.pdwGeneration == NULL) {
+      fprintf(stderr, "共享内存版本过低，请先升级\n");
+      return -4;
+    }
+    generation = *SISInfo.pdwGeneration;
+    if ((nRetCode = MPA_SIS_WaitChange(mpa_start, &generation, timeout)) < 0) {
+      fprintf(stderr, "等待配置信息变更失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+    if (nRetCode == 1) {
+      puts("等待超时，配置信息未变更");
+    } else if (*SISInfo.pdwRetired != 0) {
+      puts("共享内存已重新装载");
+    } else {
+      printf("配置信息已变更，版本号%u\n", generation);
+    }
+    nRetCode = 0;
   }
 
   return nRetCode;
 }
 
 static int Interact(const char *pszSHMFileName) {
-  int nNumOfCmd = 0;
+  int nNumOfCmd = 0, fd = -1;
   char szCommand[COMMAND_MAX], **ppCommands = NULL;
   char szPrompt[11] = ">>";
   for (;;) {
@@ -274,7 +694,13 @@ static int Interact(const char *pszSHMFileName) {
       puts("bye");
       break;
     }
+    if (IsEdit(ppCommands[0]) && (fd = MPA_SIS_AdminLock(pszSHMFileName)) == -1) {
+      fprintf(stderr, "锁定共享内存文件失败，错误码%d\n", errno);
+      continue;
+    }
     HandleCommand(pszSHMFileName, nNumOfCmd, ppCommands);
+    MPA_SIS_AdminUnlock(fd);
+    fd = -1;
   }
   return FreeCommandBuf(nNumOfCmd, ppCommands);
 }
@@ -400,7 +826,10 @@ static int HandleCommand(const char *pszSHMFileName, int argc, char **argv) {
     if (0 != DecimalStrToUInt(argv[3], &n3)) {
       return -3;
     }
-    if ((nRetCode = MPA_SIS_SInfoAdd(mpa_start, n1, n2, n3)) != 0) {
+    do {
+      nRetCode = MPA_SIS_SInfoAdd(mpa_start, n1, n2, n3);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(pszSHMFileName, &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "添加服务器信息失败，错误码%d\n", nRetCode);
       return -3;
     }
@@ -424,16 +853,49 @@ static int HandleCommand(const char *pszSHMFileName, int argc, char **argv) {
     if (0 != DecimalStrToUInt(argv[3], &n3)) {
       return -3;
     }
-    if ((nRetCode = MPA_SIS_SInfoModify(mpa_start, n1, n2, n3)) != 0) {
+    do {
+      nRetCode = MPA_SIS_SInfoModify(mpa_start, n1, n2, n3);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(pszSHMFileName, &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "修改服务器信息失败，错误码%d\n", nRetCode);
       return -3;
     }
+  } else if (strcmp(argv[0], "sg") == 0) {
+    if (argc < 3) {
+      fprintf(stderr, "命令行参数无效\n");
+      return -1;
+    }
+    if ((mpa_start = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    DWORD n1 = 0, n2 = 0;
+    if (0 != DecimalStrToUInt(argv[1], &n1)) {
+      return -3;
+    }
+    if (0 != DecimalStrToUInt(argv[2], &n2)) {
+      return -3;
+    }
+    do {
+      nRetCode = MPA_SIS_SInfoSetGroup(mpa_start, n1, n2);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(pszSHMFileName, &mpa_start));
+    if (nRetCode != 0) {
+      fprintf(stderr, "设置服务组失败，错误码%d\n", nRetCode);
+      return -3;
+    }
   } else if (strcmp(argv[0], "s-") == 0) {
     if ((mpa_start = MPA_SIS_Init(pszSHMFileName)) == NULL) {
       fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
       return -2;
     }
-    if ((nRetCode = MPA_SIS_SInfoDelLast(mpa_start)) != 0) {
+    DWORD n1 = 0;
+    if (argc > 1 && 0 != DecimalStrToUInt(argv[1], &n1)) {
+      return -3;
+    }
+    do {
+      nRetCode = (argc > 1) ? MPA_SIS_SInfoDelete(mpa_start, n1) : MPA_SIS_SInfoDelLast(mpa_start);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(pszSHMFileName, &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "删除服务器信息失败，错误码%d\n", nRetCode);
       return -3;
     }
@@ -453,7 +915,10 @@ static int HandleCommand(const char *pszSHMFileName, int argc, char **argv) {
     if (0 != DecimalStrToUInt(argv[3], &n3)) {
       return -3;
     }
-    if ((nRetCode = MPA_SIS_TInfoAdd(mpa_start, n1, n3)) != 0) {
+    do {
+      nRetCode = MPA_SIS_TInfoAdd(mpa_start, n1, n3);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(pszSHMFileName, &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "添加类型信息失败，错误码%d\n", nRetCode);
       return -4;
     }
@@ -479,7 +944,10 @@ static int HandleCommand(const char *pszSHMFileName, int argc, char **argv) {
     if (0 != DecimalStrToUInt(argv[6], &n4)) {
       return -3;
     }
-    if ((nRetCode = MPA_SIS_TInfoModify(mpa_start, n1, n2, n3, n4)) != 0) {
+    do {
+      nRetCode = MPA_SIS_TInfoModify(mpa_start, n1, n2, n3, n4);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(pszSHMFileName, &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "修改类型信息失败，错误码%d\n", nRetCode);
       return -4;
     }
@@ -488,7 +956,16 @@ static int HandleCommand(const char *pszSHMFileName, int argc, char **argv) {
       fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
       return -2;
     }
-    if ((nRetCode = MPA_SIS_TInfoDelLast(mpa_start)) != 0) {
+    DWORD n1 = 0, n3 = 0;
+    if (argc > 2 &&
+        (0 != DecimalStrToUInt(argv[1], &n1) || 0 != DecimalStrToUInt(argv[2], &n3))) {
+      return -3;
+    }
+    do {
+      nRetCode = (argc > 2) ? MPA_SIS_TInfoDelete(mpa_start, n1, n3)
+                           : MPA_SIS_TInfoDelLast(mpa_start);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(pszSHMFileName, &mpa_start));
+    if (nRetCode != 0) {
       fprintf(stderr, "删除类型信息失败，错误码%d\n", nRetCode);
       return -4;
     }
@@ -507,6 +984,34 @@ static int HandleCommand(const char *pszSHMFileName, int argc, char **argv) {
       fprintf(stderr, "导入服务器信息失败，错误码%d\n", nRetCode);
       return -5;
     }
+  } else if (strcmp(argv[0], "apply") == 0) {
+    if (argc < 2) {
+      fprintf(stderr, "命令行参数无效\n");
+      return -1;
+    }
+    if ((nRetCode = MPA_SIS_ApplyConfigDiff(pszSHMFileName, argv[1])) < 0) {
+      fprintf(stderr, "应用配置信息差异失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+    printf("已更新%d条配置信息\n", nRetCode);
+  } else if (strcmp(argv[0], "compile") == 0) {
+    if (argc < 2) {
+      fprintf(stderr, "命令行参数无效\n");
+      return -1;
+    }
+    if ((nRetCode = MPA_SIS_CompileConfig(pszSHMFileName, argv[1])) != 0) {
+      fprintf(stderr, "编译共享内存映像失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+  } else if (strcmp(argv[0], "image") == 0) {
+    if (argc < 2) {
+      fprintf(stderr, "命令行参数无效\n");
+      return -1;
+    }
+    if ((nRetCode = MPA_SIS_LoadImage(pszSHMFileName, argv[1])) != 0) {
+      fprintf(stderr, "装载共享内存映像失败，错误码%d\n", nRetCode);
+      return -5;
+    }
   } else if (strcmp(argv[0], "export") == 0) {
     if (argc < 2) {
       fprintf(stderr, "命令行参数无效\n");
@@ -533,6 +1038,90 @@ static int HandleCommand(const char *pszSHMFileName, int argc, char **argv) {
       fprintf(stderr, "注销系统信息失败，错误码%d\n", nRetCode);
       return -4;
     }
+  } else if (strcmp(argv[0], "upgrade") == 0) {
+    if ((nRetCode = MPA_SIS_Upgrade(pszSHMFileName)) != 0) {
+      fprintf(stderr, "升级共享内存文件失败，错误码%d\n", nRetCode);
+      return -6;
+    }
+  } else if (strcmp(argv[0], "compact") == 0) {
+    int batch = 0;
+    if ((mpa_start = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    if ((argc > 1) && (0 != DecimalStrToInt(argv[1], &batch) || batch < 0)) {
+      return -3;
+    }
+    do {
+      nRetCode = MPA_SIS_Compact(mpa_start, (size_t)batch);
+    } while (nRetCode == MPA_SIS_ERR_RETIRED && Remap(pszSHMFileName, &mpa_start));
+    if (nRetCode < 0) {
+      fprintf(stderr, "整理共享内存失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+    printf("已移动%d条信息\n", nRetCode);
+    nRetCode = 0;
+  } else if (strcmp(argv[0], "grow") == 0) {
+    if ((nRetCode = Grow(pszSHMFileName, argc - 1, argv + 1)) != 0) {
+      return nRetCode;
+    }
+  } else if (strcmp(argv[0], "stat") == 0) {
+    if ((mpa_start = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    MPA_SIS_DisplayStat(mpa_start);
+  } else if (strcmp(argv[0], "qstat") == 0) {
+    if ((mpa_start = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    if ((nRetCode = ShowQueueStats(mpa_start)) != 0) {
+      fprintf(stderr, "获取消息队列信息失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+  } else if (strcmp(argv[0], "qshare") == 0) {
+    if ((mpa_start = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    if ((nRetCode = ShowSharedQueues(pszSHMFileName, mpa_start)) != 0) {
+      fprintf(stderr, "获取消息队列信息失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+  } else if (strcmp(argv[0], "qsplit") == 0) {
+    if ((nRetCode = SplitQueue(pszSHMFileName, argc - 1, argv + 1)) != 0) {
+      return nRetCode;
+    }
+  } else if (strcmp(argv[0], "watch") == 0) {
+    int timeout = -1;
+    DWORD generation = 0;
+    MPA_SISInfo SISInfo;
+    if ((mpa_start = MPA_SIS_Init(pszSHMFileName)) == NULL) {
+      fprintf(stderr, "MPA初始化失败，错误码%d\n", errno);
+      return -2;
+    }
+    if ((argc > 1) && (0 != DecimalStrToInt(argv[1], &timeout))) {
+      return -3;
+    }
+    GetSISInfo(mpa_start, &SISInfo);
+    if (SISInfo.pdwGeneration == NULL) {
+      fprintf(stderr, "共享内存版本过低，请先升级\n");
+      return -4;
+    }
+    generation = *SISInfo.pdwGeneration;
+    if ((nRetCode = MPA_SIS_WaitChange(mpa_start, &generation, timeout)) < 0) {
+      fprintf(stderr, "等待配置信息变更失败，错误码%d\n", nRetCode);
+      return -5;
+    }
+    if (nRetCode == 1) {
+      puts("等待超时，配置信息未变更");
+    } else if (*SISInfo.pdwRetired != 0) {
+      puts("共享内存已重新装载");
+    } else {
+      printf("配置信息已变更，版本号%u\n", generation);
+    }
+    nRetCode = 0;
   } else if (strcmp(argv[0], "help") == 0) {
     CommandHelp();
   } else {